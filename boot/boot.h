@@ -20,4 +20,4 @@
 
 #define GCLK_SYSTEM 0
 #define DFU_INTF 0
-#define DFU_TRANSFER_SIZE (FLASH_PAGE_SIZE * 4)
+#define DFU_TRANSFER_SIZE (FLASH_PAGE_SIZE * 32)
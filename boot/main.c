@@ -42,6 +42,85 @@ void init_systick() {
 	g_msTicks = 0;
 }
 
+/*** NVM programming ***/
+
+// Downloaded blocks are copied to RAM and programmed from the main loop, so the host can send
+// the next block into the other buffer while the previous one is written. Rows are erased ahead
+// of the block that is expected next.
+
+// Worst case NVM timings from the datasheet
+#define NVM_PAGE_WRITE_US 2500
+#define NVM_ROW_ERASE_US 6000
+#define NVM_ROW_SIZE (FLASH_PAGE_SIZE * 4)
+
+typedef struct DfuBlock {
+	uint32_t addr;
+	uint16_t len;
+	uint8_t data[DFU_TRANSFER_SIZE];
+} DfuBlock;
+
+DfuBlock dfu_blocks[2];
+volatile uint8_t dfu_pending = 0; // Number of blocks received and not yet programmed
+uint8_t dfu_write_index = 0; // Oldest pending block
+uint16_t dfu_write_offset = 0; // Bytes of the oldest pending block already programmed
+uint32_t dfu_erased_start = 0; // Rows in [start, end) have been erased
+uint32_t dfu_erased_end = 0;
+uint32_t dfu_erase_limit = 0; // End of the block expected next
+int32_t dfu_last_block = -1; // Number of the last block received, or -1 before the first
+
+// Perform one row erase or page write, returning false if there was nothing to do.
+// Runs with interrupts disabled so it can be called from both the main loop and the USB handler.
+bool dfu_program_step() {
+	bool worked = true;
+	__disable_irq();
+	if (dfu_pending > 0) {
+		DfuBlock* b = &dfu_blocks[dfu_write_index];
+		uint32_t addr = b->addr + dfu_write_offset;
+		if (addr < dfu_erased_start || addr >= dfu_erased_end) {
+			if (addr < dfu_erased_start || addr > dfu_erased_end) {
+				// Not contiguous with the previous download, so start a new erased region
+				dfu_erased_start = dfu_erased_end = addr - (addr % NVM_ROW_SIZE);
+			}
+			nvm_erase_row(dfu_erased_end);
+			dfu_erased_end += NVM_ROW_SIZE;
+		} else {
+			uint16_t len = b->len - dfu_write_offset;
+			if (len > FLASH_PAGE_SIZE) len = FLASH_PAGE_SIZE;
+			nvm_write_page(addr, &b->data[dfu_write_offset], len);
+			dfu_write_offset += len;
+			if (dfu_write_offset >= b->len) {
+				dfu_write_offset = 0;
+				dfu_write_index ^= 1;
+				dfu_pending -= 1;
+			}
+		}
+	} else if (dfu_erased_end < dfu_erase_limit) {
+		// Idle, so erase ahead of the next block
+		nvm_erase_row(dfu_erased_end);
+		dfu_erased_end += NVM_ROW_SIZE;
+	} else {
+		worked = false;
+	}
+	__enable_irq();
+	return worked;
+}
+
+// Estimate in ms of how long until a buffer is free for the next block
+unsigned dfu_busy_time() {
+	if (dfu_pending < 2) {
+		return 0;
+	}
+	DfuBlock* b = &dfu_blocks[dfu_write_index];
+	uint32_t remaining = b->len - dfu_write_offset;
+	uint32_t end = b->addr + b->len;
+	uint32_t pages = (remaining + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	uint32_t rows = 0;
+	if (end > dfu_erased_end) {
+		rows = (end - dfu_erased_end + NVM_ROW_SIZE - 1) / NVM_ROW_SIZE;
+	}
+	return (pages * NVM_PAGE_WRITE_US + rows * NVM_ROW_ERASE_US + 999) / 1000;
+}
+
 /*** USB / DFU ***/
 
 void dfu_cb_dnload_block(uint16_t block_num, uint16_t len) {
@@ -50,21 +129,44 @@ void dfu_cb_dnload_block(uint16_t block_num, uint16_t len) {
 		return;
 	}
 
-	if (block_num * DFU_TRANSFER_SIZE > FLASH_FW_SIZE) {
+	if (block_num * DFU_TRANSFER_SIZE + len > FLASH_FW_SIZE) {
 		dfu_error(DFU_STATUS_errADDRESS);
 		return;
 	}
 
-	nvm_erase_row(FLASH_FW_START + block_num * DFU_TRANSFER_SIZE);
+	// The host asked again before the advertised poll timeout expired, so finish the oldest block here
+	while (dfu_pending == 2) {
+		dfu_program_step();
+	}
+
+	if (block_num == 0 || block_num <= dfu_last_block) {
+		// A new or retried download, after one that may have failed partway. Its rows were erased
+		// for the old image and may have been programmed since, so erase them again.
+		while (dfu_pending > 0) {
+			dfu_program_step();
+		}
+		dfu_erased_start = dfu_erased_end = dfu_erase_limit = 0;
+	}
+	dfu_last_block = block_num;
+
+	DfuBlock* b = &dfu_blocks[(dfu_write_index + dfu_pending) % 2];
+	b->addr = FLASH_FW_START + block_num * DFU_TRANSFER_SIZE;
+	b->len = len;
 }
 
 void dfu_cb_dnload_packet_completed(uint16_t block_num, uint16_t offset, uint8_t* data, uint16_t length) {
-	unsigned addr = FLASH_FW_START + block_num * DFU_TRANSFER_SIZE + offset;
-	nvm_write_page(addr, data, length);
+	DfuBlock* b = &dfu_blocks[(dfu_write_index + dfu_pending) % 2];
+	memcpy(&b->data[offset], data, length);
 }
 
+// Returns the bwPollTimeout to report in the following GETSTATUS
 unsigned dfu_cb_dnload_block_completed(uint16_t block_num, uint16_t length) {
-	return 0;
+	dfu_pending += 1;
+	dfu_erase_limit = FLASH_FW_START + (block_num + 2) * DFU_TRANSFER_SIZE;
+	if (dfu_erase_limit > FLASH_FW_START + FLASH_FW_SIZE) {
+		dfu_erase_limit = FLASH_FW_START + FLASH_FW_SIZE;
+	}
+	return dfu_busy_time();
 }
 
 void dfu_cb_manifest(void) {
@@ -113,7 +215,14 @@ void bootloader_main() {
 
 	while(!exit_and_jump) {
 		led_task();
-		__WFI(); /* conserve power */
+		if (!dfu_program_step()) {
+			__WFI(); /* conserve power */
+		}
+	}
+
+	// Finish programming the last blocks
+	while (dfu_pending > 0) {
+		dfu_program_step();
 	}
 
 	delay_ms(25);
@@ -32,37 +32,125 @@ u16 adc_sample() {
     return ADC->RESULT.reg;
 }
 
-u16 adc_read(Pin p, u32 gain) {
+/// The INPUTCTRL value that samples pin `p` against ground
+u32 adc_inputctrl(Pin p, u32 gain) {
+    return ADC_INPUTCTRL_MUXPOS(p.chan) // select from proper pin
+        | ADC_INPUTCTRL_MUXNEG_GND // 0 = gnd
+        | gain;
+}
+
+static void adc_select(Pin p, u32 gain) {
     // switch pin mux to analog in
     pin_analog(p);
 
-    ADC->INPUTCTRL.reg = (ADC_INPUTCTRL_MUXPOS(p.chan) // select from proper pin
-        | ADC_INPUTCTRL_MUXNEG_GND // 0 = gnd
-        | gain);
+    ADC->INPUTCTRL.reg = adc_inputctrl(p, gain);
+}
 
+u16 adc_read(Pin p, u32 gain) {
+    adc_select(p, gain);
     return adc_sample();
 }
 
+/// Start a conversion like adc_read, but finish with the RESRDY interrupt instead of waiting for
+/// it. The handler reads the result from ADC->RESULT and disables the interrupt.
+void adc_start(Pin p, u32 gain) {
+    adc_select(p, gain);
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+    ADC->INTENSET.reg = ADC_INTENSET_RESRDY;
+    ADC->SWTRIG.reg = ADC_SWTRIG_START;
+}
+
+/// Cancel a conversion started by adc_start
+void adc_cancel() {
+    ADC->INTENCLR.reg = ADC_INTENCLR_RESRDY;
+    ADC->SWTRIG.reg = ADC_SWTRIG_FLUSH;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+}
+
+/// Set up the ADC to start a conversion on each EVSYS event instead of by software. Each
+/// conversion moves on to the next of `scan` consecutive inputs starting at `muxpos`, and
+/// averages 2^samplenum samples in hardware.
+void adc_stream_config(u8 muxpos, u8 scan, u8 prescaler, u8 samplenum, u32 gain) {
+    ADC->CTRLA.reg = 0;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+
+    // averaging accumulates into the 16-bit result
+    ADC->CTRLB.reg = ADC_CTRLB_PRESCALER(prescaler)
+        | (samplenum > 0 ? ADC_CTRLB_RESSEL_16BIT : ADC_CTRLB_RESSEL_12BIT);
+    // shift the sum back down, up to the 4 bits the hardware allows
+    ADC->AVGCTRL.reg = ADC_AVGCTRL_SAMPLENUM(samplenum)
+        | ADC_AVGCTRL_ADJRES(samplenum < 4 ? samplenum : 4);
+    ADC->INPUTCTRL.reg = (ADC_INPUTCTRL_MUXPOS(muxpos)
+        | ADC_INPUTCTRL_MUXNEG_GND
+        | ADC_INPUTCTRL_INPUTSCAN(scan - 1)
+        | gain);
+    ADC->EVCTRL.reg = ADC_EVCTRL_STARTEI;
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+
+    ADC->CTRLA.reg = ADC_CTRLA_ENABLE;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+}
+
+/// Return the ADC to the software-triggered configuration used by adc_read
+void adc_stream_disable() {
+    ADC->CTRLA.reg = 0;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+
+    ADC->EVCTRL.reg = 0;
+    ADC->AVGCTRL.reg = 0;
+    ADC->CTRLB.reg = ADC_CTRLB_PRESCALER_DIV512;
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+
+    ADC->CTRLA.reg = ADC_CTRLA_ENABLE;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+}
+
+/// Switch the software-triggered ADC to also start a conversion on each EVSYS event, so that
+/// DMA can select each input and then start its conversion.
+void adc_set_event_start(bool enable) {
+    // EVCTRL is enable-protected
+    ADC->CTRLA.reg = 0;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+
+    ADC->EVCTRL.reg = enable ? ADC_EVCTRL_STARTEI : 0;
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+
+    ADC->CTRLA.reg = ADC_CTRLA_ENABLE;
+    while(ADC->STATUS.reg & ADC_STATUS_SYNCBUSY);
+}
+
 void dac_init(u8 channel) {
     // hook up clk
     PM->APBCMASK.reg |= PM_APBCMASK_DAC;
     GCLK->CLKCTRL.reg = GCLK_CLKCTRL_CLKEN |
     GCLK_CLKCTRL_GEN(channel) |
     GCLK_CLKCTRL_ID(DAC_GCLK_ID);
+
+    // set vcc as reference voltage. The output only reaches the pin once it is muxed to analog.
+    DAC->CTRLB.reg = DAC_CTRLB_EOEN |DAC_CTRLB_REFSEL_AVCC;
+
+    // enable
+    DAC->CTRLA.reg = DAC_CTRLA_ENABLE;
+    while(DAC->STATUS.reg & DAC_STATUS_SYNCBUSY);
 }
 
 void dac_write(Pin p, u16 val) {
     // switch dac pinmux. this must be PA02
     pin_analog(p);
 
-    // disable
-    DAC->CTRLA.reg &= ~DAC_CTRLA_ENABLE;
+    DAC->DATA.reg = val;
+}
 
-    // set vcc as reference voltage
-    DAC->CTRLB.reg = DAC_CTRLB_EOEN |DAC_CTRLB_REFSEL_AVCC;
+/// Switch the DAC between converting on each DATA write, and loading DATABUF into DATA on each
+/// EVSYS event, so that DMA can keep DATABUF filled at a timer-driven rate.
+void dac_set_event_start(bool enable) {
+    // EVCTRL is enable-protected
+    DAC->CTRLA.reg = 0;
+    while(DAC->STATUS.reg & DAC_STATUS_SYNCBUSY);
 
-    // enable
-    DAC->CTRLA.reg = DAC_CTRLA_ENABLE;
+    DAC->EVCTRL.reg = enable ? DAC_EVCTRL_STARTEI : 0;
 
-    DAC->DATA.reg = val;
+    DAC->CTRLA.reg = DAC_CTRLA_ENABLE;
+    while(DAC->STATUS.reg & DAC_STATUS_SYNCBUSY);
 }
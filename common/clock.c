@@ -106,3 +106,48 @@ void clock_init_crystal(u8 clk_system, u8 clk_32k) {
   gclk_enable(clk_system, GCLK_SOURCE_DFLL48M, 1);
   while (GCLK->STATUS.bit.SYNCBUSY);
 }
+
+// FDPLL96M reference: the 32kHz crystal, without a GCLK. 96MHz = 32768Hz * (LDR + 1 + LDRFRAC / 16)
+#define DPLL_LDR     2928
+#define DPLL_LDRFRAC 11
+
+// Users of the FDPLL96M, which only runs while there is one
+static u8 dpll_users;
+static bool dpll_configured;
+
+/// Set up the FDPLL96M for DPLL_FREQ from the 32kHz crystal, which clock_init_crystal must have
+/// started. SERCOMs can then be clocked from odd divisions of it that the DFLL48M can't give. It
+/// is left stopped until dpll_acquire.
+void dpll_init() {
+  SYSCTRL->DPLLCTRLA.reg = 0;
+  SYSCTRL->DPLLRATIO.reg = SYSCTRL_DPLLRATIO_LDR(DPLL_LDR) | SYSCTRL_DPLLRATIO_LDRFRAC(DPLL_LDRFRAC);
+  SYSCTRL->DPLLCTRLB.reg = SYSCTRL_DPLLCTRLB_REFCLK_REF0;
+  dpll_users = 0;
+  dpll_configured = true;
+}
+
+/// Returns true if dpll_init has set up the FDPLL96M, so it can be used through dpll_acquire
+bool dpll_available() {
+  return dpll_configured;
+}
+
+/// Start the FDPLL96M for a new user, and wait for it to lock if it wasn't running, so a generator
+/// switched to it afterwards never runs from an unlocked clock
+void dpll_acquire() {
+  if (dpll_users++ > 0) {
+    return;
+  }
+  // Not ONDEMAND: a SERCOM generator switched to it would otherwise stop while it locked again
+  SYSCTRL->DPLLCTRLA.reg = SYSCTRL_DPLLCTRLA_ENABLE;
+
+  u32 ready = SYSCTRL_DPLLSTATUS_LOCK | SYSCTRL_DPLLSTATUS_CLKRDY;
+  while ((SYSCTRL->DPLLSTATUS.reg & ready) != ready);
+}
+
+/// Drop a user of the FDPLL96M taken with dpll_acquire, and stop it after the last one
+void dpll_release() {
+  if (dpll_users == 0 || --dpll_users > 0) {
+    return;
+  }
+  SYSCTRL->DPLLCTRLA.reg = 0;
+}
@@ -1,12 +1,17 @@
 #include "common/hw.h"
 #include <string.h>
 
-DMA_DESC_ALIGN DmacDescriptor dma_descriptors[12];
-DMA_DESC_ALIGN DmacDescriptor dma_descriptors_wb[12];
+DMA_DESC_ALIGN DmacDescriptor dma_descriptors[DMA_NUM_CHAN];
+DMA_DESC_ALIGN DmacDescriptor dma_descriptors_wb[DMA_NUM_CHAN];
+
+// Descriptors for the second and later links of chains, handed out by dma_desc_alloc
+DMA_DESC_ALIGN DmacDescriptor dma_pool[DMA_POOL_SIZE];
+u32 dma_pool_used; // Bitmap of allocated pool entries
 
 void dma_init() {
     memset(&dma_descriptors, 0, sizeof(dma_descriptors));
     memset(&dma_descriptors_wb, 0, sizeof(dma_descriptors_wb));
+    dma_pool_used = 0;
 
     PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
     PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
@@ -34,6 +39,32 @@ void dma_start(DmaChan chan) {
     __enable_irq();
 }
 
+/// Stop a channel and clear a completion the DMAC_Handler has not yet seen, for callers that
+/// account for the transfer themselves. Must be called with interrupts disabled.
+void dma_stop(DmaChan chan) {
+    DMAC->CHID.reg = chan;
+    DMAC->CHCTRLA.reg = 0;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL;
+}
+
+/// Pause a channel at the end of the current beat, keeping its place in the descriptor chain.
+void dma_suspend(DmaChan chan) {
+    __disable_irq();
+    DMAC->CHID.reg = chan;
+    DMAC->CHCTRLB.bit.CMD = DMAC_CHCTRLB_CMD_SUSPEND_Val;
+    __enable_irq();
+}
+
+/// Continue a channel paused by dma_suspend. The suspend flag is cleared first so it is never
+/// mistaken for a descriptor suspend in DMAC_Handler.
+void dma_resume(DmaChan chan) {
+    __disable_irq();
+    DMAC->CHID.reg = chan;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_SUSP;
+    DMAC->CHCTRLB.bit.CMD = DMAC_CHCTRLB_CMD_RESUME_Val;
+    __enable_irq();
+}
+
 void dma_enable_interrupt(DmaChan chan) {
     __disable_irq();
     DMAC->CHID.reg = chan;
@@ -41,6 +72,38 @@ void dma_enable_interrupt(DmaChan chan) {
     __enable_irq();
 }
 
+void dma_disable_interrupt(DmaChan chan) {
+    __disable_irq();
+    DMAC->CHID.reg = chan;
+    DMAC->CHINTENCLR.reg = DMAC_CHINTENCLR_TCMPL | DMAC_CHINTENCLR_TERR;
+    __enable_irq();
+}
+
+/// Clear completion and error flags left over from a previous transfer.
+void dma_clear_interrupt(DmaChan chan) {
+    __disable_irq();
+    DMAC->CHID.reg = chan;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR;
+    __enable_irq();
+}
+
+/// True if a channel has finished its descriptor chain since its flags were last cleared.
+bool dma_complete(DmaChan chan) {
+    __disable_irq();
+    DMAC->CHID.reg = chan;
+    bool done = DMAC->CHINTFLAG.bit.TCMPL;
+    __enable_irq();
+    return done;
+}
+
+/// Generate an event for every beat of descriptors with EVOSEL set (see dma_fill_sercom_rx).
+void dma_enable_event_output(DmaChan chan) {
+    __disable_irq();
+    DMAC->CHID.reg = chan;
+    DMAC->CHCTRLB.bit.EVOE = 1;
+    __enable_irq();
+}
+
 u32 dma_remaining(DmaChan chan) {
     return dma_descriptors_wb[chan].BTCNT.reg;
 }
@@ -74,16 +137,58 @@ void dma_fill_sercom_rx(DmacDescriptor* desc, SercomId id, u8 *dst, unsigned siz
     }
 }
 
-void dma_sercom_configure_tx(DmaChan chan, SercomId id) {
+/// Reset a channel and have it move one beat per trigger from the peripheral `trigsrc`.
+void dma_configure(DmaChan chan, u32 trigsrc) {
+    __disable_irq();
     DMAC->CHID.reg = chan;
     DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
-    DMAC->CHCTRLB.reg = DMAC_CHCTRLB_TRIGACT_BEAT | DMAC_CHCTRLB_TRIGSRC(id*2 + 2);
+    DMAC->CHCTRLB.reg = DMAC_CHCTRLB_TRIGACT_BEAT | DMAC_CHCTRLB_TRIGSRC(trigsrc);
+    __enable_irq();
+}
+
+void dma_sercom_configure_tx(DmaChan chan, SercomId id) {
+    dma_configure(chan, id*2 + 2);
 }
 
 void dma_sercom_configure_rx(DmaChan chan, SercomId id) {
-    DMAC->CHID.reg = chan;
-    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
-    DMAC->CHCTRLB.reg = DMAC_CHCTRLB_TRIGACT_BEAT | DMAC_CHCTRLB_TRIGSRC(id*2 + 1);
+    dma_configure(chan, id*2 + 1);
+}
+
+/// Allocate `count` consecutive descriptors from the pool, so they can be linked with
+/// dma_link_chain or dma_link_ring. Returns NULL if the pool has no such run free.
+DmacDescriptor* dma_desc_alloc(u32 count) {
+    if (count == 0 || count > DMA_POOL_SIZE) {
+        return NULL;
+    }
+
+    u32 mask = (1u << count) - 1;
+    DmacDescriptor* chain = NULL;
+    __disable_irq();
+    for (u32 i = 0; i + count <= DMA_POOL_SIZE; i++) {
+        if ((dma_pool_used & (mask << i)) == 0) {
+            dma_pool_used |= mask << i;
+            chain = &dma_pool[i];
+            break;
+        }
+    }
+    __enable_irq();
+
+    if (chain != NULL) {
+        memset(chain, 0, count * sizeof(DmacDescriptor));
+    }
+    return chain;
+}
+
+/// Return descriptors from dma_desc_alloc to the pool. The channels using them must be stopped.
+void dma_desc_free(DmacDescriptor* chain, u32 count) {
+    if (chain == NULL) {
+        return;
+    }
+
+    u32 mask = (1u << count) - 1;
+    __disable_irq();
+    dma_pool_used &= ~(mask << (chain - dma_pool));
+    __enable_irq();
 }
 
 void dma_link_chain(DmacDescriptor* chain, u32 count) {
@@ -93,6 +198,15 @@ void dma_link_chain(DmacDescriptor* chain, u32 count) {
     chain[count-1].DESCADDR.reg = 0;
 }
 
+/// Link a chain into a ring that `chan` runs until aborted. The first descriptor is copied to the
+/// channel's descriptor slot by dma_start_descriptor, so the last one links back to that slot.
+void dma_link_ring(DmaChan chan, DmacDescriptor* chain, u32 count) {
+    for (u32 i = 0; i<count-1; i++) {
+        chain[i].DESCADDR.reg = (unsigned) &chain[i+1];
+    }
+    chain[count-1].DESCADDR.reg = (unsigned) &dma_descriptors[chan];
+}
+
 void dma_start_descriptor(DmaChan chan, DmacDescriptor* chain) {
     dma_abort(chan);
     memcpy(&dma_descriptors[chan], &chain[0], sizeof(DmacDescriptor));
@@ -112,3 +226,20 @@ void dma_sercom_start_rx(DmaChan chan, SercomId id, u8* dst, unsigned size) {
     dma_descriptors[chan].DESCADDR.reg = 0;
     dma_start(chan);
 }
+
+void dma_sercom_i2c_start_tx(DmaChan chan, SercomId id, u8* src, unsigned size) {
+    dma_abort(chan);
+    dma_fill_sercom_tx(&dma_descriptors[chan], id, src, size);
+    // I2CM.DATA is not at the same address as SPI.DATA
+    dma_descriptors[chan].DSTADDR.reg = (unsigned) &sercom(id)->I2CM.DATA;
+    dma_descriptors[chan].DESCADDR.reg = 0;
+    dma_start(chan);
+}
+
+void dma_sercom_i2c_start_rx(DmaChan chan, SercomId id, u8* dst, unsigned size) {
+    dma_abort(chan);
+    dma_fill_sercom_rx(&dma_descriptors[chan], id, dst, size);
+    dma_descriptors[chan].SRCADDR.reg = (unsigned) &sercom(id)->I2CM.DATA;
+    dma_descriptors[chan].DESCADDR.reg = 0;
+    dma_start(chan);
+}
@@ -170,29 +170,58 @@ inline static void evsys_config(u8 channel, u8 source, u8 user) {
 // analog.c
 void adc_init(u8 channel, u8 refctrl);
 u16 adc_sample();
+u32 adc_inputctrl(Pin p, u32 gain);
 u16 adc_read(Pin p, u32 gain);
+void adc_start(Pin p, u32 gain);
+void adc_cancel();
+void adc_stream_config(u8 muxpos, u8 scan, u8 prescaler, u8 samplenum, u32 gain);
+void adc_stream_disable();
+void adc_set_event_start(bool enable);
 void dac_init(u8 channel);
 void dac_write(Pin p, u16 val);
+void dac_set_event_start(bool enable);
 
 
 // clock.c
+// Output of the FDPLL96M while running, between dpll_acquire and dpll_release
+#define DPLL_FREQ 96000000
 void gclk_enable(uint32_t id, uint32_t src, uint32_t div);
 void clock_init_usb(u8 clk_system);
 void clock_init_crystal(u8 clk_system, u8 clk_32k);
+void dpll_init();
+bool dpll_available();
+void dpll_acquire();
+void dpll_release();
 
 // dma.c
 #define DMA_DESC_ALIGN __attribute__((aligned(16)))
+#define DMA_NUM_CHAN 12
+#define DMA_POOL_SIZE 16
+extern DmacDescriptor dma_descriptors[DMA_NUM_CHAN];
 
 void dma_init();
 void dma_sercom_start_tx(DmaChan chan, SercomId id, u8* src, unsigned size);
 void dma_sercom_start_rx(DmaChan chan, SercomId id, u8* dst, unsigned size);
+void dma_sercom_i2c_start_tx(DmaChan chan, SercomId id, u8* src, unsigned size);
+void dma_sercom_i2c_start_rx(DmaChan chan, SercomId id, u8* dst, unsigned size);
 void dma_abort(DmaChan chan);
+void dma_stop(DmaChan chan);
+void dma_suspend(DmaChan chan);
+void dma_resume(DmaChan chan);
 void dma_enable_interrupt(DmaChan chan);
+void dma_disable_interrupt(DmaChan chan);
+void dma_clear_interrupt(DmaChan chan);
+bool dma_complete(DmaChan chan);
+void dma_enable_event_output(DmaChan chan);
 void dma_fill_sercom_tx(DmacDescriptor* desc, SercomId id, u8 *src, unsigned size);
 void dma_fill_sercom_rx(DmacDescriptor* desc, SercomId id, u8 *dst, unsigned size);
 void dma_sercom_configure_tx(DmaChan chan, SercomId id);
 void dma_sercom_configure_rx(DmaChan chan, SercomId id);
+void dma_configure(DmaChan chan, u32 trigsrc);
+DmacDescriptor* dma_desc_alloc(u32 count);
+void dma_desc_free(DmacDescriptor* chain, u32 count);
 void dma_link_chain(DmacDescriptor* chain, u32 count);
+void dma_link_ring(DmaChan chan, DmacDescriptor* chain, u32 count);
 void dma_start_descriptor(DmaChan chan, DmacDescriptor* chain);
 u32 dma_remaining(DmaChan chan);
 
@@ -206,12 +235,36 @@ inline static Sercom* sercom(SercomId id) {
 #define SERCOM_SPI_BAUD_8MHZ 2
 #define SERCOM_SPI_BAUD_12MHZ 1
 #define SERCOM_SPI_BAUD_24MHZ 0
+// Reference clock of SERCOMs clocked from DFLL48M, and the fastest rated SPI master clock
+#define SERCOM_REF_FREQ 48000000
+#define SERCOM_SPI_MAX_FREQ 12000000
+// Fastest USART rate with 16x oversampling of a SERCOM_REF_FREQ clock
+#define SERCOM_UART_MAX_RATE 3000000
+// CTRLA.SAMPR values: 16x oversampling with an arithmetic or a fractional BAUD
+#define SERCOM_UART_SAMPR_ARITH 0
+#define SERCOM_UART_SAMPR_FRAC  1
+
+/// Source and divider of the GCLK generator clocking a SERCOM
+typedef struct SercomClock {
+    /// GCLK_SOURCE_DFLL48M, or GCLK_SOURCE_FDPLL divided to at most SERCOM_REF_FREQ
+    u8 src;
+    /// Generator divider, or 0 if not set
+    u8 div;
+} SercomClock;
+
 void sercom_clock_enable(SercomId id, uint32_t clock_channel, u8 div);
+void sercom_clock_enable_src(SercomId id, uint32_t clock_channel, SercomClock clk);
+void sercom_clock_disable(SercomId id);
 void sercom_reset(SercomId id);
 void sercom_spi_slave_init(SercomId id, u32 dipo, u32 dopo, bool cpol, bool cpha);
 void sercom_spi_master_init(SercomId id, u32 dipo, u32 dopo, bool cpol, bool cpha, u8 baud);
+void sercom_spi_master_reconfigure(SercomId id, bool cpol, bool cpha, u8 baud);
+u32 sercom_spi_clock_calc(u32 freq, SercomClock* clk, u8* baud);
 void sercom_i2c_master_init(SercomId id, u8 baud);
-void sercom_uart_init(SercomId id, u32 rxpo, u32 txpo, u32 baud);
+void sercom_uart_init(SercomId id, u32 rxpo, u32 txpo, u8 sampr, u32 baud);
+u16 sercom_uart_baud(u32 rate);
+u32 sercom_uart_clock_calc(u32 rate, SercomClock* clk, u8* sampr, u16* baud);
+void sercom_uart_set_baud(SercomId id, u16 baud);
 
 inline static void jump_to_flash(uint32_t addr_p, uint32_t r0_val) {
   uint32_t *addr = (void*) addr_p;
@@ -248,6 +301,11 @@ void timer_clock_enable(TimerId id);
 void tcc_delay_start(TimerId id, u32 ticks);
 void tcc_delay_disable(TimerId id);
 void tcc_delay_enable(TimerId id);
+void tcc_delay_enable_retrigger(TimerId id, u32 ticks);
+void tc_event_enable(TimerId id, u32 ticks);
+void tc_event_disable(TimerId id);
+void tcc_capture_enable(TimerId id, u32 prescaler, u8 channels);
+void tcc_capture_disable(TimerId id);
 
 // PWM
 
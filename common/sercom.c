@@ -1,12 +1,40 @@
 #include "common/hw.h"
 
 void sercom_clock_enable(SercomId id, uint32_t clock_channel, u8 divider) {
+    sercom_clock_enable_src(id, clock_channel, (SercomClock) { GCLK_SOURCE_DFLL48M, divider });
+}
+
+// SERCOMs whose generator is set to the FDPLL96M, each holding it running with dpll_acquire
+static u8 sercom_dpll_users;
+
+/// Drop the FDPLL96M if the generator of a SERCOM no longer uses it
+static void sercom_dpll_release(SercomId id) {
+    if (sercom_dpll_users & (1 << id)) {
+        sercom_dpll_users &= ~(1 << id);
+        dpll_release();
+    }
+}
+
+/// Clock a SERCOM from its own generator, set to `clk`. Generator 0 is the CPU and bridge clock,
+/// so it is attached as it is and never reprogrammed. The FDPLL96M is started before a generator
+/// is switched to it, and stopped once no SERCOM generator uses it.
+void sercom_clock_enable_src(SercomId id, uint32_t clock_channel, SercomClock clk) {
     // prevent this clock write from changing any other clocks
     PM->APBCMASK.reg |= 1 << (PM_APBCMASK_SERCOM0_Pos + id);
 
+    bool dpll = clock_channel != 0 && clk.src == GCLK_SOURCE_FDPLL;
+    if (dpll && !(sercom_dpll_users & (1 << id))) {
+      dpll_acquire();
+      sercom_dpll_users |= 1 << id;
+    }
+
     if (clock_channel != 0) {
       // clock generators 3-8 have 8 division factor bits - DIV[7:0]
-      gclk_enable(clock_channel, GCLK_SOURCE_DFLL48M, divider);
+      gclk_enable(clock_channel, clk.src, clk.div);
+    }
+
+    if (!dpll) {
+      sercom_dpll_release(id);
     }
 
     // attach clock
@@ -15,6 +43,14 @@ void sercom_clock_enable(SercomId id, uint32_t clock_channel, u8 divider) {
         GCLK_CLKCTRL_ID(SERCOM0_GCLK_ID_CORE + id);
 }
 
+/// Stop the clocks of a SERCOM that has been reset, after which its registers can't be accessed
+/// until sercom_clock_enable
+void sercom_clock_disable(SercomId id) {
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(SERCOM0_GCLK_ID_CORE + id);
+    PM->APBCMASK.reg &= ~(1 << (PM_APBCMASK_SERCOM0_Pos + id));
+    sercom_dpll_release(id);
+}
+
 inline void sercom_reset(SercomId id) {
     sercom(id)->SPI.CTRLA.reg = SERCOM_SPI_CTRLA_SWRST;
     while(sercom(id)->SPI.CTRLA.reg & SERCOM_SPI_CTRLA_SWRST);
@@ -58,17 +94,90 @@ void sercom_spi_master_init(SercomId id, u32 dipo, u32 dopo, bool cpol, bool cph
 
 }
 
+/// Change the clock mode and baud of an enabled SPI master, without a reset
+void sercom_spi_master_reconfigure(SercomId id, bool cpol, bool cpha, u8 baud) {
+    // CPOL and CPHA are enable-protected
+    sercom(id)->SPI.CTRLA.bit.ENABLE = 0;
+    while(sercom(id)->SPI.SYNCBUSY.bit.ENABLE);
+
+    sercom(id)->SPI.BAUD.reg = baud;
+    sercom(id)->SPI.CTRLA.bit.CPOL = cpol;
+    sercom(id)->SPI.CTRLA.bit.CPHA = cpha;
+
+    sercom(id)->SPI.CTRLA.bit.ENABLE = 1;
+    while(sercom(id)->SPI.SYNCBUSY.bit.ENABLE);
+}
+
+/// Generator setting for a SERCOM clock of DPLL_FREQ / m, from the DFLL48M where it can divide to
+/// it, and otherwise from the FDPLL96M. `m` can only be odd if dpll_available().
+static SercomClock sercom_clock_for(u32 m) {
+    if (m % 2 == 0) {
+        return (SercomClock) { GCLK_SOURCE_DFLL48M, m / 2 };
+    }
+    return (SercomClock) { GCLK_SOURCE_FDPLL, m };
+}
+
+// Divisions m of DPLL_FREQ the SERCOM clock can take: 2 (the SERCOM maximum) to 255 from the
+// FDPLL96M, and any even one up to 2 * 255 from the DFLL48M
+#define SERCOM_CLOCK_MIN_M 2
+#define SERCOM_CLOCK_MAX_M 510
+#define SERCOM_CLOCK_MAX_DPLL_M 255
+
+static inline bool sercom_clock_m_valid(u32 m, bool dpll) {
+    return m % 2 == 0 || (dpll && m <= SERCOM_CLOCK_MAX_DPLL_M);
+}
+
+/// Find the SERCOM clock and BAUD for the fastest SPI clock not above freq. Odd divisions of the
+/// FDPLL96M are used when it is available and come closer than the DFLL48M. Returns the frequency
+/// actually achieved.
+u32 sercom_spi_clock_calc(u32 freq, SercomClock* clk, u8* baud) {
+    if (freq > SERCOM_SPI_MAX_FREQ) {
+        freq = SERCOM_SPI_MAX_FREQ;
+    } else if (freq == 0) {
+        freq = 1;
+    }
+    bool dpll = dpll_available();
+
+    // f = 96MHz / (2 * m * (baud + 1)), so look for the smallest m * (baud + 1) >= n
+    u32 n = (DPLL_FREQ / 2 + freq - 1) / freq;
+    u32 best_m = SERCOM_CLOCK_MAX_M, best_steps = 256;
+
+    // Smaller m would need more than the 256 steps of BAUD
+    u32 m = (n + 255) / 256;
+    if (m < SERCOM_CLOCK_MIN_M) {
+        m = SERCOM_CLOCK_MIN_M;
+    }
+    for (; m <= SERCOM_CLOCK_MAX_M; m++) {
+        if (!sercom_clock_m_valid(m, dpll)) continue;
+        u32 steps = (n + m - 1) / m;
+        if (steps <= 256 && m * steps < best_m * best_steps) {
+            best_m = m;
+            best_steps = steps;
+            if (m * steps == n) break;
+        }
+        if (steps == 1) break;
+    }
+
+    *clk = sercom_clock_for(best_m);
+    *baud = best_steps - 1;
+    return DPLL_FREQ / (2 * best_m * best_steps);
+}
+
 void sercom_i2c_master_init(SercomId id, u8 baud) {
     sercom_reset(id);
     sercom(id)->I2CM.CTRLA.reg = SERCOM_I2CM_CTRLA_MODE_I2C_MASTER;
     sercom(id)->I2CM.BAUD.reg = baud;
+    // Smart mode: reading DATA sends the ACKACT acknowledge and starts the next byte, so a
+    // DMA read needs no CPU involvement between bytes
+    sercom(id)->I2CM.CTRLB.reg = SERCOM_I2CM_CTRLB_SMEN;
     sercom(id)->I2CM.CTRLA.reg
         = SERCOM_I2CM_CTRLA_ENABLE
         | SERCOM_I2CM_CTRLA_MODE_I2C_MASTER;
     sercom(id)->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSSTATE(1);
 }
 
-void sercom_uart_init(SercomId id, u32 rxpo, u32 txpo, u32 baud) {
+/// Reset and enable a USART, with SERCOM_UART_SAMPR_ARITH or SERCOM_UART_SAMPR_FRAC for `baud`
+void sercom_uart_init(SercomId id, u32 rxpo, u32 txpo, u8 sampr, u32 baud) {
     sercom_reset(id);
     sercom(id)->USART.CTRLA.reg = SERCOM_USART_CTRLA_MODE_USART_INT_CLK;
     sercom(id)->USART.BAUD.reg = baud;
@@ -79,6 +188,88 @@ void sercom_uart_init(SercomId id, u32 rxpo, u32 txpo, u32 baud) {
         = SERCOM_USART_CTRLA_ENABLE
         | SERCOM_USART_CTRLA_MODE_USART_INT_CLK
         | SERCOM_SPI_CTRLA_DORD
+        | SERCOM_USART_CTRLA_SAMPR(sampr)
         | SERCOM_USART_CTRLA_TXPO(txpo)
         | SERCOM_USART_CTRLA_RXPO(rxpo);
 }
+
+/// BAUD register value for `rate` with 16x oversampling of a 48MHz SERCOM clock. Rates above the
+/// 3Mbaud maximum are clamped to it, and rates below the slowest of about 46 baud, including 0, to
+/// that.
+u16 sercom_uart_baud(u32 rate) {
+    if (rate > SERCOM_UART_MAX_RATE) {
+        rate = SERCOM_UART_MAX_RATE;
+    }
+    // 65536 * (1 - 16 * rate / 48MHz), with 65536 * 16 / 48MHz reduced to 1024 / 46875
+    u32 step = (rate * 1024 + 46875 / 2) / 46875;
+    return (step == 0) ? 0xffff : 65536 - step;
+}
+
+/// Find the SERCOM clock, sampling mode and BAUD for the USART rate closest to `rate`. A
+/// fractional BAUD can make many rates exactly from some division of the DFLL48M or FDPLL96M, and
+/// without the bit-to-bit jitter of an arithmetic BAUD, so one is used unless the arithmetic BAUD
+/// on the DFLL48M comes closer. Rates above SERCOM_UART_MAX_RATE are clamped to it. Returns the
+/// rate actually achieved.
+u32 sercom_uart_clock_calc(u32 rate, SercomClock* clk, u8* sampr, u16* baud) {
+    if (rate > SERCOM_UART_MAX_RATE) {
+        rate = SERCOM_UART_MAX_RATE;
+    } else if (rate == 0) {
+        rate = 1;
+    }
+    bool dpll = dpll_available();
+
+    // rate = 96MHz / (2 * m * n), with n = 8 * BAUD + FP in eighths of the 16x oversampled
+    // bit. BAUD is 13 bits and at least 1.
+    u32 best_m = SERCOM_CLOCK_MIN_M, best_n = 0xffff, best_err = 0xffffffff;
+    for (u32 m = SERCOM_CLOCK_MIN_M; m <= SERCOM_CLOCK_MAX_M; m++) {
+        if (!sercom_clock_m_valid(m, dpll)) continue;
+        u32 n = (DPLL_FREQ + m * rate) / (2 * m * rate);
+        if (n < 8) {
+            // Larger m only gets further from the rate
+            break;
+        } else if (n > 0xffff) {
+            continue;
+        }
+
+        // Error in rate, scaled by the 2 * m * n that is close to DPLL_FREQ / rate for all m
+        u32 actual = 2 * m * n * rate;
+        u32 err = actual > DPLL_FREQ ? actual - DPLL_FREQ : DPLL_FREQ - actual;
+        if (err < best_err) {
+            best_m = m;
+            best_n = n;
+            best_err = err;
+            if (err == 0) break;
+        }
+    }
+
+    // The arithmetic BAUD gives rate = 48MHz / 16 * (65536 - BAUD) / 65536, an error scaled by
+    // 65536 as the fractional one is by 2 * m * n
+    u16 arith = sercom_uart_baud(rate);
+    uint64_t arith_actual = (uint64_t) (SERCOM_REF_FREQ / 16) * (65536 - arith);
+    uint64_t scaled_rate = (uint64_t) rate * 65536;
+    uint64_t arith_err = arith_actual > scaled_rate
+        ? arith_actual - scaled_rate : scaled_rate - arith_actual;
+    if (best_err != 0 && arith_err * 2 * best_m * best_n < (uint64_t) best_err * 65536) {
+        *clk = (SercomClock) { GCLK_SOURCE_DFLL48M, 1 };
+        *sampr = SERCOM_UART_SAMPR_ARITH;
+        *baud = arith;
+        return arith_actual / 65536;
+    }
+
+    *clk = sercom_clock_for(best_m);
+    *sampr = SERCOM_UART_SAMPR_FRAC;
+    *baud = SERCOM_USART_BAUD_FRAC_BAUD(best_n / 8) | SERCOM_USART_BAUD_FRAC_FP(best_n % 8);
+    return DPLL_FREQ / (2 * best_m * best_n);
+}
+
+/// Change the baud rate of an enabled USART, without a reset
+void sercom_uart_set_baud(SercomId id, u16 baud) {
+    // BAUD is enable-protected
+    sercom(id)->USART.CTRLA.bit.ENABLE = 0;
+    while(sercom(id)->USART.SYNCBUSY.bit.ENABLE);
+
+    sercom(id)->USART.BAUD.reg = baud;
+
+    sercom(id)->USART.CTRLA.bit.ENABLE = 1;
+    while(sercom(id)->USART.SYNCBUSY.bit.ENABLE);
+}
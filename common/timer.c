@@ -18,6 +18,82 @@ void tcc_delay_start(TimerId id, u32 ticks) {
 void tcc_delay_disable(TimerId id) {
     tcc(id)->INTENCLR.reg = TC_INTENSET_OVF;
     tcc(id)->CTRLA.bit.ENABLE = 0;
+
+    // stop listening for retrigger events
+    while (tcc(id)->SYNCBUSY.reg > 0);
+    tcc(id)->EVCTRL.reg = 0;
+}
+
+// sets up a TC to overflow, generating an event, every `ticks` cycles of GCLK 0,
+// using the smallest prescaler that fits the 16-bit counter
+void tc_event_enable(TimerId id, u32 ticks) {
+    static const u16 prescalers[] = {1, 2, 4, 8, 16, 64, 256, 1024};
+    u32 prescaler = 0;
+    while (prescaler < 7 && ticks / prescalers[prescaler] > 0x10000) {
+        prescaler++;
+    }
+    u32 top = ticks / prescalers[prescaler];
+    if (top > 0x10000) top = 0x10000;
+    if (top < 1) top = 1;
+
+    timer_clock_enable(id);
+
+    tc(id)->COUNT16.CTRLA.reg = TC_CTRLA_SWRST;
+    while (tc(id)->COUNT16.CTRLA.bit.SWRST);
+
+    tc(id)->COUNT16.CTRLA.reg
+        = TC_CTRLA_MODE_COUNT16
+        | TC_CTRLA_WAVEGEN_MFRQ
+        | TC_CTRLA_PRESCALER(prescaler);
+    tc(id)->COUNT16.CC[0].reg = top - 1;
+    tc(id)->COUNT16.EVCTRL.reg = TC_EVCTRL_OVFEO;
+
+    while (tc(id)->COUNT16.STATUS.bit.SYNCBUSY);
+
+    tc(id)->COUNT16.CTRLA.bit.ENABLE = 1;
+}
+
+// stops a TC started by tc_event_enable
+void tc_event_disable(TimerId id) {
+    tc(id)->COUNT16.CTRLA.bit.ENABLE = 0;
+    while (tc(id)->COUNT16.STATUS.bit.SYNCBUSY);
+    tc(id)->COUNT16.EVCTRL.reg = 0;
+}
+
+// sets up a TCC to count freely over its full 24-bit range at GCLK 0 / `prescaler`, capturing
+// the count into CC[n] on each event on match/capture event input n of the first `channels`.
+// The overflow interrupt is enabled so the caller can extend the count.
+void tcc_capture_enable(TimerId id, u32 prescaler, u8 channels) {
+    u32 cpten = 0;
+    u32 mcei = 0;
+    for (int i = 0; i<channels; i++) {
+        cpten |= TCC_CTRLA_CPTEN0 << i;
+        mcei |= TCC_EVCTRL_MCEI0 << i;
+    }
+
+    timer_clock_enable(id);
+
+    tcc(id)->CTRLA.reg = TCC_CTRLA_SWRST;
+    while (tcc(id)->SYNCBUSY.reg > 0 && tcc(id)->CTRLA.bit.SWRST > 0);
+
+    tcc(id)->CTRLA.reg = prescaler | cpten;
+    tcc(id)->EVCTRL.reg = mcei;
+    tcc(id)->PER.reg = 0xffffff;
+
+    while (tcc(id)->SYNCBUSY.reg > 0);
+
+    tcc(id)->INTFLAG.reg = TCC_INTFLAG_OVF;
+    tcc(id)->INTENSET.reg = TCC_INTENSET_OVF;
+    tcc(id)->CTRLA.bit.ENABLE = 1;
+}
+
+// stops a TCC started by tcc_capture_enable
+void tcc_capture_disable(TimerId id) {
+    tcc(id)->INTENCLR.reg = TCC_INTENSET_OVF;
+    tcc(id)->CTRLA.bit.ENABLE = 0;
+
+    while (tcc(id)->SYNCBUSY.reg > 0);
+    tcc(id)->EVCTRL.reg = 0;
 }
 
 // sets up a timer to count down in one-shot mode.
@@ -32,3 +108,19 @@ void tcc_delay_enable(TimerId id) {
     tcc(id)->CTRLA.bit.ENABLE = 1;
     tcc(id)->INTENSET.reg = TCC_INTENSET_OVF;
 }
+
+// sets up a one-shot countdown of `ticks` that is (re)started in hardware by every
+// event on event input 0, rather than by tcc_delay_start.
+void tcc_delay_enable_retrigger(TimerId id, u32 ticks) {
+    timer_clock_enable(id);
+
+    tcc(id)->CTRLA.reg = TCC_CTRLA_PRESCALER_DIV256;
+    tcc(id)->CTRLBSET.reg = TCC_CTRLBSET_DIR | TCC_CTRLBSET_ONESHOT;
+    tcc(id)->EVCTRL.reg = TCC_EVCTRL_EVACT0_RETRIGGER | TCC_EVCTRL_TCEI0;
+    tcc(id)->PER.reg = ticks;
+
+    while (tcc(id)->SYNCBUSY.reg > 0);
+
+    tcc(id)->CTRLA.bit.ENABLE = 1;
+    tcc(id)->INTENSET.reg = TCC_INTENSET_OVF;
+}
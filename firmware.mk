@@ -9,8 +9,14 @@ $(TARGET)_SRC += \
   firmware/flash.c \
   firmware/bridge.c \
   firmware/port.c \
+  firmware/power.c \
   firmware/usbpipe.c \
   firmware/usbserial.c \
 
 $(TARGET)_LDSCRIPT = common/samd21g18a_firmware_partition.ld
 $(TARGET)_DEFINE += -D __SAMD21G18A__
+
+# `make TRACE=1` records bridge, port, DMA and interrupt events for scripts/trace.py
+ifdef TRACE
+$(TARGET)_DEFINE += -D TRACE
+endif
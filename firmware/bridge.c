@@ -9,28 +9,379 @@ typedef enum BridgeState {
 
 BridgeState bridge_state = BRIDGE_STATE_DISABLE;
 
+/// Move to a new state, keeping the bus clocks the DMA needs running during a transaction
+static inline void bridge_set_state(BridgeState state) {
+    bridge_state = state;
+    trace(TRACE_BRIDGE_STATE, 0, state);
+    power_set(POWER_BRIDGE, state == BRIDGE_STATE_CTRL || state == BRIDGE_STATE_DATA);
+}
+
+// Header command bytes sent by the SoC and the SAMD21 for each framing version. Version 1 carries
+// 8-bit lengths. Version 2 appends the high byte of each length to the version 1 header.
+#define BRIDGE_CMD_V1 0x53
+#define BRIDGE_REPLY_V1 0xCA
+#define BRIDGE_CMD_V2 0x54
+#define BRIDGE_REPLY_V2 0xCB
+
+// Status bit advertised by the SAMD21 when it supports version 2 framing, and set by the SoC in a
+// version 1 header to switch both sides to version 2 after that transaction.
+#define BRIDGE_STATUS_V2 0x80
+// The version 1 status byte also carries the ready (bits 0-2) and open (bits 4-6) state of
+// channels 0-2. Version 2 sends the state of all channels in the ready and open bytes.
+#define BRIDGE_STATUS_OPEN_SHIFT 4
+#define BRIDGE_V1_CHAN_MASK ((1 << BRIDGE_V1_NUM_CHAN) - 1)
+
+// Version 2 header flag: the sender supports pipelining. When both headers of a transaction with
+// data set it, the data phase ends with a trailer in which both sides exchange the header for the
+// next transaction. The SoC can then skip the header phase of the next transaction by not clocking
+// any header bytes after SYNC falls.
+#define BRIDGE_FLAG_PIPELINE 0x01
+
+// Version 2 headers end with a sequence number and a check byte. The SoC numbers its headers, and
+// the SAMD21 answers with the number of the last one whose transaction took effect, so the SoC can
+// tell whether a data phase whose trailer it didn't get took place. A header whose check doesn't
+// match is ignored like one with a bad command byte.
+
+#define BRIDGE_V1_MAX_SIZE 255
+
+// A version 1 header ends after the sizes of the first BRIDGE_V1_NUM_CHAN channels
 typedef struct ControlPkt {
     u8 cmd;
     u8 status;
     u8 size[BRIDGE_NUM_CHAN];
+    u8 size_hi[BRIDGE_NUM_CHAN]; // version 2 only
+    u8 flags; // version 2 only
+    u8 ready; // version 2 only
+    u8 open; // version 2 only
+    u8 seq; // version 2 only
+    u8 check; // version 2 only, must be last
 } __attribute__((packed)) ControlPkt;
 
+u8 bridge_version = 1;
 u8 was_open = 0;
 ControlPkt ctrl_rx;
 ControlPkt ctrl_tx;
 
+// Header for the next transaction, exchanged in the trailer of a pipelined data phase
+ControlPkt ctrl_rx_next;
+ControlPkt ctrl_tx_next;
+bool trailer_pending = false;
+
 DMA_DESC_ALIGN DmacDescriptor dma_chain_control_rx[2];
 DMA_DESC_ALIGN DmacDescriptor dma_chain_control_tx[2];
 
-DMA_DESC_ALIGN DmacDescriptor dma_chain_data_rx[BRIDGE_NUM_CHAN*2];
-DMA_DESC_ALIGN DmacDescriptor dma_chain_data_tx[BRIDGE_NUM_CHAN*2];
+DMA_DESC_ALIGN DmacDescriptor dma_chain_data_rx[BRIDGE_NUM_CHAN*2 + 1];
+DMA_DESC_ALIGN DmacDescriptor dma_chain_data_tx[BRIDGE_NUM_CHAN*2 + 1];
 
-// These variables store the state configured by bridge_start_{in, out}
-u8* in_chan_ptr[BRIDGE_NUM_CHAN];
-u8 in_chan_size[BRIDGE_NUM_CHAN];
+// These variables store the buffers queued by bridge_start_{in, out}. Entry 0 is the oldest.
+u8* in_chan_ptr[BRIDGE_NUM_CHAN][BRIDGE_QUEUE_DEPTH];
+u16 in_chan_size[BRIDGE_NUM_CHAN][BRIDGE_QUEUE_DEPTH];
+u8 in_chan_count[BRIDGE_NUM_CHAN];
 
-u8* out_chan_ptr[BRIDGE_NUM_CHAN];
+u8* out_chan_ptr[BRIDGE_NUM_CHAN][BRIDGE_QUEUE_DEPTH];
+u8 out_chan_count[BRIDGE_NUM_CHAN];
+// Bitmaps of the channels with an OUT buffer queued, and of the enabled channels
 u8 out_chan_ready;
+u8 chan_enabled;
+
+// Sizes of the current data phase, decoded from the header when SYNC rises
+u16 data_out_size[BRIDGE_NUM_CHAN];
+u16 data_in_size[BRIDGE_NUM_CHAN];
+// Channels opened by the SoC in the header of the current data phase
+u8 data_open;
+// Channels whose queued buffer completes with the current data phase
+u8 data_out_done;
+u8 data_in_done;
+// The buffers taken from the queues for the current data phase, and the channels whose oldest IN
+// buffer was only advanced, which are put back if SYNC falls before the data phase completes
+u8* data_out_ptr[BRIDGE_NUM_CHAN];
+u8* data_in_ptr[BRIDGE_NUM_CHAN];
+u8 data_in_split;
+
+// A finished data phase whose channel callbacks have yet to run. Captured by the DMA completion
+// or, if SYNC falls before DMAC_Handler runs, by the SYNC handler.
+bool done_pending = false;
+u8 done_open;
+u8 done_out;
+u8 done_in;
+u16 done_size[BRIDGE_NUM_CHAN];
+
+// Sequence number of the last SoC header whose transaction took effect, and its value before the
+// current data phase, restored if the data phase is cut short
+u8 seq_done;
+u8 seq_before;
+
+// The queues as the SoC last saw them: the header of the last transaction less the buffers its
+// data phase moved, or the trailer if it had one. The SoC keeps the same view, and IRQ is only
+// raised when the queues differ from it.
+ControlPkt ctrl_seen;
+bool irq_high = false;
+
+// When IRQ was raised, for the latency until the SoC starts a transaction
+u32 irq_stamp;
+bool irq_timing = false;
+
+/// Length of the header packet for the current framing version
+static inline u32 bridge_ctrl_len() {
+    return (bridge_version == 2) ? sizeof(ControlPkt) : 2 + BRIDGE_V1_NUM_CHAN;
+}
+
+/// Number of channels the current framing version can address
+static inline u8 bridge_num_chan() {
+    return (bridge_version == 2) ? BRIDGE_NUM_CHAN : BRIDGE_V1_NUM_CHAN;
+}
+
+/// Largest per-channel transfer for the current framing version
+static inline u16 bridge_max_size() {
+    return (bridge_version == 2) ? BRIDGE_BUF_SIZE : BRIDGE_V1_MAX_SIZE;
+}
+
+/// Rotating XOR of the bytes of a header packet before its check byte. This catches any error
+/// confined to one byte, and is cheap enough for the SYNC interrupt.
+static inline u8 bridge_ctrl_check(ControlPkt* pkt) {
+    u8* buf = (u8*) pkt;
+    u8 check = 0;
+    for (u32 i=0; i<sizeof(ControlPkt) - 1; i++) {
+        check = ((check << 1) | (check >> 7)) ^ buf[i];
+    }
+    return check;
+}
+
+/// Decode the length of a channel from a header packet
+static inline u16 bridge_ctrl_size(ControlPkt* pkt, u8 chan) {
+    if (chan >= bridge_num_chan()) {
+        return 0;
+    }
+    u16 size = pkt->size[chan];
+    if (bridge_version == 2) {
+        size |= pkt->size_hi[chan] << 8;
+    }
+    return size;
+}
+
+/// Decode the bitmap of channels ready to receive from a header packet
+static inline u8 bridge_ctrl_ready(ControlPkt* pkt) {
+    return (bridge_version == 2) ? pkt->ready : pkt->status & BRIDGE_V1_CHAN_MASK;
+}
+
+/// Decode the bitmap of open channels from a header packet
+static inline u8 bridge_ctrl_open(ControlPkt* pkt) {
+    return (bridge_version == 2) ? pkt->open : (pkt->status >> BRIDGE_STATUS_OPEN_SHIFT) & BRIDGE_V1_CHAN_MASK;
+}
+
+/// Grant channels of one priority their weighted share of the budget, then what is left of it in
+/// channel order. `want` is reduced by what each channel is granted.
+static void bridge_share_budget(u8 priority, u16 want[], u16 size[], u16* budget) {
+    u32 weights = 0;
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        if (bridge_channels[chan].priority == priority && want[chan] > 0) {
+            weights += bridge_channels[chan].weight ? bridge_channels[chan].weight : 1;
+        }
+    }
+    if (weights == 0) {
+        return;
+    }
+
+    u16 level_budget = *budget;
+    for (u8 pass=0; pass<2; pass++) {
+        for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+            if (bridge_channels[chan].priority != priority || want[chan] == 0) continue;
+            u16 grant = *budget;
+            if (pass == 0) {
+                u8 weight = bridge_channels[chan].weight ? bridge_channels[chan].weight : 1;
+                grant = level_budget * weight / weights;
+            }
+            if (grant > want[chan]) grant = want[chan];
+            size[chan] += grant;
+            want[chan] -= grant;
+            *budget -= grant;
+        }
+    }
+}
+
+/// Fill a header packet with the state of the oldest queued buffer of each channel. Up to
+/// BRIDGE_IN_BUDGET bytes are announced, and up to BRIDGE_BULK_CAP per channel while a more urgent
+/// channel has data. Channels that don't fit send the rest of their buffer in a later transaction.
+/// Nothing is announced on a channel the SoC last reported closed, as its queue is dropped when
+/// the close is processed, and a data phase agreed on before that would send filler to the socket.
+void bridge_fill_ctrl(ControlPkt* pkt) {
+    pkt->cmd = (bridge_version == 2) ? BRIDGE_REPLY_V2 : BRIDGE_REPLY_V1;
+    u16 max_size = bridge_max_size();
+    u16 want[BRIDGE_NUM_CHAN];
+    u16 size[BRIDGE_NUM_CHAN];
+    u32 total = 0;
+    u8 priorities = 0;
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        bool pending = chan < bridge_num_chan() && in_chan_count[chan] > 0 && (data_open & (1<<chan));
+        want[chan] = pending ? in_chan_size[chan][0] : 0;
+        if (want[chan] > max_size) want[chan] = max_size;
+        if (want[chan] > 0) {
+            total += want[chan];
+            priorities |= 1 << bridge_channels[chan].priority;
+        }
+        size[chan] = 0;
+    }
+
+    if (priorities & (priorities - 1)) {
+        // Keep the transaction short while urgent data waits, by capping the other channels
+        u8 urgent = 0;
+        while (!(priorities & (1 << urgent))) urgent++;
+        for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+            if (bridge_channels[chan].priority != urgent && want[chan] > BRIDGE_BULK_CAP) {
+                total -= want[chan] - BRIDGE_BULK_CAP;
+                want[chan] = BRIDGE_BULK_CAP;
+            }
+        }
+    }
+
+    if (total <= BRIDGE_IN_BUDGET) {
+        // Everything fits, which is the usual case. This also runs when SYNC falls, so skip the
+        // sharing.
+        memcpy(size, want, sizeof(size));
+    } else {
+        u16 budget = BRIDGE_IN_BUDGET;
+        for (u8 priority=0; priority<BRIDGE_NUM_PRIORITY && budget > 0; priority++) {
+            if (priorities & (1 << priority)) {
+                bridge_share_budget(priority, want, size, &budget);
+            }
+        }
+    }
+
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        pkt->size[chan] = size[chan] & 0xFF;
+        pkt->size_hi[chan] = size[chan] >> 8;
+    }
+    pkt->ready = out_chan_ready;
+    pkt->open = chan_enabled;
+    pkt->status = (out_chan_ready & BRIDGE_V1_CHAN_MASK)
+        | ((chan_enabled & BRIDGE_V1_CHAN_MASK) << BRIDGE_STATUS_OPEN_SHIFT)
+        | BRIDGE_STATUS_V2;
+    pkt->flags = BRIDGE_FLAG_PIPELINE;
+    pkt->seq = seq_done;
+    pkt->check = bridge_ctrl_check(pkt);
+}
+
+/// Request a transaction from the SoC if the queues changed since it last saw them. Called with
+/// interrupts disabled. Between SYNC edges the header is already sent, so the check is left to the
+/// end of the header phase.
+static void bridge_update_irq() {
+    if (irq_high || bridge_state == BRIDGE_STATE_DISABLE || bridge_state == BRIDGE_STATE_CTRL) {
+        return;
+    }
+
+    ControlPkt now;
+    bridge_fill_ctrl(&now);
+    // Only channels that became ready matter, the SoC finds out about the others when it sends
+    bool changed = (now.ready & ~ctrl_seen.ready) || now.open != ctrl_seen.open;
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        if (now.size[chan] != ctrl_seen.size[chan] || now.size_hi[chan] != ctrl_seen.size_hi[chan]) {
+            changed = true;
+        }
+    }
+
+    if (changed) {
+        irq_stamp = stats_stamp();
+        irq_timing = true;
+        irq_high = true;
+        pin_high(PIN_BRIDGE_IRQ);
+    }
+}
+
+/// Remove the oldest queued IN buffer of a channel
+static inline void bridge_pop_in(u8 chan) {
+    in_chan_ptr[chan][0] = in_chan_ptr[chan][1];
+    in_chan_size[chan][0] = in_chan_size[chan][1];
+    in_chan_count[chan] -= 1;
+}
+
+/// Remove the oldest queued OUT buffer of a channel
+static inline void bridge_pop_out(u8 chan) {
+    out_chan_ptr[chan][0] = out_chan_ptr[chan][1];
+    out_chan_count[chan] -= 1;
+    if (out_chan_count[chan] == 0) {
+        out_chan_ready &= ~(1<<chan);
+    }
+}
+
+/// Put a buffer back at the head of a channel's IN queue
+static inline void bridge_unpop_in(u8 chan, u8* ptr, u16 size) {
+    in_chan_ptr[chan][1] = in_chan_ptr[chan][0];
+    in_chan_size[chan][1] = in_chan_size[chan][0];
+    in_chan_ptr[chan][0] = ptr;
+    in_chan_size[chan][0] = size;
+    in_chan_count[chan] += 1;
+}
+
+/// Put a buffer back at the head of a channel's OUT queue
+static inline void bridge_unpop_out(u8 chan, u8* ptr) {
+    out_chan_ptr[chan][1] = out_chan_ptr[chan][0];
+    out_chan_ptr[chan][0] = ptr;
+    out_chan_count[chan] += 1;
+    out_chan_ready |= (1<<chan);
+}
+
+/// Return the buffers of a data phase that SYNC cut short to their queues, so they go in a later
+/// transaction instead of being lost. Their owners still count them as queued, so there is room.
+/// Channels disabled since the data phase started have dropped their buffers.
+static void bridge_rollback() {
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        if (!(chan_enabled & (1<<chan))) {
+            continue;
+        }
+        if (data_out_done & (1<<chan)) {
+            bridge_unpop_out(chan, data_out_ptr[chan]);
+        }
+        if (data_in_done & (1<<chan)) {
+            bridge_unpop_in(chan, data_in_ptr[chan], data_in_size[chan]);
+        } else if (data_in_split & (1<<chan)) {
+            in_chan_ptr[chan][0] -= data_in_size[chan];
+            in_chan_size[chan][0] += data_in_size[chan];
+        }
+    }
+    data_out_done = 0;
+    data_in_done = 0;
+    data_in_split = 0;
+    trailer_pending = false;
+    seq_done = seq_before;
+    stats.bridge_aborted++;
+}
+
+/// Take the results of the finished data phase for bridge_report_completion. Call with interrupts
+/// disabled, or from the SYNC handler.
+static void bridge_capture_completion() {
+    done_open = data_open;
+    done_out = data_out_done;
+    done_in = data_in_done;
+    memcpy(done_size, data_out_size, sizeof(done_size));
+    done_pending = true;
+}
+
+/// Ignore the header the SoC sent. The SoC took our header as the state of the queues, and may
+/// count transfers that didn't happen as done, so IRQ is raised again while anything is queued.
+static void bridge_reject_header() {
+    stats.bridge_header_errors++;
+    bridge_set_state(BRIDGE_STATE_IDLE);
+    memset(&ctrl_seen, 0, sizeof(ControlPkt));
+    pin_low(PIN_BRIDGE_IRQ);
+    irq_high = false;
+    irq_timing = false;
+    bridge_update_irq();
+}
+
+/// Switch framing version and size the header DMA chains to match
+void bridge_set_version(u8 version) {
+    bridge_version = version;
+    trailer_pending = false;
+
+    u32 len = bridge_ctrl_len();
+    dma_fill_sercom_rx(&dma_chain_control_rx[0], SERCOM_BRIDGE, (u8*)&ctrl_rx, len);
+    dma_fill_sercom_rx(&dma_chain_control_rx[1], SERCOM_BRIDGE, NULL, len);
+    dma_link_chain(dma_chain_control_rx, 2);
+
+    dma_fill_sercom_tx(&dma_chain_control_tx[0], SERCOM_BRIDGE, NULL, len);
+    dma_fill_sercom_tx(&dma_chain_control_tx[1], SERCOM_BRIDGE, (u8*)&ctrl_tx, len);
+    dma_link_chain(dma_chain_control_tx, 2);
+}
 
 void bridge_init() {
     sercom_clock_enable(SERCOM_BRIDGE, GCLK_SYSTEM, 1);
@@ -49,14 +400,10 @@ void bridge_init() {
     pin_out(PIN_BRIDGE_IRQ);
 
     dma_sercom_configure_rx(DMA_BRIDGE_RX, SERCOM_BRIDGE);
-    dma_fill_sercom_rx(&dma_chain_control_rx[0], SERCOM_BRIDGE, (u8*)&ctrl_rx, sizeof(ControlPkt));
-    dma_fill_sercom_rx(&dma_chain_control_rx[1], SERCOM_BRIDGE, NULL, sizeof(ControlPkt));
-    dma_link_chain(dma_chain_control_rx, 2);
-
     dma_sercom_configure_tx(DMA_BRIDGE_TX, SERCOM_BRIDGE);
-    dma_fill_sercom_tx(&dma_chain_control_tx[0], SERCOM_BRIDGE, NULL, sizeof(ControlPkt));
-    dma_fill_sercom_tx(&dma_chain_control_tx[1], SERCOM_BRIDGE, (u8*)&ctrl_tx, sizeof(ControlPkt));
-    dma_link_chain(dma_chain_control_tx, 2);
+
+    // Always start with the version 1 framing, the SoC requests version 2 if it supports it
+    bridge_set_version(1);
 
     pin_mux_eic(PIN_BRIDGE_SYNC);
     eic_config(PIN_BRIDGE_SYNC, EIC_CONFIG_SENSE_BOTH);
@@ -66,7 +413,15 @@ void bridge_init() {
         EVSYS_USER_NONE);
     EVSYS->INTENSET.reg = EVSYS_EVD(EVSYS_BRIDGE_SYNC);
 
-    bridge_state = BRIDGE_STATE_IDLE;
+    // The SoC has seen none of the queues yet, which may already hold data from before a flash
+    // session. Without this nothing raises IRQ until the queues change again.
+    __disable_irq();
+    memset(&ctrl_seen, 0, sizeof(ControlPkt));
+    irq_high = false;
+    irq_timing = false;
+    bridge_set_state(BRIDGE_STATE_IDLE);
+    bridge_update_irq();
+    __enable_irq();
 }
 
 void bridge_disable() {
@@ -81,12 +436,30 @@ void bridge_disable() {
     pin_in(PIN_FLASH_CS);
 
     pin_low(PIN_BRIDGE_IRQ);
+    irq_high = false;
 
-    bridge_state = BRIDGE_STATE_DISABLE;
+    bridge_set_state(BRIDGE_STATE_DISABLE);
 }
 
 void bridge_handle_sync() {
     if (pin_read(PIN_BRIDGE_SYNC) == 0) {
+        if (irq_timing) {
+            stats_max(&stats.irq_latency_max, stats_elapsed(irq_stamp));
+            irq_timing = false;
+        }
+
+        if (bridge_state == BRIDGE_STATE_DATA) {
+            if (dma_complete(DMA_BRIDGE_RX)) {
+                // The data phase finished, but DMAC_Handler hasn't run yet and won't see it once
+                // the DMA is restarted below, so have it report the captured results
+                bridge_capture_completion();
+                NVIC_SetPendingIRQ(DMAC_IRQn);
+            } else {
+                // The SoC gave up on the data phase, e.g. because our header was corrupted
+                bridge_rollback();
+            }
+        }
+
         // Reset SERCOM to clear FIFOs and prepare for header packet
         dma_abort(DMA_BRIDGE_TX);
         dma_abort(DMA_BRIDGE_RX);
@@ -94,158 +467,296 @@ void bridge_handle_sync() {
         sercom_spi_slave_init(SERCOM_BRIDGE, BRIDGE_DIPO, BRIDGE_DOPO, 1, 1);
 
         ctrl_rx.cmd = 0x00;
-        ctrl_tx.cmd = 0xCA;
-        for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
-            ctrl_tx.size[chan] = in_chan_size[chan];
-        }
-        ctrl_tx.status = out_chan_ready;
+        bridge_fill_ctrl(&ctrl_tx);
 
         dma_start_descriptor(DMA_BRIDGE_TX, &dma_chain_control_tx[0]);
         dma_start_descriptor(DMA_BRIDGE_RX, &dma_chain_control_rx[0]);
-        DMAC->CHINTENCLR.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR; // note: depends on ID from previous call
-        bridge_state = BRIDGE_STATE_CTRL;
+        dma_disable_interrupt(DMA_BRIDGE_RX);
+        bridge_set_state(BRIDGE_STATE_CTRL);
     } else {
+        // If no header was clocked in, the SoC continues a pipeline with the header exchanged in
+        // the trailer of the previous data phase
+        bool from_trailer = ctrl_rx.cmd == 0x00 && trailer_pending;
+        if (from_trailer) {
+            memcpy(&ctrl_rx, &ctrl_rx_next, sizeof(ControlPkt));
+            memcpy(&ctrl_tx, &ctrl_tx_next, sizeof(ControlPkt));
+        }
+        trailer_pending = false;
+
         // Configure DMA for the data phase
-        if (ctrl_rx.cmd != 0x53) {
-            bridge_state = BRIDGE_STATE_IDLE;
-            return;
+        if (ctrl_rx.cmd != ((bridge_version == 2) ? BRIDGE_CMD_V2 : BRIDGE_CMD_V1)) {
+            // The SoC may have restarted and lost the negotiated version. Fall back to version 1
+            // so the next header is understood. A corrupted trailer only means the SoC sends a
+            // header again.
+            if (bridge_version != 1 && !from_trailer) {
+                bridge_set_version(1);
+            }
+            return bridge_reject_header();
+        }
+
+        if (done_pending) {
+            // The channels haven't been told about the last data phase yet, so their queues
+            // can't be moved again. DMAC_Handler was held off for a whole transaction, and the
+            // SoC sends this header again as it does after a bad check.
+            return bridge_reject_header();
+        }
+
+        if (bridge_version == 2 && ctrl_rx.check != bridge_ctrl_check(&ctrl_rx)) {
+            // The SoC finds out from the sequence number in our next header, and retries
+            return bridge_reject_header();
         }
 
+        for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+            data_out_size[chan] = bridge_ctrl_size(&ctrl_rx, chan);
+            data_in_size[chan] = bridge_ctrl_size(&ctrl_tx, chan);
+            if (data_out_size[chan] > BRIDGE_BUF_SIZE) {
+                return bridge_reject_header();
+            }
+        }
+
+        seq_before = seq_done;
+        seq_done = ctrl_rx.seq;
+
+        // Decoded before a version switch at the end of this header phase changes the layout
+        u8 rx_ready = bridge_ctrl_ready(&ctrl_rx);
+        u8 tx_ready = bridge_ctrl_ready(&ctrl_tx);
+        data_open = bridge_ctrl_open(&ctrl_rx);
+
         // Set this flag so the LED boot sequence stops
         booted = true;
+        stats.bridge_transactions++;
 
         u8 desc = 0;
-
-        // Create DMA chain
+        data_out_done = 0;
+        data_in_done = 0;
+        data_in_split = 0;
+        // Channels moved by this data phase, which the SoC no longer counts as ready or pending
+        u8 moved_out = 0;
+        u8 moved_in = 0;
+
+        // Create DMA chain. When the header came from a trailer, a channel may have been disabled
+        // since it was sent. Its transfer still takes place as agreed, but into or from nowhere.
         for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
-            u8 size = ctrl_rx.size[chan];
-            if (ctrl_tx.status & (1<<chan) && size > 0) {
-                out_chan_ready &= ~ (1<<chan);
+            u16 size = data_out_size[chan];
+            if (tx_ready & (1<<chan) && size > 0) {
+                u8* dst = NULL;
+                if (out_chan_count[chan] > 0) {
+                    dst = out_chan_ptr[chan][0];
+                    data_out_ptr[chan] = dst;
+                    bridge_pop_out(chan);
+                    data_out_done |= (1<<chan);
+                }
                 dma_fill_sercom_tx(&dma_chain_data_tx[desc], SERCOM_BRIDGE, NULL, size);
-                dma_fill_sercom_rx(&dma_chain_data_rx[desc], SERCOM_BRIDGE, out_chan_ptr[chan], size);
+                dma_fill_sercom_rx(&dma_chain_data_rx[desc], SERCOM_BRIDGE, dst, size);
                 desc++;
+                moved_out |= (1<<chan);
+                stats.bridge_out_transfers[chan]++;
+                stats.bridge_out_bytes[chan] += size;
             }
 
-            size = ctrl_tx.size[chan];
-            if (ctrl_rx.status & (1<<chan) && size > 0) {
-                in_chan_size[chan] = 0;
-                dma_fill_sercom_tx(&dma_chain_data_tx[desc], SERCOM_BRIDGE, in_chan_ptr[chan], size);
+            size = data_in_size[chan];
+            if (rx_ready & (1<<chan) && size > 0) {
+                u8* src = NULL;
+                if (in_chan_count[chan] > 0 && in_chan_size[chan][0] >= size) {
+                    src = in_chan_ptr[chan][0];
+                    if (size < in_chan_size[chan][0]) {
+                        // Only part of the buffer fits in this frame, send the rest in the next one
+                        in_chan_ptr[chan][0] += size;
+                        in_chan_size[chan][0] -= size;
+                        data_in_split |= (1<<chan);
+                    } else {
+                        data_in_ptr[chan] = src;
+                        bridge_pop_in(chan);
+                        data_in_done |= (1<<chan);
+                    }
+                }
+                dma_fill_sercom_tx(&dma_chain_data_tx[desc], SERCOM_BRIDGE, src, size);
                 dma_fill_sercom_rx(&dma_chain_data_rx[desc], SERCOM_BRIDGE, NULL, size);
                 desc++;
+                moved_in |= (1<<chan);
+                stats.bridge_in_transfers[chan]++;
+                stats.bridge_in_bytes[chan] += size;
             }
         }
 
+        if (desc > 0 && bridge_version == 2
+            && (ctrl_rx.flags & BRIDGE_FLAG_PIPELINE) && (ctrl_tx.flags & BRIDGE_FLAG_PIPELINE)) {
+            // Append the trailer. Its header describes the queues as they are once this data phase
+            // completes, so buffers queued behind the ones in this transaction go in the next.
+            ctrl_rx_next.cmd = 0x00;
+            bridge_fill_ctrl(&ctrl_tx_next);
+            dma_fill_sercom_tx(&dma_chain_data_tx[desc], SERCOM_BRIDGE, (u8*)&ctrl_tx_next, sizeof(ControlPkt));
+            dma_fill_sercom_rx(&dma_chain_data_rx[desc], SERCOM_BRIDGE, (u8*)&ctrl_rx_next, sizeof(ControlPkt));
+            desc++;
+            trailer_pending = true;
+            memcpy(&ctrl_seen, &ctrl_tx_next, sizeof(ControlPkt));
+        } else {
+            memcpy(&ctrl_seen, &ctrl_tx, sizeof(ControlPkt));
+            ctrl_seen.ready &= ~moved_out;
+            for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+                if (moved_in & (1<<chan)) {
+                    ctrl_seen.size[chan] = 0;
+                    ctrl_seen.size_hi[chan] = 0;
+                }
+            }
+        }
+
+        if (desc == 0) {
+            stats.bridge_empty++;
+        }
+
         if (desc > 0) {
             dma_link_chain(dma_chain_data_tx, desc);
             dma_link_chain(dma_chain_data_rx, desc);
             dma_start_descriptor(DMA_BRIDGE_TX, &dma_chain_data_tx[0]);
             dma_start_descriptor(DMA_BRIDGE_RX, &dma_chain_data_rx[0]);
-            DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR; // note: depends on ID from previous call
-            DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
-            bridge_state = BRIDGE_STATE_DATA;
-        } else if ((ctrl_rx.status & 0xF0) != (was_open & 0xF0)) {
+            dma_clear_interrupt(DMA_BRIDGE_RX);
+            dma_enable_interrupt(DMA_BRIDGE_RX);
+            bridge_set_state(BRIDGE_STATE_DATA);
+        } else if (data_open != was_open) {
             // No data to transfer, but we need to process an open/close, so trigger a DMA
             // completion interrupt (which runs at a lower priority). The interrupt is already
             // pending because of the control packet completion, and just needs to be unmasked
             // to trigger the interrupt.
-            bridge_state = BRIDGE_STATE_DATA;
-            DMAC->CHID.reg = DMA_BRIDGE_RX;
-            DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+            bridge_set_state(BRIDGE_STATE_DATA);
+            dma_enable_interrupt(DMA_BRIDGE_RX);
         } else {
             // No data to transfer
-            bridge_state = BRIDGE_STATE_IDLE;
+            bridge_set_state(BRIDGE_STATE_IDLE);
         }
 
         pin_low(PIN_BRIDGE_IRQ);
-    }
-}
-
-void bridge_dma_rx_completion() {
-    if (bridge_state == BRIDGE_STATE_DATA) {
-
-        // Copy the global state to this stack frame in case SYNC changes and the ISR overwrites these
-        uint8_t rx_status = ctrl_rx.status;
-        uint8_t tx_status = ctrl_tx.status;
-        uint8_t rx_size[BRIDGE_NUM_CHAN];
-        memcpy(rx_size, ctrl_rx.size, sizeof(rx_size));
-        uint8_t tx_size[BRIDGE_NUM_CHAN];
-        memcpy(tx_size, ctrl_tx.size, sizeof(tx_size));
-        __asm__ __volatile__ ("" : : : "memory");
-
-        #define CHECK_OPEN(x) \
-            if ((rx_status & (0x10<<x)) && !(was_open & (0x10<<x))) { \
-                bridge_open_##x(rx_size[x]); \
-            }
-
-        #define CHECK_COMPLETION_OUT(x) \
-            if (tx_status & (1<<x) && rx_size[x] > 0) { \
-                bridge_completion_out_##x(rx_size[x]); \
-            }
+        irq_high = false;
+        irq_timing = false;
 
-        #define CHECK_COMPLETION_IN(x) \
-            if (rx_status & (1<<x) && tx_size[x] > 0) { \
-                bridge_completion_in_##x(); \
-            }
+        // The SoC acknowledged version 2 support in this version 1 header, so both sides use
+        // version 2 starting with the next transaction
+        if (bridge_version == 1 && (ctrl_rx.status & BRIDGE_STATUS_V2)) {
+            bridge_set_version(2);
+        }
 
-        #define CHECK_CLOSE(x) \
-            if (!(rx_status & (0x10<<x)) && (was_open & (0x10<<x))) { \
-                bridge_close_##x(rx_size[x]); \
-            }
+        // Buffers queued during the header phase, or the rest of a buffer sent in pieces, need
+        // another transaction
+        bridge_update_irq();
+    }
+}
 
-        CHECK_OPEN(0)
-        CHECK_OPEN(1)
-        CHECK_OPEN(2)
+/// Run the channel callbacks of a data phase captured by bridge_capture_completion, at the DMAC
+/// interrupt priority so they don't preempt the other handlers of the channels
+void bridge_report_completion() {
+    __disable_irq();
+    if (!done_pending) {
+        __enable_irq();
+        return;
+    }
+    // Copied to this stack frame, as the SYNC handler can capture the next data phase
+    u8 rx_open = done_open;
+    u8 out_done = done_out;
+    u8 in_done = done_in;
+    u16 rx_size[BRIDGE_NUM_CHAN];
+    memcpy(rx_size, done_size, sizeof(rx_size));
+    done_pending = false;
+    __enable_irq();
 
-        CHECK_COMPLETION_OUT(0);
-        CHECK_COMPLETION_OUT(1);
-        CHECK_COMPLETION_OUT(2);
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        const BridgeChannel* c = &bridge_channels[chan];
+        if ((rx_open & (1<<chan)) && !(was_open & (1<<chan)) && c->open) {
+            c->open();
+        }
+    }
 
-        CHECK_COMPLETION_IN(0);
-        CHECK_COMPLETION_IN(1);
-        CHECK_COMPLETION_IN(2);
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        const BridgeChannel* c = &bridge_channels[chan];
+        if ((out_done & (1<<chan)) && c->completion_out) {
+            c->completion_out(rx_size[chan]);
+        }
+    }
 
-        CHECK_CLOSE(0)
-        CHECK_CLOSE(1)
-        CHECK_CLOSE(2)
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        const BridgeChannel* c = &bridge_channels[chan];
+        if ((in_done & (1<<chan)) && c->completion_in) {
+            c->completion_in();
+        }
+    }
 
+    for (u8 chan=0; chan<BRIDGE_NUM_CHAN; chan++) {
+        const BridgeChannel* c = &bridge_channels[chan];
+        if (!(rx_open & (1<<chan)) && (was_open & (1<<chan)) && c->close) {
+            c->close();
+        }
+    }
 
-        #undef CHECK_OPEN
-        #undef CHECK_COMPLETION_OUT
-        #undef CHECK_COMPLETION_IN
-        #undef CHECK_CLOSE
+    was_open = rx_open;
+}
 
-        was_open = ctrl_rx.status & 0xF0;
-        bridge_state = BRIDGE_STATE_IDLE;
+void bridge_dma_rx_completion() {
+    __disable_irq();
+    if (bridge_state == BRIDGE_STATE_DATA) {
+        bridge_capture_completion();
+        bridge_set_state(BRIDGE_STATE_IDLE);
     }
+    __enable_irq();
+    bridge_report_completion();
 }
 
-void bridge_start_in(u8 channel, u8* data, u8 length) {
+/// Queue a buffer to send to the SoC. Up to BRIDGE_QUEUE_DEPTH buffers can be queued per channel,
+/// and they complete in order.
+void bridge_start_in(u8 channel, u8* data, u16 length) {
     __disable_irq();
-    in_chan_ptr[channel] = data;
-    in_chan_size[channel] = length;
+    u8 i = in_chan_count[channel];
+    if (i >= BRIDGE_QUEUE_DEPTH) {
+        invalid();
+    }
+    in_chan_ptr[channel][i] = data;
+    in_chan_size[channel][i] = length;
+    in_chan_count[channel] = i + 1;
+    bridge_update_irq();
     __enable_irq();
-    pin_high(PIN_BRIDGE_IRQ);
 }
 
+/// Queue a BRIDGE_BUF_SIZE buffer to receive from the SoC. Up to BRIDGE_QUEUE_DEPTH buffers can
+/// be queued per channel, and they complete in order.
 void bridge_start_out(u8 channel, u8* data) {
     __disable_irq();
-    out_chan_ptr[channel] = data;
+    u8 i = out_chan_count[channel];
+    if (i >= BRIDGE_QUEUE_DEPTH) {
+        invalid();
+    }
+    out_chan_ptr[channel][i] = data;
+    out_chan_count[channel] = i + 1;
     out_chan_ready |= (1<<channel);
+    bridge_update_irq();
     __enable_irq();
-    pin_high(PIN_BRIDGE_IRQ);
+}
+
+/// Drop the buffers queued on a channel, including any data that was waiting to be sent
+static inline void bridge_clear_chan(u8 channel) {
+    out_chan_ready &= ~(1<<channel);
+    out_chan_count[channel] = 0;
+    in_chan_count[channel] = 0;
 }
 
 void bridge_enable_chan(u8 channel) {
     __disable_irq();
-    out_chan_ready |= (0x10<<channel);
+    chan_enabled |= (1<<channel);
+    bridge_update_irq();
+    __enable_irq();
+}
+
+/// Drop the buffers queued on a channel and leave it open, for a channel that was closed by the
+/// SoC, so the next session starts with empty queues
+void bridge_reset_chan(u8 channel) {
+    __disable_irq();
+    bridge_clear_chan(channel);
+    chan_enabled |= (1<<channel);
+    bridge_update_irq();
     __enable_irq();
-    pin_high(PIN_BRIDGE_IRQ);
 }
 
 void bridge_disable_chan(u8 channel) {
     __disable_irq();
-    out_chan_ready &= ~(0x11<<channel); // Also clears the "ready to accept data" bit
-    in_chan_size[channel] = 0; // Clears any data that was waiting to be sent
+    chan_enabled &= ~(1<<channel);
+    bridge_clear_chan(channel);
+    bridge_update_irq();
     __enable_irq();
-    pin_high(PIN_BRIDGE_IRQ);
 }
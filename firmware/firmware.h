@@ -6,12 +6,14 @@
 /// DMA allocation. Channels 0-3 support EVSYS and are reserved for
 /// functions that need it
 #define DMA_TERMINAL_RX 0
+#define DMA_PORT_A_RX 1 // EVSYS: UART RX idle timeout
+#define DMA_PORT_B_RX 2 // EVSYS: UART RX idle timeout
 #define DMA_BRIDGE_TX 4
 #define DMA_BRIDGE_RX 5
 #define DMA_PORT_A_TX 6
-#define DMA_PORT_A_RX 7
+#define DMA_ADC_STREAM 7
 #define DMA_PORT_B_TX 8
-#define DMA_PORT_B_RX 9
+#define DMA_WAVE 9
 #define DMA_TERMINAL_TX 10
 
 
@@ -22,6 +24,12 @@
 /// EVSYS allocation
 #define EVSYS_BRIDGE_SYNC 0
 #define EVSYS_TERMINAL_TIMEOUT 1
+#define EVSYS_PORT_A_UART_TIMEOUT 2
+#define EVSYS_PORT_B_UART_TIMEOUT 3
+#define EVSYS_ADC_STREAM 4
+#define EVSYS_WAVE 5
+#define EVSYS_EDGE_CAPTURE_0 6
+#define EVSYS_EDGE_CAPTURE_1 7
 
 /// USB Endpoint allocation
 #define USB_EP_FLASH_OUT 0x02
@@ -37,17 +45,25 @@
 /// Timer allocation
 #define TC_TERMINAL_TIMEOUT 3
 #define TC_BOOT             4
+#define TC_ADC_STREAM       5
+// shared with boot because TC_BOOT is only used before the ports are up
+#define TC_WAVE             TC_BOOT
 
 // TCC allocation
 // muxed with i2c. also used for uart read timers
 #define TCC_PORT_A 2 // PA12, PA13
 #define TCC_PORT_B 0 // PA08, PA09
+// breathes the power LED until booted
+#define TCC_EDGE_CAPTURE 1
 
 // GCLK channel allocation
 #define GCLK_SYSTEM 0
 #define GCLK_32K    2
-#define GCLK_PORT_A 3
-#define GCLK_PORT_B 4
+// One generator per port SERCOM, so each can be set for its own clock
+#define GCLK_PORT_A_SPI      3
+#define GCLK_PORT_A_UART_I2C 4
+#define GCLK_PORT_B_SPI      5
+#define GCLK_PORT_B_UART_I2C 6
 
 extern volatile bool booted;
 
@@ -64,67 +80,261 @@ extern u8 flash_buffer[FLASH_BUFFER_SIZE];
 
 // bridge.c
 
-#define BRIDGE_NUM_CHAN 3
+// Channels 0-2 are available with both framing versions, the rest only with version 2
+#define BRIDGE_NUM_CHAN 8
+#define BRIDGE_V1_NUM_CHAN 3
 #define BRIDGE_USB 0
 #define BRIDGE_PORT_A 1
 #define BRIDGE_PORT_B 2
-#define BRIDGE_BUF_SIZE 255
+// Largest transfer per channel per bridge transaction. Only reachable with the version 2
+// (16-bit length) framing, version 1 framing sends a buffer in pieces of up to 255 bytes.
+#define BRIDGE_BUF_SIZE 1024
 #define BRIDGE_ARG_SIZE 5
+// Number of buffers that can be queued in each direction of a channel
+#define BRIDGE_QUEUE_DEPTH 2
+// Most bytes sent to the SoC per transaction, shared between channels by priority and weight
+#define BRIDGE_IN_BUDGET (BRIDGE_BUF_SIZE * 2)
+#define BRIDGE_NUM_PRIORITY 4
+// Largest transfer announced for a channel while a channel of a more urgent priority has data
+// waiting, so the urgent data isn't held up behind full bulk frames
+#define BRIDGE_BULK_CAP 256
+
+/// Callbacks of a bridge channel, each of which may be NULL, and its share of the transfers to the
+/// SoC. Channels of a lower priority number are served first, and channels of the same priority
+/// share what's left in proportion to their weights.
+typedef struct BridgeChannel {
+    void (*open)();
+    void (*close)();
+    void (*completion_out)(u16 size);
+    void (*completion_in)();
+    u8 priority;
+    u8 weight;
+} BridgeChannel;
+
+/// Defined by the application, indexed by channel number
+extern const BridgeChannel bridge_channels[BRIDGE_NUM_CHAN];
 
 void bridge_init();
 void bridge_disable();
 void bridge_handle_sync();
 void bridge_dma_rx_completion();
+void bridge_report_completion();
 
-void bridge_start_in(u8 channel, u8* data, u8 length);
+void bridge_start_in(u8 channel, u8* data, u16 length);
 void bridge_start_out(u8 channel, u8* data);
 void bridge_enable_chan(u8 channel);
+void bridge_reset_chan(u8 channel);
 void bridge_disable_chan(u8 channel);
 
-void bridge_completion_in_0();
-void bridge_completion_in_1();
-void bridge_completion_in_2();
-void bridge_completion_in_3();
-
-void bridge_completion_out_0(u8 size);
-void bridge_completion_out_1(u8 size);
-void bridge_completion_out_2(u8 size);
-void bridge_completion_out_3(u8 size);
-
-void bridge_open_0();
-void bridge_open_1();
-void bridge_open_2();
-void bridge_open_3();
-
-void bridge_close_0();
-void bridge_close_1();
-void bridge_close_2();
-void bridge_close_3();
-
 void cancel_breathing_animation();
 void init_breathing_animation();
 
+// Performance counters, read by the host with REQ_STATS
+
+/// Interrupt handlers whose longest run is recorded
+typedef enum StatsIsr {
+    STATS_ISR_DMAC,
+    STATS_ISR_SYNC,
+    STATS_ISR_EIC,
+    STATS_ISR_SERCOM,
+    STATS_ISR_TCC,
+    STATS_NUM_ISR,
+} StatsIsr;
+
+/// Durations are in 48 MHz SysTick cycles
+typedef struct Stats {
+    u32 bridge_transactions; // Transactions with a valid header
+    u32 bridge_empty; // Transactions without a data phase
+    u32 bridge_out_transfers[BRIDGE_NUM_CHAN]; // Data phases carrying data from the SoC
+    u32 bridge_out_bytes[BRIDGE_NUM_CHAN];
+    u32 bridge_in_transfers[BRIDGE_NUM_CHAN]; // Data phases carrying data to the SoC
+    u32 bridge_in_bytes[BRIDGE_NUM_CHAN];
+    u32 irq_latency_max; // From raising IRQ until the SoC lowers SYNC
+    u32 port_errors[2];
+    u32 uart_overruns[2]; // Bytes dropped by the UART receivers
+    u32 isr_max[STATS_NUM_ISR];
+    u32 bridge_header_errors; // Headers rejected for a bad command byte, check or size
+    u32 bridge_aborted; // Data phases cut short by SYNC, whose buffers were queued again
+    u32 i2c_nacks[2]; // I2C transfers not acknowledged or that lost the bus
+} Stats;
+
+extern Stats stats;
+
+void stats_timer_free_run();
+
+/// Cycle stamp for stats_elapsed. SysTick counts down, and free runs over 24 bits unless a macro
+/// timer trigger needs its 1ms interrupt.
+static inline u32 stats_stamp() {
+    return SysTick->VAL;
+}
+
+/// Cycles since a stamp, modulo the SysTick period
+static inline u32 stats_elapsed(u32 stamp) {
+    u32 now = SysTick->VAL;
+    return (stamp >= now) ? stamp - now : stamp + SysTick->LOAD + 1 - now;
+}
+
+static inline void stats_max(u32* max, u32 value) {
+    if (value > *max) {
+        *max = value;
+    }
+}
+
+// Event trace, built in with `make TRACE=1` and read by the host with REQ_TRACE or over SWD
+
+/// Trace events, and what chan and arg hold for each
+typedef enum TraceEvent {
+    TRACE_ISR, // chan: StatsIsr, arg: duration in cycles, 0xffff if longer. Recorded on exit.
+    TRACE_DMA, // chan: DMA channel whose transfer completed
+    TRACE_BRIDGE_STATE, // arg: BridgeState entered
+    TRACE_PORT_CMD, // chan: bridge channel, arg: command byte being started
+    TRACE_PORT_STATE, // chan: bridge channel, arg: PortState the parser stopped in
+    TRACE_PORT_ERROR, // chan: bridge channel
+} TraceEvent;
+
+/// Number of entries kept, a power of 2. The oldest are overwritten.
+#define TRACE_LEN 512
+
+typedef struct TraceEntry {
+    u32 stamp; // stats_stamp() when the event was recorded
+    u8 event;
+    u8 chan;
+    u16 arg;
+} TraceEntry;
+
+/// Laid out as read by scripts/trace.py
+typedef struct Trace {
+    u32 count; // Events recorded since the trace was restarted. Entry count % TRACE_LEN is next.
+    u32 reload; // SysTick LOAD when the trace was frozen, so the host can unwrap the stamps
+    u16 len; // TRACE_LEN
+    u8 frozen; // Set while the host reads the trace, and new events are dropped
+    u8 reserved;
+    TraceEntry entries[TRACE_LEN];
+} Trace;
+
+#ifdef TRACE
+extern Trace trace_log;
+
+void trace_freeze();
+void trace_restart();
+
+/// Append an event. Callable from any handler, as the SYNC handler can preempt the others.
+static inline void trace(TraceEvent event, u8 chan, u16 arg) {
+    u32 primask = __get_PRIMASK();
+    __disable_irq();
+    if (!trace_log.frozen) {
+        TraceEntry* e = &trace_log.entries[trace_log.count++ % TRACE_LEN];
+        e->stamp = stats_stamp();
+        e->event = event;
+        e->chan = chan;
+        e->arg = arg;
+    }
+    __set_PRIMASK(primask);
+}
+#else
+#define trace(event, chan, arg) ((void) 0)
+#endif
+
+/// Record the duration of an interrupt handler that started at the stamp
+static inline void stats_isr(StatsIsr isr, u32 stamp) {
+    u32 elapsed = stats_elapsed(stamp);
+    stats_max(&stats.isr_max[isr], elapsed);
+    trace(TRACE_ISR, isr, elapsed > 0xffff ? 0xffff : elapsed);
+}
+
 // port.c
 
 #define UART_MS_TIMEOUT 10 // send uart data after ms timeout even if buffer is not full
-#define UART_RX_SIZE 32
+// Largest UART RX DMA transfer, into the reply buffer or into each of the two buffers used while
+// the reply buffer is busy. A full transfer goes to the host as one REPLY_ASYNC_UART_RX packet,
+// so it must fit its 8-bit length.
+#define UART_RX_SIZE 255
+
+// Number of buffers in each direction of a port's bridge FIFO. While one command buffer is
+// parsed the next can be received from the host, and while one reply buffer is filled the
+// previous two can be queued on the bridge, so a pipelined transaction always has the next one.
+#define PORT_NUM_CMD_BUFS 2
+#define PORT_NUM_REPLY_BUFS 3
+
+// Reply space required before starting a command: the largest fixed-size reply (CMD_SPI_CONFIG)
+#define PORT_REPLY_RESERVE 5
+// Reply space required before accepting async events: a full UART flush with its header,
+// followed by an overflow report. Also covers a streaming ADC buffer or a batch of edge records.
+#define PORT_ASYNC_RESERVE (UART_RX_SIZE + 2 + 3)
 
 typedef struct UartBuf {
-    u8 head;
-    u8 tail;
-    u8 buf_len;
-    u8 rx[UART_RX_SIZE];
+    /// Buffer the RX DMA is writing into
+    u8 active;
+    /// Number of bytes in the other buffer waiting to be copied to the reply buffer
+    u8 pending;
+    /// Number of received bytes dropped since the last report to the host
+    u16 overflow;
+    /// Where the RX DMA's REPLY_ASYNC_UART_RX header goes in reply_buf while it receives straight
+    /// into the reply buffer, or NULL while it receives into `rx`
+    u8* direct;
+    u8 rx[2][UART_RX_SIZE];
 } UartBuf;
 
+// Number of samples in each half of the streaming ADC double buffer
+#define ADC_STREAM_SAMPLES 64
+
+// Number of samples in each half of the waveform output double buffer. A looped table can use
+// both halves.
+#define WAVE_SAMPLES 128
+
+// Number of pin edges buffered by edge capture while waiting to be sent to the host
+#define EDGE_CAPTURE_SIZE 64
+
+// Number of command sequences a port can store with CMD_MACRO_STORE, and the size of each
+#define PORT_NUM_MACROS 4
+#define PORT_MACRO_SIZE 64
+// PortData.macro when the host's commands are being parsed
+#define PORT_NO_MACRO 0xff
+
+// Number of SPI configurations a port keeps for switching between devices with CMD_SPI_SELECT
+#define PORT_SPI_CONFIGS 4
+
+typedef struct SpiConfig {
+    /// FLAG_SPI_CPOL / FLAG_SPI_CPHA
+    u8 flags;
+    /// SERCOM clock, with a div of 0 if the slot has not been configured
+    SercomClock clock;
+    u8 baud;
+} SpiConfig;
+
 typedef struct PortData {
     /// Pin mappings
     const TesselPort* port;
 
-    /// Buffers for data from the host
-    USB_ALIGN u8 cmd_buf[BRIDGE_BUF_SIZE];
+    /// Ring of buffers for data from the host
+    USB_ALIGN u8 cmd_bufs[PORT_NUM_CMD_BUFS][BRIDGE_BUF_SIZE];
+
+    /// Ring of buffers for data to the host
+    USB_ALIGN u8 reply_bufs[PORT_NUM_REPLY_BUFS][BRIDGE_BUF_SIZE];
+
+    /// Length of valid data in each buffer of cmd_bufs
+    u16 cmd_bufs_len[PORT_NUM_CMD_BUFS];
+
+    /// Length of valid data in each buffer of reply_bufs
+    u16 reply_bufs_len[PORT_NUM_REPLY_BUFS];
+
+    /// Command buffer currently being parsed (cmd_bufs[cmd_ring_pos])
+    u8* cmd_buf;
+
+    /// Reply buffer currently being filled (the buffer following the queued ones)
+    u8* reply_buf;
 
-    /// Buffers for data to the host
-    USB_ALIGN u8 reply_buf[BRIDGE_BUF_SIZE];
+    /// Index of the oldest filled buffer in cmd_bufs
+    u8 cmd_ring_pos;
+
+    /// Number of filled buffers in cmd_bufs, including the one being parsed
+    u8 cmd_ring_count;
+
+    /// Index of the oldest buffer in reply_bufs queued for the host
+    u8 reply_ring_pos;
+
+    /// Number of buffers in reply_bufs queued for the host, including the one being sent
+    u8 reply_ring_count;
 
     /// Bridge channel
     u8 chan;
@@ -142,13 +352,13 @@ typedef struct PortData {
     u8 mode;
 
     /// Length of valid data in cmd_buf
-    u8 cmd_len;
+    u16 cmd_len;
 
     /// Current position in cmd_buf
-    u8 cmd_pos;
+    u16 cmd_pos;
 
     /// Current write position in reply_buf (length of valid data written)
-    u8 reply_len;
+    u16 reply_len;
 
     /// Currently executing command (PortCmd in port.c)
     u8 cmd;
@@ -162,42 +372,93 @@ typedef struct PortData {
     /// Position into arguments
     u8 arg_pos;
 
-    /// GCLK channel for this port
-    u8 clock_channel;
+    /// GCLK channels for the SPI and UART/I2C SERCOMs of this port
+    u8 spi_clock_channel;
+    u8 uart_i2c_clock_channel;
 
     /// TCC channel for this port
     u8 tcc_channel;
 
-    /// True if the port is waiting for a packet from the host
-    bool pending_out;
+    /// EVSYS channel that restarts the TCC on each UART byte received
+    u8 evsys_channel;
+
+    /// Number of free cmd_bufs entries queued on the bridge to receive packets from the host
+    u8 pending_out;
+
+    /// Number of the oldest queued reply_bufs entries handed to the bridge to send to the host
+    u8 pending_in;
 
-    /// True if the port is sending a packet to the host
-    bool pending_in;
+    /// Clock currently applied to spi_clock_channel
+    SercomClock spi_clock;
+
+    SpiConfig spi_configs[PORT_SPI_CONFIGS];
     UartBuf uart_buf;
+
+    /// Command sequences stored by the host, and the length of each
+    u8 macros[PORT_NUM_MACROS][PORT_MACRO_SIZE];
+    u8 macro_len[PORT_NUM_MACROS];
+
+    /// Stored sequence being parsed in place of the host's commands, or PORT_NO_MACRO
+    u8 macro;
+
+    /// Number of times to run it again once it finishes
+    u8 macro_repeat;
+
+    /// Position and length in the host's command buffer, to go back to after the sequence
+    u16 host_pos;
+    u16 host_len;
+
+    /// Stored sequence run by the trigger set with CMD_MACRO_TRIGGER
+    u8 trigger_macro;
+
+    /// Port pin whose interrupt runs trigger_macro, or PORT_NO_MACRO
+    u8 trigger_pin;
+
+    /// Period in ms at which trigger_macro runs, or 0, and the ms until the next run
+    u16 trigger_period;
+    u16 trigger_countdown;
+
+    /// True if a triggered run is waiting for the port to be idle
+    bool trigger_pending;
 } PortData;
 
 extern PortData port_a;
 extern PortData port_b;
 
-void port_init(PortData* p, u8 chan, const TesselPort* port,
-    u8 clock_channel, u8 tcc_channel, DmaChan dma_tx, DmaChan dma_rx);
+void port_init(PortData* p, u8 chan, const TesselPort* port, u8 spi_clock_channel,
+    u8 uart_i2c_clock_channel, u8 tcc_channel, u8 evsys_channel, DmaChan dma_tx, DmaChan dma_rx);
 void port_enable(PortData *p);
-void port_bridge_out_completion(PortData* p, u8 len);
+void port_bridge_out_completion(PortData* p, u16 len);
 void port_bridge_in_completion(PortData* p);
 void port_dma_rx_completion(PortData* p);
 void port_dma_tx_completion(PortData* p);
 void port_handle_sercom_uart_i2c(PortData* p);
 void port_handle_extint(PortData *p, u32 flags);
+void port_adc_stream_completion();
+void port_adc_completion();
+void port_wave_completion();
+bool port_edge_capture_overflow();
 void port_disable(PortData *p);
+void port_macro_tick(PortData *p);
 void uart_send_data(PortData *p);
 
+// power.c
+
+// Reasons for power_set, each held while something that needs the bus clocks may be running
+#define POWER_USB (1 << 0)
+#define POWER_BRIDGE (1 << 1)
+#define POWER_PORT(chan) (1 << (1 + (chan))) // port channels 1 and 2
+
+void power_init();
+void power_set(u32 reason, bool busy);
+
 // usbpipe.c
 
 void usbpipe_init();
 void usbpipe_disable();
 void pipe_usb_out_completion();
 void pipe_bridge_in_completion();
-void pipe_bridge_out_completion(u8 count);
+void pipe_bridge_out_completion(u16 count);
 void pipe_usb_in_completion();
 
 // usbserial.c
@@ -208,3 +469,5 @@ void usbserial_in_completion();
 void usbserial_dma_rx_completion();
 void usbserial_dma_tx_completion();
 void usbserial_handle_tc();
+void usbserial_control_setup();
+void usbserial_control_out_completion();
@@ -13,20 +13,55 @@
 // Byte 2: in_count[23..16]
 // Byte 3, bit 0: SR_POLL flag
 // Byte 3, bit 1: WREN flag
+// Byte 3, bit 2: PROGRAM flag
 //
 // 1. If the SR_POLL flag is set, the firmware issues a READSR (0x05) command to the flash, and
 //    reads bytes until bit 1 ("write in progress") is not set.
 // 2. If the WREN flag is set, the firmware issues a WREN (0x06) command to the flash.
 // 3. The remainder (after the 4-byte header) of the OUT transfer after the header is sent on
 //    the SPI bus.
-// 4. `in_count` bytes are read from SPI and sent to the IN endpoint
+// 4. `in_count` bytes are read from SPI and sent to the IN endpoint. The read is split across
+//    both halves of the buffer, so one half is sent on USB while SPI fills the other.
+//
+// ## Bulk programming
+// If the PROGRAM flag is set, the OUT transfer is exactly 8 bytes: the header is followed by the
+// 32-bit big-endian address of a page, and `in_count` is instead the number of bytes to program
+// from that address. The host then streams that many bytes on the OUT endpoint. The firmware
+// programs them page by page, issuing WREN (0x06) and 4-byte page program (0x12) and polling the
+// status register itself, and receives the next page into one half of the buffer while the
+// previous one is programming from the other. When the last page is done, the final value of
+// the status register is sent as a single byte to the IN endpoint.
+//
+// A PROGRAM transfer that is not 8 bytes long, or whose address is not page-aligned, programs
+// nothing. The `in_count` bytes that follow are received and dropped, and are then answered with a
+// status of 0xff, which has the programming error bit (0x40) set.
+
+#define SPI_FLASH_PAGE_SIZE 256
+// Status sent in place of the status register for an invalid PROGRAM header
+#define FLASH_PROG_STATUS_INVALID 0xff
 
 u32 flash_in_count;
 u32 flash_out_count;
 bool flash_flag_sr_poll;
 bool flash_flag_wren;
+bool flash_programming;
+bool flash_prog_rejected; // Dropping the data of an invalid PROGRAM header
 u8 flash_byte;
 
+// State of the two halves of flash_buffer, for reads and programming
+u16 flash_half_len[2];
+u8 flash_half_full; // Number of halves that hold data for the other side
+u8 flash_half_spi; // Next half used by SPI
+u8 flash_half_usb; // Next half used by USB
+bool flash_spi_busy;
+bool flash_usb_busy;
+u32 flash_spi_count; // Bytes left to transfer on SPI
+u32 flash_usb_count; // Bytes left to transfer on USB
+
+u32 flash_prog_addr; // Address of the next page to program
+u8 flash_prog_cmd[5];
+DmacDescriptor* flash_prog_chain; // Page program command and data, sent back to back
+
 
 typedef enum FlashState {
     FLASH_STATE_DISABLE,
@@ -37,17 +72,29 @@ typedef enum FlashState {
     // |   |                              |
     // |   +------- WREN_OUT  <-----------+
     // |   v
-    // |  OUT --> IN_SPI --> IN_USB +
-    // |            ^               |
-    // +------------+---------------+
+    // |  OUT --> IN --+
+    // |              |
+    // +--------------+
     // (diagram assumes SR_POLL == WREN_OUT)
+    //
+    // While programming, USB OUT transfers run independently of these states:
+    //
+    //                    +---------------------------------------------+
+    //                    v                                             |
+    // IDLE --> PROG_IDLE --> SR_POLL_OUT --> SR_POLL_IN --> WREN_OUT --> PROG_DATA
+    //            (last page done) +--> PROG_STATUS --> IDLE
+    //
+    // A rejected PROGRAM header stays in PROG_IDLE until its data has been dropped, then goes to
+    // PROG_STATUS.
     FLASH_STATE_IDLE,   // Waiting for a USB packet OUT
     FLASH_STATE_OUT, // Waiting on DMA write to SPI
-    FLASH_STATE_IN_SPI,  // Waiting on DMA read from SPI
-    FLASH_STATE_IN_USB,  // Waiting on USB IN transfer
+    FLASH_STATE_IN,  // Waiting on DMA reads from SPI and USB IN transfers
     FLASH_STATE_SR_POLL_OUT, // Waiting to write READSR command
     FLASH_STATE_SR_POLL_IN, // Waiting to read status register
     FLASH_STATE_WREN_OUT, // Waiting to write WREN command
+    FLASH_STATE_PROG_IDLE, // Waiting for a page to arrive from USB
+    FLASH_STATE_PROG_DATA, // Waiting to write page program command and data
+    FLASH_STATE_PROG_STATUS, // Waiting on USB IN transfer of the final status
 } FlashState;
 
 FlashState flash_state = FLASH_STATE_DISABLE;
@@ -61,6 +108,11 @@ void flash_init() {
     dma_sercom_configure_rx(DMA_FLASH_RX, SERCOM_BRIDGE);
     dma_enable_interrupt(DMA_FLASH_RX);
 
+    flash_prog_chain = dma_desc_alloc(2);
+    if (flash_prog_chain == NULL) {
+        invalid();
+    }
+
     pin_low(PIN_SOC_RST);
     pin_out(PIN_SOC_RST);
 
@@ -71,12 +123,16 @@ void flash_init() {
     pin_out(PIN_FLASH_CS);
 
     flash_state = FLASH_STATE_IDLE;
+    flash_programming = false;
+    flash_prog_rejected = false;
     usb_ep_start_out(USB_EP_FLASH_OUT, flash_buffer, FLASH_BUFFER_SIZE);
 }
 
 void flash_disable() {
     dma_abort(DMA_FLASH_TX);
     dma_abort(DMA_FLASH_RX);
+    dma_desc_free(flash_prog_chain, 2);
+    flash_prog_chain = NULL;
 
     pin_in(PIN_BRIDGE_MOSI);
     pin_in(PIN_BRIDGE_MISO);
@@ -90,13 +146,47 @@ void flash_disable() {
     // Leaves RST low until manually enabled
 }
 
-u32 flash_in_packet_len() {
-    return (flash_in_count > FLASH_BUFFER_SIZE) ? FLASH_BUFFER_SIZE : flash_in_count;
+u8* flash_half(u8 half) {
+    return flash_buffer + half * SPI_FLASH_PAGE_SIZE;
 }
+
+u16 flash_half_chunk(u32 count) {
+    return (count > SPI_FLASH_PAGE_SIZE) ? SPI_FLASH_PAGE_SIZE : count;
+}
+
+void flash_half_reset() {
+    flash_half_full = 0;
+    flash_half_spi = 0;
+    flash_half_usb = 0;
+    flash_spi_busy = false;
+    flash_usb_busy = false;
+}
+
 void flash_start_read();
 void flash_start_write();
 void flash_start_sr_poll();
 void flash_start_wren();
+void flash_start_program();
+void flash_reject_program();
+void flash_prog_discard();
+void flash_prog_step();
+
+void flash_idle() {
+    pin_high(PIN_FLASH_CS);
+    flash_programming = false;
+    flash_prog_rejected = false;
+    usb_ep_start_out(USB_EP_FLASH_OUT, flash_buffer, FLASH_BUFFER_SIZE);
+    flash_state = FLASH_STATE_IDLE;
+}
+
+// Send a single command byte with CS held low until it completes
+void flash_command(u8 cmd, FlashState state) {
+    pin_low(PIN_FLASH_CS);
+    flash_byte = cmd;
+    dma_sercom_start_rx(DMA_FLASH_RX, SERCOM_BRIDGE, NULL, 1);
+    dma_sercom_start_tx(DMA_FLASH_TX, SERCOM_BRIDGE, &flash_byte, 1);
+    flash_state = state;
+}
 
 void flash_usb_out_completion() {
     if (flash_state == FLASH_STATE_IDLE) {
@@ -112,7 +202,19 @@ void flash_usb_out_completion() {
         flash_flag_sr_poll = flash_buffer[3] & 0x1;
         flash_flag_wren = flash_buffer[3] & 0x2;
 
-        flash_start_sr_poll();
+        if (flash_buffer[3] & 0x4) {
+            flash_start_program();
+        } else {
+            flash_start_sr_poll();
+        }
+    } else if (flash_prog_rejected) {
+        flash_prog_discard();
+    } else if (flash_programming) {
+        // A page has arrived in the half USB was filling
+        flash_usb_busy = false;
+        flash_half_full += 1;
+        flash_half_usb ^= 1;
+        flash_prog_step();
     } else {
         invalid();
     }
@@ -121,11 +223,7 @@ void flash_usb_out_completion() {
 
 void flash_start_sr_poll() {
     if (flash_flag_sr_poll) {
-        pin_low(PIN_FLASH_CS);
-        flash_byte = 0x05;
-        dma_sercom_start_rx(DMA_FLASH_RX, SERCOM_BRIDGE, NULL, 1);
-        dma_sercom_start_tx(DMA_FLASH_TX, SERCOM_BRIDGE, &flash_byte, 1);
-        flash_state = FLASH_STATE_SR_POLL_OUT;
+        flash_command(0x05, FLASH_STATE_SR_POLL_OUT);
     } else {
         flash_start_wren();
     }
@@ -139,11 +237,7 @@ void flash_read_sr_poll() {
 
 void flash_start_wren() {
     if (flash_flag_wren) {
-        pin_low(PIN_FLASH_CS);
-        flash_byte = 0x06;
-        dma_sercom_start_rx(DMA_FLASH_RX, SERCOM_BRIDGE, NULL, 1);
-        dma_sercom_start_tx(DMA_FLASH_TX, SERCOM_BRIDGE, &flash_byte, 1);
-        flash_state = FLASH_STATE_WREN_OUT;
+        flash_command(0x06, FLASH_STATE_WREN_OUT);
     } else {
         flash_start_write();
     }
@@ -160,19 +254,124 @@ void flash_start_write() {
     }
 }
 
+void flash_read_step() {
+    // Read into a free half while CS stays low
+    if (!flash_spi_busy && flash_half_full < 2 && flash_spi_count > 0) {
+        u16 len = flash_half_chunk(flash_spi_count);
+        flash_half_len[flash_half_spi] = len;
+        dma_sercom_start_rx(DMA_FLASH_RX, SERCOM_BRIDGE, flash_half(flash_half_spi), len);
+        dma_sercom_start_tx(DMA_FLASH_TX, SERCOM_BRIDGE, NULL, len);
+        flash_spi_count -= len;
+        flash_spi_busy = true;
+    }
+    // Send a half that has been read
+    if (!flash_usb_busy && flash_half_full > 0) {
+        usb_ep_start_in(USB_EP_FLASH_IN, flash_half(flash_half_usb), flash_half_len[flash_half_usb], false);
+        flash_usb_busy = true;
+    }
+}
+
 void flash_start_read() {
     if (flash_in_count > 0) {
-        u32 len = flash_in_packet_len();
-        dma_sercom_start_rx(DMA_FLASH_RX, SERCOM_BRIDGE, flash_buffer, len);
-        dma_sercom_start_tx(DMA_FLASH_TX, SERCOM_BRIDGE, NULL, len);
-        flash_state = FLASH_STATE_IN_SPI;
+        flash_half_reset();
+        flash_spi_count = flash_in_count;
+        flash_usb_count = flash_in_count;
+        flash_state = FLASH_STATE_IN;
+        flash_read_step();
     } else {
-        pin_high(PIN_FLASH_CS);
-        usb_ep_start_out(USB_EP_FLASH_OUT, flash_buffer, FLASH_BUFFER_SIZE);
-        flash_state = FLASH_STATE_IDLE;
+        flash_idle();
     }
 }
 
+// Drop the next part of the data of a rejected PROGRAM header, or report the rejection once it
+// has all been received, instead of leaving the host waiting for the status
+void flash_prog_discard() {
+    if (flash_usb_count > 0) {
+        u16 len = flash_half_chunk(flash_usb_count);
+        usb_ep_start_out(USB_EP_FLASH_OUT, flash_half(0), len);
+        flash_usb_count -= len;
+    } else {
+        flash_buffer[0] = FLASH_PROG_STATUS_INVALID;
+        usb_ep_start_in(USB_EP_FLASH_IN, flash_buffer, 1, false);
+        flash_state = FLASH_STATE_PROG_STATUS;
+    }
+}
+
+void flash_reject_program() {
+    flash_usb_count = flash_in_count;
+    flash_programming = true;
+    flash_prog_rejected = true;
+    flash_state = FLASH_STATE_PROG_IDLE;
+    flash_prog_discard();
+}
+
+void flash_start_program() {
+    if (usb_ep_out_length(USB_EP_FLASH_OUT) != 8) {
+        // Invalid packet has no address
+        flash_reject_program();
+        return;
+    }
+
+    flash_prog_addr = flash_buffer[4] << 24 | flash_buffer[5] << 16 | flash_buffer[6] << 8 | flash_buffer[7];
+    if (flash_prog_addr % SPI_FLASH_PAGE_SIZE != 0) {
+        flash_reject_program();
+        return;
+    }
+
+    flash_half_reset();
+    flash_spi_count = flash_in_count;
+    flash_usb_count = flash_in_count;
+    flash_programming = true;
+    flash_state = FLASH_STATE_PROG_IDLE;
+    flash_prog_step();
+}
+
+void flash_prog_step() {
+    // Receive the next page into a free half
+    if (!flash_usb_busy && flash_half_full < 2 && flash_usb_count > 0) {
+        u16 len = flash_half_chunk(flash_usb_count);
+        flash_half_len[flash_half_usb] = len;
+        usb_ep_start_out(USB_EP_FLASH_OUT, flash_half(flash_half_usb), len);
+        flash_usb_count -= len;
+        flash_usb_busy = true;
+    }
+    // Once a page is waiting, or everything has been sent, wait for the previous page to finish
+    if (flash_state == FLASH_STATE_PROG_IDLE && (flash_half_full > 0 || flash_spi_count == 0)) {
+        flash_command(0x05, FLASH_STATE_SR_POLL_OUT);
+    }
+}
+
+// The flash is no longer busy, so program the next page or report completion
+void flash_prog_next() {
+    if (flash_half_full > 0) {
+        flash_command(0x06, FLASH_STATE_WREN_OUT);
+    } else if (flash_spi_count == 0) {
+        flash_buffer[0] = flash_byte;
+        usb_ep_start_in(USB_EP_FLASH_IN, flash_buffer, 1, false);
+        flash_state = FLASH_STATE_PROG_STATUS;
+    } else {
+        flash_state = FLASH_STATE_PROG_IDLE;
+    }
+}
+
+void flash_prog_page() {
+    u16 len = flash_half_len[flash_half_spi];
+    pin_low(PIN_FLASH_CS);
+    flash_prog_cmd[0] = 0x12;
+    flash_prog_cmd[1] = flash_prog_addr >> 24;
+    flash_prog_cmd[2] = flash_prog_addr >> 16;
+    flash_prog_cmd[3] = flash_prog_addr >> 8;
+    flash_prog_cmd[4] = flash_prog_addr >> 0;
+
+    // The data follows the command in the same chain, without a gap for an interrupt
+    dma_fill_sercom_tx(&flash_prog_chain[0], SERCOM_BRIDGE, flash_prog_cmd, sizeof(flash_prog_cmd));
+    dma_fill_sercom_tx(&flash_prog_chain[1], SERCOM_BRIDGE, flash_half(flash_half_spi), len);
+    dma_link_chain(flash_prog_chain, 2);
+    dma_sercom_start_rx(DMA_FLASH_RX, SERCOM_BRIDGE, NULL, sizeof(flash_prog_cmd) + len);
+    dma_start_descriptor(DMA_FLASH_TX, flash_prog_chain);
+    flash_state = FLASH_STATE_PROG_DATA;
+}
+
 void flash_dma_rx_completion() {
     if (flash_state == FLASH_STATE_DISABLE) {
         return;
@@ -181,27 +380,55 @@ void flash_dma_rx_completion() {
     } else if (flash_state == FLASH_STATE_SR_POLL_IN) {
         if ((flash_byte & 1) == 0) {
             pin_high(PIN_FLASH_CS);
-            flash_start_wren();
+            if (flash_programming) {
+                flash_prog_next();
+            } else {
+                flash_start_wren();
+            }
         } else {
             flash_read_sr_poll();
         }
     } else if (flash_state == FLASH_STATE_WREN_OUT) {
         pin_high(PIN_FLASH_CS);
-        flash_start_write();
+        if (flash_programming) {
+            flash_prog_page();
+        } else {
+            flash_start_write();
+        }
     } else if (flash_state == FLASH_STATE_OUT) {
         flash_start_read();
-    } else if (flash_state == FLASH_STATE_IN_SPI) {
-        usb_ep_start_in(USB_EP_FLASH_IN, flash_buffer, flash_in_packet_len(), false);
-        flash_state = FLASH_STATE_IN_USB;
+    } else if (flash_state == FLASH_STATE_IN) {
+        flash_spi_busy = false;
+        flash_half_full += 1;
+        flash_half_spi ^= 1;
+        flash_read_step();
+    } else if (flash_state == FLASH_STATE_PROG_DATA) {
+        // Raising CS starts programming the page, which frees its half for the next one
+        pin_high(PIN_FLASH_CS);
+        flash_prog_addr += flash_half_len[flash_half_spi];
+        flash_spi_count -= flash_half_len[flash_half_spi];
+        flash_half_full -= 1;
+        flash_half_spi ^= 1;
+        flash_state = FLASH_STATE_PROG_IDLE;
+        flash_prog_step();
     } else {
         invalid();
     }
 }
 
 void flash_usb_in_completion() {
-    if (flash_state == FLASH_STATE_IN_USB) {
-        flash_in_count -= flash_in_packet_len();
-        flash_start_read();
+    if (flash_state == FLASH_STATE_IN) {
+        flash_usb_busy = false;
+        flash_usb_count -= flash_half_len[flash_half_usb];
+        flash_half_full -= 1;
+        flash_half_usb ^= 1;
+        if (flash_usb_count == 0) {
+            flash_idle();
+        } else {
+            flash_read_step();
+        }
+    } else if (flash_state == FLASH_STATE_PROG_STATUS) {
+        flash_idle();
     } else {
         invalid();
     }
@@ -8,6 +8,38 @@ USB_ALIGN u8 flash_buffer[FLASH_BUFFER_SIZE];
 
 // Indicates whether the SPI Daemon is listening for USB traffic
 volatile bool booted = false;
+
+Stats stats;
+
+/// Let SysTick count without interrupts, so it provides cycle stamps
+void stats_timer_free_run() {
+    SysTick->CTRL = 0;
+    SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+#ifdef TRACE
+// Sent to the host by USB DMA straight from here
+USB_ALIGN Trace trace_log = {.len = TRACE_LEN};
+
+/// Stop recording, so the host reads a consistent trace
+void trace_freeze() {
+    __disable_irq();
+    trace_log.frozen = 1;
+    trace_log.reload = SysTick->LOAD;
+    __enable_irq();
+}
+
+/// Discard the trace and record again
+void trace_restart() {
+    __disable_irq();
+    trace_log.count = 0;
+    trace_log.frozen = 0;
+    __enable_irq();
+}
+#endif
+
 // LED Chan: TCC1/WO[0]
 #define PWR_LED_TCC_CHAN 1
 // CC channel 0 on TCC instance 1
@@ -78,6 +110,11 @@ uint32_t interpolate(uint32_t position) {
     Handler for the POWER LED breathing animation
 */
 void TCC1_Handler() {
+    // After boot, the timer may have been reused for edge capture
+    if (port_edge_capture_overflow()) {
+        return;
+    }
+
     tcc(PWR_LED_TCC_CHAN)->INTFLAG.reg = TCC_INTFLAG_OVF;
 
     // booted is true when the coprocess first gets
@@ -187,6 +224,9 @@ int main(void) {
         clock_init_crystal(GCLK_SYSTEM, GCLK_32K);
     }
 
+    // Left stopped until a port SERCOM is clocked from it
+    dpll_init();
+
     pin_mux(PIN_USB_DM);
     pin_mux(PIN_USB_DP);
     usb_init();
@@ -223,14 +263,19 @@ int main(void) {
     NVIC_SetPriority(EVSYS_IRQn, 0);
 
     adc_init(GCLK_SYSTEM, ADC_REFCTRL_REFSEL_INTVCC1);
+    NVIC_EnableIRQ(ADC_IRQn);
+    NVIC_SetPriority(ADC_IRQn, 0xff);
     dac_init(GCLK_32K);
 
+    stats_timer_free_run();
     bridge_init();
 
-    port_init(&port_a, 1, &PORT_A, GCLK_PORT_A,
-        TCC_PORT_A, DMA_PORT_A_TX, DMA_PORT_A_RX);
-    port_init(&port_b, 2, &PORT_B, GCLK_PORT_B,
-        TCC_PORT_B, DMA_PORT_B_TX, DMA_PORT_B_RX);
+    port_init(&port_a, 1, &PORT_A, GCLK_PORT_A_SPI, GCLK_PORT_A_UART_I2C,
+        TCC_PORT_A, EVSYS_PORT_A_UART_TIMEOUT, DMA_PORT_A_TX, DMA_PORT_A_RX);
+    port_init(&port_b, 2, &PORT_B, GCLK_PORT_B_SPI, GCLK_PORT_B_UART_I2C,
+        TCC_PORT_B, EVSYS_PORT_B_UART_TIMEOUT, DMA_PORT_B_TX, DMA_PORT_B_RX);
+
+    power_init();
 
     __enable_irq();
     SCB->SCR |= SCB_SCR_SLEEPONEXIT_Msk;
@@ -241,9 +286,14 @@ int main(void) {
 }
 
 void DMAC_Handler() {
+    u32 stamp = stats_stamp();
     u32 intpend = DMAC->INTPEND.reg;
+    // A bridge data phase whose completion the SYNC handler took first
+    bridge_report_completion();
+
     if (intpend & DMAC_INTPEND_TCMPL) {
         u32 id = intpend & DMAC_INTPEND_ID_Msk;
+        trace(TRACE_DMA, id, 0);
 
         if (id == DMA_BRIDGE_RX) {
             bridge_dma_rx_completion();
@@ -256,6 +306,10 @@ void DMAC_Handler() {
             port_dma_rx_completion(&port_a);
         } else if (id == DMA_PORT_B_RX) {
             port_dma_rx_completion(&port_b);
+        } else if (id == DMA_ADC_STREAM) {
+            port_adc_stream_completion();
+        } else if (id == DMA_WAVE) {
+            port_wave_completion();
         } else if (id == DMA_TERMINAL_RX) {
             usbserial_dma_rx_completion();
         } else if (id == DMA_TERMINAL_TX) {
@@ -268,84 +322,123 @@ void DMAC_Handler() {
     }
 
     DMAC->INTPEND.reg = intpend;
+    stats_isr(STATS_ISR_DMAC, stamp);
 }
 
 void EIC_Handler() {
+    u32 stamp = stats_stamp();
     u32 flags = EIC->INTFLAG.reg;
     if (flags & PORT_A.pin_interrupts) {
         port_handle_extint(&port_a, flags);
     } else if (flags & PORT_B.pin_interrupts) {
         port_handle_extint(&port_b, flags);
     }
+    stats_isr(STATS_ISR_EIC, stamp);
+}
+
+void ADC_Handler() {
+    port_adc_completion();
+}
+
+void SysTick_Handler() {
+    port_macro_tick(&port_a);
+    port_macro_tick(&port_b);
 }
 
 void EVSYS_Handler() {
+    u32 stamp = stats_stamp();
     if (EVSYS->INTFLAG.reg & EVSYS_EVD(EVSYS_BRIDGE_SYNC)) {
         EVSYS->INTFLAG.reg = EVSYS_EVD(EVSYS_BRIDGE_SYNC);
         bridge_handle_sync();
     } else {
         invalid();
     }
+    stats_isr(STATS_ISR_SYNC, stamp);
 }
 
 void SERCOM_HANDLER(SERCOM_PORT_A_UART_I2C) {
+    u32 stamp = stats_stamp();
     port_handle_sercom_uart_i2c(&port_a);
+    stats_isr(STATS_ISR_SERCOM, stamp);
 }
 
 void SERCOM_HANDLER(SERCOM_PORT_B_UART_I2C) {
+    u32 stamp = stats_stamp();
     port_handle_sercom_uart_i2c(&port_b);
+    stats_isr(STATS_ISR_SERCOM, stamp);
 }
 
-void bridge_open_0() {}
-
-void bridge_completion_out_0(u8 count) {
-    pipe_bridge_out_completion(count);
-}
-void bridge_completion_in_0() {
-    pipe_bridge_in_completion();
-}
-void bridge_close_0() {}
-
-void bridge_open_1() {
+void port_a_bridge_open() {
     port_enable(&port_a);
 }
-void bridge_completion_out_1(u8 count) {
+void port_a_bridge_completion_out(u16 count) {
     port_bridge_out_completion(&port_a, count);
 }
-void bridge_completion_in_1() {
+void port_a_bridge_completion_in() {
     port_bridge_in_completion(&port_a);
 }
-void bridge_close_1() {
+void port_a_bridge_close() {
     port_disable(&port_a);
 }
 
-void bridge_open_2() {
+void port_b_bridge_open() {
     port_enable(&port_b);
 }
-void bridge_completion_out_2(u8 count) {
+void port_b_bridge_completion_out(u16 count) {
     port_bridge_out_completion(&port_b, count);
 }
-void bridge_completion_in_2() {
+void port_b_bridge_completion_in() {
     port_bridge_in_completion(&port_b);
 }
-void bridge_close_2() {
+void port_b_bridge_close() {
     port_disable(&port_b);
 }
 
+// Priority 0 is left for streams that must not wait behind command traffic. Port commands come
+// before the USB pipe, which carries bulk transfers like deploys. spid uses the same classes.
+const BridgeChannel bridge_channels[BRIDGE_NUM_CHAN] = {
+    [BRIDGE_USB] = {
+        .completion_out = pipe_bridge_out_completion,
+        .completion_in = pipe_bridge_in_completion,
+        .priority = 2,
+        .weight = 1,
+    },
+    [BRIDGE_PORT_A] = {
+        .open = port_a_bridge_open,
+        .close = port_a_bridge_close,
+        .completion_out = port_a_bridge_completion_out,
+        .completion_in = port_a_bridge_completion_in,
+        .priority = 1,
+        .weight = 1,
+    },
+    [BRIDGE_PORT_B] = {
+        .open = port_b_bridge_open,
+        .close = port_b_bridge_close,
+        .completion_out = port_b_bridge_completion_out,
+        .completion_in = port_b_bridge_completion_in,
+        .priority = 1,
+        .weight = 1,
+    },
+};
+
 void TC_HANDLER(TC_TERMINAL_TIMEOUT) {
     usbserial_handle_tc();
 }
 
 void TCC_HANDLER(TCC_PORT_A) {
+    u32 stamp = stats_stamp();
     uart_send_data(&port_a);
 
     // clear irq
     tcc(TCC_PORT_A)->INTFLAG.reg = TCC_INTENSET_OVF;
+    stats_isr(STATS_ISR_TCC, stamp);
 }
 
 void TCC_HANDLER(TCC_PORT_B) {
+    u32 stamp = stats_stamp();
     uart_send_data(&port_b);
 
     // clear irq
     tcc(TCC_PORT_B)->INTFLAG.reg = TCC_INTENSET_OVF;
+    stats_isr(STATS_ISR_TCC, stamp);
 }
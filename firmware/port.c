@@ -2,6 +2,8 @@
 
 /// Signal an error on the port. The host must take action to reset the port to resume communication.
 void port_error(PortData* p) {
+    stats.port_errors[p->chan - 1]++;
+    trace(TRACE_PORT_ERROR, p->chan, 0);
     bridge_disable_chan(p->chan);
 }
 
@@ -54,11 +56,37 @@ typedef enum PortCmd {
     CMD_STOP = 20,
     CMD_PWM_DUTY_CYCLE = 27,
     CMD_PWM_PERIOD = 28,
+    CMD_I2C_TRANSFER = 29, // write, then repeated-start read, as one I2C transaction
+    CMD_SPI_CONFIG = 30, // store an SPI config for a frequency, reply with the achieved rate
+    CMD_SPI_SELECT = 31, // switch SPI to a stored config
+    CMD_ANALOG_STREAM_START = 32, // sample continuously, sending REPLY_ASYNC_ADC_DATA
+    CMD_ANALOG_STREAM_STOP = 33,
+    CMD_WAVE_START = 34, // set up waveform output from a looped table or host-refilled stream
+    CMD_WAVE_DATA = 35, // samples for the waveform, 16-bit LE
+    CMD_WAVE_STOP = 36,
+    CMD_EDGE_CAPTURE_START = 37, // timestamp edges of up to two pins, sending REPLY_ASYNC_EDGE_DATA
+    CMD_EDGE_CAPTURE_STOP = 38,
+    CMD_MACRO_STORE = 39, // store a command sequence in a slot
+    CMD_MACRO_RUN = 40, // parse a stored sequence a number of times, as if sent by the host
+    CMD_MACRO_TRIGGER = 41, // run a stored sequence on a timer or pin interrupt
+    CMD_UART_CONFIG = 42, // enable UART at the closest rate to a baud rate, reply with the rate
 } PortCmd;
 
 #define FLAG_SPI_CPOL (1<<0)
 #define FLAG_SPI_CPHA (1<<1)
 
+// CMD_MACRO_TRIGGER sources
+#define TRIGGER_NONE 0
+#define TRIGGER_TIMER 1 // every n ms, counted by SysTick
+#define TRIGGER_PIN 2 // on each interrupt of a pin set up by CMD_GPIO_INT
+
+// Progress of a CMD_I2C_TRANSFER, kept in arg[3]. The length of the read is kept in arg[4] once
+// it has started.
+#define I2C_XFER_ADDR 0 // address not yet sent
+#define I2C_XFER_WRITE 1 // sending the payload by DMA
+#define I2C_XFER_READ 2 // receiving by DMA after a (repeated) start
+#define I2C_XFER_NACK 3 // not acknowledged or lost the bus, skipping the rest of the payload
+
 typedef enum {
     REPLY_ACK = 0x80,
     REPLY_NACK = 0x81,
@@ -68,6 +96,14 @@ typedef enum {
 
     REPLY_ASYNC_PIN_CHANGE_N = 0xC0, // 0xC0 + n
     REPLY_ASYNC_UART_RX = 0xD0,
+    REPLY_ASYNC_UART_OVERFLOW = 0xD1, // followed by the number of dropped bytes, 16-bit LE
+    REPLY_ASYNC_ADC_DATA = 0xD2, // followed by a sample count and 16-bit LE samples
+    REPLY_ASYNC_ADC_OVERFLOW = 0xD3, // followed by the number of dropped samples, 16-bit LE
+    REPLY_ASYNC_WAVE_REFILL = 0xD4, // a streamed waveform has room for WAVE_SAMPLES more
+    REPLY_ASYNC_WAVE_UNDERRUN = 0xD5, // followed by the number of replayed halves, 16-bit LE
+    REPLY_ASYNC_EDGE_DATA = 0xD6, // followed by a count and that many EDGE_RECORD_LEN records
+    REPLY_ASYNC_EDGE_OVERFLOW = 0xD7, // followed by the number of dropped edges, 16-bit LE
+    REPLY_ASYNC_MACRO_RUN = 0xD8, // followed by the slot whose triggered run's replies follow
 } PortReply;
 
 typedef enum PortMode {
@@ -93,6 +129,143 @@ void port_step(PortData* p);
 void port_enable_async_events(PortData *p);
 void port_disable_async_events(PortData *p);
 void uart_send_data(PortData *p);
+bool uart_rx_copy(PortData *p);
+bool port_rx_locked(PortData *p);
+bool adc_stream_copy(PortData *p);
+void adc_stream_stop();
+bool wave_notify(PortData *p);
+void wave_stop();
+bool edge_capture_copy(PortData *p);
+void edge_capture_stop();
+void port_macro_timer_update();
+static void adc_read_start_next();
+
+// TCC retrigger period for the UART RX idle timeout
+#define UART_TIMEOUT_TICKS (200 * UART_MS_TIMEOUT)
+
+/// EVSYS user for event input 0 of each TCC
+static const u8 tcc_ev0_user[] = {
+    EVSYS_ID_USER_TCC0_EV_0,
+    EVSYS_ID_USER_TCC1_EV_0,
+    EVSYS_ID_USER_TCC2_EV_0,
+};
+
+// Slowest ADC prescaler code that keeps the ADC clock from GCLK_SYSTEM under its 2.1MHz maximum
+#define ADC_STREAM_MIN_PRESCALER 3 // DIV32
+
+/// Streaming ADC state. There is a single ADC, so at most one port streams at a time.
+typedef struct AdcStream {
+    /// Port the samples are sent to, or NULL if the ADC is not streaming
+    PortData* port;
+    /// Half of buf the DMA is writing into
+    u8 active;
+    /// True if the other half is full and waiting to be copied to the reply buffer
+    bool pending;
+    /// Number of samples dropped since the last report to the host
+    u16 overflow;
+    u16 buf[2][ADC_STREAM_SAMPLES];
+} AdcStream;
+
+AdcStream adc_stream;
+
+/// Circular pair of descriptors, one per half of adc_stream.buf
+DMA_DESC_ALIGN DmacDescriptor adc_stream_chain[2];
+
+/// Port whose CMD_ANALOG_READ is converting, and the other port if it is waiting for the ADC.
+/// The reads finish in the ADC interrupt instead of blocking every other handler.
+PortData* adc_read_port;
+PortData* adc_read_next;
+
+/// DMA trigger for the overflow of each TCC
+static const u8 tcc_dmac_ovf[] = {
+    TCC0_DMAC_ID_OVF,
+    TCC1_DMAC_ID_OVF,
+    TCC2_DMAC_ID_OVF,
+};
+
+// CMD_WAVE_START targets. 1-8 is the PWM duty cycle of port pin n-1, which needs a TCC output.
+// Other targets, and the DAC from any port but B, are a port error.
+#define WAVE_TARGET_DAC 0
+
+/// Waveform output state. There is a single DAC, and its PWM alternative shares the TCCs, so
+/// at most one port plays a waveform at a time.
+typedef struct WaveOut {
+    /// Port the samples come from, or NULL if no waveform is set up
+    PortData* port;
+    /// True if the output is the DAC, which is paced by TC_WAVE
+    bool dac;
+    /// True once the DMA has been started
+    bool playing;
+    /// Number of samples in the looped table, or 0 to stream halves refilled by the host
+    u16 loop_len;
+    /// DAC conversions per second
+    u32 rate;
+    /// DMA trigger, and the register it writes
+    u8 trigsrc;
+    u32 dst;
+    /// Half of buf that the host is filling, and the byte position in it (or in the table)
+    u8 fill;
+    u16 fill_pos;
+    /// Half of buf the DMA is playing
+    u8 play;
+    /// Halves holding samples that have not been played yet
+    bool ready[2];
+    /// Number of REPLY_ASYNC_WAVE_REFILL to send
+    u8 refill;
+    /// Number of halves replayed because the host had not refilled them in time
+    u16 underrun;
+    u16 buf[2][WAVE_SAMPLES];
+} WaveOut;
+
+WaveOut wave;
+
+/// A looped table uses the first descriptor, a stream cycles between both halves
+DMA_DESC_ALIGN DmacDescriptor wave_chain[2];
+
+// TCC_EDGE_CAPTURE counts at GCLK_SYSTEM / 16 = 3MHz
+#define EDGE_CAPTURE_PRESCALER TCC_CTRLA_PRESCALER_DIV16
+// Number of capture channels on TCC_EDGE_CAPTURE, and so of pins captured at once
+#define EDGE_CAPTURE_CHANNELS 2
+// Each record is the pin number with the level in bit 3, and the 32-bit LE timestamp
+#define EDGE_RECORD_LEN 5
+// Records sent per REPLY_ASYNC_EDGE_DATA, so that a batch and an overflow report fit in
+// PORT_ASYNC_RESERVE
+#define EDGE_CAPTURE_BATCH 48
+
+/// EVSYS channel and user that carry each capture channel's pin edges to the timer
+static const u8 edge_capture_evsys[EDGE_CAPTURE_CHANNELS] = {
+    EVSYS_EDGE_CAPTURE_0,
+    EVSYS_EDGE_CAPTURE_1,
+};
+static const u8 edge_capture_user[EDGE_CAPTURE_CHANNELS] = {
+    EVSYS_ID_USER_TCC1_MC_0,
+    EVSYS_ID_USER_TCC1_MC_1,
+};
+
+/// Edge capture state. Each pin's EXTINT event latches the free-running TCC_EDGE_CAPTURE count
+/// in hardware, so the timestamps don't depend on interrupt latency. There is a single timer,
+/// so at most one port captures at a time.
+typedef struct EdgeCapture {
+    /// Port the edges are sent to, or NULL if edge capture is off
+    PortData* port;
+    /// Port pin captured by each channel
+    u8 pins[EDGE_CAPTURE_CHANNELS];
+    /// Number of channels in use
+    u8 channels;
+    /// EIC lines of the captured pins
+    u16 extints;
+    /// Timer overflows, the upper 8 bits of the timestamps
+    u8 epoch;
+    /// Oldest record in the ring, and the number of records
+    u8 head;
+    u8 count;
+    /// Number of edges dropped since the last report to the host
+    u16 overflow;
+    u8 pin[EDGE_CAPTURE_SIZE];
+    u32 time[EDGE_CAPTURE_SIZE];
+} EdgeCapture;
+
+EdgeCapture edge_capture;
 
 /// Returns true of the specified pin index has interrupt capability
 inline static bool port_pin_supports_interrupt(PortData* p, u8 i) {
@@ -101,32 +274,45 @@ inline static bool port_pin_supports_interrupt(PortData* p, u8 i) {
 }
 
 /// Initialize the port. Call once on boot.
-void port_init(PortData* p, u8 chan, const TesselPort* port,
-    u8 clock_channel, u8 tcc_channel, DmaChan dma_tx, DmaChan dma_rx) {
+void port_init(PortData* p, u8 chan, const TesselPort* port, u8 spi_clock_channel,
+    u8 uart_i2c_clock_channel, u8 tcc_channel, u8 evsys_channel, DmaChan dma_tx, DmaChan dma_rx) {
     p->tcc_channel = tcc_channel;
+    p->evsys_channel = evsys_channel;
     p->chan = chan;
     p->port = port;
     p->dma_tx = dma_tx;
     p->dma_rx = dma_rx;
-    p->clock_channel = clock_channel;
-
-    sercom_clock_enable(p->port->spi, p->clock_channel, 1);
-    sercom_clock_enable(p->port->uart_i2c, p->clock_channel, 1);
+    p->spi_clock_channel = spi_clock_channel;
+    p->uart_i2c_clock_channel = uart_i2c_clock_channel;
+    p->spi_clock = (SercomClock) { GCLK_SOURCE_DFLL48M, 1 };
 
+    // The SERCOMs are clocked only while a mode uses them
     bridge_enable_chan(chan);
 }
 
 /// Enable the port. Call when switching into a mode where the port will be used.
 /// Resets all port state.
 void port_enable(PortData* p) {
+    p->cmd_ring_pos = 0;
+    p->cmd_ring_count = 0;
+    p->cmd_buf = p->cmd_bufs[0];
+    p->reply_ring_pos = 0;
+    p->reply_ring_count = 0;
+    p->reply_buf = p->reply_bufs[0];
     bridge_start_out(p->chan, p->cmd_buf);
-    p->pending_in = false;
-    p->pending_out = true;
+    p->pending_in = 0;
+    p->pending_out = 1;
     p->cmd_len = 0;
     p->cmd_pos = 0;
     p->reply_len = 0;
     p->state = PORT_READ_CMD;
     p->mode = MODE_NONE;
+    memset(p->spi_configs, 0, sizeof(p->spi_configs));
+    memset(p->macro_len, 0, sizeof(p->macro_len));
+    p->macro = PORT_NO_MACRO;
+    p->trigger_pin = PORT_NO_MACRO;
+    p->trigger_period = 0;
+    p->trigger_pending = false;
     NVIC_EnableIRQ(SERCOM0_IRQn + p->port->uart_i2c);
     NVIC_SetPriority(SERCOM0_IRQn + p->port->uart_i2c, 0xff);
     NVIC_EnableIRQ(TCC0_IRQn + p->tcc_channel);
@@ -141,10 +327,39 @@ void port_enable(PortData* p) {
 /// Disable the port.
 void port_disable(PortData* p) {
     p->state = PORT_DISABLE;
-    sercom_reset(p->port->spi);
-    sercom_reset(p->port->uart_i2c);
+    if (p->mode == MODE_UART) {
+        tcc_delay_disable(p->tcc_channel);
+        p->uart_buf.direct = NULL;
+    }
+    // A SERCOM whose mode was disabled was already reset, and can't be without its clock
+    if (p->mode == MODE_SPI) {
+        sercom_reset(p->port->spi);
+    } else if (p->mode == MODE_UART || p->mode == MODE_I2C) {
+        sercom_reset(p->port->uart_i2c);
+    }
+    sercom_clock_disable(p->port->spi);
+    sercom_clock_disable(p->port->uart_i2c);
     dma_abort(p->dma_tx);
     dma_abort(p->dma_rx);
+    if (adc_read_next == p) {
+        adc_read_next = NULL;
+    }
+    if (adc_read_port == p) {
+        adc_cancel();
+        adc_read_port = NULL;
+        adc_read_start_next();
+    }
+    if (adc_stream.port == p) {
+        adc_stream_stop();
+    }
+    if (wave.port == p) {
+        wave_stop();
+    }
+    if (edge_capture.port == p) {
+        edge_capture_stop();
+    }
+    p->trigger_period = 0;
+    port_macro_timer_update();
 
     port_disable_async_events(p);
 
@@ -157,9 +372,53 @@ void port_disable(PortData* p) {
     EIC->INTFLAG.reg = p->port->pin_interrupts;
 
     pin_low(p->port->power);
+    power_set(POWER_PORT(p->chan), false);
+
+    // After the port has been reset, re-enable it. Buffers still queued belong to the old session.
+    bridge_reset_chan(p->chan);
+}
+
+/// Index of the cmd_bufs entry that the next packet from the host is received into
+static inline u8 port_cmd_ring_free(PortData* p) {
+    return (p->cmd_ring_pos + p->cmd_ring_count) % PORT_NUM_CMD_BUFS;
+}
+
+/// Index of the cmd_bufs entry to queue on the bridge after the ones already pending
+static inline u8 port_cmd_ring_next_out(PortData* p) {
+    return (p->cmd_ring_pos + p->cmd_ring_count + p->pending_out) % PORT_NUM_CMD_BUFS;
+}
+
+/// Point cmd_buf at the oldest filled command buffer, if any. While a stored sequence is
+/// parsed, the buffer is picked up when it finishes.
+void port_cmd_ring_load(PortData* p) {
+    u16 len = (p->cmd_ring_count > 0) ? p->cmd_bufs_len[p->cmd_ring_pos] : 0;
+    if (p->macro != PORT_NO_MACRO) {
+        p->host_len = len;
+        p->host_pos = 0;
+        return;
+    }
+    p->cmd_buf = p->cmd_bufs[p->cmd_ring_pos];
+    p->cmd_len = len;
+    p->cmd_pos = 0;
+}
+
+/// Return the fully-parsed command buffer to the ring and move on to the next one
+void port_cmd_ring_release(PortData* p) {
+    p->cmd_ring_pos = (p->cmd_ring_pos + 1) % PORT_NUM_CMD_BUFS;
+    p->cmd_ring_count -= 1;
+    port_cmd_ring_load(p);
+}
+
+/// Queue the reply buffer being filled for the host and start filling the next one.
+/// Requires that fewer than PORT_NUM_REPLY_BUFS - 1 buffers are already queued.
+void port_reply_ring_queue(PortData* p) {
+    u8 fill_pos = (p->reply_ring_pos + p->reply_ring_count) % PORT_NUM_REPLY_BUFS;
+    p->reply_bufs_len[fill_pos] = p->reply_len;
+    p->reply_ring_count += 1;
 
-    // After the port has been reset, re-enable it
-    bridge_enable_chan(p->chan);
+    fill_pos = (fill_pos + 1) % PORT_NUM_REPLY_BUFS;
+    p->reply_buf = p->reply_bufs[fill_pos];
+    p->reply_len = 0;
 }
 
 /// Enqueue a byte on the reply buf. Requires that at least one byte of space is available.
@@ -171,59 +430,100 @@ void port_send_status(PortData* p, u8 d) {
     p->reply_buf[p->reply_len++] = d;
 }
 
+// PortCmdInfo flags
+#define CMD_VALID (1<<0)
+#define CMD_PAYLOAD (1<<1) // followed by arg[0] bytes of payload
+#define CMD_NO_TX_LOCK (1<<2) // doesn't hold on to cmd_buf while executing
+#define CMD_NO_RX_LOCK (1<<3) // doesn't write into reply_buf while executing
+#define CMD_PIN (1<<4) // takes just a pin, and is run by port_pin_cmd
+
+typedef struct PortCmdInfo {
+    /// Number of argument bytes
+    u8 args;
+    u8 flags;
+} PortCmdInfo;
+
+/// Decoding information for each command, indexed by PortCmd
+static const PortCmdInfo port_cmds[] = {
+    [CMD_NOP] =                 { 0, CMD_VALID },
+    [CMD_FLUSH] =               { 0, CMD_VALID },
+    // 1 byte for length
+    [CMD_ECHO] =                { 1, CMD_VALID | CMD_PAYLOAD },
+    [CMD_TX] =                  { 1, CMD_VALID | CMD_PAYLOAD | CMD_NO_RX_LOCK },
+    [CMD_RX] =                  { 1, CMD_VALID | CMD_NO_TX_LOCK },
+    [CMD_TXRX] =                { 1, CMD_VALID | CMD_PAYLOAD },
+    // 1 byte for pin
+    [CMD_GPIO_IN] =             { 1, CMD_VALID | CMD_PIN },
+    [CMD_GPIO_HIGH] =           { 1, CMD_VALID | CMD_PIN },
+    [CMD_GPIO_LOW] =            { 1, CMD_VALID | CMD_PIN },
+    [CMD_GPIO_TOGGLE] =         { 1, CMD_VALID | CMD_PIN },
+    [CMD_GPIO_INPUT] =          { 1, CMD_VALID | CMD_PIN },
+    [CMD_GPIO_RAW_READ] =       { 1, CMD_VALID | CMD_PIN },
+    [CMD_GPIO_WAIT] =           { 1, CMD_VALID },
+    [CMD_GPIO_CFG] =            { 1, CMD_VALID },
+    [CMD_ANALOG_READ] =         { 1, CMD_VALID },
+    // 1 byte for pin and mode
+    [CMD_GPIO_INT] =            { 1, CMD_VALID },
+    [CMD_GPIO_PULL] =           { 1, CMD_VALID },
+    // 2 bytes for value
+    [CMD_ANALOG_WRITE] =        { 2, CMD_VALID },
+    // 1 byte for mode, 1 byte for freq, 1 byte for div
+    [CMD_ENABLE_SPI] =          { 3, CMD_VALID },
+    [CMD_DISABLE_SPI] =         { 0, CMD_VALID },
+    // 1 byte for freq
+    [CMD_ENABLE_I2C] =          { 1, CMD_VALID },
+    [CMD_DISABLE_I2C] =         { 0, CMD_VALID },
+    // 1 byte for baud, 1 byte for mode
+    [CMD_ENABLE_UART] =         { 2, CMD_VALID },
+    [CMD_DISABLE_UART] =        { 0, CMD_VALID },
+    // 1 byte for addr
+    [CMD_START] =               { 1, CMD_VALID },
+    [CMD_STOP] =                { 0, CMD_VALID },
+    // 1 byte for pin, 2 bytes for duty cycle
+    [CMD_PWM_DUTY_CYCLE] =      { 3, CMD_VALID },
+    // 1 byte for tcc id & prescalar, 2 bytes for period
+    [CMD_PWM_PERIOD] =          { 3, CMD_VALID },
+    // 1 byte for 7-bit addr, 1 byte for tx len, 1 byte for rx len. Locks depend on the phase.
+    [CMD_I2C_TRANSFER] =        { 3, CMD_VALID },
+    // 1 byte for slot and mode, 4 bytes for frequency
+    [CMD_SPI_CONFIG] =          { 5, CMD_VALID },
+    // 1 byte for slot
+    [CMD_SPI_SELECT] =          { 1, CMD_VALID },
+    // 1 byte for pin and scan count, 1 byte for prescaler and averaging, 3 bytes for sample rate
+    [CMD_ANALOG_STREAM_START] = { 5, CMD_VALID },
+    [CMD_ANALOG_STREAM_STOP] =  { 0, CMD_VALID },
+    // 1 byte for target, 1 byte for loop length, 3 bytes for rate
+    [CMD_WAVE_START] =          { 5, CMD_VALID },
+    // 1 byte for length
+    [CMD_WAVE_DATA] =           { 1, CMD_VALID | CMD_PAYLOAD | CMD_NO_RX_LOCK },
+    [CMD_WAVE_STOP] =           { 0, CMD_VALID },
+    // 1 byte for pin mask
+    [CMD_EDGE_CAPTURE_START] =  { 1, CMD_VALID },
+    [CMD_EDGE_CAPTURE_STOP] =   { 0, CMD_VALID },
+    // 1 byte for length, 1 byte for slot
+    [CMD_MACRO_STORE] =         { 2, CMD_VALID | CMD_PAYLOAD | CMD_NO_RX_LOCK },
+    // 1 byte for slot, 1 byte for number of runs
+    [CMD_MACRO_RUN] =           { 2, CMD_VALID },
+    // 1 byte for slot, 1 byte for source, 2 bytes for period in ms or pin
+    [CMD_MACRO_TRIGGER] =       { 4, CMD_VALID },
+    // 4 bytes for baud rate
+    [CMD_UART_CONFIG] =         { 4, CMD_VALID },
+};
+
+#define PORT_NUM_CMDS (sizeof(port_cmds) / sizeof(port_cmds[0]))
+
+/// Returns true if `cmd` is a known command
+static inline bool port_cmd_valid(u8 cmd) {
+    return cmd < PORT_NUM_CMDS && (port_cmds[cmd].flags & CMD_VALID);
+}
+
 /// Returns the number of argument bytes for the specified command
 int port_cmd_args(PortCmd cmd) {
-    switch (cmd) {
-        case CMD_NOP:
-        case CMD_FLUSH:
-        case CMD_DISABLE_SPI:
-        case CMD_DISABLE_I2C:
-        case CMD_DISABLE_UART:
-        case CMD_STOP:
-            return 0;
-
-        // Length argument:
-        case CMD_ECHO:
-        case CMD_TX:
-        case CMD_RX:
-        case CMD_TXRX:
-            return 1;
-
-        // Pin argument:
-        case CMD_GPIO_IN:
-        case CMD_GPIO_HIGH:
-        case CMD_GPIO_LOW:
-        case CMD_GPIO_TOGGLE:
-        case CMD_GPIO_WAIT:
-        case CMD_GPIO_INT:
-        case CMD_GPIO_CFG:
-        case CMD_GPIO_INPUT:
-        case CMD_GPIO_RAW_READ:
-        case CMD_ANALOG_READ:
-        case CMD_GPIO_PULL:
-            return 1;
-
-        case CMD_ANALOG_WRITE:
-            return 2;
-
-        // Config argument:
-        case CMD_ENABLE_SPI:
-            // 1 byte for mode, 1 byte for freq, 1 byte for div
-            return 3;
-        case CMD_ENABLE_I2C:
-            // 1 byte for freq
-            return 1;
-        case CMD_ENABLE_UART:
-            return 2; // 1 byte for baud, 1 byte for mode
-        case CMD_START:
-            return 1; // 1 byte for addr
-        case CMD_PWM_DUTY_CYCLE:
-            return 3; // 1 byte for pin, 2 bytes for duty cycle
-        case CMD_PWM_PERIOD:
-            return 3; // 1 byte for tcc id & prescalar, 2 bytes for period
+    if (!port_cmd_valid(cmd)) {
+        invalid();
+        return 0;
     }
-    invalid();
-    return 0;
+    return port_cmds[cmd].args;
 }
 
 /// Calculate the number of bytes that can immediately be processed for a TX command
@@ -260,6 +560,79 @@ u32 port_txrx_len(PortData *p) {
     return size;
 }
 
+/// Calculate the reply space the current command needs before port_continue_cmd can run
+u32 port_exec_reply_len(PortData *p) {
+    switch (p->cmd) {
+        case CMD_I2C_TRANSFER:
+            // The read is a single DMA transfer, so it needs room for all of it and the header.
+            // Otherwise the transfer ends with an ACK or NACK.
+            if (p->arg[3] != I2C_XFER_NACK && p->arg[1] == 0 && p->arg[2] > 0) {
+                return 1 + p->arg[2];
+            }
+            return 1;
+        default:
+            return port_rx_locked(p) ? 1 : 0;
+    }
+}
+
+/// Put the port in SPI master mode with the given clock. If it is already in SPI mode, only
+/// the clock and mode are changed, so the port can switch between devices quickly.
+void port_spi_configure(PortData* p, u8 flags, u8 baud, SercomClock clk) {
+    if (p->mode != MODE_SPI || clk.src != p->spi_clock.src || clk.div != p->spi_clock.div) {
+        sercom_clock_enable_src(p->port->spi, p->spi_clock_channel, clk);
+        p->spi_clock = clk;
+    }
+
+    if (p->mode == MODE_SPI) {
+        sercom_spi_master_reconfigure(p->port->spi,
+            !!(flags & FLAG_SPI_CPOL), !!(flags & FLAG_SPI_CPHA), baud);
+        return;
+    }
+
+    // can only do spi master
+    sercom_spi_master_init(p->port->spi, p->port->spi_dipo, p->port->spi_dopo,
+        !!(flags & FLAG_SPI_CPOL), !!(flags & FLAG_SPI_CPHA), baud);
+    dma_sercom_configure_tx(p->dma_tx, p->port->spi);
+    dma_sercom_configure_rx(p->dma_rx, p->port->spi);
+    dma_enable_interrupt(p->dma_rx);
+    pin_mux(p->port->mosi);
+    pin_mux(p->port->miso);
+    pin_mux(p->port->sck);
+    p->mode = MODE_SPI;
+}
+
+/// Put the port in UART mode, with its SERCOM clocked from `clk` and the given BAUD
+void port_uart_enable(PortData* p, SercomClock clk, u8 sampr, u16 baud) {
+    // set up uart
+    pin_mux(p->port->tx);
+    pin_mux(p->port->rx);
+    sercom_clock_enable_src(p->port->uart_i2c, p->uart_i2c_clock_channel, clk);
+    sercom_uart_init(p->port->uart_i2c, p->port->uart_dipo, p->port->uart_dopo, sampr, baud);
+    dma_sercom_configure_tx(p->dma_tx, p->port->uart_i2c);
+    dma_enable_interrupt(p->dma_tx);
+
+    // receive by DMA, generating an event for every byte
+    dma_sercom_configure_rx(p->dma_rx, p->port->uart_i2c);
+    dma_enable_event_output(p->dma_rx);
+    dma_enable_interrupt(p->dma_rx);
+
+    p->mode = MODE_UART;
+
+    p->uart_buf.active = 0;
+    p->uart_buf.pending = 0;
+    p->uart_buf.overflow = 0;
+    p->uart_buf.direct = NULL;
+
+    // each received byte restarts the timer, so that uart data will get written
+    // once the line has been idle for UART_MS_TIMEOUT
+    evsys_config(p->evsys_channel,
+        EVSYS_ID_GEN_DMAC_CH_0 + p->dma_rx,
+        tcc_ev0_user[p->tcc_channel]);
+    tcc_delay_enable_retrigger(p->tcc_channel, UART_TIMEOUT_TICKS);
+
+    dma_sercom_start_rx(p->dma_rx, p->port->uart_i2c, p->uart_buf.rx[0], UART_RX_SIZE);
+}
+
 /// Get the GPIO pin for a port pin index
 Pin port_selected_pin(PortData* p) {
     return p->port->gpio[p->arg[0] % 8];
@@ -275,42 +648,799 @@ void port_exec_async_complete(PortData* p, ExecStatus s) {
     port_step(p);
 }
 
-/// Flush pending received UART data to the reply buffer
-void uart_send_data(PortData *p){
-    if (p->uart_buf.buf_len > 0) {
-        // pad 2 bytes at the beginning
-        // 1st byte indicates uart rx
-        // 2nd byte indicates uart rx number.
-        // this also means rx number has to be <255
-        u8 count = p->uart_buf.buf_len;
-
-        if (count + 2 > BRIDGE_BUF_SIZE - p->reply_len) {
-            // Shouldn't have to worry about insufficient buffer space because the buffer is
-            // always flushed before enabling async events, but assert to be sure.
+/// Stop the UART RX DMA and account for the bytes it received. Bytes received straight into the
+/// reply buffer are committed there. Otherwise the DMA buffer is handed over to be copied, unless
+/// the other one is still waiting, in which case the new bytes are dropped and counted.
+/// Called with interrupts disabled.
+static void uart_rx_stop(PortData *p) {
+    UartBuf* u = &p->uart_buf;
+
+    // A completion not yet seen by DMAC_Handler is accounted for here
+    dma_stop(p->dma_rx);
+
+    u8 count = UART_RX_SIZE - dma_remaining(p->dma_rx);
+    if (u->direct != NULL) {
+        if (count > 0) {
+            u->direct[0] = REPLY_ASYNC_UART_RX;
+            u->direct[1] = count;
+            p->reply_len += 2 + count;
+        }
+        u->direct = NULL;
+    } else if (count > 0) {
+        if (u->pending == 0) {
+            u->pending = count;
+            u->active ^= 1;
+        } else {
+            u->overflow = (u->overflow > 0xffff - count) ? 0xffff : u->overflow + count;
+            stats.uart_overruns[p->chan - 1] += count;
+        }
+    }
+
+    // Characters the SERCOM itself had to drop
+    if (sercom(p->port->uart_i2c)->USART.STATUS.bit.BUFOVF) {
+        sercom(p->port->uart_i2c)->USART.STATUS.reg = SERCOM_USART_STATUS_BUFOVF;
+        stats.uart_overruns[p->chan - 1]++;
+        if (u->overflow < 0xffff) {
+            u->overflow++;
+        }
+    }
+}
+
+/// Take the bytes the UART RX DMA has received so far and restart it on a free buffer of the
+/// UartBuf. Called from the DMA completion (buffer full), the TCC idle timeout, and before anything
+/// else writes to the reply buffer the DMA was receiving into.
+void uart_rx_swap(PortData *p) {
+    UartBuf* u = &p->uart_buf;
+
+    __disable_irq();
+    uart_rx_stop(p);
+    __enable_irq();
+
+    dma_sercom_start_rx(p->dma_rx, p->port->uart_i2c, u->rx[u->active], UART_RX_SIZE);
+}
+
+/// Move the UART RX DMA into the reply buffer, after room for the REPLY_ASYNC_UART_RX header, so
+/// received data doesn't have to be copied. Only called while async events are allowed, which
+/// leaves room for a full buffer. Nothing else may write to the reply buffer until uart_rx_swap.
+/// Returns true if data received before the move has to be copied first.
+bool uart_rx_direct(PortData *p) {
+    UartBuf* u = &p->uart_buf;
+    if (u->direct != NULL) {
+        return false;
+    }
+
+    __disable_irq();
+    uart_rx_stop(p);
+    if (u->pending > 0) {
+        __enable_irq();
+        dma_sercom_start_rx(p->dma_rx, p->port->uart_i2c, u->rx[u->active], UART_RX_SIZE);
+        return true;
+    }
+    u->direct = &p->reply_buf[p->reply_len];
+    __enable_irq();
+
+    dma_sercom_start_rx(p->dma_rx, p->port->uart_i2c, u->direct + 2, UART_RX_SIZE);
+    return false;
+}
+
+/// Copy UART data received while the reply buffer was busy, and the count of any dropped bytes, to
+/// the reply buffer.
+/// Returns true if anything was copied.
+bool uart_rx_copy(PortData *p) {
+    UartBuf* u = &p->uart_buf;
+    bool copied = false;
+
+    if (u->pending > 0) {
+        if (u->pending + 2 > BRIDGE_BUF_SIZE - p->reply_len) {
+            // Async events are only processed with PORT_ASYNC_RESERVE bytes free, but assert to be sure.
             port_error(p);
-            return;
+            return false;
         }
 
         p->reply_buf[p->reply_len++] = REPLY_ASYNC_UART_RX;
+        p->reply_buf[p->reply_len++] = u->pending;
+        memcpy(&p->reply_buf[p->reply_len], u->rx[u->active ^ 1], u->pending);
+        p->reply_len += u->pending;
+
+        // Free the buffer for the next swap
+        u->pending = 0;
+        copied = true;
+    }
+
+    __disable_irq();
+    u16 overflow = u->overflow;
+    u->overflow = 0;
+    __enable_irq();
+
+    if (overflow > 0) {
+        if (3 > BRIDGE_BUF_SIZE - p->reply_len) {
+            port_error(p);
+            return false;
+        }
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_UART_OVERFLOW;
+        p->reply_buf[p->reply_len++] = overflow & 0xff;
+        p->reply_buf[p->reply_len++] = overflow >> 8;
+        copied = true;
+    }
+
+    return copied;
+}
+
+/// The UART RX line has been idle for UART_MS_TIMEOUT: pass on whatever has been received
+void uart_send_data(PortData *p){
+    if (p->mode != MODE_UART || p->state == PORT_DISABLE) {
+        return;
+    }
+    uart_rx_swap(p);
+    port_step(p);
+}
+
+/// Start converting continuously into adc_stream.buf, at `rate` conversions per second.
+/// Each conversion takes the next of `scan` consecutive ADC inputs starting at the one of `pin`.
+/// A stream of the other port is left running, and the request is a port error.
+void adc_stream_start(PortData *p, Pin pin, u8 scan, u8 prescaler, u8 samplenum, u32 rate) {
+    if (adc_stream.port != NULL && adc_stream.port != p) {
+        port_error(p);
+        return;
+    }
+
+    if (adc_stream.port != NULL) {
+        adc_stream_stop();
+    }
+
+    // switch the pins of the scan to analog in
+    for (int i = 0; i<8; i++) {
+        if (p->port->gpio[i].chan >= pin.chan && p->port->gpio[i].chan < pin.chan + scan) {
+            pin_analog(p->port->gpio[i]);
+        }
+    }
+
+    adc_stream.port = p;
+    adc_stream.active = 0;
+    adc_stream.pending = false;
+    adc_stream.overflow = 0;
+
+    // The DMA cycles between the two halves, interrupting as each one fills
+    for (int i = 0; i<2; i++) {
+        adc_stream_chain[i].SRCADDR.reg = (unsigned) &ADC->RESULT.reg;
+        adc_stream_chain[i].DSTADDR.reg = (unsigned) &adc_stream.buf[i][ADC_STREAM_SAMPLES];
+        adc_stream_chain[i].BTCNT.reg = ADC_STREAM_SAMPLES;
+        adc_stream_chain[i].BTCTRL.reg = DMAC_BTCTRL_VALID
+            | DMAC_BTCTRL_DSTINC
+            | DMAC_BTCTRL_BEATSIZE_HWORD
+            | DMAC_BTCTRL_BLOCKACT_INT;
+    }
+    dma_link_ring(DMA_ADC_STREAM, adc_stream_chain, 2);
+
+    dma_configure(DMA_ADC_STREAM, ADC_DMAC_ID_RESRDY);
+    dma_enable_interrupt(DMA_ADC_STREAM);
+    dma_start_descriptor(DMA_ADC_STREAM, adc_stream_chain);
+
+    adc_stream_config(pin.chan, scan,
+        prescaler < ADC_STREAM_MIN_PRESCALER ? ADC_STREAM_MIN_PRESCALER : prescaler,
+        samplenum > 10 ? 10 : samplenum, // up to 1024 samples
+        ADC_INPUTCTRL_GAIN_DIV2);
+
+    // The timer overflow starts each conversion
+    evsys_config(EVSYS_ADC_STREAM, EVSYS_ID_GEN_TC3_OVF + TC_ADC_STREAM - 3, EVSYS_ID_USER_ADC_START);
+    tc_event_enable(TC_ADC_STREAM, 48000000 / (rate > 0 ? rate : 1));
+}
+
+/// Stop the streaming ADC, dropping any samples not yet passed on
+void adc_stream_stop() {
+    tc_event_disable(TC_ADC_STREAM);
+    dma_abort(DMA_ADC_STREAM);
+    adc_stream_disable();
+    adc_stream.port = NULL;
+}
+
+/// A half of the ADC stream buffer has filled, and the DMA has moved on to the other one.
+/// If that one was still waiting to be copied, its samples are dropped and counted.
+void port_adc_stream_completion() {
+    AdcStream* s = &adc_stream;
+    if (s->port == NULL) {
+        return;
+    }
+
+    if (s->pending) {
+        s->overflow = (s->overflow > 0xffff - ADC_STREAM_SAMPLES) ? 0xffff : s->overflow + ADC_STREAM_SAMPLES;
+    }
+    s->pending = true;
+    s->active ^= 1;
+
+    if (s->port->state != PORT_DISABLE) {
+        port_step(s->port);
+    }
+}
+
+/// Start the conversion of a port that was waiting for another's CMD_ANALOG_READ to finish
+static void adc_read_start_next() {
+    if (adc_read_port == NULL && adc_read_next != NULL) {
+        adc_read_port = adc_read_next;
+        adc_read_next = NULL;
+        adc_start(port_selected_pin(adc_read_port), ADC_INPUTCTRL_GAIN_DIV2);
+    }
+}
+
+/// The conversion of a CMD_ANALOG_READ is done, so reply with it and continue that port
+void port_adc_completion() {
+    ADC->INTENCLR.reg = ADC_INTENCLR_RESRDY;
+    u16 val = ADC->RESULT.reg;
+
+    PortData* p = adc_read_port;
+    adc_read_port = NULL;
+    adc_read_start_next();
+    if (p == NULL) {
+        return;
+    }
+
+    p->reply_buf[p->reply_len++] = REPLY_DATA;
+    p->reply_buf[p->reply_len++] = val & 0xFF; // lower 8 bits
+    p->reply_buf[p->reply_len++] = val >> 8;// higher 8 bits
+    port_exec_async_complete(p, EXEC_DONE);
+}
+
+/// Copy a full half of the ADC stream buffer, and the count of any dropped samples, to the
+/// reply buffer. Returns true if anything was copied.
+bool adc_stream_copy(PortData *p) {
+    AdcStream* s = &adc_stream;
+    bool copied = false;
+
+    __disable_irq();
+    bool pending = s->pending;
+    u16 overflow = s->overflow;
+    s->overflow = 0;
+    __enable_irq();
+
+    if (pending) {
+        if (2 + ADC_STREAM_SAMPLES * 2 > BRIDGE_BUF_SIZE - p->reply_len) {
+            // Async events are only processed with PORT_ASYNC_RESERVE bytes free, but assert to be sure.
+            port_error(p);
+            return false;
+        }
+
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_ADC_DATA;
+        p->reply_buf[p->reply_len++] = ADC_STREAM_SAMPLES;
+        // samples are little endian, like the host expects
+        memcpy(&p->reply_buf[p->reply_len], s->buf[s->active ^ 1], ADC_STREAM_SAMPLES * 2);
+        p->reply_len += ADC_STREAM_SAMPLES * 2;
+
+        s->pending = false;
+        copied = true;
+    }
+
+    if (overflow > 0) {
+        if (3 > BRIDGE_BUF_SIZE - p->reply_len) {
+            port_error(p);
+            return false;
+        }
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_ADC_OVERFLOW;
+        p->reply_buf[p->reply_len++] = overflow & 0xff;
+        p->reply_buf[p->reply_len++] = overflow >> 8;
+        copied = true;
+    }
+
+    return copied;
+}
+
+/// Returns true if `target` is an output of port `p`: the DAC, which is on pin 7 of port B, or a
+/// pin with a TCC output
+static bool wave_target_valid(PortData *p, u8 target) {
+    if (target == WAVE_TARGET_DAC) {
+        return p == &port_b;
+    }
+    return target <= 8 && p->port->gpio[target - 1].alt_mux != 0;
+}
+
+/// Set up waveform output to `target`. Playback starts once the looped table of `loop_len`
+/// samples, or both halves of a stream, have been received. A waveform of the other port is left
+/// playing, and the request is a port error.
+void wave_setup(PortData *p, u8 target, u8 loop_len, u32 rate) {
+    if (!wave_target_valid(p, target) || (wave.port != NULL && wave.port != p)) {
+        port_error(p);
+        return;
+    }
+
+    if (wave.port != NULL) {
+        wave_stop();
+    }
+
+    wave.port = p;
+    wave.playing = false;
+    wave.loop_len = loop_len;
+    wave.rate = rate > 0 ? rate : 1;
+    wave.fill = 0;
+    wave.fill_pos = 0;
+    wave.play = 0;
+    wave.ready[0] = wave.ready[1] = false;
+    wave.refill = 0;
+    wave.underrun = 0;
+
+    if (target == WAVE_TARGET_DAC) {
+        // DATABUF is loaded into DATA on each timer event, and refilled by DMA
+        wave.dac = true;
+        pin_analog(PORT_B.g3);
+        dac_set_event_start(true);
+        wave.trigsrc = DAC_DMAC_ID_EMPTY;
+        wave.dst = (unsigned) &DAC->DATABUF.reg;
+    } else {
+        // The buffered duty cycle is updated once per PWM period
+        Pin pin = p->port->gpio[target - 1];
+        wave.dac = false;
+        pwm_set_pin_duty(pin, 0);
+        wave.trigsrc = tcc_dmac_ovf[pin.tcc_id];
+        wave.dst = (unsigned) &tcc(pin.tcc_id)->CCB[pin.cc_chan].reg;
+    }
+}
+
+/// Start the DMA, and the timer for the DAC
+void wave_play() {
+    for (int i = 0; i<2; i++) {
+        wave_chain[i].SRCADDR.reg = (unsigned) &wave.buf[i][WAVE_SAMPLES];
+        wave_chain[i].DSTADDR.reg = wave.dst;
+        wave_chain[i].BTCNT.reg = WAVE_SAMPLES;
+        wave_chain[i].BTCTRL.reg = DMAC_BTCTRL_VALID
+            | DMAC_BTCTRL_SRCINC
+            | DMAC_BTCTRL_BEATSIZE_HWORD
+            | DMAC_BTCTRL_BLOCKACT_INT;
+    }
+
+    if (wave.loop_len > 0) {
+        // The table repeats without interrupts
+        wave_chain[0].SRCADDR.reg = (unsigned) &wave.buf[0][0] + wave.loop_len * 2;
+        wave_chain[0].BTCNT.reg = wave.loop_len;
+        wave_chain[0].BTCTRL.reg &= ~DMAC_BTCTRL_BLOCKACT_Msk;
+        dma_link_ring(DMA_WAVE, wave_chain, 1);
+    } else {
+        dma_link_ring(DMA_WAVE, wave_chain, 2);
+    }
+
+    dma_configure(DMA_WAVE, wave.trigsrc);
+    dma_enable_interrupt(DMA_WAVE);
+    dma_start_descriptor(DMA_WAVE, wave_chain);
+
+    if (wave.dac) {
+        evsys_config(EVSYS_WAVE, EVSYS_ID_GEN_TC3_OVF + TC_WAVE - 3, EVSYS_ID_USER_DAC_START);
+        tc_event_enable(TC_WAVE, 48000000 / wave.rate);
+    }
+
+    wave.playing = true;
+}
+
+/// Copy samples from the host into the table, or into the half of the stream being refilled
+void wave_write(u8* data, u32 len) {
+    while (len > 0) {
+        u8* region = (wave.loop_len > 0) ? (u8*) wave.buf : (u8*) wave.buf[wave.fill];
+        u32 region_len = (wave.loop_len > 0) ? wave.loop_len * 2 : WAVE_SAMPLES * 2;
+
+        u32 size = region_len - wave.fill_pos;
+        if (len < size) {
+            size = len;
+        }
+        memcpy(region + wave.fill_pos, data, size);
+        wave.fill_pos += size;
+        data += size;
+        len -= size;
+
+        if (wave.fill_pos == region_len) {
+            wave.fill_pos = 0;
+            if (wave.loop_len == 0) {
+                wave.ready[wave.fill] = true;
+                wave.fill ^= 1;
+            }
+
+            // Further tables replace the one playing
+            if (!wave.playing && (wave.loop_len > 0 || (wave.ready[0] && wave.ready[1]))) {
+                wave_play();
+            }
+        }
+    }
+}
+
+/// Stop waveform output. The DAC or PWM output keeps its last value.
+void wave_stop() {
+    dma_abort(DMA_WAVE);
+    if (wave.dac) {
+        tc_event_disable(TC_WAVE);
+        dac_set_event_start(false);
+    }
+    wave.port = NULL;
+}
+
+/// A half of a streamed waveform has been played, and the DMA has moved on to the other one.
+/// If that one was not refilled in time, it plays again and is counted as an underrun.
+void port_wave_completion() {
+    if (wave.port == NULL || wave.loop_len > 0) {
+        return;
+    }
+
+    wave.ready[wave.play] = false;
+    wave.play ^= 1;
+    if (!wave.ready[wave.play] && wave.underrun < 0xffff) {
+        wave.underrun++;
+    }
+    if (wave.refill < 2) {
+        wave.refill++;
+    }
+
+    if (wave.port->state != PORT_DISABLE) {
+        port_step(wave.port);
+    }
+}
+
+/// Ask the host for more streamed samples, and report underruns. Returns true if anything was
+/// added to the reply buffer.
+bool wave_notify(PortData *p) {
+    if (wave.refill == 0 && wave.underrun == 0) {
+        return false;
+    }
+
+    __disable_irq();
+    u8 refill = wave.refill;
+    u16 underrun = wave.underrun;
+    wave.refill = 0;
+    wave.underrun = 0;
+    __enable_irq();
+
+    // Async events are only processed with PORT_ASYNC_RESERVE bytes free
+    while (refill-- > 0) {
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_WAVE_REFILL;
+    }
+    if (underrun > 0) {
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_WAVE_UNDERRUN;
+        p->reply_buf[p->reply_len++] = underrun & 0xff;
+        p->reply_buf[p->reply_len++] = underrun >> 8;
+    }
+    return true;
+}
+
+/// Start timestamping both edges of the pins in `mask`: at most EDGE_CAPTURE_CHANNELS pins
+/// that support interrupts. A capture of the other port is left running, and the request is a
+/// port error.
+void edge_capture_start(PortData *p, u8 mask) {
+    if (edge_capture.port != NULL && edge_capture.port != p) {
+        port_error(p);
+        return;
+    }
+
+    if (edge_capture.port != NULL) {
+        edge_capture_stop();
+    }
+
+    u8 pins[EDGE_CAPTURE_CHANNELS];
+    u8 channels = 0;
+    for (int i = 0; i<8; i++) {
+        if (mask & (1 << i)) {
+            if (!port_pin_supports_interrupt(p, i) || channels == EDGE_CAPTURE_CHANNELS) {
+                port_error(p);
+                return;
+            }
+            pins[channels++] = i;
+        }
+    }
+    if (channels == 0) {
+        port_error(p);
+        return;
+    }
+
+    EdgeCapture* c = &edge_capture;
+    c->port = p;
+    c->channels = channels;
+    c->extints = 0;
+    c->epoch = 0;
+    c->head = 0;
+    c->count = 0;
+    c->overflow = 0;
+
+    // The LED has stopped breathing by the time the ports are in use, so take over its timer
+    cancel_breathing_animation();
+    tcc_capture_enable(TCC_EDGE_CAPTURE, EDGE_CAPTURE_PRESCALER, channels);
+    NVIC_EnableIRQ(TCC1_IRQn);
+
+    // Each pin's EXTINT event triggers the capture on its channel
+    for (int i = 0; i<channels; i++) {
+        Pin pin = p->port->gpio[pins[i]];
+        u8 extint = pin_extint(pin);
+
+        c->pins[i] = pins[i];
+        c->extints |= 1 << extint;
+        evsys_config(edge_capture_evsys[i], EVSYS_ID_GEN_EIC_EXTINT_0 + extint, edge_capture_user[i]);
+        eic_config(pin, EIC_CONFIG_SENSE_BOTH);
+        pin_mux_eic(pin);
+    }
+
+    EIC->INTFLAG.reg = c->extints;
+    EIC->EVCTRL.reg |= c->extints;
+    EIC->INTENSET.reg = c->extints;
+}
+
+/// Stop edge capture, dropping any edges not yet passed on
+void edge_capture_stop() {
+    EdgeCapture* c = &edge_capture;
+
+    EIC->INTENCLR.reg = c->extints;
+    EIC->EVCTRL.reg &= ~c->extints;
+    for (int i = 0; i<c->channels; i++) {
+        Pin pin = c->port->port->gpio[c->pins[i]];
+        eic_config(pin, EIC_CONFIG_SENSE_NONE);
+        pin_gpio(pin);
+    }
+    EIC->INTFLAG.reg = c->extints;
+
+    tcc_capture_disable(TCC_EDGE_CAPTURE);
+    c->port = NULL;
+}
+
+/// Count an overflow of TCC_EDGE_CAPTURE. Returns false if edge capture isn't using the timer.
+bool port_edge_capture_overflow() {
+    if (edge_capture.port == NULL) {
+        return false;
+    }
+
+    tcc(TCC_EDGE_CAPTURE)->INTFLAG.reg = TCC_INTFLAG_OVF;
+    edge_capture.epoch++;
+    return true;
+}
+
+/// Extend a 24-bit count captured by TCC_EDGE_CAPTURE to 32 bits. Only called from the EIC
+/// interrupt, which has the same priority as the timer's, so an overflow that hasn't been
+/// counted yet is still flagged.
+static u32 edge_capture_time(u32 count) {
+    u32 epoch = edge_capture.epoch;
+    if ((tcc(TCC_EDGE_CAPTURE)->INTFLAG.reg & TCC_INTFLAG_OVF) && count < 0x800000) {
+        // captured after that overflow
+        epoch++;
+    }
+    return (epoch << 24) | count;
+}
+
+/// Add an edge to the ring, or count it as dropped if the ring is full
+static void edge_capture_push(u8 pin, u32 time) {
+    EdgeCapture* c = &edge_capture;
+    if (c->count == EDGE_CAPTURE_SIZE) {
+        if (c->overflow < 0xffff) {
+            c->overflow++;
+        }
+        return;
+    }
+
+    u8 pos = (c->head + c->count) % EDGE_CAPTURE_SIZE;
+    c->pin[pos] = pin;
+    c->time[pos] = time;
+    c->count++;
+}
+
+/// Buffer the captured edge of each pin flagged in `extints`, oldest first
+static void edge_capture_record(u16 extints) {
+    EdgeCapture* c = &edge_capture;
+    u8 pin[EDGE_CAPTURE_CHANNELS];
+    u32 time[EDGE_CAPTURE_CHANNELS];
+    u8 n = 0;
+
+    for (int i = 0; i<c->channels; i++) {
+        Pin sys_pin = c->port->port->gpio[c->pins[i]];
+        if (extints & (1 << pin_extint(sys_pin))) {
+            // The level is read as the interrupt runs, while the timestamp was latched at the edge
+            pin[n] = c->pins[i] | (pin_read(sys_pin) << 3);
+            time[n] = edge_capture_time(tcc(TCC_EDGE_CAPTURE)->CC[i].reg & 0xffffff);
+            n++;
+        }
+    }
+
+    // Both channels can capture before the interrupt runs. Put the earlier one first, allowing
+    // for wraparound.
+    if (n == 2 && time[0] != time[1] && time[0] - time[1] < 0x80000000) {
+        edge_capture_push(pin[1], time[1]);
+        edge_capture_push(pin[0], time[0]);
+    } else {
+        for (int i = 0; i<n; i++) {
+            edge_capture_push(pin[i], time[i]);
+        }
+    }
+}
+
+/// Copy a batch of buffered edges, and the count of any dropped edges, to the reply buffer.
+/// Returns true if anything was copied.
+bool edge_capture_copy(PortData *p) {
+    EdgeCapture* c = &edge_capture;
+
+    __disable_irq();
+    u8 count = c->count;
+    u16 overflow = c->overflow;
+    c->overflow = 0;
+    __enable_irq();
+
+    if (count == 0 && overflow == 0) {
+        return false;
+    }
+
+    if (count > EDGE_CAPTURE_BATCH) {
+        count = EDGE_CAPTURE_BATCH;
+    }
+
+    if (2 + count * EDGE_RECORD_LEN + 3 > BRIDGE_BUF_SIZE - p->reply_len) {
+        // Async events are only processed with PORT_ASYNC_RESERVE bytes free, but assert to be sure.
+        port_error(p);
+        return false;
+    }
+
+    if (count > 0) {
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_EDGE_DATA;
         p->reply_buf[p->reply_len++] = count;
+        for (int i = 0; i<count; i++) {
+            u8 pos = (c->head + i) % EDGE_CAPTURE_SIZE;
+            u32 time = c->time[pos];
+            p->reply_buf[p->reply_len++] = c->pin[pos];
+            p->reply_buf[p->reply_len++] = time & 0xff;
+            p->reply_buf[p->reply_len++] = (time >> 8) & 0xff;
+            p->reply_buf[p->reply_len++] = (time >> 16) & 0xff;
+            p->reply_buf[p->reply_len++] = time >> 24;
+        }
+
+        // The interrupt only appends, so only the count needs to be updated atomically
+        c->head = (c->head + count) % EDGE_CAPTURE_SIZE;
+        __disable_irq();
+        c->count -= count;
+        __enable_irq();
+    }
+
+    if (overflow > 0) {
+        p->reply_buf[p->reply_len++] = REPLY_ASYNC_EDGE_OVERFLOW;
+        p->reply_buf[p->reply_len++] = overflow & 0xff;
+        p->reply_buf[p->reply_len++] = overflow >> 8;
+    }
+
+    return true;
+}
+
+/// Returns the number of payload bytes that follow the arguments of a command
+u32 port_cmd_payload_len(u8 cmd, const u8* arg) {
+    if (cmd == CMD_I2C_TRANSFER) {
+        return arg[1];
+    }
+    return (port_cmds[cmd].flags & CMD_PAYLOAD) ? arg[0] : 0;
+}
+
+/// Returns true if a stored sequence is made of whole, known commands, none of which are macro
+/// commands
+bool port_macro_valid(const u8* buf, u8 len) {
+    u32 pos = 0;
+    while (pos < len) {
+        u8 cmd = buf[pos++];
+        if (!port_cmd_valid(cmd)
+           || cmd == CMD_MACRO_STORE || cmd == CMD_MACRO_RUN || cmd == CMD_MACRO_TRIGGER) {
+            return false;
+        }
+
+        u32 arg_len = port_cmd_args(cmd);
+        if (pos + arg_len > len) {
+            return false;
+        }
+        pos += arg_len + port_cmd_payload_len(cmd, &buf[pos]);
+    }
+    return pos == len;
+}
+
+/// Start parsing stored sequence `slot` in place of the host's commands, `runs` times
+void port_macro_enter(PortData* p, u8 slot, u8 runs) {
+    p->host_pos = p->cmd_pos;
+    p->host_len = p->cmd_len;
+    p->cmd_buf = p->macros[slot];
+    p->cmd_pos = 0;
+    p->cmd_len = p->macro_len[slot];
+    p->macro = slot;
+    p->macro_repeat = runs - 1;
+}
+
+/// The stored sequence has been parsed. Run it again, or go back to the host's commands.
+void port_macro_next(PortData* p) {
+    if (p->macro_repeat > 0) {
+        p->macro_repeat--;
+        p->cmd_pos = 0;
+        return;
+    }
+
+    p->macro = PORT_NO_MACRO;
+    p->cmd_buf = p->cmd_bufs[p->cmd_ring_pos];
+    p->cmd_pos = p->host_pos;
+    p->cmd_len = p->host_len;
+}
 
-        // copy data into reply buf
-        for (uint8_t i = 0; i < count; i++) {
-            p->reply_buf[p->reply_len++] = p->uart_buf.rx[p->uart_buf.tail];
-            p->uart_buf.tail = (p->uart_buf.tail + 1) % UART_RX_SIZE;
+/// SysTick counts the ms of timer triggers, and only interrupts while a port has one
+void port_macro_timer_update() {
+    if (port_a.trigger_period > 0 || port_b.trigger_period > 0) {
+        if (!(SysTick->CTRL & SysTick_CTRL_TICKINT_Msk)) {
+            SysTick_Config(48000000 / 1000);
         }
+    } else if (SysTick->CTRL & SysTick_CTRL_TICKINT_Msk) {
+        stats_timer_free_run();
+    }
+}
+
+/// Called every ms while a timer trigger is set. An elapsed period runs the triggered sequence
+/// once the port has parsed the host's commands. A run that is still waiting is not repeated.
+void port_macro_tick(PortData* p) {
+    if (p->trigger_period == 0 || --p->trigger_countdown > 0) {
+        return;
+    }
 
-        p->uart_buf.buf_len -= count;
+    p->trigger_countdown = p->trigger_period;
+    p->trigger_pending = true;
+    if (p->state != PORT_DISABLE) {
         port_step(p);
     }
 }
 
+/// Set what runs stored sequence `slot` without a command from the host
+void port_macro_trigger(PortData* p, u8 slot, u8 source, u16 value) {
+    p->trigger_macro = slot;
+    p->trigger_pin = PORT_NO_MACRO;
+    p->trigger_period = 0;
+    p->trigger_pending = false;
+
+    if (source == TRIGGER_TIMER && value > 0) {
+        p->trigger_period = value;
+        p->trigger_countdown = value;
+    } else if (source == TRIGGER_PIN && value < 8 && port_pin_supports_interrupt(p, value)) {
+        p->trigger_pin = value;
+    } else if (source != TRIGGER_NONE) {
+        port_error(p);
+    }
+
+    port_macro_timer_update();
+}
+
+/// Execute a CMD_PIN command on `pin`. Those that reply send a single status byte.
+static inline void port_pin_cmd(PortData *p, u8 cmd, Pin pin) {
+    switch (cmd) {
+        case CMD_GPIO_IN:
+            pin_in(pin);
+            port_send_status(p, pin_read(pin) ? REPLY_HIGH : REPLY_LOW);
+            break;
+        case CMD_GPIO_INPUT:
+            pin_in(pin);
+            break;
+        case CMD_GPIO_RAW_READ:
+            port_send_status(p, pin_read(pin) ? REPLY_HIGH : REPLY_LOW);
+            break;
+        case CMD_GPIO_HIGH:
+            pin_high(pin);
+            pin_out(pin);
+            break;
+        case CMD_GPIO_LOW:
+            pin_low(pin);
+            pin_out(pin);
+            break;
+        case CMD_GPIO_TOGGLE:
+            pin_toggle(pin);
+            pin_out(pin);
+            break;
+    }
+}
+
+/// Execute a run of CMD_PIN commands whose argument is already in cmd_buf, without going
+/// through the argument parser state for each. Returns true if any were executed.
+bool port_pin_cmd_run(PortData *p) {
+    bool ran = false;
+    while (p->cmd_len - p->cmd_pos >= 2 && BRIDGE_BUF_SIZE - p->reply_len >= PORT_REPLY_RESERVE) {
+        u8 cmd = p->cmd_buf[p->cmd_pos];
+        if (!port_cmd_valid(cmd) || !(port_cmds[cmd].flags & CMD_PIN)) {
+            break;
+        }
+        port_pin_cmd(p, cmd, p->port->gpio[p->cmd_buf[p->cmd_pos + 1] % 8]);
+        p->cmd_pos += 2;
+        ran = true;
+    }
+    return ran;
+}
+
 /// Begin execution of a command. This function performs the setup for commands with payloads,
 /// or the entire execution for commands that do not have payloads.
 ///   EXEC_DONE: move on to the next command
 ///   EXEC_CONTINUE: schedule port_continue_command to be called with a part of the payload when
 ///                  available
 ExecStatus port_begin_cmd(PortData *p) {
+    trace(TRACE_PORT_CMD, p->chan, p->cmd);
     switch (p->cmd) {
         case CMD_NOP:
             return EXEC_DONE;
@@ -322,35 +1452,16 @@ ExecStatus port_begin_cmd(PortData *p) {
             return EXEC_CONTINUE;
 
         case CMD_TX:
+        case CMD_WAVE_DATA:
             return EXEC_CONTINUE;
 
         case CMD_GPIO_IN:
-            pin_in(port_selected_pin(p));
-            u8 state = pin_read(port_selected_pin(p));
-            port_send_status(p, state ? REPLY_HIGH : REPLY_LOW);
-            return EXEC_DONE;
-
         case CMD_GPIO_INPUT:
-            pin_in(port_selected_pin(p));
-            return EXEC_DONE;
-
         case CMD_GPIO_RAW_READ:
-            port_send_status(p, pin_read(port_selected_pin(p)) ? REPLY_HIGH : REPLY_LOW);
-            return EXEC_DONE;
-
         case CMD_GPIO_HIGH:
-            pin_high(port_selected_pin(p));
-            pin_out(port_selected_pin(p));
-            return EXEC_DONE;
-
         case CMD_GPIO_LOW:
-            pin_low(port_selected_pin(p));
-            pin_out(port_selected_pin(p));
-            return EXEC_DONE;
-
         case CMD_GPIO_TOGGLE:
-            pin_toggle(port_selected_pin(p));
-            pin_out(port_selected_pin(p));
+            port_pin_cmd(p, p->cmd, port_selected_pin(p));
             return EXEC_DONE;
 
         case CMD_GPIO_PULL: {
@@ -402,15 +1513,86 @@ ExecStatus port_begin_cmd(PortData *p) {
             return EXEC_DONE;
 
         case CMD_ANALOG_READ: {
-            // copy analog data into reply buffer
-            u16 val = adc_read(port_selected_pin(p), ADC_INPUTCTRL_GAIN_DIV2);
+            if (adc_stream.port != NULL) {
+                // the ADC is converting on the stream's timer
+                port_error(p);
+                return EXEC_DONE;
+            }
+            // port_adc_completion writes the reply, after any read of the other port
+            if (adc_read_port == NULL) {
+                adc_read_port = p;
+                adc_start(port_selected_pin(p), ADC_INPUTCTRL_GAIN_DIV2);
+            } else {
+                adc_read_next = p;
+            }
+            return EXEC_ASYNC;
+        }
 
-            p->reply_buf[p->reply_len++] = REPLY_DATA;
-            p->reply_buf[p->reply_len++] = val & 0xFF; // lower 8 bits
-            p->reply_buf[p->reply_len++] = val >> 8;// higher 8 bits
+        case CMD_ANALOG_STREAM_START:
+            if (adc_read_port != NULL) {
+                // the other port is waiting for a single conversion
+                port_error(p);
+                return EXEC_DONE;
+            }
+            adc_stream_start(p, port_selected_pin(p), ((p->arg[0] >> 4) & 0x7) + 1,
+                p->arg[1] & 0x7, (p->arg[1] >> 4) & 0xf,
+                p->arg[2] | (p->arg[3] << 8) | (p->arg[4] << 16));
+            return EXEC_DONE;
 
+        case CMD_ANALOG_STREAM_STOP:
+            if (adc_stream.port == p) {
+                adc_stream_stop();
+            }
+            return EXEC_DONE;
+
+        case CMD_WAVE_START:
+            wave_setup(p, p->arg[0], p->arg[1], p->arg[2] | (p->arg[3] << 8) | (p->arg[4] << 16));
+            return EXEC_DONE;
+
+        case CMD_WAVE_STOP:
+            if (wave.port == p) {
+                wave_stop();
+            }
+            return EXEC_DONE;
+
+        case CMD_EDGE_CAPTURE_START:
+            edge_capture_start(p, p->arg[0]);
+            return EXEC_DONE;
+
+        case CMD_EDGE_CAPTURE_STOP:
+            if (edge_capture.port == p) {
+                edge_capture_stop();
+            }
+            return EXEC_DONE;
+
+        case CMD_MACRO_STORE:
+            if (p->arg[1] >= PORT_NUM_MACROS || p->arg[0] > PORT_MACRO_SIZE) {
+                port_error(p);
+                return EXEC_DONE;
+            }
+            // macro_len counts the bytes stored so far
+            p->macro_len[p->arg[1]] = 0;
+            return p->arg[0] > 0 ? EXEC_CONTINUE : EXEC_DONE;
+
+        case CMD_MACRO_RUN:
+            // Stored sequences can't run each other
+            if (p->macro != PORT_NO_MACRO || p->arg[0] >= PORT_NUM_MACROS
+               || p->macro_len[p->arg[0]] == 0) {
+                port_error(p);
+                return EXEC_DONE;
+            }
+            if (p->arg[1] > 0) {
+                port_macro_enter(p, p->arg[0], p->arg[1]);
+            }
+            return EXEC_DONE;
+
+        case CMD_MACRO_TRIGGER:
+            if (p->arg[0] >= PORT_NUM_MACROS) {
+                port_error(p);
+                return EXEC_DONE;
+            }
+            port_macro_trigger(p, p->arg[0], p->arg[1], p->arg[2] | (p->arg[3] << 8));
             return EXEC_DONE;
-        }
 
         case CMD_ANALOG_WRITE:
             // get the higher and lower args
@@ -418,39 +1600,66 @@ ExecStatus port_begin_cmd(PortData *p) {
             return EXEC_DONE;
 
         case CMD_ENABLE_SPI:
-            // set up clock in case we need to use a divider
-            sercom_clock_enable(p->port->spi, p->clock_channel, p->arg[2]);
-            // can only do spi master
-            sercom_spi_master_init(p->port->spi, p->port->spi_dipo, p->port->spi_dopo,
-                !!(p->arg[0] & FLAG_SPI_CPOL), !!(p->arg[0] & FLAG_SPI_CPHA), p->arg[1]);
-            dma_sercom_configure_tx(p->dma_tx, p->port->spi);
-            dma_sercom_configure_rx(p->dma_rx, p->port->spi);
-            dma_enable_interrupt(p->dma_rx);
-            pin_mux(p->port->mosi);
-            pin_mux(p->port->miso);
-            pin_mux(p->port->sck);
-            p->mode = MODE_SPI;
+            port_spi_configure(p, p->arg[0], p->arg[1],
+                (SercomClock) { GCLK_SOURCE_DFLL48M, p->arg[2] });
+            return EXEC_DONE;
+
+        case CMD_SPI_CONFIG: {
+            SpiConfig* c = &p->spi_configs[(p->arg[0] >> 4) % PORT_SPI_CONFIGS];
+            u32 freq = p->arg[1] | (p->arg[2] << 8) | (p->arg[3] << 16) | (p->arg[4] << 24);
+            u32 actual = sercom_spi_clock_calc(freq, &c->clock, &c->baud);
+            c->flags = p->arg[0] & (FLAG_SPI_CPOL | FLAG_SPI_CPHA);
+
+            p->reply_buf[p->reply_len++] = REPLY_DATA;
+            p->reply_buf[p->reply_len++] = actual & 0xFF;
+            p->reply_buf[p->reply_len++] = (actual >> 8) & 0xFF;
+            p->reply_buf[p->reply_len++] = (actual >> 16) & 0xFF;
+            p->reply_buf[p->reply_len++] = actual >> 24;
+            return EXEC_DONE;
+        }
+
+        case CMD_SPI_SELECT: {
+            SpiConfig* c = &p->spi_configs[p->arg[0] % PORT_SPI_CONFIGS];
+            if (c->clock.div == 0) {
+                port_error(p);
+                return EXEC_DONE;
+            }
+            port_spi_configure(p, c->flags, c->baud, c->clock);
             return EXEC_DONE;
+        }
 
         case CMD_DISABLE_SPI:
-            // TODO: disable SERCOM
             pin_gpio(p->port->mosi);
             pin_gpio(p->port->miso);
             pin_gpio(p->port->sck);
+            if (p->mode == MODE_SPI) {
+                sercom_reset(p->port->spi);
+                sercom_clock_disable(p->port->spi);
+            }
             p->mode = MODE_NONE;
             return EXEC_DONE;
 
         case CMD_ENABLE_I2C:
+            sercom_clock_enable(p->port->uart_i2c, p->uart_i2c_clock_channel, 1);
             sercom_i2c_master_init(p->port->uart_i2c, p->arg[0]);
             pin_mux(p->port->sda);
             pin_mux(p->port->scl);
             sercom(p->port->uart_i2c)->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_ERROR;
+            // for CMD_I2C_TRANSFER
+            dma_sercom_configure_tx(p->dma_tx, p->port->uart_i2c);
+            dma_enable_interrupt(p->dma_tx);
+            dma_sercom_configure_rx(p->dma_rx, p->port->uart_i2c);
+            dma_enable_interrupt(p->dma_rx);
             p->mode = MODE_I2C;
             return EXEC_DONE;
 
         case CMD_DISABLE_I2C:
             pin_gpio(p->port->sda);
             pin_gpio(p->port->scl);
+            if (p->mode == MODE_I2C) {
+                sercom_reset(p->port->uart_i2c);
+                sercom_clock_disable(p->port->uart_i2c);
+            }
             p->mode = MODE_NONE;
             return EXEC_DONE;
 
@@ -470,32 +1679,40 @@ ExecStatus port_begin_cmd(PortData *p) {
             sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.CMD = 3;
             return EXEC_DONE;
 
-        case CMD_ENABLE_UART:
-            // set up uart
-            pin_mux(p->port->tx);
-            pin_mux(p->port->rx);
-            sercom_uart_init(p->port->uart_i2c, p->port->uart_dipo,
-                p->port->uart_dopo, (p->arg[0] << 8) + p->arg[1]); // 63019
-            dma_sercom_configure_tx(p->dma_tx, p->port->uart_i2c);
-            dma_enable_interrupt(p->dma_tx);
-
-            p->mode = MODE_UART;
+        case CMD_I2C_TRANSFER:
+            // A transfer without a payload or read only sends the address, to probe for a device
+            p->arg[3] = I2C_XFER_ADDR;
+            return EXEC_CONTINUE;
 
-            p->uart_buf.head = 0;
-            p->uart_buf.tail = 0;
-            p->uart_buf.buf_len = 0;
-            // set up interrupt on uart receive data complete
-            sercom(p->port->uart_i2c)->USART.INTENSET.reg = SERCOM_USART_INTFLAG_RXC;
+        case CMD_ENABLE_UART:
+            port_uart_enable(p, (SercomClock) { GCLK_SOURCE_DFLL48M, 1 }, SERCOM_UART_SAMPR_ARITH,
+                (p->arg[0] << 8) + p->arg[1]); // 63019
+            return EXEC_DONE;
 
-            // set up interrupt timer so that uart data will get written on timeout
-            tcc_delay_enable(p->tcc_channel);
+        case CMD_UART_CONFIG: {
+            u32 rate = p->arg[0] | (p->arg[1] << 8) | (p->arg[2] << 16) | (p->arg[3] << 24);
+            SercomClock clk;
+            u8 sampr;
+            u16 baud;
+            u32 actual = sercom_uart_clock_calc(rate, &clk, &sampr, &baud);
+            port_uart_enable(p, clk, sampr, baud);
 
+            p->reply_buf[p->reply_len++] = REPLY_DATA;
+            p->reply_buf[p->reply_len++] = actual & 0xFF;
+            p->reply_buf[p->reply_len++] = (actual >> 8) & 0xFF;
+            p->reply_buf[p->reply_len++] = (actual >> 16) & 0xFF;
+            p->reply_buf[p->reply_len++] = actual >> 24;
             return EXEC_DONE;
+        }
 
         case CMD_DISABLE_UART:
-            p->mode = MODE_NONE;
-            sercom(p->port->uart_i2c)->USART.INTENCLR.reg = SERCOM_USART_INTFLAG_RXC;
+            dma_abort(p->dma_rx);
             tcc_delay_disable(p->tcc_channel);
+            if (p->mode == MODE_UART) {
+                sercom_reset(p->port->uart_i2c);
+                sercom_clock_disable(p->port->uart_i2c);
+            }
+            p->mode = MODE_NONE;
             pin_gpio(p->port->tx);
             pin_gpio(p->port->rx);
             return EXEC_DONE;
@@ -567,10 +1784,9 @@ ExecStatus port_continue_cmd(PortData *p) {
                 p->reply_len += size;
                 p->arg[0] -= size;
             } else if (p->mode == MODE_I2C) {
-                p->reply_buf[p->reply_len] = sercom(p->port->uart_i2c)->I2CM.DATA.reg;
+                // In smart mode, reading DATA acknowledges the byte and starts the next read
                 sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.ACKACT = 0;
-                while(sercom(p->port->uart_i2c)->I2CM.SYNCBUSY.bit.SYSOP) {}
-                sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.CMD = 2;
+                p->reply_buf[p->reply_len] = sercom(p->port->uart_i2c)->I2CM.DATA.reg;
                 p->reply_len += 1;
                 p->arg[0] -= 1;
                 sercom(p->port->uart_i2c)->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_SB;
@@ -586,53 +1802,137 @@ ExecStatus port_continue_cmd(PortData *p) {
                 p->arg[0] -= size;
             }
             return EXEC_ASYNC;
+        case CMD_MACRO_STORE: {
+            u32 size = port_tx_len(p);
+            u8* len = &p->macro_len[p->arg[1]];
+            memcpy(&p->macros[p->arg[1]][*len], &p->cmd_buf[p->cmd_pos], size);
+            *len += size;
+            p->cmd_pos += size;
+            p->arg[0] -= size;
+            if (p->arg[0] > 0) {
+                return EXEC_CONTINUE;
+            }
+
+            if (!port_macro_valid(p->macros[p->arg[1]], *len)) {
+                *len = 0;
+                port_error(p);
+            }
+            return EXEC_DONE;
+        }
+        case CMD_WAVE_DATA: {
+            u32 size = port_tx_len(p);
+            if (wave.port == p) {
+                wave_write(&p->cmd_buf[p->cmd_pos], size);
+            }
+            p->cmd_pos += size;
+            p->arg[0] -= size;
+            return p->arg[0] == 0 ? EXEC_DONE : EXEC_CONTINUE;
+        }
+        case CMD_I2C_TRANSFER:
+            if (p->arg[3] == I2C_XFER_NACK) {
+                // Skip the rest of the payload as it arrives, then report the failure in place of
+                // the data or ACK
+                u32 size = p->arg[1];
+                if (p->cmd_len - p->cmd_pos < size) {
+                    size = p->cmd_len - p->cmd_pos;
+                }
+                p->cmd_pos += size;
+                p->arg[1] -= size;
+                if (p->arg[1] > 0) {
+                    return EXEC_CONTINUE;
+                }
+                port_send_status(p, REPLY_NACK);
+                return EXEC_DONE;
+            } else if (p->arg[1] > 0) {
+                // Send as much of the payload as is available. The DMA is triggered by MB,
+                // so it is started before the address is sent.
+                u32 size = p->arg[1];
+                if (p->cmd_len - p->cmd_pos < size) {
+                    size = p->cmd_len - p->cmd_pos;
+                }
+                dma_sercom_i2c_start_tx(p->dma_tx, p->port->uart_i2c, &p->cmd_buf[p->cmd_pos], size);
+                if (p->arg[3] == I2C_XFER_ADDR) {
+                    while(sercom(p->port->uart_i2c)->I2CM.SYNCBUSY.bit.SYSOP) {}
+                    sercom(p->port->uart_i2c)->I2CM.ADDR.reg = p->arg[0] << 1;
+                    p->arg[3] = I2C_XFER_WRITE;
+                }
+                p->cmd_pos += size;
+                p->arg[1] -= size;
+                return EXEC_ASYNC;
+            } else if (p->arg[2] > 0) {
+                // (Repeated) start and read the whole reply. With LENEN, the last byte is
+                // NACKed and followed by a STOP without CPU involvement. MB is only set if the
+                // address is not acknowledged.
+                port_send_status(p, REPLY_DATA);
+                dma_sercom_i2c_start_rx(p->dma_rx, p->port->uart_i2c, &p->reply_buf[p->reply_len], p->arg[2]);
+                // An earlier STOP leaves ACKACT set, which would NACK the first byte
+                sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.ACKACT = 0;
+                while(sercom(p->port->uart_i2c)->I2CM.SYNCBUSY.bit.SYSOP) {}
+                sercom(p->port->uart_i2c)->I2CM.ADDR.reg = (p->arg[0] << 1 | 1)
+                    | SERCOM_I2CM_ADDR_LENEN
+                    | SERCOM_I2CM_ADDR_LEN(p->arg[2]);
+                sercom(p->port->uart_i2c)->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_MB;
+                p->arg[3] = I2C_XFER_READ;
+                p->arg[4] = p->arg[2];
+                p->reply_len += p->arg[2];
+                p->arg[2] = 0;
+                return EXEC_ASYNC;
+            } else if (p->arg[3] == I2C_XFER_ADDR) {
+                // Address probe, MB is set once the address has been acknowledged or not
+                while(sercom(p->port->uart_i2c)->I2CM.SYNCBUSY.bit.SYSOP) {}
+                sercom(p->port->uart_i2c)->I2CM.ADDR.reg = p->arg[0] << 1;
+                sercom(p->port->uart_i2c)->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_MB;
+                p->arg[3] = I2C_XFER_WRITE;
+                return EXEC_ASYNC;
+            } else if (p->arg[3] == I2C_XFER_WRITE) {
+                // Write-only transfer, the last byte has been sent and acknowledged
+                sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.ACKACT = 1;
+                sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.CMD = 3;
+                port_send_status(p, REPLY_ACK);
+            }
+            return EXEC_DONE;
     }
     return EXEC_DONE;
 }
 
 // Returns true if the TX buffer is in use in the PORT_EXEC_ASYNC state of the current command
 bool port_tx_locked(PortData* p) {
-    switch (p->cmd) {
-        case CMD_RX:
-            return false;
-        default:
-            return true;
+    if (p->cmd == CMD_I2C_TRANSFER) {
+        return p->arg[1] > 0 || (p->state == PORT_EXEC_ASYNC && p->arg[3] == I2C_XFER_WRITE);
     }
+    return !(port_cmds[p->cmd].flags & CMD_NO_TX_LOCK);
 }
 
 // Returns true if the RX buffer is in use in the PORT_EXEC_ASYNC state of the current command
 bool port_rx_locked(PortData *p) {
-    switch (p->cmd) {
-        case CMD_TX:
-            return false;
-        default:
-            return true;
+    if (p->cmd == CMD_I2C_TRANSFER) {
+        return p->arg[3] == I2C_XFER_READ;
     }
+    return !(port_cmds[p->cmd].flags & CMD_NO_RX_LOCK);
 }
 
-/// Enable interrupts for async events
+/// EIC lines of the port that are edge captured. These stay enabled in every port state, as
+/// edges are buffered and only copied to the reply buffer by port_step.
+static inline u16 port_capture_extints(PortData *p) {
+    return (edge_capture.port == p) ? edge_capture.extints : 0;
+}
+
+/// Enable interrupts for async events. UART data is received by DMA at any time. While async
+/// events are allowed it goes straight into the reply buffer, otherwise it is copied there later.
 void port_enable_async_events(PortData *p) {
     EIC->INTENSET.reg = p->port->pin_interrupts;
-
-    // enable uart data getting copied
-    if (p->mode == MODE_UART) {
-        tcc(p->tcc_channel)->INTENSET.reg = TCC_INTENSET_OVF;
-    }
 }
 
 /// Disable interrupts for async events
 void port_disable_async_events(PortData *p) {
-    EIC->INTENCLR.reg = p->port->pin_interrupts;
-
-    // disable uart data getting copied
-    if (p->mode == MODE_UART) {
-        tcc(p->tcc_channel)->INTENCLR.reg = TCC_INTENCLR_OVF;
-    }
+    EIC->INTENCLR.reg = p->port->pin_interrupts & ~port_capture_extints(p);
 }
 
 /// Return true if the port is in a state where it can handle asyncronous events
 inline bool port_async_events_allowed(PortData* p) {
-    if (!p->pending_in) {
+    // The reply buffer being filled is never owned by the bridge, but async events need
+    // enough room in it for a full UART flush.
+    if (BRIDGE_BUF_SIZE - p->reply_len >= PORT_ASYNC_RESERVE) {
         if (p->state == PORT_READ_CMD) return true;
 
         // TX doesn't touch reply_buf, so it is safe to process async events while it is sending.
@@ -642,6 +1942,24 @@ inline bool port_async_events_allowed(PortData* p) {
     return false;
 }
 
+/// Return true if the cmd_buf and reply_buf have what the current state needs to make progress
+bool port_can_step(PortData* p) {
+    bool cmd_available = p->cmd_pos < p->cmd_len;
+    u32 reply_remaining = BRIDGE_BUF_SIZE - p->reply_len;
+
+    switch (p->state) {
+        case PORT_READ_CMD:
+            return cmd_available && reply_remaining >= PORT_REPLY_RESERVE;
+        case PORT_READ_ARG:
+            return cmd_available;
+        case PORT_EXEC:
+            // Payload commands consume cmd_buf and/or produce into reply_buf
+            return (cmd_available || !port_tx_locked(p)) && reply_remaining >= port_exec_reply_len(p);
+        default:
+            return false;
+    }
+}
+
 /// Step the state machine. This is the main dispatch function of the port control logic.
 /// This gets called after an event occurs to decide what happens next.
 void port_step(PortData* p) {
@@ -652,24 +1970,70 @@ void port_step(PortData* p) {
 
     port_disable_async_events(p);
 
+    // Nothing else may write to the reply buffer while UART data is received into it
+    if (p->mode == MODE_UART && p->uart_buf.direct != NULL) {
+        uart_rx_swap(p);
+    }
+
     while (1) {
-        // If the command buffer has been processed, request a new one
-        if (p->cmd_pos >= p->cmd_len && !p->pending_out && !(p->state == PORT_EXEC_ASYNC && port_tx_locked(p))) {
-            p->pending_out = true;
-            port_bridge_start_out(p, p->cmd_buf);
+        if (p->state == PORT_READ_CMD && p->cmd_pos >= p->cmd_len) {
+            if (p->macro != PORT_NO_MACRO) {
+                port_macro_next(p);
+            } else if (p->trigger_pending && p->macro_len[p->trigger_macro] > 0
+                       && BRIDGE_BUF_SIZE - p->reply_len >= 2) {
+                // Triggered runs go between the host's command buffers, with their replies
+                // marked so the host can tell them from those of its own commands
+                p->trigger_pending = false;
+                p->reply_buf[p->reply_len++] = REPLY_ASYNC_MACRO_RUN;
+                p->reply_buf[p->reply_len++] = p->trigger_macro;
+                port_macro_enter(p, p->trigger_macro, 1);
+            }
+        }
+        // If the command buffer has been processed, return it to the ring
+        if (p->macro == PORT_NO_MACRO && p->cmd_ring_count > 0 && p->cmd_pos >= p->cmd_len
+           && !(p->state == PORT_EXEC_ASYNC && port_tx_locked(p))) {
+            port_cmd_ring_release(p);
+        }
+        // Queue every free command buffer on the bridge to receive new packets
+        while (p->cmd_ring_count + p->pending_out < PORT_NUM_CMD_BUFS) {
+            port_bridge_start_out(p, p->cmd_bufs[port_cmd_ring_next_out(p)]);
+            p->pending_out += 1;
         }
-        // If the reply buffer is full, flush it.
+
+        // If the reply buffer is full, queue it and switch to the next one.
         // Or, if there is any data and no commands, might as well flush.
-        if ((p->reply_len >= BRIDGE_BUF_SIZE || (p->pending_out && p->reply_len > 0))
-           && !p->pending_in && !(p->state == PORT_EXEC_ASYNC && port_rx_locked(p))) {
-            p->pending_in = true;
-            port_bridge_start_in(p, p->reply_buf, p->reply_len);
+        if ((p->reply_len > BRIDGE_BUF_SIZE - PORT_REPLY_RESERVE || (p->cmd_pos >= p->cmd_len && p->reply_len > 0)
+             || (p->state == PORT_EXEC && BRIDGE_BUF_SIZE - p->reply_len < port_exec_reply_len(p)))
+           && p->reply_ring_count < PORT_NUM_REPLY_BUFS - 1
+           && !(p->state == PORT_EXEC_ASYNC && port_rx_locked(p))) {
+            port_reply_ring_queue(p);
+        }
+        // Hand queued reply buffers to the bridge, oldest first
+        while (p->pending_in < p->reply_ring_count) {
+            u8 pos = (p->reply_ring_pos + p->pending_in) % PORT_NUM_REPLY_BUFS;
+            port_bridge_start_in(p, p->reply_bufs[pos], p->reply_bufs_len[pos]);
+            p->pending_in += 1;
         }
 
-        // Wait for bridge transfers to complete;
-        // TODO: multiple-buffer FIFO
-        if (p->pending_in || p->pending_out) {
+        // Wait for bridge transfers to complete if the current buffers are exhausted
+        if (!port_can_step(p)) {
             if (port_async_events_allowed(p)) {
+                // Received UART data goes out with the next reply
+                if (p->mode == MODE_UART && uart_rx_copy(p)) {
+                    continue;
+                }
+                if (adc_stream.port == p && adc_stream_copy(p)) {
+                    continue;
+                }
+                if (wave.port == p && wave_notify(p)) {
+                    continue;
+                }
+                if (edge_capture.port == p && edge_capture_copy(p)) {
+                    continue;
+                }
+                if (p->mode == MODE_UART && uart_rx_direct(p)) {
+                    continue;
+                }
                 // If we're waiting for further commands, also
                 // wait for async events.
                 port_enable_async_events(p);
@@ -678,15 +2042,25 @@ void port_step(PortData* p) {
         };
 
         if (p->state == PORT_READ_CMD) {
+            // Simple pin commands, like a chip select around a transfer, run straight from the
+            // buffer. Then go round again, as that may have used up the buffer.
+            if (port_pin_cmd_run(p)) {
+                continue;
+            }
+
             // Read a command byte and look up how many argument bytes it needs
             p->cmd = p->cmd_buf[p->cmd_pos++];
-            p->arg_len = port_cmd_args(p->cmd);
+            u8 arg_len = port_cmd_args(p->cmd);
 
-            if (p->arg_len > 0) {
+            if (p->cmd_len - p->cmd_pos >= arg_len) {
+                // All of the arguments are in the buffer, so don't parse them one at a time
+                memcpy(p->arg, &p->cmd_buf[p->cmd_pos], arg_len);
+                p->cmd_pos += arg_len;
+                p->state = port_begin_cmd(p);
+            } else {
+                p->arg_len = arg_len;
                 p->arg_pos = 0;
                 p->state = PORT_READ_ARG;
-            } else {
-                p->state = port_begin_cmd(p);
             }
         } else if (p->state == PORT_READ_ARG) {
             // Read an argument byte
@@ -706,23 +2080,43 @@ void port_step(PortData* p) {
             break;
         }
     }
+
+    trace(TRACE_PORT_STATE, p->chan, p->state);
+
+    // Commands in progress and received UART data, ADC samples and waveforms may be moving by DMA
+    power_set(POWER_PORT(p->chan), p->state == PORT_EXEC_ASYNC || p->mode == MODE_UART
+        || adc_stream.port == p || wave.port == p);
 }
 
-void port_bridge_out_completion(PortData* p, u8 len) {
-    p->pending_out = false;
-    p->cmd_len = len;
-    p->cmd_pos = 0;
+void port_bridge_out_completion(PortData* p, u16 len) {
+    p->pending_out -= 1;
+    p->cmd_bufs_len[port_cmd_ring_free(p)] = len;
+    p->cmd_ring_count += 1;
+    if (p->cmd_ring_count == 1) {
+        // The ring was empty, so this is now the buffer to parse
+        port_cmd_ring_load(p);
+    }
     port_step(p);
 }
 
 void port_bridge_in_completion(PortData* p) {
-    p->pending_in = false;
-    p->reply_len = 0;
+    p->pending_in -= 1;
+    p->reply_ring_pos = (p->reply_ring_pos + 1) % PORT_NUM_REPLY_BUFS;
+    p->reply_ring_count -= 1;
     port_step(p);
 }
 
 void port_dma_rx_completion(PortData* p) {
-    if (p->state == PORT_EXEC_ASYNC) {
+    if (p->mode == MODE_UART) {
+        // An RX buffer filled up before the line went idle
+        uart_rx_swap(p);
+        port_step(p);
+    } else if (p->state == PORT_EXEC_ASYNC && p->cmd == CMD_I2C_TRANSFER) {
+        // The hardware sends the STOP after the last byte
+        sercom(p->port->uart_i2c)->I2CM.INTENCLR.reg = SERCOM_I2CM_INTENCLR_MB;
+        p->state = EXEC_DONE;
+        port_step(p);
+    } else if (p->state == PORT_EXEC_ASYNC) {
         p->state = (p->arg[0] == 0 ? EXEC_DONE : EXEC_CONTINUE);
         port_step(p);
     } else {
@@ -732,7 +2126,15 @@ void port_dma_rx_completion(PortData* p) {
 }
 
 void port_dma_tx_completion(PortData* p) {
-    if (p->state == PORT_EXEC_ASYNC) {
+    if (p->state == PORT_EXEC_ASYNC && p->cmd == CMD_I2C_TRANSFER) {
+        if (p->arg[1] == 0) {
+            // The last byte is in DATA; continue once it has been sent
+            sercom(p->port->uart_i2c)->I2CM.INTENSET.reg = SERCOM_I2CM_INTENSET_MB;
+        } else {
+            p->state = EXEC_CONTINUE;
+            port_step(p);
+        }
+    } else if (p->state == PORT_EXEC_ASYNC) {
         p->state = (p->arg[0] == 0 ? EXEC_DONE : EXEC_CONTINUE);
         port_step(p);
     } else {
@@ -741,40 +2143,59 @@ void port_dma_tx_completion(PortData* p) {
     }
 }
 
-void port_handle_sercom_uart_i2c(PortData* p) {
-    if (p->mode == MODE_UART) {
-        if (sercom(p->port->uart_i2c)->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_RXC) {
-            sercom(p->port->uart_i2c)->USART.INTFLAG.reg = SERCOM_USART_INTFLAG_RXC;
-
-            // reset timeout
-            tcc_delay_start(p->tcc_channel, 200*10);
-
-            // Read data and push into buffer
-            p->uart_buf.rx[p->uart_buf.head] = sercom(p->port->uart_i2c)->USART.DATA.reg;
-            p->uart_buf.head = (p->uart_buf.head + 1) % UART_RX_SIZE;
+/// End a CMD_I2C_TRANSFER that was not acknowledged or lost the bus. The port carries on, and the
+/// host gets REPLY_NACK in place of the data or ACK once the rest of the payload is skipped.
+static void port_i2c_transfer_nack(PortData* p) {
+    // A completion not yet seen by DMAC_Handler would find the transfer already over
+    __disable_irq();
+    dma_stop(p->dma_tx);
+    dma_stop(p->dma_rx);
+    __enable_irq();
+
+    if (sercom(p->port->uart_i2c)->I2CM.STATUS.reg
+        & (SERCOM_I2CM_STATUS_BUSERR | SERCOM_I2CM_STATUS_ARBLOST)) {
+        // Another master has the bus, so force the bus state back to idle instead of sending a STOP
+        sercom(p->port->uart_i2c)->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSERR
+            | SERCOM_I2CM_STATUS_ARBLOST | SERCOM_I2CM_STATUS_LENERR;
+        while(sercom(p->port->uart_i2c)->I2CM.SYNCBUSY.bit.SYSOP) {}
+        sercom(p->port->uart_i2c)->I2CM.STATUS.reg = SERCOM_I2CM_STATUS_BUSSTATE(1);
+    } else {
+        sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.ACKACT = 1;
+        sercom(p->port->uart_i2c)->I2CM.CTRLB.bit.CMD = 3;
+    }
+    sercom(p->port->uart_i2c)->I2CM.INTFLAG.reg = SERCOM_I2CM_INTFLAG_ERROR;
 
-            if (p->uart_buf.buf_len < UART_RX_SIZE) {
-                p->uart_buf.buf_len++;
-            } else {
-                // Buffer full. Drop the oldest byte.
-                p->uart_buf.tail = (p->uart_buf.tail + 1) % UART_RX_SIZE;
-            }
+    if (p->arg[3] == I2C_XFER_READ) {
+        // Give back the room reserved for the data
+        p->reply_len -= 1 + p->arg[4];
+    }
+    p->arg[3] = I2C_XFER_NACK;
+    stats.i2c_nacks[p->chan - 1]++;
+}
 
-            // If the buffer is almost full and we're in a safe state, flush it immediately
-            if (p->uart_buf.buf_len > (UART_RX_SIZE - 4) && port_async_events_allowed(p)) {
-                uart_send_data(p);
-            }
-        }
+void port_handle_sercom_uart_i2c(PortData* p) {
+    if (p->mode == MODE_UART) {
+        // Received data is handled by DMA, no SERCOM interrupts are enabled
+        sercom(p->port->uart_i2c)->USART.INTFLAG.reg = SERCOM_USART_INTFLAG_RXC;
     } else if (p->mode == MODE_I2C) {
-        // interrupt on i2c flag
-        if (sercom(p->port->uart_i2c)->I2CM.INTFLAG.bit.ERROR) {
-            // TODO: signal errors in a less-destructive way e.g. for bus scanning
+        if (p->state == PORT_EXEC_ASYNC && p->cmd == CMD_I2C_TRANSFER) {
+            // MB during a read means the address was not acknowledged
+            if (sercom(p->port->uart_i2c)->I2CM.INTFLAG.bit.ERROR
+                || sercom(p->port->uart_i2c)->I2CM.STATUS.bit.RXNACK
+                || p->arg[3] == I2C_XFER_READ) {
+                port_i2c_transfer_nack(p);
+            }
+        } else if (sercom(p->port->uart_i2c)->I2CM.INTFLAG.bit.ERROR) {
+            // The separate START, TX, RX and STOP commands have no reply to carry the error
             port_error(p);
         }
 
         sercom(p->port->uart_i2c)->I2CM.INTFLAG.reg = SERCOM_I2CM_INTFLAG_SB | SERCOM_I2CM_INTFLAG_MB;
         sercom(p->port->uart_i2c)->I2CM.INTENCLR.reg = SERCOM_I2CM_INTFLAG_SB | SERCOM_I2CM_INTFLAG_MB;
-        if (p->state == PORT_EXEC_ASYNC) {
+        if (p->state == PORT_EXEC_ASYNC && p->cmd == CMD_I2C_TRANSFER) {
+            p->state = EXEC_CONTINUE;
+            port_step(p);
+        } else if (p->state == PORT_EXEC_ASYNC) {
             p->state = (p->arg[0] == 0 ? EXEC_DONE : EXEC_CONTINUE);
             port_step(p);
         } else {
@@ -788,12 +2209,35 @@ void port_handle_sercom_uart_i2c(PortData* p) {
 }
 
 void port_handle_extint(PortData *p, u32 flags) {
+    u16 captured = flags & port_capture_extints(p);
+    if (captured) {
+        edge_capture_record(captured);
+        EIC->INTFLAG.reg = captured;
+
+        flags &= ~captured;
+        if (!(flags & p->port->pin_interrupts)) {
+            if (p->state != PORT_DISABLE) {
+                port_step(p);
+            }
+            return;
+        }
+    }
+
     if (p->state == PORT_READ_CMD) {
         // Async event
+        if (p->mode == MODE_UART && p->uart_buf.direct != NULL) {
+            uart_rx_swap(p);
+        }
         for (int pin = 0; pin<8; pin++) {
             if (port_pin_supports_interrupt(p, pin)) {
                 Pin sys_pin = p->port->gpio[pin];
-                if (flags & (1 << pin_extint(sys_pin))) {
+                if ((flags & (1 << pin_extint(sys_pin))) && pin == p->trigger_pin) {
+                    // Runs the triggered sequence instead of notifying the host
+                    p->trigger_pending = true;
+                    if (eic_read_config(sys_pin) & EIC_CONFIG_SENSE_LEVEL) {
+                        eic_config(sys_pin, EIC_CONFIG_SENSE_NONE);
+                    }
+                } else if (flags & (1 << pin_extint(sys_pin))) {
                     u8 response = REPLY_ASYNC_PIN_CHANGE_N + pin;
 
                     // If the pin's state is high, set bit 3
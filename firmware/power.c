@@ -0,0 +1,32 @@
+#include "firmware.h"
+
+// # Sleep between events
+// All of the firmware runs in interrupt handlers, and the CPU sleeps on exit from each one. While
+// nothing is running, it sleeps in IDLE2, which also stops the AHB and APB clocks. The generic
+// clocks keep running, so every peripheral and wake source works as before, and only the bus
+// clocks have to restart on wake, which is well within the time the SoC waits after a SYNC edge.
+//
+// DMA transfers and the USB need the AHB clock, so while any of them may be running the firmware
+// holds a reason bit with power_set, and the CPU only sleeps in IDLE0.
+//
+// STANDBY would also stop the generic clocks. That isn't used, as the bridge SYNC edge reaches
+// the firmware through a resynchronized EVSYS channel, and it would be lost with GCLK_EVSYS stopped.
+
+/// Bitmap of POWER_* reasons that need the bus clocks
+u32 power_busy;
+
+void power_init() {
+    power_busy = 0;
+    PM->SLEEP.reg = PM_SLEEP_IDLE_APB;
+}
+
+/// Set or clear one of the POWER_* reasons the bus clocks have to keep running in sleep.
+void power_set(u32 reason, bool busy) {
+    __disable_irq();
+    u32 was_busy = power_busy;
+    power_busy = busy ? (power_busy | reason) : (power_busy & ~reason);
+    if ((was_busy == 0) != (power_busy == 0)) {
+        PM->SLEEP.reg = (power_busy != 0) ? PM_SLEEP_IDLE_CPU : PM_SLEEP_IDLE_APB;
+    }
+    __enable_irq();
+}
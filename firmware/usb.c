@@ -154,7 +154,7 @@ __attribute__((__aligned__(4))) const ConfigDesc configuration_descriptor = {
 		.bLength = sizeof(CDC_FunctionalACMDescriptor),
 		.bDescriptorType = USB_DTYPE_CSInterface,
 		.bDescriptorSubtype = CDC_SUBTYPE_ACM,
-		.bmCapabilities = 0x00,
+		.bmCapabilities = 0x02, // line coding and control line state requests
 	},
 	.CDC_functional_union = {
 		.bLength = sizeof(CDC_FunctionalUnionDescriptor),
@@ -215,7 +215,8 @@ __attribute__((__aligned__(4))) const USB_StringDescriptor msft_os = {
 	.bString = u"MSFT100" MSFT_ID_STR
 };
 
-__attribute__((__aligned__(4))) uint8_t ep0_buffer[146];
+// Holds the Microsoft descriptors and the stats block
+__attribute__((__aligned__(4))) uint8_t ep0_buffer[sizeof(Stats) > 146 ? sizeof(Stats) : 146];
 
 // TODO: this doesn't need to be in RAM if it is copied into usb_ep0_out one packet at a time
 const USB_MicrosoftCompatibleDescriptor msft_compatible = {
@@ -316,6 +317,8 @@ uint16_t usb_cb_get_descriptor(uint8_t type, uint8_t index, const uint8_t** ptr)
 }
 
 void usb_cb_reset(void) {
+	// The USB stack has no suspend callback, so the bus clocks stay up once a host is seen
+	power_set(POWER_USB, true);
 }
 
 bool usb_cb_set_configuration(uint8_t config) {
@@ -333,6 +336,8 @@ bool usb_cb_set_configuration(uint8_t config) {
 #define REQ_PWR_PORT_B 0x11
 #define REQ_PWR_LED 0x20
 #define REQ_INFO 0x30
+#define REQ_STATS 0x31
+#define REQ_TRACE 0x32
 #define REQ_PWR_PORT_A_IO 0x40
 #define REQ_PWR_PORT_B_IO 0x50
 #define REQ_INFO_GIT_HASH 0x0
@@ -400,6 +405,37 @@ void req_info(uint16_t wIndex) {
     return usb_ep0_in(len);
 }
 
+/// Read the Stats block, clearing it afterwards if wValue is 1
+void req_stats(uint16_t wValue) {
+    uint16_t len = sizeof(Stats);
+    if (len > usb_setup.wLength) len = usb_setup.wLength;
+    __disable_irq();
+    memcpy(ep0_buffer, &stats, len);
+    if (wValue == 1) {
+        memset(&stats, 0, sizeof(stats));
+    }
+    __enable_irq();
+    usb_ep_start_in(0x80, ep0_buffer, len, true);
+    usb_ep0_out();
+}
+
+#ifdef TRACE
+/// Read the trace, freezing it until it is restarted with wValue 1. It is sent from where it is
+/// recorded, as it doesn't fit ep0_buffer.
+void req_trace(uint16_t wValue) {
+    if (wValue == 1) {
+        trace_restart();
+        usb_ep0_out();
+        return usb_ep0_in(0);
+    }
+    trace_freeze();
+    uint16_t len = sizeof(Trace);
+    if (len > usb_setup.wLength) len = usb_setup.wLength;
+    usb_ep_start_in(0x80, (u8*) &trace_log, len, true);
+    usb_ep0_out();
+}
+#endif
+
 void req_boot() {
     wdt_reset(GCLK_32K);
     usb_ep0_out();
@@ -439,10 +475,18 @@ void usb_cb_control_setup(void) {
 			case MSFT_ID: return handle_msft_compatible(&msft_compatible, &msft_extended);
 			case REQ_PWR: return req_gpio(usb_setup.wIndex, usb_setup.wValue);
 			case REQ_INFO: return req_info(usb_setup.wIndex);
+			case REQ_STATS: return req_stats(usb_setup.wValue);
+#ifdef TRACE
+			case REQ_TRACE: return req_trace(usb_setup.wValue);
+#endif
 			case REQ_BOOT: return req_boot();
 			case REQ_OPENWRT_BOOT_STATUS: return req_boot_status();
 		}
 	} else if (recipient == USB_RECIPIENT_INTERFACE) {
+		if ((usb_setup.bmRequestType & USB_REQTYPE_TYPE_MASK) == USB_REQTYPE_CLASS
+			&& usb_setup.wIndex == INTERFACE_CDC_CONTROL) {
+			return usbserial_control_setup();
+		}
 		switch(usb_setup.bRequest) {
 			case MSFT_ID: return handle_msft_compatible(&msft_compatible, &msft_extended);
 		}
@@ -454,6 +498,10 @@ void usb_cb_control_in_completion(void) {
 }
 
 void usb_cb_control_out_completion(void) {
+	uint8_t recipient = usb_setup.bmRequestType & USB_REQTYPE_RECIPIENT_MASK;
+	if (recipient == USB_RECIPIENT_INTERFACE && usb_setup.wIndex == INTERFACE_CDC_CONTROL) {
+		usbserial_control_out_completion();
+	}
 }
 
 void usb_cb_completion(void) {
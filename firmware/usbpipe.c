@@ -1,22 +1,28 @@
 #include "firmware.h"
-#define OUT_RING_SIZE 10
+#define OUT_RING_SIZE 16 // Enough packets for a full bridge frame
 #define PACKET_SIZE 64
+// Packets are contiguous, so consecutive ones are sent to the bridge as a single frame
 USB_ALIGN u8 out_ring_buf[OUT_RING_SIZE][PACKET_SIZE];
 volatile u8 out_ring_count = 0; // Number of packets in the ring buffer
 volatile u8 out_ring_write_pos = 0; // Packet index in which we're currently receiving a packet, or will once it's free
 volatile u8 out_ring_read_pos = 0; // Packet index from which we're currently sending a packet, or will once it's filled.
 volatile u8 out_ring_short_packet = 0; // If nonzero, the ring ends with a short packet of this size
 volatile bool out_usb_pending = false;
-volatile bool out_bridge_pending = false;
+volatile u8 out_bridge_pending = 0; // Number of frames queued on the bridge
+volatile u8 out_bridge_queued = 0; // Number of packets in those frames, starting at out_ring_read_pos
+u8 out_bridge_packets[BRIDGE_QUEUE_DEPTH]; // Number of packets in each queued frame, oldest first
 
-typedef enum {
-    PIPE_DISABLE,
-    PIPE_WAIT_FOR_USB,
-    PIPE_WAIT_FOR_BRIDGE,
-} PipeState;
+// Frames from the SoC are received into a ring, so that the next ones can come in over the bridge
+// while one is sent on USB. Each is sent as a single multi-packet IN transfer.
+#define IN_RING_SIZE 3
+USB_ALIGN u8 in_ring_buf[IN_RING_SIZE][BRIDGE_BUF_SIZE];
+u16 in_ring_len[IN_RING_SIZE]; // Length of the frame received into each buffer
+volatile u8 in_ring_count = 0; // Number of received frames, including the one being sent on USB
+volatile u8 in_ring_read_pos = 0; // Frame index we're currently sending on USB, or will once it's filled
+volatile bool in_usb_pending = false;
+volatile u8 in_bridge_pending = 0; // Number of free buffers queued on the bridge, following the received frames
 
-PipeState pipe_state_soc_to_pc;
-USB_ALIGN u8 pipe_buffer_soc_to_pc[BRIDGE_BUF_SIZE];
+void in_ring_step();
 
 void usbpipe_init() {
     usb_enable_ep(USB_EP_PIPE_OUT, USB_EP_TYPE_BULK, 64);
@@ -24,10 +30,14 @@ void usbpipe_init() {
 
     usb_ep_start_out(USB_EP_PIPE_OUT, out_ring_buf[out_ring_write_pos], PACKET_SIZE);
     out_usb_pending = true;
-    out_bridge_pending = false;
+    out_bridge_pending = 0;
+    out_bridge_queued = 0;
 
-    bridge_start_out(BRIDGE_USB, pipe_buffer_soc_to_pc);
-    pipe_state_soc_to_pc = PIPE_WAIT_FOR_BRIDGE;
+    in_ring_count = 0;
+    in_ring_read_pos = 0;
+    in_usb_pending = false;
+    in_bridge_pending = 0;
+    in_ring_step();
 
     bridge_enable_chan(BRIDGE_USB); // Tells SPI Daemon to start connection to USB Daemon
 }
@@ -39,10 +49,29 @@ void usbpipe_disable() {
     out_ring_write_pos = 0;
     out_ring_read_pos = 0;
     out_ring_short_packet = 0;
-    pipe_state_soc_to_pc = PIPE_DISABLE;
+    in_ring_count = 0;
+    in_ring_read_pos = 0;
+    in_usb_pending = false;
+    in_bridge_pending = 0;
     bridge_disable_chan(BRIDGE_USB); // Tells SPI Daemon to close connection to USB Daemon
 }
 
+void in_ring_step() {
+    // While the bridge can queue another buffer and there are free buffers that aren't queued yet
+    while (in_bridge_pending < BRIDGE_QUEUE_DEPTH && in_ring_count + in_bridge_pending < IN_RING_SIZE) {
+        // The next buffer to queue follows the received frames and the buffers already queued
+        u8 pos = (in_ring_read_pos + in_ring_count + in_bridge_pending) % IN_RING_SIZE;
+        bridge_start_out(BRIDGE_USB, in_ring_buf[pos]);
+        in_bridge_pending += 1;
+    }
+
+    // If we are not currently sending and there is a received frame, send it to the PC
+    if (!in_usb_pending && in_ring_count > 0) {
+        usb_ep_start_in(USB_EP_PIPE_IN, in_ring_buf[in_ring_read_pos], in_ring_len[in_ring_read_pos], false);
+        in_usb_pending = true;
+    }
+}
+
 void out_ring_step() {
     // If we are not currently receiving
     // And there is an empty buffer to receive data into
@@ -54,21 +83,33 @@ void out_ring_step() {
         out_usb_pending = true;
     }
 
-    // If we are not waiting on a bridge transaction to complete and we have packets to send
-    if (!out_bridge_pending && out_ring_count > 0) {
-        // The size of the packet is 64 bytes (unless the below case is true)
-        u8 len = PACKET_SIZE;
-        // If we only have one outgoing packet and it is a short packet
-        if (out_ring_count == 1 && out_ring_short_packet != 0) {
-             // The length is actually a subset of a full packet
-             len = out_ring_short_packet;
-             // Reset the short packet var
-             out_ring_short_packet = 0;
+    // While the bridge can queue another frame and we have packets that aren't queued yet
+    while (out_bridge_pending < BRIDGE_QUEUE_DEPTH && out_ring_count > out_bridge_queued) {
+        // The next frame starts at the packet following the ones already queued
+        u8 pos = (out_ring_read_pos + out_bridge_queued) % OUT_RING_SIZE;
+        u8 packets = 0;
+        u16 len = 0;
+        // Join the packets waiting in the ring, up to the end of the buffer or the frame limit.
+        // A short packet is always the last in the ring, so it ends the frame.
+        while (out_bridge_queued + packets < out_ring_count && pos + packets < OUT_RING_SIZE
+               && len + PACKET_SIZE <= BRIDGE_BUF_SIZE) {
+            packets += 1;
+            // If this is the last packet and it is a short packet
+            if (out_bridge_queued + packets == out_ring_count && out_ring_short_packet != 0) {
+                // The length is actually a subset of a full packet
+                len += out_ring_short_packet;
+                // Reset the short packet var
+                out_ring_short_packet = 0;
+            } else {
+                len += PACKET_SIZE;
+            }
         }
         // Start sending data to the spi daemon
-        bridge_start_in(BRIDGE_USB, out_ring_buf[out_ring_read_pos], len);
+        bridge_start_in(BRIDGE_USB, out_ring_buf[pos], len);
         // We are currently waiting on the SPI
-        out_bridge_pending = true;
+        out_bridge_packets[out_bridge_pending] = packets;
+        out_bridge_pending += 1;
+        out_bridge_queued += packets;
     }
 }
 
@@ -90,32 +131,42 @@ void pipe_usb_out_completion() {
 
 // Finished sending on bridge, start receive from USB
 void pipe_bridge_in_completion() {
-    // Increment the location of where we will read from next (to send over USB)
-    out_ring_read_pos = (out_ring_read_pos + 1) % OUT_RING_SIZE;
+    // The oldest frame has been sent, and the others move up the queue
+    u8 packets = out_bridge_packets[0];
+    for (int i = 1; i < BRIDGE_QUEUE_DEPTH; i++) {
+        out_bridge_packets[i - 1] = out_bridge_packets[i];
+    }
+    // Move the location of where we will read from next past the frame's packets
+    out_ring_read_pos = (out_ring_read_pos + packets) % OUT_RING_SIZE;
     // Decrement the number of packets that need reading
-    out_ring_count -= 1;
+    out_ring_count -= packets;
     // Mark the bridge transfer as complete
-    out_bridge_pending = false;
+    out_bridge_queued -= packets;
+    out_bridge_pending -= 1;
     // Move data along
     out_ring_step();
 }
 
 // Received from bridge, send to USB
-void pipe_bridge_out_completion(u8 count) {
-    if (pipe_state_soc_to_pc == PIPE_WAIT_FOR_BRIDGE) {
-        usb_ep_start_in(USB_EP_PIPE_IN, pipe_buffer_soc_to_pc, count, false);
-        pipe_state_soc_to_pc = PIPE_WAIT_FOR_USB;
-    } else {
+void pipe_bridge_out_completion(u16 count) {
+    if (in_bridge_pending == 0) {
         invalid();
     }
+    // The bridge completes buffers in order, so this is the one after the received frames
+    u8 pos = (in_ring_read_pos + in_ring_count) % IN_RING_SIZE;
+    in_ring_len[pos] = count;
+    in_ring_count += 1;
+    in_bridge_pending -= 1;
+    in_ring_step();
 }
 
-// Finished sending on USB, start receive from bridge
+// Finished sending on USB, free the buffer to receive from bridge
 void pipe_usb_in_completion() {
-    if (pipe_state_soc_to_pc == PIPE_WAIT_FOR_USB) {
-        bridge_start_out(BRIDGE_USB, pipe_buffer_soc_to_pc);
-        pipe_state_soc_to_pc = PIPE_WAIT_FOR_BRIDGE;
-    } else {
+    if (!in_usb_pending) {
         invalid();
     }
+    in_ring_read_pos = (in_ring_read_pos + 1) % IN_RING_SIZE;
+    in_ring_count -= 1;
+    in_usb_pending = false;
+    in_ring_step();
 }
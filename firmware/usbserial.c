@@ -1,24 +1,58 @@
+#include "usb.h"
 #include "firmware.h"
 
 #define BUF_SIZE 64
 
-u8 usbserial_active_rx_buf = 0;
-u8 usbserial_sending_in = 0;
-USB_ALIGN u8 usbserial_buf_in[2][64];
-USB_ALIGN u8 usbserial_buf_out[64];
+// Packets received from the SoC console, waiting to be sent on USB IN. The DMA always has a free
+// packet to receive into, so at most RX_RING_SIZE - 1 are waiting.
+#define RX_RING_SIZE 8
+// Packets received from USB OUT, waiting to be sent to the SoC console
+#define TX_RING_SIZE 4
+
+// Packets are contiguous, so full ones up to the end of a ring go out as a single transfer
+USB_ALIGN u8 usbserial_rx_ring[RX_RING_SIZE][BUF_SIZE];
+u8 usbserial_rx_len[RX_RING_SIZE];
+u8 usbserial_rx_read; // Oldest packet waiting for USB IN
+u8 usbserial_rx_count; // Number of waiting packets, including those being sent
+u8 usbserial_rx_sending; // Number of packets in the USB IN transfer, from usbserial_rx_read
+bool usbserial_rx_flush_deferred; // The idle timeout passed while the ring was full
+
+USB_ALIGN u8 usbserial_tx_ring[TX_RING_SIZE][BUF_SIZE];
+u8 usbserial_tx_len[TX_RING_SIZE];
+u8 usbserial_tx_read; // Oldest packet waiting for the UART
+u8 usbserial_tx_count; // Number of waiting packets, including those being sent
+u8 usbserial_tx_sending; // Number of packets in the DMA transfer, from usbserial_tx_read
+bool usbserial_out_pending;
+
+// CDC ACM class requests on the control interface
+#define REQ_CDC_SET_LINE_CODING 0x20
+#define REQ_CDC_GET_LINE_CODING 0x21
+#define REQ_CDC_SET_CONTROL_LINE_STATE 0x22
+
+// CDC line coding: 32-bit little-endian baud rate, stop bits, parity and data bits. Only the rate
+// is used, the console is always 8N1. Kept across USB resets so the console doesn't revert.
+u8 usbserial_line_coding[7] = { 0x00, 0xC2, 0x01, 0x00, 0, 0, 8 }; // 115200
+
+static void usbserial_start_out();
+
+static u32 usbserial_rate() {
+    return usbserial_line_coding[0] | usbserial_line_coding[1] << 8
+        | usbserial_line_coding[2] << 16 | usbserial_line_coding[3] << 24;
+}
 
 void usbserial_init() {
     sercom_clock_enable(SERCOM_TERMINAL, GCLK_SYSTEM, 1);
     pin_mux(PIN_SERIAL_TX);
     pin_mux(PIN_SERIAL_RX);
-    sercom_uart_init(SERCOM_TERMINAL, TERMINAL_RXPO, TERMINAL_TXPO, 63019);
+    sercom_uart_init(SERCOM_TERMINAL, TERMINAL_RXPO, TERMINAL_TXPO, SERCOM_UART_SAMPR_ARITH,
+        sercom_uart_baud(usbserial_rate()));
 
     dma_sercom_configure_tx(DMA_TERMINAL_TX, SERCOM_TERMINAL);
-    DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR; // ID depends on prev call
+    dma_enable_interrupt(DMA_TERMINAL_TX);
 
     dma_sercom_configure_rx(DMA_TERMINAL_RX, SERCOM_TERMINAL);
-    DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR; // ID depends on prev call
-    DMAC->CHCTRLB.bit.EVOE = 1;
+    dma_enable_interrupt(DMA_TERMINAL_RX);
+    dma_enable_event_output(DMA_TERMINAL_RX);
 
     // Set up timer to (re)start counting when a character is received. When it times out, the
     // interrupt flushes the receive buffer.
@@ -49,40 +83,102 @@ void usbserial_init() {
         EVSYS_ID_GEN_DMAC_CH_0 + DMA_TERMINAL_RX,
         EVSYS_ID_USER_TC3_EVU + TC_TERMINAL_TIMEOUT - 3);
 
-    usbserial_active_rx_buf = 0;
-    usbserial_sending_in = false;
-    dma_sercom_start_rx(DMA_TERMINAL_RX, SERCOM_TERMINAL, usbserial_buf_in[0], BUF_SIZE);
+    usbserial_rx_read = 0;
+    usbserial_rx_count = 0;
+    usbserial_rx_flush_deferred = false;
+    usbserial_rx_sending = 0;
+    usbserial_tx_read = 0;
+    usbserial_tx_count = 0;
+    usbserial_tx_sending = 0;
+    usbserial_out_pending = false;
+    dma_sercom_start_rx(DMA_TERMINAL_RX, SERCOM_TERMINAL, usbserial_rx_ring[0], BUF_SIZE);
 
     usb_enable_ep(USB_EP_CDC_NOTIFICATION, USB_EP_TYPE_INTERRUPT, 8);
     usb_enable_ep(USB_EP_CDC_OUT, USB_EP_TYPE_BULK, 64);
     usb_enable_ep(USB_EP_CDC_IN, USB_EP_TYPE_BULK, 64);
 
-    usb_ep_start_out(USB_EP_CDC_OUT, usbserial_buf_out, BUF_SIZE);
+    usbserial_start_out();
+}
+
+/// Number of packets from `pos` that can go in one transfer: full ones up to the end of the ring,
+/// and the first short one
+static u8 usbserial_run(const u8* len, u8 pos, u8 count, u8 size, u16* total) {
+    u8 n = 0;
+    *total = 0;
+    while (n < count && pos + n < size) {
+        *total += len[pos + n];
+        n++;
+        if (len[pos + n - 1] < BUF_SIZE) {
+            break;
+        }
+    }
+    return n;
+}
+
+/// Receive the next packet from USB OUT, if there is a free one in the ring
+static void usbserial_start_out() {
+    if (!usbserial_out_pending && usbserial_tx_count < TX_RING_SIZE) {
+        u8 pos = (usbserial_tx_read + usbserial_tx_count) % TX_RING_SIZE;
+        usb_ep_start_out(USB_EP_CDC_OUT, usbserial_tx_ring[pos], BUF_SIZE);
+        usbserial_out_pending = true;
+    }
+}
+
+/// Send the waiting packets from USB OUT to the UART, if it is idle
+static void usbserial_start_tx() {
+    if (usbserial_tx_sending == 0 && usbserial_tx_count > 0) {
+        u16 len;
+        usbserial_tx_sending = usbserial_run(usbserial_tx_len, usbserial_tx_read,
+            usbserial_tx_count, TX_RING_SIZE, &len);
+        dma_sercom_start_tx(DMA_TERMINAL_TX, SERCOM_TERMINAL, usbserial_tx_ring[usbserial_tx_read], len);
+    }
 }
 
 void usbserial_out_completion() {
     u32 len = usb_ep_out_length(USB_EP_CDC_OUT);
-    dma_sercom_start_tx(DMA_TERMINAL_TX, SERCOM_TERMINAL, usbserial_buf_out, len);
+    usbserial_out_pending = false;
+    if (len > 0) {
+        usbserial_tx_len[(usbserial_tx_read + usbserial_tx_count) % TX_RING_SIZE] = len;
+        usbserial_tx_count++;
+        usbserial_start_tx();
+    }
+    usbserial_start_out();
 }
 
 void usbserial_dma_tx_completion() {
-    usb_ep_start_out(USB_EP_CDC_OUT, usbserial_buf_out, BUF_SIZE);
+    usbserial_tx_read = (usbserial_tx_read + usbserial_tx_sending) % TX_RING_SIZE;
+    usbserial_tx_count -= usbserial_tx_sending;
+    usbserial_tx_sending = 0;
+    usbserial_start_tx();
+    usbserial_start_out();
+}
+
+/// Send the waiting packets from the UART on USB IN, if it is idle
+static void usbserial_start_in() {
+    if (usbserial_rx_sending == 0 && usbserial_rx_count > 0) {
+        u16 len;
+        usbserial_rx_sending = usbserial_run(usbserial_rx_len, usbserial_rx_read,
+            usbserial_rx_count, RX_RING_SIZE, &len);
+        usb_ep_start_in(USB_EP_CDC_IN, usbserial_rx_ring[usbserial_rx_read], len, false);
+    }
 }
 
+/// Queue the packet the DMA is receiving into for USB IN, and move the DMA on to the next one.
+/// If the ring has no free packet, the received bytes are dropped instead.
 void usbserial_rx_flush() {
     dma_abort(DMA_TERMINAL_RX);
-
-    tc(TC_TERMINAL_TIMEOUT)->COUNT16.INTENCLR.reg = TC_INTENSET_OVF;
-    tc(TC_TERMINAL_TIMEOUT)->COUNT16.INTFLAG.reg = TC_INTFLAG_OVF;
-
-    if (!usbserial_sending_in) {
-        u32 size = BUF_SIZE - dma_remaining(DMA_TERMINAL_RX);
-        usb_ep_start_in(USB_EP_CDC_IN, usbserial_buf_in[usbserial_active_rx_buf], size, false);
-        usbserial_sending_in = true;
-        usbserial_active_rx_buf ^= 1;
+    usbserial_rx_flush_deferred = false;
+
+    u8 pos = (usbserial_rx_read + usbserial_rx_count) % RX_RING_SIZE;
+    u32 size = BUF_SIZE - dma_remaining(DMA_TERMINAL_RX);
+    if (size > 0 && usbserial_rx_count < RX_RING_SIZE - 1) {
+        usbserial_rx_len[pos] = size;
+        usbserial_rx_count++;
+        pos = (pos + 1) % RX_RING_SIZE;
     }
 
-    dma_sercom_start_rx(DMA_TERMINAL_RX, SERCOM_TERMINAL, usbserial_buf_in[usbserial_active_rx_buf], BUF_SIZE);
+    dma_sercom_start_rx(DMA_TERMINAL_RX, SERCOM_TERMINAL, usbserial_rx_ring[pos], BUF_SIZE);
+    usbserial_start_in();
 }
 
 void usbserial_dma_rx_completion() {
@@ -91,13 +187,59 @@ void usbserial_dma_rx_completion() {
 
 void usbserial_handle_tc() {
     if (tc(TC_TERMINAL_TIMEOUT)->COUNT16.INTFLAG.bit.OVF) {
-        usbserial_rx_flush();
+        tc(TC_TERMINAL_TIMEOUT)->COUNT16.INTFLAG.reg = TC_INTFLAG_OVF;
+        // With the ring full, a partial packet keeps filling until there is room for it, and is
+        // flushed once a USB IN transfer frees a packet
+        if (usbserial_rx_count < RX_RING_SIZE - 1) {
+            usbserial_rx_flush();
+        } else {
+            usbserial_rx_flush_deferred = true;
+        }
     }
 }
 
 void usbserial_in_completion() {
-    usbserial_sending_in = false;
-    tc(TC_TERMINAL_TIMEOUT)->COUNT16.INTENSET.reg = TC_INTENSET_OVF;
+    usbserial_rx_read = (usbserial_rx_read + usbserial_rx_sending) % RX_RING_SIZE;
+    usbserial_rx_count -= usbserial_rx_sending;
+    usbserial_rx_sending = 0;
+    if (usbserial_rx_flush_deferred) {
+        // Also starts the next USB IN transfer
+        return usbserial_rx_flush();
+    }
+    usbserial_start_in();
+}
+
+/// Handle a CDC class request on the control interface
+void usbserial_control_setup() {
+    switch (usb_setup.bRequest) {
+        case REQ_CDC_SET_LINE_CODING:
+            // Applied in usbserial_control_out_completion once the data stage arrives
+            return usb_ep0_out();
+        case REQ_CDC_GET_LINE_CODING: {
+            u16 len = sizeof(usbserial_line_coding);
+            if (len > usb_setup.wLength) len = usb_setup.wLength;
+            memcpy(ep0_buf_in, usbserial_line_coding, len);
+            usb_ep0_out();
+            return usb_ep0_in(len);
+        }
+        case REQ_CDC_SET_CONTROL_LINE_STATE:
+            // The console has no modem control lines
+            usb_ep0_out();
+            return usb_ep0_in(0);
+    }
+    return usb_ep0_stall();
+}
+
+/// Called for each OUT stage of a request to the control interface, which includes the status
+/// stage of GET_LINE_CODING
+void usbserial_control_out_completion() {
+    if (usb_setup.bRequest == REQ_CDC_SET_LINE_CODING) {
+        if (usb_setup.wLength >= sizeof(usbserial_line_coding)) {
+            memcpy(usbserial_line_coding, ep0_buf_out, sizeof(usbserial_line_coding));
+            sercom_uart_set_baud(SERCOM_TERMINAL, sercom_uart_baud(usbserial_rate()));
+        }
+        usb_ep0_in(0);
+    }
 }
 
 void usbserial_disable() {
@@ -22,6 +22,13 @@ const PWM_MIN_FREQUENCY = 1;
 const PWM_PRESCALARS = [1, 2, 4, 8, 16, 64, 256, 1024];
 // Maximum number of unscaled ticks in a second (48 MHz)
 const SAMD21_TICKS_PER_SECOND = 48000000;
+// UART baud rates, and the fastest for which the rounding of the host-computed baud register is
+// negligible
+const UART_MIN_BAUDRATE = 9600;
+const UART_MAX_BAUDRATE = 3000000;
+const UART_MAX_ARITHMETIC_BAUDRATE = 115200;
+// Largest payload spid sends for one port in a bridge transaction
+const BRIDGE_FRAME_SIZE = 1024;
 
 function Tessel(options) {
   if (Tessel.instance) {
@@ -201,6 +208,10 @@ Tessel.Port = function(name, socketPath, board) {
   // Number of tasks occupying the socket
   this._pendingTasks = 0;
 
+  // Whether the socket is corked until the end of the tick, and the depth of nested batch() calls
+  this._corked = false;
+  this._batchDepth = 0;
+
   // Unreference this socket so that the script will exit
   // if nothing else is waiting in the event queue.
   this.unref();
@@ -230,119 +241,245 @@ Tessel.Port = function(name, socketPath, board) {
   this.sock.on('readable', function() {
     var queued;
     // This value can potentially be `null`.
-    var available = new Buffer(this.sock.read() || 0);
-
-    // Copy incoming data into the reply buffer
-    replyBuf = Buffer.concat([replyBuf, available]);
-
-    // While we still have data to process in the buffer
-    while (replyBuf.length !== 0) {
-      // Grab the next byte
-      var byte = replyBuf[0];
-      // If the next byte equals the marker for a uart incoming
-      if (byte === REPLY.ASYNC_UART_RX) {
-        // Get the next byte which is the number of bytes
-        var rxNum = replyBuf[1];
-        // As long as the number of butes of rx buffer exists
-        // and we have at least the number of bytes needed for a uart rx packet
-        if (rxNum !== undefined && replyBuf.length >= 2 + rxNum) {
-          // Read the incoming data
-          var rxData = replyBuf.slice(2, 2 + rxNum);
-          // Cut those bytes out of the reply buf packet so we don't
-          // process them again
-          replyBuf = replyBuf.slice(2 + rxNum);
-
-          // If a uart port was instantiated
-          if (this._uart) {
-            // Push this data into the buffer
-            this._uart.push(rxData);
+    var available = this.sock.read();
+
+    // Only copy when a partial reply is left over from the last read. Replies are parsed at an
+    // offset into the buffer, so that consuming them doesn't create a Buffer for each reply.
+    if (available) {
+      replyBuf = replyBuf.length === 0 ? available : Buffer.concat([replyBuf, available]);
+    }
+    var pos = 0;
+
+    try {
+      // While we still have data to process in the buffer
+      while (pos < replyBuf.length) {
+        // Grab the next byte
+        var byte = replyBuf[pos];
+        // If the next byte equals the marker for a uart incoming
+        if (byte === REPLY.ASYNC_UART_RX) {
+          // Get the next byte which is the number of bytes
+          var rxNum = replyBuf[pos + 1];
+          // As long as the number of butes of rx buffer exists
+          // and we have at least the number of bytes needed for a uart rx packet
+          if (rxNum !== undefined && replyBuf.length - pos >= 2 + rxNum) {
+            // Read the incoming data
+            var rxData = replyBuf.slice(pos + 2, pos + 2 + rxNum);
+            // Cut those bytes out of the reply buf packet so we don't
+            // process them again
+            pos += 2 + rxNum;
+
+            // If a uart port was instantiated
+            if (this._uart) {
+              // Push this data into the buffer
+              this._uart.push(rxData);
+            }
+            // Something went wrong and the packet is malformed
+          } else {
+            break;
           }
-          // Something went wrong and the packet is malformed
-        } else {
-          break;
-        }
-        // This is some other async transaction
-      } else if (byte >= REPLY.MIN_ASYNC) {
-        // If this is a pin change
-        if (byte >= REPLY.ASYNC_PIN_CHANGE_N && byte < REPLY.ASYNC_PIN_CHANGE_N + 16) {
-          // Pull out the pin number (requires clearing the value bit)
-          var pin = this.pin[(byte - REPLY.ASYNC_PIN_CHANGE_N) & ~(1 << 3)];
-          // Get the mode change
-          var mode = pin.interruptMode;
-          // Get the pin value
-          var pinValue = (byte >> 3) & 1;
-
-          // For one-time 'low' or 'high' event
-          if (mode === 'low' || mode === 'high') {
-            pin.emit(mode);
-            // Reset the pin interrupt state (prevent constant interrupts)
-            pin.interruptMode = null;
-            // Decrement the number of tasks waiting on the socket
-            this.unref();
+          // If the next byte equals the marker for dropped uart data
+        } else if (byte === REPLY.ASYNC_UART_OVERFLOW) {
+          // The number of dropped bytes follows as a 16-bit little endian value
+          if (replyBuf.length - pos >= 3) {
+            var dropped = replyBuf.readUInt16LE(pos + 1);
+            // Cut those bytes out of the reply buf packet
+            pos += 3;
+
+            // If a uart port was instantiated
+            if (this._uart) {
+              // Let it know how much incoming data was lost
+              this._uart.emit('overflow', dropped);
+            }
           } else {
-            // Emit the change and rise or fall
-            pin.emit('change', pinValue);
-            pin.emit(pinValue ? 'rise' : 'fall');
+            break;
           }
+          // If the next byte equals the marker for streamed analog samples
+        } else if (byte === REPLY.ASYNC_ADC_DATA) {
+          // Get the next byte which is the number of 16-bit samples
+          var sampleNum = replyBuf[pos + 1];
+          if (sampleNum !== undefined && replyBuf.length - pos >= 2 + sampleNum * 2) {
+            var samples = [];
+            for (var sample = 0; sample < sampleNum; sample++) {
+              samples.push(replyBuf.readUInt16LE(pos + 2 + sample * 2));
+            }
+            // Cut those bytes out of the reply buf packet
+            pos += 2 + sampleNum * 2;
 
-        } else {
-          // Some other async event
-          this.emit('async-event', byte);
-        }
+            this.emit('analog-data', samples);
+          } else {
+            break;
+          }
+          // If the next byte equals the marker for dropped analog samples
+        } else if (byte === REPLY.ASYNC_ADC_OVERFLOW) {
+          if (replyBuf.length - pos >= 3) {
+            var droppedSamples = replyBuf.readUInt16LE(pos + 1);
+            pos += 3;
 
-        // Cut this byte off of the reply buffer
-        replyBuf = replyBuf.slice(1);
-      } else {
-        // If there are no commands awaiting a response
-        if (this.replyQueue.length === 0) {
-          // Throw an error... something went wrong
-          throw new Error('Received unexpected response with no commands pending: ' + byte);
-        }
+            this.emit('analog-overflow', droppedSamples);
+          } else {
+            break;
+          }
+          // If the next byte asks for more streamed waveform samples
+        } else if (byte === REPLY.ASYNC_WAVE_REFILL) {
+          pos += 1;
+
+          this.emit('wave-refill');
+          // If the next byte equals the marker for a waveform underrun
+        } else if (byte === REPLY.ASYNC_WAVE_UNDERRUN) {
+          if (replyBuf.length - pos >= 3) {
+            var underruns = replyBuf.readUInt16LE(pos + 1);
+            pos += 3;
+
+            this.emit('wave-underrun', underruns);
+          } else {
+            break;
+          }
+          // If the next byte equals the marker for captured pin edges
+        } else if (byte === REPLY.ASYNC_EDGE_DATA) {
+          // Get the next byte which is the number of 5-byte edge records
+          var edgeNum = replyBuf[pos + 1];
+          if (edgeNum !== undefined && replyBuf.length - pos >= 2 + edgeNum * 5) {
+            var edges = [];
+            for (var edge = 0; edge < edgeNum; edge++) {
+              var record = replyBuf[pos + 2 + edge * 5];
+              edges.push({
+                pin: record & 0x7,
+                level: (record >> 3) & 1,
+                time: replyBuf.readUInt32LE(pos + 3 + edge * 5),
+              });
+            }
+            // Cut those bytes out of the reply buf packet
+            pos += 2 + edgeNum * 5;
+
+            this.emit('edges', edges);
+          } else {
+            break;
+          }
+          // If the next byte equals the marker for dropped pin edges
+        } else if (byte === REPLY.ASYNC_EDGE_OVERFLOW) {
+          if (replyBuf.length - pos >= 3) {
+            var droppedEdges = replyBuf.readUInt16LE(pos + 1);
+            pos += 3;
+
+            this.emit('edge-overflow', droppedEdges);
+          } else {
+            break;
+          }
+          // If the next byte marks the replies of a triggered macro run
+        } else if (byte === REPLY.ASYNC_MACRO_RUN) {
+          if (replyBuf.length - pos >= 2) {
+            var slot = replyBuf[pos + 1];
+            pos += 2;
+
+            // Its replies come before those of any commands still pending
+            var entries = this._macroReplies(slot, 1, function(error, results) {
+              this.emit('macro', slot, results);
+            });
+            entries.forEach(function() {
+              this.ref();
+            }, this);
+            this.replyQueue.unshift.apply(this.replyQueue, entries);
+          } else {
+            break;
+          }
+          // This is some other async transaction
+        } else if (byte >= REPLY.MIN_ASYNC) {
+          // If this is a pin change
+          if (byte >= REPLY.ASYNC_PIN_CHANGE_N && byte < REPLY.ASYNC_PIN_CHANGE_N + 16) {
+            // Pull out the pin number (requires clearing the value bit)
+            var pin = this.pin[(byte - REPLY.ASYNC_PIN_CHANGE_N) & ~(1 << 3)];
+            // Get the mode change
+            var mode = pin.interruptMode;
+            // Get the pin value
+            var pinValue = (byte >> 3) & 1;
+
+            // For one-time 'low' or 'high' event
+            if (mode === 'low' || mode === 'high') {
+              pin.emit(mode);
+              // Reset the pin interrupt state (prevent constant interrupts)
+              pin.interruptMode = null;
+              // Decrement the number of tasks waiting on the socket
+              this.unref();
+            } else {
+              // Emit the change and rise or fall
+              pin.emit('change', pinValue);
+              pin.emit(pinValue ? 'rise' : 'fall');
+            }
 
-        // Get the size if the incoming packet
-        var size = this.replyQueue[0].size;
+          } else {
+            // Some other async event
+            this.emit('async-event', byte);
+          }
 
-        // If we have reply data
-        if (byte === REPLY.DATA) {
-          // Ensure that the packet size agrees
-          if (!size) {
-            throw new Error('Received unexpected data packet');
+          // Cut this byte off of the reply buffer
+          pos += 1;
+        } else {
+          // If there are no commands awaiting a response
+          if (this.replyQueue.length === 0) {
+            // Throw an error... something went wrong
+            throw new Error('Received unexpected response with no commands pending: ' + byte);
           }
 
-          // The number of data bytes expected have been received.
-          if (replyBuf.length >= 1 + size) {
-            // Extract the data
-            var data = replyBuf.slice(1, 1 + size);
-            // Slice this data off of the buffer
-            replyBuf = replyBuf.slice(1 + size);
-            // Get the  queued command
+          // Get the size if the incoming packet
+          var size = this.replyQueue[0].size;
+
+          // If we have reply data
+          if (byte === REPLY.DATA) {
+            // Ensure that the packet size agrees
+            if (!size) {
+              throw new Error('Received unexpected data packet');
+            }
+
+            // The number of data bytes expected have been received.
+            if (replyBuf.length - pos >= 1 + size) {
+              // Extract the data
+              var data = replyBuf.slice(pos + 1, pos + 1 + size);
+              // Slice this data off of the buffer
+              pos += 1 + size;
+              // Get the  queued command
+              queued = this.dequeue();
+
+              // If there is a callback for th ecommand
+              if (queued.callback) {
+                // Return the data in the callback
+                queued.callback.call(this, null, queued.size ? data : byte);
+              }
+            } else {
+              // The buffer does not have the correct number of
+              // date bytes to fulfill the requirements of the
+              // reply queue's next registered handler.
+              break;
+            }
+            // If it's just one byte being returned
+          } else if (byte === REPLY.HIGH || byte === REPLY.LOW) {
+            // Slice it off
+            pos += 1;
+            // Get the callback in the queue
             queued = this.dequeue();
 
-            // If there is a callback for th ecommand
+            // If a callback was provided
             if (queued.callback) {
-              // Return the data in the callback
-              queued.callback.call(this, null, queued.size ? data : byte);
+              // Return the byte in the callback
+              queued.callback.call(this, null, byte);
+            }
+            // The end of an I2C transfer, in place of the data if it was not acknowledged
+          } else if (byte === REPLY.ACK || byte === REPLY.NACK) {
+            pos += 1;
+            queued = this.dequeue();
+
+            if (queued.callback) {
+              if (byte === REPLY.NACK) {
+                queued.callback.call(this, new Error('I2C transfer was not acknowledged'));
+              } else {
+                queued.callback.call(this, null);
+              }
             }
-          } else {
-            // The buffer does not have the correct number of
-            // date bytes to fulfill the requirements of the
-            // reply queue's next registered handler.
-            break;
-          }
-          // If it's just one byte being returned
-        } else if (byte === REPLY.HIGH || byte === REPLY.LOW) {
-          // Slice it off
-          replyBuf = replyBuf.slice(1);
-          // Get the callback in the queue
-          queued = this.dequeue();
-
-          // If a callback was provided
-          if (queued.callback) {
-            // Return the byte in the callback
-            queued.callback.call(this, null, byte);
           }
         }
       }
+    } finally {
+      // Drop the replies handled, even if a callback threw
+      replyBuf = replyBuf.slice(pos);
     }
   }.bind(this));
 
@@ -352,6 +489,9 @@ Tessel.Port = function(name, socketPath, board) {
   // Array of {size, callback} used to dispatch replies
   this.replyQueue = [];
 
+  // Reply sizes of the commands stored in each macro slot
+  this._macros = [];
+
   this.pin = [];
   for (var i = 0; i < 8; i++) {
     var interruptSupported = Tessel.Pin.interruptCapablePins.indexOf(i) !== -1;
@@ -440,6 +580,8 @@ util.inherits(Tessel.Port, EventEmitter);
 
 Tessel.Port.prototype.close = function() {
   if (!this.sock.destroyed) {
+    // Send any commands still waiting for the end of the tick
+    this._flush();
     this.sock.isAllowedToClose = true;
     this.sock.destroy();
   }
@@ -477,12 +619,48 @@ Tessel.Port.prototype.dequeue = function() {
   return this.replyQueue.shift();
 };
 
+// Commands issued in the same tick are coalesced into one socket write, which spid usually
+// sends to the coprocessor in one bridge transaction. The first cork of a tick corks the socket,
+// and it stays corked until the end of the tick, or until an uncork finds a bridge frame's
+// worth of commands waiting, so that a long burst starts moving before it is complete.
 Tessel.Port.prototype.cork = function() {
-  this.sock.cork();
+  if (!this._corked) {
+    this._corked = true;
+    this.sock.cork();
+    process.nextTick(() => this._flush());
+  }
 };
 
 Tessel.Port.prototype.uncork = function() {
-  this.sock.uncork();
+  if (!this._corked) {
+    this.sock.uncork();
+  } else if (this._batchDepth === 0 && this.sock.bufferSize >= BRIDGE_FRAME_SIZE) {
+    this._flush();
+  }
+};
+
+Tessel.Port.prototype._flush = function() {
+  if (this._corked) {
+    this._corked = false;
+    this.sock.uncork();
+  }
+};
+
+// Send every command issued by fn in one write as soon as it returns, however long, like a
+// transaction. fn must issue them synchronously. cb is called once all of them have replied.
+Tessel.Port.prototype.batch = function(fn, cb) {
+  this.cork();
+  this._batchDepth++;
+  try {
+    fn.call(this, this);
+    this.sync(cb);
+  } finally {
+    this._batchDepth--;
+    if (this._batchDepth === 0) {
+      this._flush();
+    }
+  }
+  return this;
 };
 
 Tessel.Port.prototype.sync = function(cb) {
@@ -503,11 +681,13 @@ Tessel.Port.prototype._simple_cmd = function(buf, cb) {
 };
 
 Tessel.Port.prototype._status_cmd = function(buf, cb) {
+  this.cork();
   this.sock.write(new Buffer(buf));
   this.enqueue({
     size: 0,
     callback: cb,
   });
+  this.uncork();
 };
 
 Tessel.Port.prototype._tx = function(buf, cb) {
@@ -539,11 +719,13 @@ Tessel.Port.prototype._rx = function(len, cb) {
     throw new RangeError('Buffer size must be within 1-255');
   }
 
+  this.cork();
   this.sock.write(new Buffer([CMD.RX, len]));
   this.enqueue({
     size: len,
     callback: cb,
   });
+  this.uncork();
 };
 
 Tessel.Port.prototype._txrx = function(buf, cb) {
@@ -563,6 +745,372 @@ Tessel.Port.prototype._txrx = function(buf, cb) {
   this.uncork();
 };
 
+// Sample an analog pin continuously. The samples are emitted as 'analog-data' events, in
+// batches, and any samples dropped because the host fell behind as 'analog-overflow'.
+//   pin: the first pin to sample
+//   scan: the number of consecutive ADC inputs to sample in turn, starting at pin
+//   rate: conversions per second, shared between the scanned inputs
+//   prescaler: ADC clock prescaler, 0 (DIV4) to 7 (DIV512). Faster than DIV32 is limited to DIV32.
+//   averaging: average 2^averaging samples in hardware for each result, 0 to 10
+Tessel.Port.prototype.analogStream = function(options) {
+  options = options || {};
+
+  var pin = options.pin || 0;
+  var scan = options.scan || 1;
+  var rate = options.rate || 1000;
+  var prescaler = options.prescaler === undefined ? 7 : options.prescaler;
+  var averaging = options.averaging || 0;
+
+  if (pin < 0 || pin > 7 || scan < 1 || scan > 8) {
+    throw new RangeError('Analog stream pin must be within 0-7 and scan within 1-8');
+  }
+
+  if (rate < 1 || rate > 0xFFFFFF) {
+    throw new RangeError('Analog stream rate must be within 1-16777215');
+  }
+
+  if (prescaler < 0 || prescaler > 7 || averaging < 0 || averaging > 10) {
+    throw new RangeError('Analog stream prescaler must be within 0-7 and averaging within 0-10');
+  }
+
+  this._simple_cmd([
+    CMD.ANALOG_STREAM_START,
+    pin | ((scan - 1) << 4),
+    prescaler | (averaging << 4),
+    rate & 0xFF, (rate >> 8) & 0xFF, (rate >> 16) & 0xFF
+  ]);
+
+  if (!this._analogStreaming) {
+    // Keep the socket open while waiting for samples
+    this._analogStreaming = true;
+    this.ref();
+  }
+};
+
+Tessel.Port.prototype.stopAnalogStream = function() {
+  this._simple_cmd([CMD.ANALOG_STREAM_STOP]);
+
+  if (this._analogStreaming) {
+    this._analogStreaming = false;
+    this.unref();
+  }
+};
+
+// Number of samples that each 'wave-refill' event asks for
+Tessel.Port.WAVE_SAMPLES = 128;
+
+// Play a waveform out of the DAC (pin 7 of port B), or as the PWM duty cycle of a PWM pin.
+//   pin: a PWM pin, or undefined for the DAC
+//   rate: DAC samples per second. PWM duty cycles change once per PWM period.
+//   samples: with loop, a table of up to 255 samples that repeats until stopped.
+//     Otherwise, samples are streamed: the first 2 * Tessel.Port.WAVE_SAMPLES are buffered before playback
+//     starts, and each 'wave-refill' event asks for Tessel.Port.WAVE_SAMPLES more through waveformWrite.
+Tessel.Port.prototype.waveform = function(options) {
+  options = options || {};
+
+  var target = 0;
+  var rate = options.rate || 8000;
+  var samples = options.samples || [];
+  var loopLength = options.loop ? samples.length : 0;
+
+  if (options.pin === undefined) {
+    if (this.name !== 'B') {
+      throw new RangeError('Waveform output to the DAC can only be used on Pin 7 (G3) of Port B.');
+    }
+  } else {
+    if (!this.pin[options.pin] || !this.pin[options.pin].pwmSupported) {
+      throw new RangeError('PWM can only be used on TX (pin 5) and RX (pin 6) of either module port.');
+    }
+    target = options.pin + 1;
+  }
+
+  if (options.loop && (samples.length < 1 || samples.length > 255)) {
+    throw new RangeError('A looped waveform must have 1-255 samples');
+  }
+
+  if (rate < 1 || rate > 0xFFFFFF) {
+    throw new RangeError('Waveform rate must be within 1-16777215');
+  }
+
+  this.cork();
+  this.sock.write(new Buffer([
+    CMD.WAVE_START, target, loopLength,
+    rate & 0xFF, (rate >> 8) & 0xFF, (rate >> 16) & 0xFF
+  ]));
+  if (samples.length > 0) {
+    this.waveformWrite(samples);
+  }
+  this.uncork();
+
+  if (!loopLength && !this._waveStreaming) {
+    // Keep the socket open while waiting for refill requests
+    this._waveStreaming = true;
+    this.ref();
+  }
+};
+
+Tessel.Port.prototype.waveformWrite = function(samples) {
+  var data = new Buffer(samples.length * 2);
+  var offset = 0;
+
+  samples.forEach(function(sample, index) {
+    data.writeUInt16LE(sample, index * 2);
+  });
+
+  this.cork();
+  // Each command carries at most 255 bytes, keep whole samples in each
+  while (offset < data.length) {
+    var chunk = data.slice(offset, offset + 254);
+
+    this.sock.write(new Buffer([CMD.WAVE_DATA, chunk.length]));
+    this.sock.write(chunk);
+
+    offset += 254;
+  }
+  this.uncork();
+};
+
+Tessel.Port.prototype.stopWaveform = function() {
+  this._simple_cmd([CMD.WAVE_STOP]);
+
+  if (this._waveStreaming) {
+    this._waveStreaming = false;
+    this.unref();
+  }
+};
+
+// Number of macro slots, and the most bytes of commands each can hold
+Tessel.Port.MACRO_SLOTS = 4;
+Tessel.Port.MACRO_SIZE = 64;
+
+// Store a sequence of port commands on the coprocessor, to be run by runMacro or triggerMacro
+// without a round trip per command.
+//   slot: 0 to MACRO_SLOTS - 1
+//   commands: Buffer of encoded commands, with their arguments and payloads
+//   replies: for each command in the sequence that has a reply, its number of data bytes, or 0
+//     for a HIGH/LOW status or an I2C transfer without a read
+Tessel.Port.prototype.storeMacro = function(slot, commands, replies, cb) {
+  if (typeof replies === 'function') {
+    cb = replies;
+    replies = [];
+  }
+
+  if (slot < 0 || slot >= Tessel.Port.MACRO_SLOTS) {
+    throw new RangeError('Macro slot must be within 0-' + (Tessel.Port.MACRO_SLOTS - 1));
+  }
+
+  if (commands.length < 1 || commands.length > Tessel.Port.MACRO_SIZE) {
+    throw new RangeError('Macro must be 1-' + Tessel.Port.MACRO_SIZE + ' bytes');
+  }
+
+  this._macros[slot] = replies || [];
+
+  this.cork();
+  this.sock.write(new Buffer([CMD.MACRO_STORE, commands.length, slot]));
+  this.sock.write(new Buffer(commands));
+  this.sync(cb);
+  this.uncork();
+};
+
+// Reply queue entries for `runs` runs of a macro. Once all have arrived, cb is called with
+// the data or status of each reply, in order.
+Tessel.Port.prototype._macroReplies = function(slot, runs, cb) {
+  var replies = this._macros[slot] || [];
+  var results = [];
+  var entries = [];
+
+  var collect = function(error, data) {
+    results.push(data);
+    if (results.length === entries.length) {
+      cb.call(this, null, results);
+    }
+  };
+
+  for (var run = 0; run < runs; run++) {
+    replies.forEach(function(size) {
+      entries.push({
+        size: size,
+        callback: collect,
+      });
+    });
+  }
+
+  if (entries.length === 0) {
+    cb.call(this, null, results);
+  }
+
+  return entries;
+};
+
+// Run a stored macro `runs` times. The callback receives the replies of all runs, in order.
+Tessel.Port.prototype.runMacro = function(slot, runs, cb) {
+  if (typeof runs === 'function') {
+    cb = runs;
+    runs = 1;
+  }
+
+  runs = runs === undefined ? 1 : runs;
+
+  if (runs < 1 || runs > 255) {
+    throw new RangeError('Macro runs must be within 1-255');
+  }
+
+  this.cork();
+  this.sock.write(new Buffer([CMD.MACRO_RUN, slot, runs]));
+  this._macroReplies(slot, runs, function(error, results) {
+    if (cb) {
+      cb.call(this, null, results);
+    }
+  }).forEach(this.enqueue, this);
+  this.uncork();
+};
+
+// Run a stored macro on the coprocessor whenever a trigger fires, emitting 'macro' with the slot
+// and its replies after each run. Only one macro per port has a trigger.
+//   options.interval: run every interval ms
+//   options.pin: run on each interrupt of the pin, instead of its events. Set up the interrupt
+//     first, of a mode other than 'low' or 'high'.
+//   Without options, the trigger is removed.
+Tessel.Port.prototype.triggerMacro = function(slot, options) {
+  var source = MACRO_TRIGGER.NONE;
+  var value = 0;
+
+  options = options || {};
+
+  if (options.interval !== undefined) {
+    if (options.interval < 1 || options.interval > 0xFFFF) {
+      throw new RangeError('Macro interval must be within 1-65535 ms');
+    }
+    source = MACRO_TRIGGER.TIMER;
+    value = options.interval;
+  } else if (options.pin !== undefined) {
+    if (!this.pin[options.pin] || !this.pin[options.pin].interruptSupported) {
+      throw new RangeError('Macros can only be triggered by pins 2, 5, 6 and 7.');
+    }
+    source = MACRO_TRIGGER.PIN;
+    value = options.pin;
+  }
+
+  this._simple_cmd([CMD.MACRO_TRIGGER, slot, source, value & 0xFF, value >> 8]);
+
+  if (source !== MACRO_TRIGGER.NONE && !this._macroTriggered) {
+    // Keep the socket open while waiting for runs
+    this._macroTriggered = true;
+    this.ref();
+  } else if (source === MACRO_TRIGGER.NONE && this._macroTriggered) {
+    this._macroTriggered = false;
+    this.unref();
+  }
+};
+
+// Ticks per second of the timestamps of captured edges. They wrap around after 2^32 ticks.
+Tessel.Port.EDGE_CAPTURE_FREQUENCY = 3000000;
+
+// Timestamp both edges of up to two interrupt capable pins in hardware. The edges are emitted
+// as 'edges' events, in batches of {pin, level, time}, and any edges dropped because the
+// host fell behind as 'edge-overflow'.
+//   pins: a pin number, or an array of one or two pin numbers
+Tessel.Port.prototype.captureEdges = function(pins) {
+  var mask = 0;
+
+  pins = [].concat(pins);
+
+  if (pins.length < 1 || pins.length > 2) {
+    throw new RangeError('Edge capture can be used on one or two pins at a time');
+  }
+
+  pins.forEach(function(pin) {
+    if (!this.pin[pin] || !this.pin[pin].interruptSupported) {
+      throw new RangeError('Edge capture can only be used on pins 2, 5, 6 and 7.');
+    }
+    mask |= 1 << pin;
+  }, this);
+
+  this._simple_cmd([CMD.EDGE_CAPTURE_START, mask]);
+
+  if (!this._edgeCapturing) {
+    // Keep the socket open while waiting for edges
+    this._edgeCapturing = true;
+    this.ref();
+  }
+};
+
+Tessel.Port.prototype.stopEdgeCapture = function() {
+  this._simple_cmd([CMD.EDGE_CAPTURE_STOP]);
+
+  if (this._edgeCapturing) {
+    this._edgeCapturing = false;
+    this.unref();
+  }
+};
+
+Tessel.Port.prototype._i2c_transfer = function(address, txbuf, rxlen, cb) {
+  if (txbuf.length > 255 || rxlen > 255) {
+    throw new RangeError('Buffer size must be within 0-255');
+  }
+
+  this.cork();
+  // A single command: write txbuf, then repeated start and read rxlen bytes
+  this.sock.write(new Buffer([CMD.I2C_TRANSFER, address, txbuf.length, rxlen]));
+  if (txbuf.length > 0) {
+    this.sock.write(new Buffer(txbuf));
+  }
+  // The reply is the data read, or ACK for a transfer without a read. Either is replaced by NACK
+  // if the device doesn't acknowledge, which makes a transfer with neither a probe for a device.
+  this.enqueue({
+    size: rxlen,
+    callback: cb,
+  });
+  this.uncork();
+};
+
+Tessel.Port.prototype._spi_config = function(slot, mode, frequency, cb) {
+  var packet = new Buffer(6);
+
+  // The coprocessor picks the clock divider and baud, and replies with the rate achieved
+  packet.writeUInt8(CMD.SPI_CONFIG, 0);
+  packet.writeUInt8((slot << 4) | (mode & 0x3), 1);
+  packet.writeUInt32LE(frequency, 2);
+
+  this.cork();
+  this.sock.write(packet);
+  this.enqueue({
+    size: 4,
+    callback: cb && function(err, data) {
+      if (err) {
+        return cb.call(this, err);
+      }
+      cb.call(this, null, data.readUInt32LE(0));
+    },
+  });
+  this.uncork();
+};
+
+Tessel.Port.prototype._uart_config = function(baudrate, cb) {
+  var packet = new Buffer(5);
+
+  // The coprocessor picks the clock and baud register, enables UART, and replies with the rate
+  packet.writeUInt8(CMD.UART_CONFIG, 0);
+  packet.writeUInt32LE(baudrate, 1);
+
+  this.cork();
+  this.sock.write(packet);
+  this.enqueue({
+    size: 4,
+    callback: cb && function(err, data) {
+      if (err) {
+        return cb.call(this, err);
+      }
+      cb.call(this, null, data.readUInt32LE(0));
+    },
+  });
+  this.uncork();
+};
+
+Tessel.Port.prototype._spi_select = function(slot, cb) {
+  this._simple_cmd([CMD.SPI_SELECT, slot], cb);
+};
+
 Tessel.Port.PATH = {
   'A': '/var/run/tessel/port_a',
   'B': '/var/run/tessel/port_b'
@@ -773,6 +1321,7 @@ Tessel.Pin.prototype.analogRead = function(cb) {
     throw new Error('analogPin.read is async, pass in a callback to get the value');
   }
 
+  this._port.cork();
   this._port.sock.write(new Buffer([CMD.ANALOG_READ, this.pin]));
   this._port.enqueue({
     size: 2,
@@ -780,6 +1329,7 @@ Tessel.Pin.prototype.analogRead = function(cb) {
       cb(err, (data[0] + (data[1] << 8)) / ANALOG_RESOLUTION);
     },
   });
+  this._port.uncork();
 
   return this;
 };
@@ -795,7 +1345,9 @@ Tessel.Pin.prototype.analogWrite = function(val) {
     throw new RangeError('Analog write must be between 0 and 1');
   }
 
+  this._port.cork();
   this._port.sock.write(new Buffer([CMD.ANALOG_WRITE, data >> 8, data & 0xff]));
+  this._port.uncork();
   return this;
 };
 
@@ -821,7 +1373,9 @@ Tessel.Pin.prototype.pwmDutyCycle = function(dutyCycle, cb) {
   var packet = new Buffer([CMD.PWM_DUTY_CYCLE, this.pin, dutyCycleTicks >> 8, dutyCycleTicks & 0xff]);
 
   // Write it to the socket
+  this._port.cork();
   this._port.sock.write(packet, cb);
+  this._port.uncork();
 
   return this;
 };
@@ -908,6 +1462,10 @@ Tessel.I2C.prototype.transfer = function(txbuf, rxlen, callback) {
   this._port.uncork();
 };
 
+Tessel.I2C.prototype.readRegister = function(register, length, callback) {
+  this._port._i2c_transfer(this.address, [register], length, callback);
+};
+
 Tessel.SPI = function(params, port) {
   this._port = port;
   // Default the params if none were provided
@@ -1010,20 +1568,24 @@ Tessel.UART = function(port, options) {
         return baudrate;
       },
       set: (value) => {
-        // baud is given by the following:
-        // baud = 65536*(1-(samples_per_bit)*(f_wanted/f_ref))
-        // samples_per_bit = 16, 8, or 3
-        // f_ref = 48e6
-
-        if (value < 9600 || value > 115200) {
-          throw new Error('UART baudrate must be between 9600 and 115200');
+        if (value < UART_MIN_BAUDRATE || value > UART_MAX_BAUDRATE) {
+          throw new Error('UART baudrate must be between ' + UART_MIN_BAUDRATE + ' and ' + UART_MAX_BAUDRATE);
         }
 
         baudrate = value;
 
-        var computed = Math.floor(65536 * (1 - 16 * (baudrate / 48e6)));
+        if (baudrate <= UART_MAX_ARITHMETIC_BAUDRATE) {
+          // baud is given by the following:
+          // baud = 65536*(1-(samples_per_bit)*(f_wanted/f_ref))
+          // samples_per_bit = 16, 8, or 3
+          // f_ref = 48e6
+          var computed = Math.floor(65536 * (1 - 16 * (baudrate / 48e6)));
 
-        this._port._simple_cmd([CMD.ENABLE_UART, computed >> 8, computed & 0xFF]);
+          this._port._simple_cmd([CMD.ENABLE_UART, computed >> 8, computed & 0xFF]);
+        } else {
+          // Faster rates need a SERCOM clock and baud register picked for them
+          this._port._uart_config(baudrate);
+        }
       }
     }
   });
@@ -1083,6 +1645,20 @@ var CMD = {
   STOP: 20,
   PWM_DUTY_CYCLE: 27,
   PWM_PERIOD: 28,
+  I2C_TRANSFER: 29,
+  SPI_CONFIG: 30,
+  SPI_SELECT: 31,
+  ANALOG_STREAM_START: 32,
+  ANALOG_STREAM_STOP: 33,
+  WAVE_START: 34,
+  WAVE_DATA: 35,
+  WAVE_STOP: 36,
+  EDGE_CAPTURE_START: 37,
+  EDGE_CAPTURE_STOP: 38,
+  MACRO_STORE: 39,
+  MACRO_RUN: 40,
+  MACRO_TRIGGER: 41,
+  UART_CONFIG: 42,
 };
 
 var REPLY = {
@@ -1094,7 +1670,21 @@ var REPLY = {
 
   MIN_ASYNC: 0xA0,
   ASYNC_PIN_CHANGE_N: 0xC0, // c0 to c8 is all async pin assignments
-  ASYNC_UART_RX: 0xD0
+  ASYNC_UART_RX: 0xD0,
+  ASYNC_UART_OVERFLOW: 0xD1,
+  ASYNC_ADC_DATA: 0xD2,
+  ASYNC_ADC_OVERFLOW: 0xD3,
+  ASYNC_WAVE_REFILL: 0xD4,
+  ASYNC_WAVE_UNDERRUN: 0xD5,
+  ASYNC_EDGE_DATA: 0xD6,
+  ASYNC_EDGE_OVERFLOW: 0xD7,
+  ASYNC_MACRO_RUN: 0xD8
+};
+
+var MACRO_TRIGGER = {
+  NONE: 0,
+  TIMER: 1,
+  PIN: 2
 };
 
 // Currently unused. Uncomment when ready to implement
@@ -679,12 +679,13 @@ exports['Tessel.Port.prototype'] = {
   },
 
   _simple_cmd: function(test) {
-    test.expect(4);
+    test.expect(5);
 
     this.port._simple_cmd([], function() {});
 
     test.equal(this.socket.cork.callCount, 1);
-    test.equal(this.socket.uncork.callCount, 1);
+    // The socket stays corked until the end of the tick
+    test.equal(this.socket.uncork.callCount, 0);
 
     // Called by _simple_cmd and sync
     test.equal(this.socket.write.callCount, 2);
@@ -694,6 +695,123 @@ exports['Tessel.Port.prototype'] = {
 
     test.equal(buffer instanceof Buffer, true);
 
+    process.nextTick(() => {
+      test.equal(this.socket.uncork.callCount, 1);
+      test.done();
+    });
+  },
+
+  corkCoalescesTick: function(test) {
+    test.expect(4);
+
+    this.port._simple_cmd([CMD.GPIO_HIGH, 1]);
+    this.port._simple_cmd([CMD.GPIO_LOW, 1]);
+    this.port._rx(2, function() {});
+
+    test.equal(this.socket.cork.callCount, 1);
+    test.equal(this.socket.uncork.callCount, 0);
+    test.equal(this.socket.write.callCount, 3);
+
+    process.nextTick(() => {
+      test.equal(this.socket.uncork.callCount, 1);
+      test.done();
+    });
+  },
+
+  uncorkFlushesFullFrame: function(test) {
+    test.expect(3);
+
+    this.port._simple_cmd([CMD.GPIO_HIGH, 1]);
+    test.equal(this.socket.uncork.callCount, 0);
+
+    // A bridge frame's worth of commands goes out before the end of the tick
+    this.socket.bufferSize = 1024;
+    this.port._simple_cmd([CMD.GPIO_LOW, 1]);
+    test.equal(this.socket.uncork.callCount, 1);
+
+    // The next command starts a new batch
+    this.socket.bufferSize = 0;
+    this.port._simple_cmd([CMD.GPIO_HIGH, 1]);
+    test.equal(this.socket.cork.callCount, 2);
+
+    test.done();
+  },
+
+  batch: function(test) {
+    test.expect(7);
+
+    var callback = sandbox.spy();
+
+    var result = this.port.batch(function(port) {
+      test.equal(port, this);
+      this._simple_cmd([CMD.GPIO_HIGH, 1]);
+      this._rx(2, function() {});
+      this._simple_cmd([CMD.GPIO_LOW, 1]);
+    }, callback);
+
+    test.equal(result, this.port);
+    // Flushed as soon as fn returns, with an echo for the callback at the end
+    test.equal(this.socket.cork.callCount, 1);
+    test.equal(this.socket.uncork.callCount, 1);
+    test.equal(this.socket.write.callCount, 4);
+    test.ok(this.socket.write.lastCall.args[0].equals(new Buffer([CMD.ECHO, 1, 0x88])));
+    test.equal(this.port.replyQueue[this.port.replyQueue.length - 1].callback, callback);
+
+    test.done();
+  },
+
+  batchIgnoresFrameSize: function(test) {
+    test.expect(2);
+
+    this.socket.bufferSize = 1024;
+    this.port.batch(function() {
+      this._simple_cmd([CMD.GPIO_HIGH, 1]);
+      this._simple_cmd([CMD.GPIO_LOW, 1]);
+      test.equal(this.sock.uncork.callCount, 0);
+    });
+    test.equal(this.socket.uncork.callCount, 1);
+
+    test.done();
+  },
+
+  batchNested: function(test) {
+    test.expect(2);
+
+    this.port.batch(function() {
+      this.batch(function() {
+        this._simple_cmd([CMD.GPIO_HIGH, 1]);
+      });
+      test.equal(this.sock.uncork.callCount, 0);
+    });
+    test.equal(this.socket.uncork.callCount, 1);
+
+    test.done();
+  },
+
+  batchFlushesOnThrow: function(test) {
+    test.expect(2);
+
+    test.throws(function() {
+      this.port.batch(function() {
+        this._simple_cmd([CMD.GPIO_HIGH, 1]);
+        throw new Error('oops');
+      });
+    }.bind(this));
+    test.equal(this.socket.uncork.callCount, 1);
+
+    test.done();
+  },
+
+  closeFlushes: function(test) {
+    test.expect(2);
+
+    this.port.sock.destroy = sandbox.spy();
+    this.port._simple_cmd([CMD.GPIO_HIGH, 1]);
+    this.port.close();
+
+    test.equal(this.socket.uncork.callCount, 1);
+    test.equal(this.port.sock.destroy.callCount, 1);
+
     test.done();
   },
 
@@ -1011,6 +1129,389 @@ exports['Tessel.Port.prototype'] = {
     test.done();
   },
 
+  _i2c_transfer: function(test) {
+    test.expect(8);
+
+    this.cork = sandbox.stub(Tessel.Port.prototype, 'cork');
+    this.uncork = sandbox.stub(Tessel.Port.prototype, 'uncork');
+
+    var buffer = new Buffer([0x0F]);
+    var callback = sandbox.spy();
+
+    this.a._i2c_transfer(0x1D, buffer, 6, callback);
+
+    test.equal(this.cork.callCount, 1);
+    test.equal(this.uncork.callCount, 1);
+    test.equal(this.a.sock.write.callCount, 2);
+
+    test.equal(this.a.replyQueue.length, 1);
+
+    var replyQueueEntry = this.a.replyQueue[0];
+
+    test.equal(replyQueueEntry.size, 6);
+    test.equal(replyQueueEntry.callback, callback);
+
+    test.ok(this.a.sock.write.firstCall.args[0].equals(new Buffer([CMD.I2C_TRANSFER, 0x1D, 1, 6])));
+    test.ok(this.a.sock.write.lastCall.args[0].equals(buffer));
+
+    test.done();
+  },
+
+  _i2c_transferWriteOnly: function(test) {
+    test.expect(4);
+
+    this.sync = sandbox.stub(Tessel.Port.prototype, 'sync');
+
+    var callback = sandbox.spy();
+
+    this.a._i2c_transfer(0x1D, [0x2A, 0x01], 0, callback);
+
+    test.ok(this.a.sock.write.firstCall.args[0].equals(new Buffer([CMD.I2C_TRANSFER, 0x1D, 2, 0])));
+    // The coprocessor replies with ACK or NACK
+    test.equal(this.sync.callCount, 0);
+    test.equal(this.a.replyQueue.length, 1);
+    test.deepEqual(this.a.replyQueue[0], {
+      size: 0,
+      callback: callback,
+    });
+
+    test.done();
+  },
+
+  analogStream: function(test) {
+    test.expect(4);
+
+    this._simple_cmd = sandbox.stub(Tessel.Port.prototype, '_simple_cmd');
+    this.ref = sandbox.stub(Tessel.Port.prototype, 'ref');
+    this.unref = sandbox.stub(Tessel.Port.prototype, 'unref');
+
+    this.b.analogStream({
+      pin: 1,
+      scan: 4,
+      rate: 40000,
+      prescaler: 3,
+      averaging: 2
+    });
+
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.ANALOG_STREAM_START, 0x31, 0x23, 0x40, 0x9C, 0x00]);
+    test.equal(this.ref.callCount, 1);
+
+    this.b.stopAnalogStream();
+
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.ANALOG_STREAM_STOP]);
+    test.equal(this.unref.callCount, 1);
+
+    test.done();
+  },
+
+  analogStreamInvalidOptions: function(test) {
+    test.expect(3);
+
+    test.throws(function() {
+      this.b.analogStream({
+        scan: 9
+      });
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.b.analogStream({
+        rate: 0x1000000
+      });
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.b.analogStream({
+        averaging: 11
+      });
+    }.bind(this), RangeError);
+
+    test.done();
+  },
+
+  waveformLoop: function(test) {
+    test.expect(4);
+
+    this.ref = sandbox.stub(Tessel.Port.prototype, 'ref');
+
+    this.b.waveform({
+      loop: true,
+      rate: 44100,
+      samples: [0, 0x3ff]
+    });
+
+    test.ok(this.b.sock.write.firstCall.args[0].equals(new Buffer([CMD.WAVE_START, 0, 2, 0x44, 0xAC, 0x00])));
+    test.ok(this.b.sock.write.secondCall.args[0].equals(new Buffer([CMD.WAVE_DATA, 4])));
+    test.ok(this.b.sock.write.thirdCall.args[0].equals(new Buffer([0x00, 0x00, 0xff, 0x03])));
+    // A looped table needs nothing more from the host
+    test.equal(this.ref.callCount, 0);
+
+    test.done();
+  },
+
+  waveformStreamPwm: function(test) {
+    test.expect(4);
+
+    this.ref = sandbox.stub(Tessel.Port.prototype, 'ref');
+    this.unref = sandbox.stub(Tessel.Port.prototype, 'unref');
+    this._simple_cmd = sandbox.stub(Tessel.Port.prototype, '_simple_cmd');
+
+    this.a.waveform({
+      pin: 5
+    });
+
+    test.ok(this.a.sock.write.lastCall.args[0].equals(new Buffer([CMD.WAVE_START, 6, 0, 0x40, 0x1F, 0x00])));
+    test.equal(this.ref.callCount, 1);
+
+    this.a.stopWaveform();
+
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.WAVE_STOP]);
+    test.equal(this.unref.callCount, 1);
+
+    test.done();
+  },
+
+  waveformWriteChunks: function(test) {
+    test.expect(3);
+
+    this.b.waveformWrite(new Array(200).fill(1));
+
+    // 127 whole samples fit in each command
+    test.equal(this.b.sock.write.callCount, 4);
+    test.ok(this.b.sock.write.firstCall.args[0].equals(new Buffer([CMD.WAVE_DATA, 254])));
+    test.ok(this.b.sock.write.thirdCall.args[0].equals(new Buffer([CMD.WAVE_DATA, 146])));
+
+    test.done();
+  },
+
+  waveformInvalid: function(test) {
+    test.expect(3);
+
+    test.throws(function() {
+      this.a.waveform({});
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.b.waveform({
+        pin: 0
+      });
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.b.waveform({
+        loop: true,
+        samples: []
+      });
+    }.bind(this), RangeError);
+
+    test.done();
+  },
+
+  captureEdges: function(test) {
+    test.expect(4);
+
+    this.ref = sandbox.stub(Tessel.Port.prototype, 'ref');
+    this.unref = sandbox.stub(Tessel.Port.prototype, 'unref');
+    this._simple_cmd = sandbox.stub(Tessel.Port.prototype, '_simple_cmd');
+
+    this.a.captureEdges([5, 6]);
+
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.EDGE_CAPTURE_START, 0x60]);
+    test.equal(this.ref.callCount, 1);
+
+    this.a.stopEdgeCapture();
+
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.EDGE_CAPTURE_STOP]);
+    test.equal(this.unref.callCount, 1);
+
+    test.done();
+  },
+
+  captureEdgesInvalid: function(test) {
+    test.expect(3);
+
+    test.throws(function() {
+      this.a.captureEdges([]);
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.a.captureEdges([2, 5, 6]);
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.a.captureEdges(0);
+    }.bind(this), RangeError);
+
+    test.done();
+  },
+
+  storeMacro: function(test) {
+    test.expect(3);
+
+    var commands = new Buffer([CMD.GPIO_LOW, 5, CMD.TXRX, 1, 0x9F, CMD.GPIO_HIGH, 5]);
+
+    this.a.storeMacro(1, commands, [1]);
+
+    test.ok(this.a.sock.write.firstCall.args[0].equals(new Buffer([CMD.MACRO_STORE, 7, 1])));
+    test.ok(this.a.sock.write.secondCall.args[0].equals(commands));
+    test.deepEqual(this.a._macros[1], [1]);
+
+    test.done();
+  },
+
+  storeMacroInvalid: function(test) {
+    test.expect(2);
+
+    test.throws(function() {
+      this.a.storeMacro(Tessel.Port.MACRO_SLOTS, new Buffer([CMD.NOP]));
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.a.storeMacro(0, new Buffer(Tessel.Port.MACRO_SIZE + 1));
+    }.bind(this), RangeError);
+
+    test.done();
+  },
+
+  runMacro: function(test) {
+    test.expect(4);
+
+    this.a._macros[1] = [1];
+
+    this.a.runMacro(1, 2, function(error, results) {
+      test.equal(results.length, 2);
+      test.ok(results[1].equals(new Buffer([0x20])));
+      test.done();
+    });
+
+    test.ok(this.a.sock.write.lastCall.args[0].equals(new Buffer([CMD.MACRO_RUN, 1, 2])));
+    test.equal(this.a.replyQueue.length, 2);
+
+    this.a.sock.read.returns(new Buffer([REPLY.DATA, 0x10, REPLY.DATA, 0x20]));
+    this.a.sock.emit('readable');
+  },
+
+  triggerMacro: function(test) {
+    test.expect(5);
+
+    this.ref = sandbox.stub(Tessel.Port.prototype, 'ref');
+    this.unref = sandbox.stub(Tessel.Port.prototype, 'unref');
+    this._simple_cmd = sandbox.stub(Tessel.Port.prototype, '_simple_cmd');
+
+    this.a.triggerMacro(0, {
+      interval: 1000
+    });
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.MACRO_TRIGGER, 0, 1, 0xE8, 0x03]);
+
+    this.a.triggerMacro(0, {
+      pin: 2
+    });
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.MACRO_TRIGGER, 0, 2, 2, 0]);
+    test.equal(this.ref.callCount, 1);
+
+    this.a.triggerMacro(0);
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.MACRO_TRIGGER, 0, 0, 0, 0]);
+    test.equal(this.unref.callCount, 1);
+
+    test.done();
+  },
+
+  _spi_config: function(test) {
+    test.expect(4);
+
+    var callback = sandbox.spy();
+
+    this.a._spi_config(2, 3, 5e6, callback);
+
+    test.ok(this.a.sock.write.lastCall.args[0].equals(new Buffer([CMD.SPI_CONFIG, 0x23, 0x40, 0x4B, 0x4C, 0x00])));
+    test.equal(this.a.replyQueue.length, 1);
+    test.equal(this.a.replyQueue[0].size, 4);
+
+    // The reply is the achieved frequency
+    this.a.replyQueue[0].callback(null, new Buffer([0x00, 0x3E, 0x49, 0x00]));
+    test.equal(callback.lastCall.args[1], 4.8e6);
+
+    test.done();
+  },
+
+  _spi_configError: function(test) {
+    test.expect(2);
+
+    var callback = sandbox.spy();
+    var error = new Error('Port closed');
+
+    this.a._spi_config(2, 3, 5e6, callback);
+
+    // A failed command has no reply data to read
+    this.a.replyQueue[0].callback(error);
+    test.equal(callback.lastCall.args[0], error);
+    test.equal(callback.lastCall.args.length, 1);
+
+    test.done();
+  },
+
+  _spi_select: function(test) {
+    test.expect(2);
+
+    this._simple_cmd = sandbox.stub(Tessel.Port.prototype, '_simple_cmd');
+
+    var callback = sandbox.spy();
+
+    this.a._spi_select(1, callback);
+
+    test.deepEqual(this._simple_cmd.lastCall.args[0], [CMD.SPI_SELECT, 1]);
+    test.equal(this._simple_cmd.lastCall.args[1], callback);
+
+    test.done();
+  },
+
+  _uart_config: function(test) {
+    test.expect(4);
+
+    var callback = sandbox.spy();
+
+    this.a._uart_config(1e6, callback);
+
+    test.ok(this.a.sock.write.lastCall.args[0].equals(new Buffer([CMD.UART_CONFIG, 0x40, 0x42, 0x0F, 0x00])));
+    test.equal(this.a.replyQueue.length, 1);
+    test.equal(this.a.replyQueue[0].size, 4);
+
+    // The reply is the achieved rate
+    this.a.replyQueue[0].callback(null, new Buffer([0x40, 0x42, 0x0F, 0x00]));
+    test.equal(callback.lastCall.args[1], 1e6);
+
+    test.done();
+  },
+
+  _uart_configError: function(test) {
+    test.expect(2);
+
+    var callback = sandbox.spy();
+    var error = new Error('Port closed');
+
+    this.a._uart_config(1e6, callback);
+
+    // A failed command has no reply data to read
+    this.a.replyQueue[0].callback(error);
+    test.equal(callback.lastCall.args[0], error);
+    test.equal(callback.lastCall.args.length, 1);
+
+    test.done();
+  },
+
+  _i2c_transferInvalidLengthMax: function(test) {
+    test.expect(2);
+
+    test.throws(function() {
+      this.a._i2c_transfer(0x1D, new Buffer(256), 1);
+    }.bind(this), RangeError);
+
+    test.throws(function() {
+      this.a._i2c_transfer(0x1D, new Buffer(1), 256);
+    }.bind(this), RangeError);
+
+    test.done();
+  },
+
 };
 
 exports['Tessel.Port Commands (handling incoming socket stream)'] = {
@@ -1080,6 +1581,29 @@ exports['Tessel.Port Commands (handling incoming socket stream)'] = {
     this.port.sock.emit('readable');
   },
 
+  replyAckThenNackInPlaceOfData: function(test) {
+    test.expect(4);
+
+    var ack = sandbox.spy();
+    var nack = sandbox.spy();
+    this.port.sock.read.returns(new Buffer([REPLY.ACK, REPLY.NACK]));
+    this.port.replyQueue.push({
+      size: 0,
+      callback: ack,
+    }, {
+      size: 6,
+      callback: nack,
+    });
+
+    this.port.sock.emit('readable');
+
+    test.equal(ack.lastCall.args[0], null);
+    test.ok(nack.lastCall.args[0] instanceof Error);
+    test.equal(nack.lastCall.args.length, 1);
+    test.equal(this.port.replyQueue.length, 0);
+    test.done();
+  },
+
   replydata: function(test) {
     test.expect(4);
 
@@ -1186,6 +1710,103 @@ exports['Tessel.Port Commands (handling incoming socket stream)'] = {
     this.port.sock.read.returns(new Buffer([REPLY.MIN_ASYNC]));
     this.port.sock.emit('readable');
   },
+
+  replyasyncadcdata: function(test) {
+    test.expect(1);
+
+    this.port.on('analog-data', function(samples) {
+      test.deepEqual(samples, [0x0123, 0x0fff]);
+      test.done();
+    });
+
+    // Split across two reads to check that partial packets wait for the rest
+    this.port.sock.read.returns(new Buffer([REPLY.ASYNC_ADC_DATA, 2, 0x23, 0x01]));
+    this.port.sock.emit('readable');
+
+    this.port.sock.read.returns(new Buffer([0xff, 0x0f]));
+    this.port.sock.emit('readable');
+  },
+
+  replyasyncwave: function(test) {
+    test.expect(2);
+
+    var refill = sandbox.spy();
+
+    this.port.on('wave-refill', refill);
+    this.port.on('wave-underrun', function(underruns) {
+      test.equal(refill.callCount, 2);
+      test.equal(underruns, 3);
+      test.done();
+    });
+
+    this.port.sock.read.returns(new Buffer([REPLY.ASYNC_WAVE_REFILL, REPLY.ASYNC_WAVE_REFILL, REPLY.ASYNC_WAVE_UNDERRUN, 0x03, 0x00]));
+    this.port.sock.emit('readable');
+  },
+
+  replyasyncedgedata: function(test) {
+    test.expect(2);
+
+    this.port.on('edges', function(edges) {
+      test.deepEqual(edges, [{
+        pin: 5,
+        level: 1,
+        time: 0x01020304
+      }, {
+        pin: 6,
+        level: 0,
+        time: 0x01020310
+      }]);
+    });
+
+    this.port.on('edge-overflow', function(dropped) {
+      test.equal(dropped, 0x0102);
+      test.done();
+    });
+
+    this.port.sock.read.returns(new Buffer([
+      REPLY.ASYNC_EDGE_DATA, 2,
+      0x0D, 0x04, 0x03, 0x02, 0x01,
+      0x06, 0x10, 0x03, 0x02, 0x01,
+      REPLY.ASYNC_EDGE_OVERFLOW, 0x02, 0x01
+    ]));
+    this.port.sock.emit('readable');
+  },
+
+  replyasyncmacrorun: function(test) {
+    test.expect(4);
+
+    var spy = sandbox.spy();
+
+    // A host command was pending before the triggered run
+    this.port.replyQueue.push({
+      size: 1,
+      callback: spy
+    });
+    this.port._macros[2] = [0, 2];
+
+    this.port.on('macro', function(slot, results) {
+      test.equal(slot, 2);
+      test.equal(results[0], REPLY.HIGH);
+      test.ok(results[1].equals(new Buffer([0x12, 0x34])));
+      test.equal(spy.callCount, 0);
+      test.done();
+    });
+
+    this.port.sock.read.returns(new Buffer([REPLY.ASYNC_MACRO_RUN, 2, REPLY.HIGH, REPLY.DATA, 0x12, 0x34]));
+    this.port.sock.emit('readable');
+  },
+
+  replyasyncadcoverflow: function(test) {
+    test.expect(1);
+
+    this.port.on('analog-overflow', function(dropped) {
+      test.equal(dropped, 0x0140);
+      test.done();
+    });
+
+    this.port.sock.read.returns(new Buffer([REPLY.ASYNC_ADC_OVERFLOW, 0x40, 0x01]));
+    this.port.sock.emit('readable');
+  },
 };
 
 exports['Tessel.Pin'] = {
@@ -2147,6 +2768,29 @@ exports['Tessel.I2C'] = {
     test.done();
   },
 
+  readRegister: function(test) {
+    test.expect(5);
+
+    this._i2c_transfer = sandbox.stub(Tessel.Port.prototype, '_i2c_transfer');
+
+    var device = new Tessel.I2C({
+      address: 0x01,
+      port: this.port
+    });
+
+    var handler = function() {};
+
+    device.readRegister(0x0F, 6, handler);
+
+    test.equal(device._port._i2c_transfer.callCount, 1);
+    test.equal(device._port._i2c_transfer.firstCall.args[0], device.address);
+    test.deepEqual(device._port._i2c_transfer.firstCall.args[1], [0x0F]);
+    test.equal(device._port._i2c_transfer.firstCall.args[2], 6);
+    test.equal(device._port._i2c_transfer.firstCall.args[3], handler);
+
+    test.done();
+  },
+
 };
 
 exports['Tessel.I2C.computeBaud'] = {
@@ -2236,6 +2880,24 @@ exports['Tessel.UART'] = {
     test.done();
   },
 
+  baudrateHighCmd: function(test) {
+    test.expect(4);
+
+    var _uart_config = sandbox.stub(Tessel.Port.prototype, '_uart_config');
+
+    var uart = new this.port.UART({
+      baudrate: 9600
+    });
+
+    uart.baudrate = 1000000;
+
+    test.equal(uart.baudrate, 1000000);
+    test.equal(this._simple_cmd.callCount, 1);
+    test.equal(_uart_config.callCount, 1);
+    test.equal(_uart_config.lastCall.args[0], 1000000);
+    test.done();
+  },
+
   baudrateInvalidLow: function(test) {
     test.expect(2);
 
@@ -2260,7 +2922,7 @@ exports['Tessel.UART'] = {
       baudrate: b1
     });
 
-    test.throws(() => uart.baudrate = 115201);
+    test.throws(() => uart.baudrate = 3000001);
     test.equal(uart.baudrate, b1);
 
     test.done();
@@ -2339,6 +3001,40 @@ exports['Tessel.UART'] = {
     });
 
     // Prod the socket to read our buffer
+    u1._port.sock.emit('readable');
+  },
+
+  overflowEvent: function(test) {
+
+    test.expect(2);
+
+    var u1 = new this.port.UART();
+
+    // An overflow report of 0x0102 bytes, followed by more received data
+    var payload = new Buffer([0x42]);
+    var overflow = new Buffer([Tessel.REPLY.ASYNC_UART_OVERFLOW, 0x02, 0x01]);
+    var header = new Buffer([Tessel.REPLY.ASYNC_UART_RX, payload.length]);
+
+    var called = false;
+    this.socket.read = () => {
+      if (called) {
+        return new Buffer([]);
+      }
+      called = true;
+
+      return Buffer.concat([overflow, header, payload]);
+    };
+
+    u1.once('overflow', (dropped) => {
+      test.equal(dropped, 0x0102);
+    });
+
+    // The data after the report is still delivered
+    u1.once('data', (shouldBeBuf) => {
+      test.deepEqual(shouldBeBuf, payload);
+      test.done();
+    });
+
     u1._port.sock.emit('readable');
   }
 };
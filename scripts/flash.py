@@ -25,6 +25,10 @@ def factory(mac1, mac2):
     return ''.join(map(chr, header + mac1 + [0xff] * 30 + mac2))
 
 PAGE = 256
+# Bytes streamed per USB write while bulk programming
+PROGRAM_CHUNK = 64 * 1024
+# Status reply to a program header the firmware rejected
+PROGRAM_INVALID = 0xff
 
 class Flash(object):
     def __init__(self, device):
@@ -33,13 +37,15 @@ class Flash(object):
         self.ep_in = self.interface[0]
         self.ep_out = self.interface[1]
 
+    def header(self, count, flags):
+        return [(count >> 0) & 0xff, (count >> 8) & 0xff, (count >> 16) & 0xff, flags]
+
     def transaction(self, write, read=0, status_poll=False, wren=False):
         if len(write) > 500 or read >= 2**24:
             raise ValueError("Transaction too large")
 
         flags = int(status_poll) | (int(wren) << 1)
-        hdr = [(read >> 0) & 0xff, (read >> 8) & 0xff, (read >> 16) & 0xff, flags]
-        self.ep_out.write(hdr + write)
+        self.ep_out.write(self.header(read, flags) + write)
 
         if read > 0:
             return bytearray(self.ep_in.read(max(read, 512)))
@@ -61,6 +67,10 @@ class Flash(object):
         """Read from flash"""
         return self.transaction([0x13]+address(addr), length)
 
+    def fast_read(self, addr, length):
+        """Read from flash with the fast read command"""
+        return self.transaction([0x0C]+address(addr)+[0], length)
+
     def wren(self):
         """Set the write enable flag"""
         self.transaction([0x06])
@@ -100,24 +110,52 @@ class Flash(object):
         """Write a page to flash"""
         self.transaction([0x12]+address(addr)+data, status_poll = True, wren = True)
 
+    def program(self, addr, data):
+        """Stream data to be programmed from a page-aligned address, leaving the firmware to
+        sequence the page programs"""
+        if addr % PAGE != 0 or len(data) >= 2**24:
+            raise ValueError("Invalid program region")
+
+        self.ep_out.write(self.header(len(data), 0x4) + address(addr))
+        for p in chunks(data, PROGRAM_CHUNK):
+            self.ep_out.write(p)
+        status = self.ep_in.read(64)[0]
+        if status == PROGRAM_INVALID:
+            raise AssertionError("Program header rejected at 0x{:08x}".format(addr))
+        if status & 0x40:
+            raise AssertionError("Programming error at 0x{:08x} (status {:02x})".format(addr, status))
+
     def write(self, addr, data):
         """Write a binary to flash"""
         t = time.time()
         write_addr = addr
-        for i, p in enumerate(chunks(data, PAGE)):
-            if i % 32 == 0:
-                print("Write 0x{:08x} ({:3.0f}%)\r".format(addr, i*PAGE*100.0/ len(data)), end='')
-            self.write_page(write_addr, map(ord, p))
-            write_addr += PAGE
-        self.wait_complete()
+        for i, p in enumerate(chunks(data, PROGRAM_CHUNK)):
+            print("Write 0x{:08x} ({:3.0f}%)\r".format(addr, i*PROGRAM_CHUNK*100.0/ len(data)), end='')
+            self.program(write_addr, p)
+            write_addr += PROGRAM_CHUNK
         print("\rWrite 0x{:08x} (100%, {:.2f}s)".format(addr, time.time() - t))
 
+    def verify(self, addr, data):
+        """Read back a binary and check it matches"""
+        t = time.time()
+        for i, p in enumerate(chunks(data, PROGRAM_CHUNK)):
+            offset = i * PROGRAM_CHUNK
+            if self.fast_read(addr + offset, len(p)) != bytearray(p):
+                raise AssertionError("Verify failed in 0x{:08x}-0x{:08x}".format(addr + offset, addr + offset + len(p)))
+        print("Verify 0x{:08x} (100%, {:.2f}s)".format(addr, time.time() - t))
+
     def write_tessel_flash(self, path, mac1, mac2):
         self.check_id()
         self.chip_erase()
-        self.write(0,       open(os.path.join(path, 'openwrt-ramips-mt7620-Default-u-boot.bin')).read())
-        self.write(0x40000, factory(mac1, mac2))
-        self.write(0x50000, open(os.path.join(path, 'openwrt-ramips-mt7620-tessel-squashfs-sysupgrade.bin')).read())
+        images = [
+            (0,       open(os.path.join(path, 'openwrt-ramips-mt7620-Default-u-boot.bin')).read()),
+            (0x40000, factory(mac1, mac2)),
+            (0x50000, open(os.path.join(path, 'openwrt-ramips-mt7620-tessel-squashfs-sysupgrade.bin')).read()),
+        ]
+        for addr, data in images:
+            self.write(addr, data)
+        for addr, data in images:
+            self.verify(addr, data)
 
 def randbyte():
     return random.randint(0, 255)
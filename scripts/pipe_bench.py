@@ -0,0 +1,125 @@
+"""
+Measure the rate of the USB pipe to usbexecd on the SoC, by reading the stdout of a process and
+writing the stdin of another. Each result is printed as a line of JSON.
+"""
+
+from __future__ import print_function
+import json
+import struct
+import time
+import usb.core
+
+CMD_OPEN = 0x01
+CMD_CLOSE = 0x02
+CMD_EXIT_STATUS = 0x05
+CMD_CLOSE_ACK = 0x06
+CMD_WRITE_CONTROL = 0x10
+CMD_WRITE_STDIN = 0x11
+CMD_WRITE_STDOUT = 0x12
+CMD_WRITE_STDERR = 0x13
+CMD_ACK_STDIN = 0x21
+CMD_ACK_STDOUT = 0x22
+CMD_ACK_STDERR = 0x23
+CMD_CLOSE_CONTROL = 0x30
+CMD_CLOSE_STDIN = 0x31
+CMD_CLOSE_STDOUT = 0x32
+
+STREAM_BYTES = 4 * 1024 * 1024
+READ_CREDIT = 0x1000
+PROCESS_ID = 0
+
+class Pipe(object):
+    def __init__(self, device):
+        self.interface = device.get_active_configuration()[(0, 0)]
+        self.interface.set_altsetting()
+        self.ep_in = self.interface[0]
+        self.ep_out = self.interface[1]
+        self.buf = bytearray()
+
+    def send(self, cmd, data=b''):
+        self.ep_out.write(bytearray([cmd, PROCESS_ID, 0, len(data)]) + bytearray(data))
+
+    def send_ack(self, cmd, credit):
+        self.send(cmd, struct.pack('<I', credit))
+
+    def read(self, n):
+        while len(self.buf) < n:
+            self.buf += bytearray(self.ep_in.read(4096, timeout=5000))
+        r, self.buf = self.buf[:n], self.buf[n:]
+        return r
+
+class Process(object):
+    def __init__(self, pipe, args):
+        self.pipe = pipe
+        self.stdin_credit = 0
+        self.stdout_bytes = 0
+        self.stdout_closed = False
+        self.exited = False
+        pipe.send(CMD_OPEN)
+        pipe.send_ack(CMD_ACK_STDOUT, READ_CREDIT)
+        pipe.send_ack(CMD_ACK_STDERR, READ_CREDIT)
+        pipe.send(CMD_WRITE_CONTROL, b'\0'.join(args))
+        pipe.send(CMD_CLOSE_CONTROL)
+
+    def handle_packet(self):
+        """Read and handle one packet from the daemon, returning its command"""
+        cmd, _, _, length = self.pipe.read(4)
+        data = self.pipe.read(length)
+        if cmd == CMD_ACK_STDIN:
+            self.stdin_credit += struct.unpack('<I', bytes(data))[0]
+        elif cmd == CMD_WRITE_STDOUT:
+            self.stdout_bytes += len(data)
+            self.pipe.send_ack(CMD_ACK_STDOUT, len(data))
+        elif cmd == CMD_WRITE_STDERR:
+            self.pipe.send_ack(CMD_ACK_STDERR, len(data))
+        elif cmd == CMD_CLOSE_STDOUT:
+            self.stdout_closed = True
+        elif cmd == CMD_EXIT_STATUS:
+            self.exited = True
+        return cmd
+
+    def close(self):
+        while not self.exited:
+            self.handle_packet()
+        self.pipe.send(CMD_CLOSE)
+        while self.handle_packet() != CMD_CLOSE_ACK:
+            pass
+
+def report(bench, nbytes, elapsed):
+    print(json.dumps({'bench': bench, 'bytes': nbytes, 'seconds': elapsed, 'bytes_per_sec': nbytes / elapsed}))
+
+def stdout_rate(pipe):
+    start = time.time()
+    p = Process(pipe, [b'head', b'-c', str(STREAM_BYTES).encode(), b'/dev/zero'])
+    while not p.stdout_closed:
+        p.handle_packet()
+    report('usb_pipe_stdout', p.stdout_bytes, time.time() - start)
+    p.close()
+
+def stdin_rate(pipe):
+    start = time.time()
+    p = Process(pipe, [b'dd', b'of=/dev/null', b'bs=4096'])
+    chunk = b'\0' * 255
+    sent = 0
+    while sent < STREAM_BYTES:
+        n = min(len(chunk), p.stdin_credit, STREAM_BYTES - sent)
+        if n == 0:
+            p.handle_packet()
+            continue
+        pipe.send(CMD_WRITE_STDIN, chunk[:n])
+        p.stdin_credit -= n
+        sent += n
+    pipe.send(CMD_CLOSE_STDIN)
+    while not p.exited:
+        p.handle_packet()
+    report('usb_pipe_stdin', sent, time.time() - start)
+    p.close()
+
+if __name__ == '__main__':
+    dev = usb.core.find(idVendor=0x1209, idProduct=0x7551)
+    if dev is None:
+        raise ValueError('device is not connected')
+
+    pipe = Pipe(dev)
+    stdout_rate(pipe)
+    stdin_rate(pipe)
@@ -0,0 +1,146 @@
+// Benchmarks of the port command processor. Each result is printed as one line of JSON.
+
+use std::io;
+use std::io::prelude::*;
+use std::thread;
+use std::time::{Duration, Instant};
+use unix_socket::UnixStream;
+
+use super::{parse_op, ReadAll};
+
+const GPIO_SAMPLES: usize = 1000;
+const GPIO_PIN: u8 = 2;
+const SPI_FRAMES: &'static [usize] = &[16, 64, 255];
+const SPI_BYTES: usize = 256 * 1024;
+const UART_FRAMES: &'static [usize] = &[16, 64, 255];
+const UART_BYTES: usize = 16 * 1024;
+// (baud rate, value of the SERCOM BAUD register)
+const UART_BAUDS: &'static [(u32, u16)] = &[(115200, 63019), (1000000, 43690)];
+
+fn op(name: &str) -> u8 {
+    parse_op(name).unwrap()
+}
+
+fn micros(d: Duration) -> f64 {
+    d.as_secs() as f64 * 1e6 + d.subsec_nanos() as f64 / 1e3
+}
+
+fn percentile(sorted: &[f64], p: f64) -> f64 {
+    sorted[((sorted.len() - 1) as f64 * p).round() as usize]
+}
+
+fn report_rate(bench: &str, frame: usize, bytes: usize, elapsed: Duration) {
+    let secs = micros(elapsed) / 1e6;
+    println!("{{\"bench\": \"{}\", \"frame\": {}, \"bytes\": {}, \"seconds\": {:.6}, \"bytes_per_sec\": {:.0}}}",
+        bench, frame, bytes, secs, bytes as f64 / secs);
+}
+
+/// Wait for every command sent so far to complete
+fn barrier(sock: &mut UnixStream) -> io::Result<()> {
+    try!(sock.write_all(&[op("ECHO"), 1, 0x5a]));
+    let mut buf = [0; 2];
+    try!(sock.read_all(&mut buf));
+    assert_eq!(buf, [op("DATA"), 0x5a]);
+    Ok(())
+}
+
+/// Round trip of a single GPIO read, one command in flight at a time
+fn gpio_latency(sock: &mut UnixStream) -> io::Result<()> {
+    let mut samples = Vec::with_capacity(GPIO_SAMPLES);
+    let mut buf = [0; 1];
+    for _ in 0..GPIO_SAMPLES {
+        let start = Instant::now();
+        try!(sock.write_all(&[op("GPIO_IN"), GPIO_PIN]));
+        try!(sock.read_all(&mut buf));
+        samples.push(micros(start.elapsed()));
+    }
+    samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    println!("{{\"bench\": \"gpio_latency\", \"samples\": {}, \"p50_us\": {:.1}, \"p90_us\": {:.1}, \"p99_us\": {:.1}, \"max_us\": {:.1}}}",
+        samples.len(), percentile(&samples, 0.5), percentile(&samples, 0.9),
+        percentile(&samples, 0.99), samples[samples.len() - 1]);
+    Ok(())
+}
+
+/// Send `frames` commands of `frame` data bytes from another thread, so the socket never waits
+/// for replies to be read
+fn write_frames(sock: &UnixStream, cmd: u8, frame: usize, frames: usize) -> io::Result<thread::JoinHandle<()>> {
+    let mut w = try!(sock.try_clone());
+    let mut packet = vec![cmd, frame as u8];
+    packet.extend((0..frame).map(|i| i as u8));
+    Ok(thread::spawn(move || {
+        for _ in 0..frames {
+            w.write_all(&packet).unwrap();
+        }
+    }))
+}
+
+/// Sustained SPI throughput with TX or TXRX commands of each frame size
+fn spi_throughput(sock: &mut UnixStream, cmd: &str) -> io::Result<()> {
+    try!(sock.write_all(&[op("ENABLE_SPI"), 0, 2, 1]));
+    for &frame in SPI_FRAMES {
+        let frames = SPI_BYTES / frame;
+        let start = Instant::now();
+        let writer = try!(write_frames(sock, op(cmd), frame, frames));
+        if cmd == "TXRX" {
+            let mut reply = vec![0; frame + 1];
+            for _ in 0..frames {
+                try!(sock.read_all(&mut reply));
+            }
+        }
+        writer.join().unwrap();
+        try!(barrier(sock));
+        report_rate(&format!("spi_{}", cmd.to_lowercase()), frame, frames * frame, start.elapsed());
+    }
+    try!(sock.write_all(&[op("DISABLE_SPI")]));
+    barrier(sock)
+}
+
+/// UART throughput through a loopback jumper from TX to RX. Dropped bytes are reported by the
+/// coprocessor and count as received.
+fn uart_loopback(sock: &mut UnixStream) -> io::Result<()> {
+    for &(baud, reg) in UART_BAUDS {
+        try!(sock.write_all(&[op("ENABLE_UART"), (reg >> 8) as u8, reg as u8]));
+        for &frame in UART_FRAMES {
+            let frames = UART_BYTES / frame;
+            let total = frames * frame;
+            let start = Instant::now();
+            let writer = try!(write_frames(sock, op("TX"), frame, frames));
+            let (mut received, mut dropped) = (0, 0);
+            while received + dropped < total {
+                let mut hdr = [0; 2];
+                try!(sock.read_all(&mut hdr));
+                match hdr[0] {
+                    0xD0 => {
+                        let mut data = vec![0; hdr[1] as usize];
+                        try!(sock.read_all(&mut data));
+                        received += data.len();
+                    }
+                    0xD1 => {
+                        let mut hi = [0; 1];
+                        try!(sock.read_all(&mut hi));
+                        dropped += hdr[1] as usize | (hi[0] as usize) << 8;
+                    }
+                    r => panic!("Unexpected reply 0x{:x}", r),
+                }
+            }
+            writer.join().unwrap();
+            report_rate(&format!("uart_loopback_{}", baud), frame, received, start.elapsed());
+            if dropped > 0 {
+                println!("{{\"bench\": \"uart_loopback_{}\", \"frame\": {}, \"dropped\": {}}}", baud, frame, dropped);
+            }
+        }
+        try!(sock.write_all(&[op("DISABLE_UART")]));
+        try!(barrier(sock));
+    }
+    Ok(())
+}
+
+pub fn run(sock: &mut UnixStream, uart: bool) -> io::Result<()> {
+    try!(gpio_latency(sock));
+    try!(spi_throughput(sock, "TX"));
+    try!(spi_throughput(sock, "TXRX"));
+    if uart {
+        try!(uart_loopback(sock));
+    }
+    Ok(())
+}
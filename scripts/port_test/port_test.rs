@@ -7,6 +7,8 @@ use std::fs::PathExt as NewPathExt;
 extern crate unix_socket;
 use unix_socket::UnixStream;
 
+mod bench;
+
 fn parse_op(s: &str) -> Option<u8> {
     if s == "_" {
         None
@@ -33,6 +35,9 @@ fn parse_op(s: &str) -> Option<u8> {
             "TXRX" => 18,
             "START" => 19,
             "STOP" => 20,
+            "MACRO_STORE" => 39,
+            "MACRO_RUN" => 40,
+            "MACRO_TRIGGER" => 41,
             "ACK" => 0x80,
             "NACK" => 0x81,
             "HIGH" => 0x82,
@@ -71,10 +76,19 @@ impl<R:Read> ReadAll for R {
     }
 }
 
-fn run_test(sock: &mut UnixStream, test: &mut BufRead) -> bool {
+// A line starting with `-` closes the socket and connects again, opening a new port session
+fn run_test(sockpath: &Path, test: &mut BufRead) -> io::Result<bool> {
     let mut success = true;
+    let mut sock = try!(UnixStream::connect(sockpath));
     for line in test.lines() {
         let line = line.unwrap();
+        if line.starts_with("-") {
+            println!("-");
+            drop(sock);
+            std::thread::sleep_ms(100);
+            sock = try!(UnixStream::connect(sockpath));
+            continue;
+        }
         let is_out = if line.starts_with("<") { true }
                 else if line.starts_with(">") { false }
                 else { continue };
@@ -100,7 +114,7 @@ fn run_test(sock: &mut UnixStream, test: &mut BufRead) -> bool {
             }
         }
     }
-    success
+    Ok(success)
 }
 
 fn run_tests(sockpath: &Path, fname: &Path) -> io::Result<()> {
@@ -116,10 +130,8 @@ fn run_tests(sockpath: &Path, fname: &Path) -> io::Result<()> {
     let mut success = true;
     for file in &files {
         println!("Running: {:?}", file);
-        let mut sock = try!(UnixStream::connect(&sockpath));
         let mut file = io::BufReader::new(try!(fs::File::open(file)));
-        success &= run_test(&mut sock, &mut file);
-        drop(sock);
+        success &= try!(run_test(&sockpath, &mut file));
         std::thread::sleep_ms(100);
     }
 
@@ -130,6 +142,12 @@ fn run_tests(sockpath: &Path, fname: &Path) -> io::Result<()> {
 fn main() {
     let args = std::env::args().collect::<Vec<_>>();
     let sockpath =  Path::new(&args[1]);
+    if args[2] == "--bench" {
+        let uart = args[3..].iter().any(|a| a == "--uart");
+        let mut sock = UnixStream::connect(&sockpath).unwrap();
+        bench::run(&mut sock, uart).unwrap();
+        return;
+    }
     let fname = Path::new(&args[2]);
     run_tests(sockpath, fname).unwrap();
 }
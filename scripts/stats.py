@@ -0,0 +1,50 @@
+"""
+Print the coprocessor's performance counters. Pass --clear to reset them after reading.
+"""
+
+from __future__ import print_function
+import struct
+import sys
+import usb.core
+
+REQ_STATS = 0x31
+# 48 MHz SysTick cycles
+CYCLES_PER_US = 48.0
+
+CHANNELS = ['usb', 'port a', 'port b', 'channel 3', 'channel 4', 'channel 5', 'channel 6', 'channel 7']
+ISRS = ['dmac', 'sync', 'eic', 'sercom', 'tcc']
+FIELDS = '<2I8I8I8I8II2I2I5III2I'
+
+dev = usb.core.find(idVendor=0x1209, idProduct=0x7551)
+if dev is None:
+    raise ValueError('device is not connected')
+
+clear = int('--clear' in sys.argv[1:])
+data = dev.ctrl_transfer(0xC0, REQ_STATS, clear, 0, struct.calcsize(FIELDS))
+v = list(struct.unpack(FIELDS, bytearray(data)))
+
+def take(n):
+    global v
+    r, v = v[:n], v[n:]
+    return r
+
+transactions, empty = take(2)
+n = len(CHANNELS)
+out_transfers, out_bytes, in_transfers, in_bytes = take(n), take(n), take(n), take(n)
+irq_latency, = take(1)
+port_errors, uart_overruns, isr_max = take(2), take(2), take(5)
+header_errors, aborted = take(2)
+i2c_nacks = take(2)
+
+print("bridge: {} transactions, {} empty, irq latency max {:.1f}us".format(
+    transactions, empty, irq_latency / CYCLES_PER_US))
+print("  {} bad headers, {} data phases retried".format(header_errors, aborted))
+for i, name in enumerate(CHANNELS):
+    if i > 2 and out_transfers[i] == 0 and in_transfers[i] == 0:
+        continue
+    print("  {}: from soc {} bytes in {}, to soc {} bytes in {}".format(
+        name, out_bytes[i], out_transfers[i], in_bytes[i], in_transfers[i]))
+for i, name in enumerate(CHANNELS[1:]):
+    print("{}: {} errors, {} uart bytes dropped, {} i2c nacks".format(
+        name, port_errors[i], uart_overruns[i], i2c_nacks[i]))
+print("isr max: " + ', '.join("{} {:.1f}us".format(name, isr_max[i] / CYCLES_PER_US) for i, name in enumerate(ISRS)))
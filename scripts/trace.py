@@ -0,0 +1,87 @@
+"""
+Print the coprocessor's event trace as a timeline. The firmware must be built with `make TRACE=1`.
+
+With no arguments the trace is read over USB and then restarted. Pass --keep to leave it frozen,
+or the name of a file holding the `trace_log` memory, as dumped over SWD with gdb:
+
+    dump binary memory trace.bin &trace_log ((char*) &trace_log) + sizeof(trace_log)
+"""
+
+from __future__ import print_function
+import struct
+import sys
+
+REQ_TRACE = 0x32
+# 48 MHz SysTick cycles
+CYCLES_PER_US = 48.0
+
+HEADER = '<IIHBB'
+ENTRY = '<IBBH'
+
+CHANNELS = ['usb', 'port a', 'port b', 'channel 3', 'channel 4', 'channel 5', 'channel 6', 'channel 7']
+ISRS = ['dmac', 'sync', 'eic', 'sercom', 'tcc']
+DMAS = ['terminal rx', 'port a rx', 'port b rx', 'dma 3', 'bridge tx', 'bridge rx', 'port a tx',
+    'adc stream', 'port b tx', 'wave', 'terminal tx']
+BRIDGE_STATES = ['disable', 'idle', 'ctrl', 'data']
+PORT_STATES = ['disable', 'read cmd', 'read arg', 'exec', 'exec async']
+
+def name(names, i):
+    return names[i] if i < len(names) else str(i)
+
+def describe(event, chan, arg):
+    if event == 0:
+        return "{} isr {}{:.2f}us".format(name(ISRS, chan), '>' if arg == 0xffff else '', arg / CYCLES_PER_US)
+    elif event == 1:
+        return "{} dma done".format(name(DMAS, chan))
+    elif event == 2:
+        return "bridge -> {}".format(name(BRIDGE_STATES, arg))
+    elif event == 3:
+        return "{} cmd {}".format(name(CHANNELS, chan), arg)
+    elif event == 4:
+        return "{} -> {}".format(name(CHANNELS, chan), name(PORT_STATES, arg))
+    elif event == 5:
+        return "{} error".format(name(CHANNELS, chan))
+    return "event {} chan {} arg {}".format(event, chan, arg)
+
+def read_usb(keep):
+    import usb.core
+    dev = usb.core.find(idVendor=0x1209, idProduct=0x7551)
+    if dev is None:
+        raise ValueError('device is not connected')
+    data = bytearray(dev.ctrl_transfer(0xC0, REQ_TRACE, 0, 0, 0xffff))
+    if not keep:
+        dev.ctrl_transfer(0xC0, REQ_TRACE, 1, 0, 0)
+    return data
+
+args = sys.argv[1:]
+files = [a for a in args if not a.startswith('--')]
+if files:
+    with open(files[0], 'rb') as f:
+        data = bytearray(f.read())
+else:
+    data = read_usb('--keep' in args)
+
+count, reload, length, frozen, _ = struct.unpack_from(HEADER, data)
+if reload == 0:
+    # Dumped over SWD without the firmware freezing it first, while SysTick free ran
+    reload = 0xffffff
+header_len = struct.calcsize(HEADER)
+entry_len = struct.calcsize(ENTRY)
+
+# Oldest first. The entries wrapped once more than `length` were recorded.
+n = min(count, length)
+first = count - n
+entries = [struct.unpack_from(ENTRY, data, header_len + entry_len * ((first + i) % length)) for i in range(n)]
+
+if count > length:
+    print("{} events, {} oldest overwritten".format(count, count - length))
+
+# SysTick counts down, so time goes forward as the stamp decreases, modulo its period. A gap of
+# more than one period between two events can't be seen.
+cycles = 0
+last = None
+for stamp, event, chan, arg in entries:
+    if last is not None:
+        cycles += (last - stamp) % (reload + 1)
+    last = stamp
+    print("{:12.2f}us  {}".format(cycles / CYCLES_PER_US, describe(event, chan, arg)))
@@ -0,0 +1,129 @@
+// Benchmarks of usbexecd stream bandwidth. Each result is printed as one line of JSON.
+
+use std::io;
+use std::io::prelude::*;
+use std::time::{Duration, Instant};
+use unix_socket::UnixStream;
+
+use super::{parse_op, ReadAll};
+
+const STREAM_BYTES: usize = 4 * 1024 * 1024;
+// Credit granted for stdout and stderr, as the CLI does
+const READ_CREDIT: u32 = 0x1000;
+const PROCESS_ID: u8 = 0;
+
+fn op(name: &str) -> u8 {
+    parse_op(name).unwrap()
+}
+
+fn micros(d: Duration) -> f64 {
+    d.as_secs() as f64 * 1e6 + d.subsec_nanos() as f64 / 1e3
+}
+
+fn report_rate(bench: &str, bytes: usize, elapsed: Duration) {
+    let secs = micros(elapsed) / 1e6;
+    println!("{{\"bench\": \"{}\", \"bytes\": {}, \"seconds\": {:.6}, \"bytes_per_sec\": {:.0}}}",
+        bench, bytes, secs, bytes as f64 / secs);
+}
+
+fn send(sock: &mut UnixStream, cmd: &str, data: &[u8]) -> io::Result<()> {
+    try!(sock.write_all(&[op(cmd), PROCESS_ID, 0, data.len() as u8]));
+    sock.write_all(data)
+}
+
+fn send_ack(sock: &mut UnixStream, cmd: &str, credit: u32) -> io::Result<()> {
+    send(sock, cmd, &[credit as u8, (credit >> 8) as u8, (credit >> 16) as u8, (credit >> 24) as u8])
+}
+
+/// State of the benchmarked process, updated from the packets the daemon sends
+struct Process {
+    stdin_credit: usize,
+    stdout_bytes: usize,
+    stdout_closed: bool,
+    exited: bool,
+}
+
+impl Process {
+    /// Read and handle one packet from the daemon, returning its command. Data read from stdout
+    /// and stderr is acknowledged right away.
+    fn handle_packet(&mut self, sock: &mut UnixStream) -> io::Result<u8> {
+        let mut hdr = [0; 4];
+        try!(sock.read_all(&mut hdr));
+        let mut data = vec![0; hdr[3] as usize];
+        try!(sock.read_all(&mut data));
+        let cmd = hdr[0];
+        if cmd == op("CMD_ACK_STDIN") {
+            self.stdin_credit += data[0] as usize | (data[1] as usize) << 8
+                | (data[2] as usize) << 16 | (data[3] as usize) << 24;
+        } else if cmd == op("CMD_WRITE_STDOUT") {
+            self.stdout_bytes += data.len();
+            try!(send_ack(sock, "CMD_ACK_STDOUT", data.len() as u32));
+        } else if cmd == op("CMD_WRITE_STDERR") {
+            try!(send_ack(sock, "CMD_ACK_STDERR", data.len() as u32));
+        } else if cmd == op("CMD_CLOSE_STDOUT") {
+            self.stdout_closed = true;
+        } else if cmd == op("CMD_EXIT_STATUS") {
+            self.exited = true;
+        }
+        Ok(cmd)
+    }
+
+    /// Start a process with NUL-separated arguments
+    fn open(sock: &mut UnixStream, args: &str) -> io::Result<Process> {
+        try!(send(sock, "CMD_OPEN", &[]));
+        try!(send_ack(sock, "CMD_ACK_STDOUT", READ_CREDIT));
+        try!(send_ack(sock, "CMD_ACK_STDERR", READ_CREDIT));
+        try!(send(sock, "CMD_WRITE_CONTROL", args.as_bytes()));
+        try!(send(sock, "CMD_CLOSE_CONTROL", &[]));
+        Ok(Process { stdin_credit: 0, stdout_bytes: 0, stdout_closed: false, exited: false })
+    }
+
+    fn close(mut self, sock: &mut UnixStream) -> io::Result<()> {
+        while !self.exited {
+            try!(self.handle_packet(sock));
+        }
+        try!(send(sock, "CMD_CLOSE", &[]));
+        while try!(self.handle_packet(sock)) != op("CMD_CLOSE_ACK") {}
+        Ok(())
+    }
+}
+
+/// Bandwidth of the stdout of a process writing as fast as it can
+fn stdout_bandwidth(sock: &mut UnixStream) -> io::Result<()> {
+    let start = Instant::now();
+    let mut p = try!(Process::open(sock, &format!("head\0-c\0{}\0/dev/zero", STREAM_BYTES)));
+    while !p.stdout_closed {
+        try!(p.handle_packet(sock));
+    }
+    report_rate("usbexecd_stdout", p.stdout_bytes, start.elapsed());
+    p.close(sock)
+}
+
+/// Bandwidth of the stdin of a process reading as fast as it can
+fn stdin_bandwidth(sock: &mut UnixStream) -> io::Result<()> {
+    let start = Instant::now();
+    let mut p = try!(Process::open(sock, "dd\0of=/dev/null\0bs=4096"));
+    let chunk = [0; 255];
+    let mut sent = 0;
+    while sent < STREAM_BYTES {
+        let len = *[chunk.len(), p.stdin_credit, STREAM_BYTES - sent].iter().min().unwrap();
+        if len == 0 {
+            try!(p.handle_packet(sock));
+            continue;
+        }
+        try!(send(sock, "CMD_WRITE_STDIN", &chunk[..len]));
+        p.stdin_credit -= len;
+        sent += len;
+    }
+    try!(send(sock, "CMD_CLOSE_STDIN", &[]));
+    while !p.exited {
+        try!(p.handle_packet(sock));
+    }
+    report_rate("usbexecd_stdin", sent, start.elapsed());
+    p.close(sock)
+}
+
+pub fn run(sock: &mut UnixStream) -> io::Result<()> {
+    try!(stdout_bandwidth(sock));
+    stdin_bandwidth(sock)
+}
@@ -12,6 +12,8 @@ use unix_socket::UnixListener;
 
 use std::net::Shutdown;
 
+mod bench;
+
 fn parse_op(s: &str) -> Option<u8> {
     if s == "_" {
         None
@@ -136,6 +138,14 @@ fn main() {
 
     let args = std::env::args().collect::<Vec<_>>();
     let sockpath =  Path::new(&args[1]);
+    if args[2] == "--bench" {
+        let listener = UnixListener::bind(&sockpath).unwrap();
+        let mut sock = listener.accept().unwrap();
+        bench::run(&mut sock).unwrap();
+        sock.shutdown(Shutdown::Both).unwrap();
+        fs::remove_file(sockpath).unwrap();
+        return;
+    }
     let fname = Path::new(&args[2]);
     println!("Starting test at socket path {:?}", sockpath);
 
@@ -15,18 +15,86 @@
 #include <sys/ioctl.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
+#include <linux/sockios.h>
+#include <linux/version.h>
 #include <syslog.h>
-
-#define N_CHANNEL 3
-#define BUFSIZE 255
+#include <time.h>
+#include <signal.h>
+
+// The GPIO character device is available since Linux 4.8. With older kernel headers only the
+// sysfs interface is built.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+#define HAVE_GPIO_CDEV
+#include <linux/gpio.h>
+#endif
+
+// Channels 0-2 are available with both framing versions, the rest only with version 2
+#define N_CHANNEL 8
+#define N_CHANNEL_V1 3
+#define BUFSIZE 1024
+#define BUFSIZE_V1 255
+// Per-channel ring of data read from a socket and waiting to be sent to the coprocessor
+#define OUT_RING_SIZE (BUFSIZE * 4)
+
+// Header command bytes for each framing version. Version 1 carries 8-bit lengths, version 2
+// appends the high byte of each channel's length to the version 1 header.
+#define CMD_V1 0x53
+#define REPLY_V1 0xCA
+#define CMD_V2 0x54
+#define REPLY_V2 0xCB
 
 #define STATUS_TRUE 1
 #define STATUS_FALSE 0
 #define STATUS_BYTE 0x01
 #define STATUS_BIT 0x10
+// Channels whose ready and open bits fit in the version 1 status byte
+#define STATUS_CHAN_MASK ((1 << N_CHANNEL_V1) - 1)
+// Set by the coprocessor if it supports version 2 framing, and by us in a version 1 header to
+// switch to version 2 starting with the next transaction
+#define STATUS_V2 0x80
+
+// Version 2 header flag: we support pipelining. When both headers of a transaction with data set
+// it, the data phase ends with a trailer in which both sides exchange the header for the next
+// transaction, and the next transaction skips its header phase.
+#define FLAGS_BYTE (2 + 2 * N_CHANNEL)
+#define FLAG_PIPELINE 0x01
+// Version 2 headers carry the ready and open bits of every channel in these bytes
+#define READY_BYTE (FLAGS_BYTE + 1)
+#define OPEN_BYTE (FLAGS_BYTE + 2)
+// Version 2 headers end with a sequence number and a check byte. We number our headers, and the
+// coprocessor answers with the number of the last one whose transaction took effect, so a data
+// phase whose trailer was lost can be resolved. Headers whose check doesn't match are ignored.
+#define SEQ_BYTE (FLAGS_BYTE + 3)
+#define CHECK_BYTE (FLAGS_BYTE + 4)
+#define HEADER_MAX_LENGTH (CHECK_BYTE + 1)
+
+// Number of consecutive pipelined transactions before the sockets are polled again
+#define PIPELINE_MAX_RUN 16
+
+// Consecutive bad replies retried right away, as a corrupted header is more likely than a
+// coprocessor that stopped answering. After that the wait before sending a header again starts at
+// RETRY_POLL_TIMEOUT ms and doubles with each bad reply, up to RETRY_POLL_TIMEOUT_MAX.
+#define RETRY_IMMEDIATE 3
+#define RETRY_POLL_TIMEOUT 100
+#define RETRY_POLL_TIMEOUT_MAX 3200
 
 #define USBD_CHANNEL 0
 
+// Priority class of each channel, lower is more urgent. These match the bridge_channels table in
+// the firmware: streams, then port commands, then the USB pipe's bulk transfers.
+const int channel_priority[N_CHANNEL] = {2, 1, 1, 0, 0, 0, 0, 0};
+#define PRIORITY_BULK 2
+
+// Largest frame announced on a channel while a more urgent channel has data to send, so the
+// urgent data isn't held up behind full bulk frames. Can be overridden with SPID_BULK_CAP, and 0
+// turns off the capping and the check for urgent data between pipelined transactions.
+#define BULK_CAP 256
+
+// Time the coprocessor needs after a SYNC edge before it is ready for the next SPI phase. On the
+// falling edge it resets the SERCOM and arms the header DMA, on the rising edge it decodes the
+// header and builds the data DMA chain. Can be overridden with SPID_SYNC_SETUP_US.
+#define SYNC_SETUP_US 10
+
 #define debug(args...)
 #define info(args...)   syslog(LOG_INFO, args)
 #define error(args...)  syslog(LOG_ERR, args)
@@ -36,18 +104,97 @@
 })
 
 typedef struct ChannelData {
-    int in_length;
-    char out_buf[BUFSIZE];
+    // Ring of data from the socket. SPI transfers are sent directly from it.
+    char out_buf[OUT_RING_SIZE];
+    // Position of the oldest byte in the ring
+    int out_start;
+    // Number of bytes in the ring
     int out_length;
+    // Bytes before out_start sent in a data phase the coprocessor hasn't confirmed yet, which
+    // are kept in case it has to be sent again
+    int out_sent;
+    // The socket reached end of file, close it once the ring is drained
+    bool out_eof;
     char in_buf[BUFSIZE];
 } ChannelData;
 
 ChannelData channels[N_CHANNEL];
 
+// Negotiated framing version, and whether the coprocessor has advertised version 2 support
+int protocol_version = 1;
+bool protocol_v2_supported = false;
+
+// Headers for the next transaction, exchanged in the trailer of the current one
+uint8_t next_tx_buf[HEADER_MAX_LENGTH];
+uint8_t next_rx_buf[HEADER_MAX_LENGTH];
+int pipeline_run = 0;
+bool pipeline_next = false;
+
+// Sequence number of our last header
+uint8_t header_seq = 0;
+
+// A data phase whose trailer was lost, so it isn't known whether the coprocessor took part. The
+// data it sent us is held in the channels' in_buf, and what we sent stays in the rings, until the
+// sequence number in the next header tells.
+bool unconfirmed = false;
+uint8_t unconfirmed_seq;
+uint8_t unconfirmed_rx;
+int unconfirmed_size[N_CHANNEL];
+
 uint8_t channels_writable_bitmask;
 uint8_t channels_opened_bitmask;
 uint8_t channels_enabled_bitmask;
 
+// The coprocessor's queues as of the last header it sent, less the buffers moved in that
+// transaction's data phase. It keeps the same view of what we know and raises IRQ when its queues
+// change, so a transaction is only needed when one of our own channels changes.
+uint8_t coprocessor_ready; // Channels that can accept data from us
+uint8_t coprocessor_pending; // Channels with data waiting for us
+uint8_t announced_opened; // Our open channels as the coprocessor last took them
+// Our open channels as sent in the last header, and its sequence number. With version 2 framing,
+// the coprocessor may ignore a header, so they only count as announced once it answers with it.
+uint8_t sent_opened;
+uint8_t sent_opened_seq;
+bool transaction_needed = true;
+
+// Counters logged on SIGUSR1
+typedef struct Stats {
+    unsigned long polls;
+    unsigned long irqs; // poll() wakeups by the IRQ pin
+    unsigned long idle; // poll() wakeups that didn't need a transaction
+    unsigned long transactions;
+    unsigned long pipelined; // Transactions whose header came from the previous trailer
+    unsigned long empty; // Transactions without a data phase
+    unsigned long urgent_reads; // Sockets read between pipelined transactions
+    unsigned long header_errors;
+    unsigned long trailer_errors;
+    unsigned long resent; // Data phases sent again after their trailer was lost
+    unsigned long send_errors;
+    unsigned long tx_transfers[N_CHANNEL];
+    unsigned long tx_bytes[N_CHANNEL]; // To the coprocessor
+    unsigned long rx_transfers[N_CHANNEL];
+    unsigned long rx_bytes[N_CHANNEL]; // From the coprocessor
+    long transaction_us_max; // From SYNC falling until the data phase is done
+} Stats;
+
+Stats stats;
+volatile sig_atomic_t stats_requested = 0;
+
+void stats_signal(int sig) {
+    stats_requested = 1;
+}
+
+void stats_dump() {
+    info("stats: %lu polls, %lu irqs, %lu idle, %lu transactions (%lu pipelined, %lu empty), longest %ldus\n",
+        stats.polls, stats.irqs, stats.idle, stats.transactions, stats.pipelined, stats.empty, stats.transaction_us_max);
+    info("stats: %lu header errors, %lu trailer errors (%lu resent), %lu send errors, %lu urgent reads\n",
+        stats.header_errors, stats.trailer_errors, stats.resent, stats.send_errors, stats.urgent_reads);
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        info("stats: channel %d: tx %lu bytes in %lu, rx %lu bytes in %lu\n", chan,
+            stats.tx_bytes[chan], stats.tx_transfers[chan], stats.rx_bytes[chan], stats.rx_transfers[chan]);
+    }
+}
+
 /// Use sysfs to export the specified GPIO
 void gpio_export(const char* gpio) {
     char path[512];
@@ -97,6 +244,148 @@ void gpio_edge(const char* gpio, const char* mode) {
     close(fd);
 }
 
+/// A GPIO pin accessed either through its sysfs value file or a GPIO character device line
+typedef struct Gpio {
+    int fd;
+    bool cdev;
+} Gpio;
+
+Gpio irq_gpio;
+Gpio sync_gpio;
+
+/*
+Parses a GPIO character device line specification of the form /dev/gpiochipN:line
+
+Returns:
+    true and fills chip and line if the argument names a character device line
+    false if the argument is a sysfs GPIO number
+*/
+bool gpio_parse_cdev(const char* arg, char* chip, size_t chip_len, int* line) {
+    const char* sep = strrchr(arg, ':');
+    if (sep == NULL) {
+        return false;
+    }
+#ifdef HAVE_GPIO_CDEV
+    snprintf(chip, chip_len, "%.*s", (int)(sep - arg), arg);
+    *line = atoi(sep + 1);
+    return true;
+#else
+    fatal("GPIO %s: spid was built without GPIO character device support\n", arg);
+#endif
+}
+
+#ifdef HAVE_GPIO_CDEV
+int gpio_cdev_open_chip(const char* chip) {
+    int fd = open(chip, O_RDONLY);
+    if (fd < 0) {
+        fatal("Error opening %s: %s\n", chip, strerror(errno));
+    }
+    return fd;
+}
+#endif
+
+/// Set up the IRQ pin as an input that reports rising edges
+void gpio_irq_setup(Gpio* gpio, const char* arg) {
+    char chip[256];
+    int line;
+    if (gpio_parse_cdev(arg, chip, sizeof(chip), &line)) {
+#ifdef HAVE_GPIO_CDEV
+        int chip_fd = gpio_cdev_open_chip(chip);
+        struct gpioevent_request req;
+        memset(&req, 0, sizeof(req));
+        req.lineoffset = line;
+        req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+        req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+        snprintf(req.consumer_label, sizeof(req.consumer_label), "spid-irq");
+        if (ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+            fatal("GPIO_GET_LINEEVENT_IOCTL %s: %s\n", arg, strerror(errno));
+        }
+        close(chip_fd);
+        gpio->fd = req.fd;
+        gpio->cdev = true;
+#endif
+    } else {
+        gpio_export(arg);
+        gpio_direction(arg, "in");
+        gpio_edge(arg, "rising");
+        gpio->fd = gpio_open(arg, "value");
+        gpio->cdev = false;
+    }
+}
+
+/// Set up the SYNC pin as an output, initially high
+void gpio_sync_setup(Gpio* gpio, const char* arg) {
+    char chip[256];
+    int line;
+    if (gpio_parse_cdev(arg, chip, sizeof(chip), &line)) {
+#ifdef HAVE_GPIO_CDEV
+        int chip_fd = gpio_cdev_open_chip(chip);
+        struct gpiohandle_request req;
+        memset(&req, 0, sizeof(req));
+        req.lineoffsets[0] = line;
+        req.lines = 1;
+        req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+        req.default_values[0] = 1;
+        snprintf(req.consumer_label, sizeof(req.consumer_label), "spid-sync");
+        if (ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0) {
+            fatal("GPIO_GET_LINEHANDLE_IOCTL %s: %s\n", arg, strerror(errno));
+        }
+        close(chip_fd);
+        gpio->fd = req.fd;
+        gpio->cdev = true;
+#endif
+    } else {
+        gpio_export(arg);
+        gpio_edge(arg, "none");
+        gpio_direction(arg, "high");
+        gpio->fd = gpio_open(arg, "value");
+        gpio->cdev = false;
+    }
+}
+
+/// Poll events that signal an edge on the IRQ pin
+short gpio_irq_events(Gpio* gpio) {
+    return gpio->cdev ? POLLIN : POLLPRI;
+}
+
+/// Acknowledge an edge on the IRQ pin so the next one can be polled for
+void gpio_irq_ack(Gpio* gpio) {
+#ifdef HAVE_GPIO_CDEV
+    if (gpio->cdev) {
+        // Drain all queued edge events, one transaction serves them all
+        struct gpioevent_data events[16];
+        if (read(gpio->fd, events, sizeof(events)) < 0) {
+            fatal("GPIO event read: %s", strerror(errno));
+        }
+        return;
+    }
+#endif
+    char buf[2];
+    lseek(gpio->fd, SEEK_SET, 0);
+    if (read(gpio->fd, buf, 2) < 0) {
+        fatal("GPIO read: %s", strerror(errno));
+    }
+    debug("GPIO interrupt %c\n", buf[0]);
+}
+
+/// Drive an output pin
+void gpio_write(Gpio* gpio, bool value) {
+#ifdef HAVE_GPIO_CDEV
+    if (gpio->cdev) {
+        struct gpiohandle_data data;
+        memset(&data, 0, sizeof(data));
+        data.values[0] = value;
+        if (ioctl(gpio->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0) {
+            fatal("GPIOHANDLE_SET_LINE_VALUES_IOCTL: %s", strerror(errno));
+        }
+        return;
+    }
+#endif
+    if (write(gpio->fd, value ? "1" : "0", 1) < 0) {
+        fatal("GPIO write: %s", strerror(errno));
+    }
+}
+
 // IRQ pin pollfd (when coprocessor has async data)
 #define GPIO_POLL fds[0]
 // connected domain socket pollfds
@@ -104,11 +393,29 @@ void gpio_edge(const char* gpio, const char* mode) {
 // listening domain socket pollfds
 #define SOCK_POLL(n) fds[1 + N_CHANNEL + n]
 #define N_POLLFDS (N_CHANNEL * 2 + 1)
+// A connection that hung up but still has data in its ring is parked as a negative fd, which
+// poll() ignores, so its hangup isn't reported on every call
+#define PARK_FD(fd) (-2 - (fd))
 struct pollfd fds[N_POLLFDS];
 int usbd_sock_fd;
 struct sockaddr_un usbd_sock_addr;
+
+int sync_setup_us = SYNC_SETUP_US;
+int bulk_cap = BULK_CAP;
+
+/// Microseconds since a CLOCK_MONOTONIC time
+long elapsed_us(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/// Wait for the coprocessor to handle a SYNC edge. This spins instead of calling usleep(), whose
+/// wakeup latency on the MT7620 is many times the few microseconds the coprocessor needs.
 void delay() {
-    usleep(10);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed_us(&start) < sync_setup_us);
 }
 
 /*
@@ -145,6 +452,21 @@ void set_channel_bitmask_state(uint8_t *bitmask, uint8_t channel, bool state) {
     }
 }
 
+/// Number of channels the current framing version can address
+int header_channels() {
+    return protocol_version == 2 ? N_CHANNEL : N_CHANNEL_V1;
+}
+
+/// Bitmap of the channels ready to receive in a header packet
+uint8_t header_ready(uint8_t *buf) {
+    return protocol_version == 2 ? buf[READY_BYTE] : buf[STATUS_BYTE] & STATUS_CHAN_MASK;
+}
+
+/// Bitmap of the open channels in a header packet
+uint8_t header_open(uint8_t *buf) {
+    return protocol_version == 2 ? buf[OPEN_BYTE] : (buf[STATUS_BYTE] >> 4) & STATUS_CHAN_MASK;
+}
+
 /*
 Helper function to pull out the correct bitmask from a buffer header sent by the coprocessor
 
@@ -153,7 +475,7 @@ Args:
     channel: The connection channel to get the enabled status of
 */
 uint8_t extract_enabled_state(uint8_t *rx_buf, uint8_t channel) {
-    return ((rx_buf[STATUS_BYTE] & (STATUS_BIT << channel)) ? STATUS_TRUE : STATUS_FALSE);
+    return (header_open(rx_buf) & (1 << channel)) ? STATUS_TRUE : STATUS_FALSE;
 }
 
 /*
@@ -170,11 +492,15 @@ void close_channel_connection(uint8_t channel) {
 
     info("Closing connection %d\n", channel);
     // Close the file descriptor
-    close(CONN_POLL(channel).fd);
+    int fd = CONN_POLL(channel).fd;
+    close(fd >= 0 ? fd : PARK_FD(fd));
     // Reset the file descriptor
     CONN_POLL(channel).fd = -1;
     // Clear the outgoing data
     channels[channel].out_length = 0;
+    channels[channel].out_sent = 0;
+    channels[channel].out_start = 0;
+    channels[channel].out_eof = false;
     // Re-enable events on a new connection if it's still enabled
     if (get_channel_bitmask_state(&channels_enabled_bitmask, channel) && channel != USBD_CHANNEL) {
         SOCK_POLL(channel).events = POLLIN;
@@ -216,6 +542,318 @@ void enable_usb_daemon_socket() {
     set_channel_bitmask_state(&channels_opened_bitmask, USBD_CHANNEL, true);
 }
 
+/// Largest transfer per channel per transaction for the current framing version
+int max_transfer_size() {
+    return protocol_version == 2 ? BUFSIZE : BUFSIZE_V1;
+}
+
+/// Length of the header packet for the current framing version
+int header_length() {
+    return protocol_version == 2 ? HEADER_MAX_LENGTH : 2 + N_CHANNEL_V1;
+}
+
+/// Decode the length of a channel from a header packet
+int header_size(uint8_t *buf, int chan) {
+    if (chan >= header_channels()) {
+        return 0;
+    }
+    int size = buf[2 + chan];
+    if (protocol_version == 2) {
+        size |= buf[2 + N_CHANNEL + chan] << 8;
+    }
+    return size;
+}
+
+/// Rotating XOR of the bytes of a version 2 header before its check byte, as the coprocessor
+/// computes it
+uint8_t header_check(uint8_t *buf) {
+    uint8_t check = 0;
+    for (int i=0; i<CHECK_BYTE; i++) {
+        check = ((check << 1) | (check >> 7)) ^ buf[i];
+    }
+    return check;
+}
+
+/// True if a header from the coprocessor has the command byte and check of a version, and sizes
+/// within the limit
+bool header_valid(uint8_t *buf, int version) {
+    if (buf[0] != (version == 2 ? REPLY_V2 : REPLY_V1)) {
+        return false;
+    }
+    if (version == 2 && buf[CHECK_BYTE] != header_check(buf)) {
+        return false;
+    }
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        if (header_size(buf, chan) > BUFSIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+Fills a header with the data waiting to be sent on each channel
+
+Args:
+    buf: The header to fill
+    writable: bitmask of channels that can accept data from the coprocessor
+    request_v2: Ask the coprocessor to switch to version 2 framing after this transaction
+*/
+void fill_header(uint8_t *buf, uint8_t writable, bool request_v2) {
+    memset(buf, 0, HEADER_MAX_LENGTH);
+    buf[0] = protocol_version == 2 ? CMD_V2 : CMD_V1;
+    buf[STATUS_BYTE] = (writable & STATUS_CHAN_MASK) | ((channels_opened_bitmask & STATUS_CHAN_MASK) << 4);
+    if (request_v2) {
+        buf[STATUS_BYTE] |= STATUS_V2;
+    }
+    buf[READY_BYTE] = writable;
+    buf[OPEN_BYTE] = channels_opened_bitmask;
+
+    int urgent = PRIORITY_BULK;
+    for (int i=0; i<header_channels(); i++) {
+        if (channels[i].out_length > 0 && channel_priority[i] < urgent) {
+            urgent = channel_priority[i];
+        }
+    }
+
+    for (int i=0; i<header_channels(); i++) {
+        int size = channels[i].out_length;
+        if (size > max_transfer_size()) {
+            size = max_transfer_size();
+        }
+        if (bulk_cap > 0 && channel_priority[i] > urgent && size > bulk_cap) {
+            size = bulk_cap;
+        }
+        buf[2+i] = size & 0xFF;
+        buf[2+N_CHANNEL+i] = size >> 8;
+    }
+
+    if (protocol_version == 2) {
+        // The trailer also confirms the data phase, so it is always asked for. The pipeline is
+        // broken to poll the sockets by sending a header after it.
+        buf[FLAGS_BYTE] = FLAG_PIPELINE;
+        buf[SEQ_BYTE] = ++header_seq;
+        buf[CHECK_BYTE] = header_check(buf);
+    }
+}
+
+/// Fills a header without sizes or ready channels, which only asks the coprocessor for the
+/// sequence number of the last transaction it completed
+void fill_probe_header(uint8_t *buf) {
+    fill_header(buf, 0, false);
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        buf[2 + chan] = 0;
+        buf[2 + N_CHANNEL + chan] = 0;
+    }
+    buf[CHECK_BYTE] = header_check(buf);
+}
+
+/// Number of SPI transfers in the data phase described by a pair of headers
+int count_transfers(uint8_t *tx_buf, uint8_t *rx_buf) {
+    int desc = 0;
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        if (header_ready(rx_buf) & (1<<chan) && header_size(tx_buf, chan) > 0) desc++;
+        if (header_ready(tx_buf) & (1<<chan) && header_size(rx_buf, chan) > 0) desc++;
+    }
+    return desc;
+}
+
+/// True if the data phase described by a pair of headers ends with a trailer
+bool has_trailer(uint8_t *tx_buf, uint8_t *rx_buf) {
+    return protocol_version == 2
+        && (tx_buf[FLAGS_BYTE] & FLAG_PIPELINE)
+        && (rx_buf[FLAGS_BYTE] & FLAG_PIPELINE)
+        && count_transfers(tx_buf, rx_buf) > 0;
+}
+
+/*
+Records the coprocessor's queues from the headers of a transaction
+
+Args:
+    tx_buf: The header we sent
+    rx_buf: The header the coprocessor sent
+    moved: The data phase took place, so the transfers it describes are no longer pending
+*/
+void coprocessor_view_update(uint8_t *tx_buf, uint8_t *rx_buf, bool moved) {
+    coprocessor_ready = header_ready(rx_buf);
+    coprocessor_pending = 0;
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        if (header_size(rx_buf, chan) > 0) {
+            coprocessor_pending |= (1<<chan);
+        }
+        if (moved) {
+            if (header_ready(rx_buf) & (1<<chan) && header_size(tx_buf, chan) > 0) coprocessor_ready &= ~(1<<chan);
+            if (header_ready(tx_buf) & (1<<chan)) coprocessor_pending &= ~(1<<chan);
+        }
+    }
+    sent_opened = header_open(tx_buf);
+    sent_opened_seq = tx_buf[SEQ_BYTE];
+    if (tx_buf[0] != CMD_V2) {
+        announced_opened = sent_opened;
+    }
+}
+
+/// Take the open channels of our last header as announced if the coprocessor answered with its
+/// sequence number. Until then bridge_has_work sends headers, which carry the open channels again.
+void opened_confirm(uint8_t seq) {
+    if (seq == sent_opened_seq) {
+        announced_opened = sent_opened;
+    }
+}
+
+/// True if our side has something for the coprocessor, or can take what it has waiting
+bool bridge_has_work() {
+    if (transaction_needed || channels_opened_bitmask != announced_opened) {
+        return true;
+    }
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        if (channels[chan].out_length > 0 && (coprocessor_ready & (1<<chan))) return true;
+        if (channels_writable_bitmask & coprocessor_pending & (1<<chan)) return true;
+    }
+    return false;
+}
+
+/// True if `size` bytes can be written to a socket without blocking
+bool socket_has_room(int fd, int size) {
+    int sndbuf, queued;
+    socklen_t len = sizeof(sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) < 0 || ioctl(fd, SIOCOUTQ, &queued) < 0) {
+        return false;
+    }
+    return sndbuf - queued >= size;
+}
+
+/*
+Reads everything available on a channel's socket into its ring, without blocking
+
+Returns:
+    false if the socket had an error and should be closed
+*/
+bool channel_fill_ring(uint8_t chan) {
+    ChannelData* c = &channels[chan];
+    while (c->out_length + c->out_sent < OUT_RING_SIZE && !c->out_eof) {
+        // The free space may wrap around the end of the ring
+        int end = (c->out_start + c->out_length) % OUT_RING_SIZE;
+        int free = OUT_RING_SIZE - c->out_length - c->out_sent;
+        struct iovec iov[2];
+        iov[0].iov_base = &c->out_buf[end];
+        iov[0].iov_len = (free < OUT_RING_SIZE - end) ? free : OUT_RING_SIZE - end;
+        iov[1].iov_base = &c->out_buf[0];
+        iov[1].iov_len = free - iov[0].iov_len;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+        int length = recvmsg(CONN_POLL(chan).fd, &msg, MSG_DONTWAIT);
+        debug("%i: Read %i\n", chan, length);
+
+        if (length > 0) {
+            c->out_length += length;
+        } else if (length == 0) {
+            c->out_eof = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            error("Error in read %i: %s\n", chan, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Writes data received from the coprocessor to a channel's socket
+void channel_send(uint8_t chan, int size) {
+    // The peer may have hung up while its ring drains, so don't let that raise SIGPIPE
+    int r = send(CONN_POLL(chan).fd, &channels[chan].in_buf[0], size, MSG_NOSIGNAL);
+    debug("%i: Write %u %i\n", chan, size, r);
+    if (r < 0) {
+        error("Error in write %i: %s\n", chan, strerror(errno));
+        stats.send_errors++;
+    }
+}
+
+/*
+Completes a data phase whose trailer was lost, once a header from the coprocessor tells whether it
+took place
+
+Args:
+    done: The coprocessor completed the data phase, so the data it sent is passed on. Otherwise
+        that data is dropped, and ours is sent again.
+*/
+void unconfirmed_resolve(bool done) {
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        ChannelData* c = &channels[chan];
+        if (done && (unconfirmed_rx & (1<<chan)) && CONN_POLL(chan).fd >= 0) {
+            channel_send(chan, unconfirmed_size[chan]);
+        } else if (!done) {
+            c->out_start = (c->out_start + OUT_RING_SIZE - c->out_sent) % OUT_RING_SIZE;
+            c->out_length += c->out_sent;
+        }
+        c->out_sent = 0;
+    }
+    if (!done) {
+        stats.resent++;
+    }
+    unconfirmed = false;
+}
+
+/// Milliseconds to wait before sending a header again after a number of consecutive bad replies
+int retry_timeout(int retries) {
+    if (retries <= RETRY_IMMEDIATE) {
+        return 0;
+    }
+    int timeout = RETRY_POLL_TIMEOUT;
+    for (int i=RETRY_IMMEDIATE + 1; i<retries && timeout < RETRY_POLL_TIMEOUT_MAX; i++) {
+        timeout *= 2;
+    }
+    return timeout < RETRY_POLL_TIMEOUT_MAX ? timeout : RETRY_POLL_TIMEOUT_MAX;
+}
+
+/// Only poll a socket for reading while there is room in its ring
+void channel_update_read_events(uint8_t chan) {
+    if (channels[chan].out_length + channels[chan].out_sent < OUT_RING_SIZE && !channels[chan].out_eof) {
+        CONN_POLL(chan).events |= POLLIN;
+    } else {
+        CONN_POLL(chan).events &= ~POLLIN;
+    }
+}
+
+/*
+Reads data waiting on the sockets of channels more urgent than bulk, without blocking. Called
+between pipelined transactions so a small command goes in the next trailer instead of waiting for
+the pipeline to end. Other events are left for the next poll in the main loop.
+*/
+void channel_fill_urgent() {
+    struct pollfd urgent[N_CHANNEL];
+    int chans[N_CHANNEL];
+    int n = 0;
+    for (int chan=0; chan<N_CHANNEL; chan++) {
+        if (channel_priority[chan] < PRIORITY_BULK && CONN_POLL(chan).fd >= 0
+            && (CONN_POLL(chan).events & POLLIN)) {
+            urgent[n].fd = CONN_POLL(chan).fd;
+            urgent[n].events = POLLIN;
+            urgent[n].revents = 0;
+            chans[n] = chan;
+            n++;
+        }
+    }
+
+    if (n == 0 || poll(urgent, n, 0) <= 0) {
+        return;
+    }
+
+    for (int i=0; i<n; i++) {
+        if (urgent[i].revents & POLLIN) {
+            // Errors and hangups are handled by the main loop
+            channel_fill_ring(chans[i]);
+            channel_update_read_events(chans[i]);
+            stats.urgent_reads++;
+        }
+    }
+}
+
 /*
 Checks for any requested changes from MCU in a channel's open/close status and obliges
 
@@ -280,9 +918,28 @@ int main(int argc, char** argv) {
     info("Starting");
 
     if (argc != 5) {
-      fatal("usage: spid /dev/spidev0.1 irq_gpio sync_gpio /var/run/tessel\n");
+      fatal("usage: spid /dev/spidev0.1 irq_gpio sync_gpio /var/run/tessel\n"
+            "  GPIOs are sysfs numbers, or /dev/gpiochipN:line to use the GPIO character device\n");
     }
 
+    const char* setup_env = getenv("SPID_SYNC_SETUP_US");
+    if (setup_env != NULL) {
+        sync_setup_us = atoi(setup_env);
+    }
+
+    const char* cap_env = getenv("SPID_BULK_CAP");
+    if (cap_env != NULL) {
+        bulk_cap = atoi(cap_env);
+    }
+
+    // Log the counters on SIGUSR1
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stats_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
     // Open SPI
     int spi_fd = open(argv[1], O_RDWR);
     if (spi_fd < 0) {
@@ -290,22 +947,16 @@ int main(int argc, char** argv) {
     }
 
     // set up IRQ pin
-    gpio_export(argv[2]);
-    gpio_direction(argv[2], "in");
-    gpio_edge(argv[2], "rising");
-    int irq_fd = gpio_open(argv[2], "value");
+    gpio_irq_setup(&irq_gpio, argv[2]);
 
     // set up sync pin
-    gpio_export(argv[3]);
-    gpio_edge(argv[3], "none");
-    gpio_direction(argv[3], "high");
-    int sync_fd = gpio_open(argv[3], "value");
+    gpio_sync_setup(&sync_gpio, argv[3]);
 
     memset(channels, 0, sizeof(channels));
     memset(fds, 0, sizeof(fds));
 
-    GPIO_POLL.fd = irq_fd;
-    GPIO_POLL.events = POLLPRI;
+    GPIO_POLL.fd = irq_gpio.fd;
+    GPIO_POLL.events = gpio_irq_events(&irq_gpio);
 
     // Create the listening unix domain sockets
     for (int i = 0; i<N_CHANNEL; i++) {
@@ -361,181 +1012,287 @@ int main(int argc, char** argv) {
     int retries = 0;
 
     while (1) {
-        for (int i=0; i<N_POLLFDS; i++) {
-            fds[i].revents = 0;
+        if (stats_requested) {
+            stats_requested = 0;
+            stats_dump();
         }
 
-        int nfds = poll(fds, N_POLLFDS, 5000);
-        if (nfds < 0) {
-            fatal("Error in poll: %s", strerror(errno));
-        }
+        // A valid trailer in the previous transaction already exchanged this transaction's headers
+        bool pipelined = pipeline_next;
+        pipeline_next = false;
 
-        debug("poll returned: %i\n", nfds);
+        if (!pipelined) {
+            pipeline_run = 0;
 
-        for (int i=0; i<N_POLLFDS; i++) {
-            debug("%x ", fds[i].events);
-        }
-        debug("- %x %x %x %x %x \n", POLLIN, POLLOUT, POLLERR, POLLHUP, POLLRDHUP);
+            for (int i=0; i<N_POLLFDS; i++) {
+                fds[i].revents = 0;
+            }
 
-        for (int i=0; i<N_POLLFDS; i++) {
-            debug("%x ", fds[i].revents);
-        }
-        debug("\n");
-
-        // If it was a GPIO interrupt on the IRQ pin, acknowlege it
-        if (GPIO_POLL.revents & POLLPRI) {
-            char buf[2];
-            lseek(irq_fd, SEEK_SET, 0);
-            if (read(irq_fd, buf, 2) < 0) {
-                fatal("GPIO read: %s", strerror(errno));
+            // Wait for the IRQ pin or our sockets, unless there is already work to do
+            int timeout = -1;
+            if (retries > 0) {
+                timeout = retry_timeout(retries);
+            } else if (bridge_has_work()) {
+                timeout = 0;
             }
-            debug("GPIO interrupt %c\n", buf[0]);
-        }
 
-        // Sync pin low
-        if (write(sync_fd, "0", 1) < 0) {
-            fatal("GPIO write: %s", strerror(errno));
-        }
+            int nfds = poll(fds, N_POLLFDS, timeout);
+            if (nfds < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fatal("Error in poll: %s", strerror(errno));
+            }
+            stats.polls++;
 
-        delay();
+            debug("poll returned: %i\n", nfds);
 
-        // Check for new connections on unconnected sockets
-        for (int i=0; i<N_CHANNEL; i++) {
-            // The USB Daemon channel is a client so we wont have new connection events
-            if (i == USBD_CHANNEL) {
-                // Just continue
-                continue;
+            for (int i=0; i<N_POLLFDS; i++) {
+                debug("%x ", fds[i].events);
             }
+            debug("- %x %x %x %x %x \n", POLLIN, POLLOUT, POLLERR, POLLHUP, POLLRDHUP);
 
-            if (SOCK_POLL(i).revents & POLLIN) {
-                int fd = accept(SOCK_POLL(i).fd, NULL, 0);
-                if (fd == -1) {
-                    fatal("Error in accept: %s", strerror(errno));
+            for (int i=0; i<N_POLLFDS; i++) {
+                debug("%x ", fds[i].revents);
+            }
+            debug("\n");
+
+            // If it was a GPIO interrupt on the IRQ pin, acknowlege it
+            if (GPIO_POLL.revents & GPIO_POLL.events) {
+                gpio_irq_ack(&irq_gpio);
+                stats.irqs++;
+                transaction_needed = true;
+            }
+
+            // Sockets are only serviced between pipelines, so the data announced in a trailer
+            // stays in place
+            for (int i=0; i<N_CHANNEL; i++) {
+                // The USB Daemon channel is a client so we wont have new connection events
+                if (i == USBD_CHANNEL) {
+                    // Just continue
+                    continue;
                 }
 
-                info("Accepted connection on %i\n", i);
-                CONN_POLL(i).fd = fd;
-                CONN_POLL(i).events = POLLIN | POLLOUT;
+                // Check for new connections on unconnected sockets
+                if (SOCK_POLL(i).revents & POLLIN) {
+                    int fd = accept(SOCK_POLL(i).fd, NULL, 0);
+                    if (fd == -1) {
+                        // e.g. the client gave up already, it can connect again
+                        error("Error in accept: %s", strerror(errno));
+                        continue;
+                    }
 
-                // disable further events on listening socket
-                SOCK_POLL(i).events = 0;
-                debug("\nWe have a new connection on a socket, %d\n", i);
-                set_channel_bitmask_state(&channels_opened_bitmask, i, true);
+                    info("Accepted connection on %i\n", i);
+                    CONN_POLL(i).fd = fd;
+                    CONN_POLL(i).events = POLLIN | POLLOUT;
+
+                    // disable further events on listening socket
+                    SOCK_POLL(i).events = 0;
+                    debug("\nWe have a new connection on a socket, %d\n", i);
+                    set_channel_bitmask_state(&channels_opened_bitmask, i, true);
+                }
             }
-        }
 
-        // Check which connected sockets are readable / writable or closed
-        for (int i=0; i<N_CHANNEL; i++) {
-            bool to_close = false;
-            debug("\nChecking if channel was closed %d %d\n", i, CONN_POLL(i).revents & POLLIN);
-            if (CONN_POLL(i).revents & POLLIN) {
-                int length = read(CONN_POLL(i).fd, channels[i].out_buf, BUFSIZE);
-                CONN_POLL(i).events &= ~POLLIN;
+            // Check which connected sockets are readable / writable or closed
+            for (int i=0; i<N_CHANNEL; i++) {
+                bool to_close = false;
+                debug("\nChecking if channel was closed %d %d\n", i, CONN_POLL(i).revents & POLLIN);
+                if (CONN_POLL(i).revents & (POLLIN | POLLHUP | POLLRDHUP)) {
+                    // Drain the socket, the data read before a hangup is still sent
+                    to_close = !channel_fill_ring(i);
+                    if (CONN_POLL(i).revents & (POLLHUP | POLLRDHUP)) {
+                        channels[i].out_eof = true;
+                    }
+                    channel_update_read_events(i);
+
+                    if (channels[i].out_eof && channels[i].out_length + channels[i].out_sent > 0 && !to_close
+                        && CONN_POLL(i).revents & POLLHUP) {
+                        // The peer can't read any more either, so stop polling it until the rest of
+                        // its data has been passed on
+                        CONN_POLL(i).fd = PARK_FD(CONN_POLL(i).fd);
+                        set_channel_bitmask_state(&channels_writable_bitmask, i, false);
+                        continue;
+                    }
+                }
 
-                debug("%i: Read %u\n", i, length);
+                if (to_close || CONN_POLL(i).revents & POLLERR
+                             || (channels[i].out_eof && channels[i].out_length == 0 && channels[i].out_sent == 0)) {
+                    debug("Got the call to close connection on %d", i);
+                    // Close the connection
+                    close_channel_connection(i);
+                    continue;
+                }
 
-                if (length > 0) {
-                    channels[i].out_length = length;
-                } else {
-                    if (length < 0) {
-                        error("Error in read %i: %s\n", i, strerror(errno));
-                    }
-                    to_close = true;
+                if (CONN_POLL(i).revents & POLLOUT) {
+                    CONN_POLL(i).events &= ~POLLOUT;
+                    // The connection is now writable
+                    set_channel_bitmask_state(&channels_writable_bitmask, i, true);
+                    debug("%i: Writable\n", i);
                 }
             }
 
-            if (to_close || CONN_POLL(i).revents & POLLHUP
-                         || CONN_POLL(i).revents & POLLERR
-                         || CONN_POLL(i).revents & POLLRDHUP) {
-                debug("Got the call to close connection on %d", i);
-                // Close the connection
-                close_channel_connection(i);
+            // A socket event may not concern the coprocessor at all, e.g. a channel becoming
+            // writable when there is nothing waiting for it
+            if (!bridge_has_work()) {
+                stats.idle++;
                 continue;
             }
-
-            if (CONN_POLL(i).revents & POLLOUT) {
-                CONN_POLL(i).events &= ~POLLOUT;
-                // The connection is now writable
-                set_channel_bitmask_state(&channels_writable_bitmask, i, true);
-                debug("%i: Writable\n", i);
-            }
+            transaction_needed = false;
+        } else {
+            pipeline_run++;
+            stats.pipelined++;
         }
 
-        // Prepare the header transfer
-        struct spi_ioc_transfer ctrl_transfer[2];
-        memset(ctrl_transfer, 0, sizeof(ctrl_transfer));
+        // Sync pin low
+        struct timespec transaction_start;
+        clock_gettime(CLOCK_MONOTONIC, &transaction_start);
+        gpio_write(&sync_gpio, false);
 
-        uint8_t tx_buf[2 + N_CHANNEL];
-        uint8_t rx_buf[2 + N_CHANNEL];
+        delay();
 
-        tx_buf[0] = 0x53;
-        tx_buf[1] = channels_writable_bitmask | (channels_opened_bitmask << 4);
+        uint8_t tx_buf[HEADER_MAX_LENGTH];
+        uint8_t rx_buf[HEADER_MAX_LENGTH];
+        int header_version = protocol_version;
+        bool request_v2 = false;
+
+        if (pipelined) {
+            memcpy(tx_buf, next_tx_buf, sizeof(tx_buf));
+            memcpy(rx_buf, next_rx_buf, sizeof(rx_buf));
+            // No header is clocked, the coprocessor uses the one from the trailer
+            gpio_write(&sync_gpio, true);
+        } else {
+            // Prepare the header transfer
+            struct spi_ioc_transfer ctrl_transfer[2];
+            memset(ctrl_transfer, 0, sizeof(ctrl_transfer));
+            memset(rx_buf, 0, sizeof(rx_buf));
+
+            request_v2 = protocol_version == 1 && protocol_v2_supported;
+            if (unconfirmed) {
+                // Only find out whether the coprocessor completed the data phase whose trailer
+                // was lost, as the rings can't be announced until then
+                fill_probe_header(tx_buf);
+            } else {
+                fill_header(tx_buf, channels_writable_bitmask, request_v2);
+            }
 
-        for (int i=0; i<N_CHANNEL; i++) {
-            tx_buf[2+i] = channels[i].out_length;
-        }
+            debug("tx: %2x %2x %2x %2x %2x\n", tx_buf[0], tx_buf[1], tx_buf[2], tx_buf[3], tx_buf[4]);
 
-        debug("tx: %2x %2x %2x %2x %2x\n", tx_buf[0], tx_buf[1], tx_buf[2], tx_buf[3], tx_buf[4]);
+            ctrl_transfer[0].len = header_length();
+            ctrl_transfer[0].tx_buf = (unsigned long)tx_buf;
+            ctrl_transfer[1].len = header_length();
+            ctrl_transfer[1].rx_buf = (unsigned long)rx_buf;
+            int status = ioctl(spi_fd, SPI_IOC_MESSAGE(2), ctrl_transfer);
 
-        ctrl_transfer[0].len = sizeof(tx_buf);
-        ctrl_transfer[0].tx_buf = (unsigned long)tx_buf;
-        ctrl_transfer[1].len = sizeof(rx_buf);
-        ctrl_transfer[1].rx_buf = (unsigned long)rx_buf;
-        int status = ioctl(spi_fd, SPI_IOC_MESSAGE(2), ctrl_transfer);
+            if (status < 0) {
+                // Nothing was clocked, so this is retried like a garbled reply
+                error("SPI_IOC_MESSAGE: header: %s", strerror(errno));
+                memset(rx_buf, 0, sizeof(rx_buf));
+            }
 
-        if (status < 0) {
-          fatal("SPI_IOC_MESSAGE: header: %s", strerror(errno));
-        }
+            debug("rx: %2x %2x %2x %2x %2x\n", rx_buf[0], rx_buf[1], rx_buf[2], rx_buf[3], rx_buf[4]);
+            gpio_write(&sync_gpio, true);
+
+            if (!header_valid(rx_buf, header_version)) {
+                error("Invalid header reply: %2x %2x %2x %2x %2x\n", rx_buf[0], rx_buf[1], rx_buf[2], rx_buf[3], rx_buf[4]);
+                retries++;
+                stats.header_errors++;
+                transaction_needed = true;
+
+                if (rx_buf[0] != (header_version == 2 ? REPLY_V2 : REPLY_V1)) {
+                    // The coprocessor may have been reset and forgotten the negotiated version, so
+                    // fall back to version 1 framing and negotiate again.
+                    if (protocol_version != 1) {
+                        info("Falling back to version 1 framing\n");
+                        protocol_version = 1;
+                    }
+                    protocol_v2_supported = false;
 
-        debug("rx: %2x %2x %2x %2x %2x\n", rx_buf[0], rx_buf[1], rx_buf[2], rx_buf[3], rx_buf[4]);
-        if (write(sync_fd, "1", 1) < 0) {
-            fatal("GPIO write: %s", strerror(errno));
-        }
+                    // Version 1 headers can't tell, and a coprocessor that was reset has lost the
+                    // data phase anyway
+                    if (unconfirmed) {
+                        unconfirmed_resolve(false);
+                    }
+                }
+                if (retries == RETRY_IMMEDIATE + 1) {
+                    error("No valid reply after %d retries, backing off\n", RETRY_IMMEDIATE);
+                }
+                continue;
+            }
 
-        if (rx_buf[0] != 0xCA) {
-            error("Invalid command reply: %2x %2x %2x %2x %2x\n", rx_buf[0], rx_buf[1], rx_buf[2], rx_buf[3], rx_buf[4]);
-            retries++;
+            retries = 0;
 
-            if (retries > 15) {
-                fatal("Too many retries, exiting");
-            } else {
-                continue;
+            if (header_version == 2) {
+                opened_confirm(rx_buf[SEQ_BYTE]);
+            }
+
+            if (unconfirmed) {
+                // The coprocessor's header was filled after it put back the buffers of a data
+                // phase that didn't complete
+                unconfirmed_resolve(rx_buf[SEQ_BYTE] == unconfirmed_seq);
+                transaction_needed = true;
             }
         }
 
-        // Check for any open/close requests on the channels
-        manage_channel_active_status(rx_buf);
+        // Decode the sizes using the version this header was sent with. They were checked with
+        // the header, or with the trailer it came from.
+        int rx_size[N_CHANNEL];
+        for (int chan=0; chan<N_CHANNEL; chan++) {
+            rx_size[chan] = header_size(rx_buf, chan);
+        }
+        int tx_size[N_CHANNEL];
+        for (int chan=0; chan<N_CHANNEL; chan++) {
+            tx_size[chan] = header_size(tx_buf, chan);
+        }
+        bool trailer = has_trailer(tx_buf, rx_buf);
+        stats.transactions++;
 
-        retries = 0;
+        if (!request_v2 && protocol_version == 1 && (rx_buf[STATUS_BYTE] & STATUS_V2)) {
+            // Request version 2 in the next header
+            protocol_v2_supported = true;
+        }
 
         delay();
 
         // Prepare the data transfer
-        struct spi_ioc_transfer transfer[N_CHANNEL * 2];
+        struct spi_ioc_transfer transfer[N_CHANNEL * 3 + 1];
         memset(transfer, 0, sizeof(transfer));
         int desc = 0;
 
         for (int chan=0; chan<N_CHANNEL; chan++) {
-            int size = channels[chan].out_length;
+            int size = tx_size[chan];
             // If the coprocessor is ready to receive, and we have data to send
-            if (rx_buf[1] & (1<<chan) && size > 0) {
+            if (header_ready(rx_buf) & (1<<chan) && size > 0) {
                 debug("coprocessor is ready to receive and we have %d bytes from channel %d", size, chan);
-                // Make this channel readable by others
-                CONN_POLL(chan).events |= POLLIN;
-                // Set the length to the size we need to send
-                transfer[desc].len = size;
-                // Point the output buffer to the correct place
-                transfer[desc].tx_buf = (unsigned long) &channels[chan].out_buf[0];
-                // Note that we will have no more data to send (once this is sent)
-                channels[chan].out_length = 0;
-                // Mark that we need to make a SPI transaction
+                ChannelData* c = &channels[chan];
+                // Send straight from the ring. If the frame wraps around its end, the second
+                // transfer continues the same frame on the wire.
+                int first = OUT_RING_SIZE - c->out_start;
+                if (first > size) {
+                    first = size;
+                }
+                transfer[desc].len = first;
+                transfer[desc].tx_buf = (unsigned long) &c->out_buf[c->out_start];
                 desc++;
+                if (first < size) {
+                    transfer[desc].len = size - first;
+                    transfer[desc].tx_buf = (unsigned long) &c->out_buf[0];
+                    desc++;
+                }
+                stats.tx_transfers[chan]++;
+                stats.tx_bytes[chan] += size;
+                // The space is reused by reads once the coprocessor confirms it got the data
+                c->out_start = (c->out_start + size) % OUT_RING_SIZE;
+                c->out_length -= size;
+                c->out_sent = size;
+                if (CONN_POLL(chan).fd >= 0) {
+                    channel_update_read_events(chan);
+                }
             }
 
             // The number of bytes the coprocessor wants to send to a channel
-            size = rx_buf[2+chan];
-            // Check that the channel is writable and there is data that needs to be received
-            if (get_channel_bitmask_state(&channels_writable_bitmask, chan) && size > 0) {
+            size = rx_size[chan];
+            // Check that the channel was announced writable and there is data that needs to be received
+            if (header_ready(tx_buf) & (1<<chan) && size > 0) {
                 debug("Channel %d is ready to have %d bytes written to it from bridge", chan, size);
                 // Set the appropriate size
                 transfer[desc].len = size;
@@ -543,9 +1300,40 @@ int main(int argc, char** argv) {
                 transfer[desc].rx_buf = (unsigned long) &channels[chan].in_buf[0];
                 // Mark that we need a SPI transaction to take place
                 desc++;
+                stats.rx_transfers[chan]++;
+                stats.rx_bytes[chan] += size;
             }
         }
 
+        // Announce the next transaction in the trailer. A channel stays writable if its socket
+        // can take the data from this transaction and another full frame.
+        uint8_t next_writable = 0;
+        if (trailer) {
+            for (int chan=0; chan<N_CHANNEL; chan++) {
+                int pending = (header_ready(tx_buf) & (1<<chan)) ? rx_size[chan] : 0;
+                if (get_channel_bitmask_state(&channels_opened_bitmask, chan) && CONN_POLL(chan).fd >= 0
+                    && socket_has_room(CONN_POLL(chan).fd, pending + BUFSIZE)) {
+                    next_writable |= (1<<chan);
+                }
+            }
+
+            if (bulk_cap > 0) {
+                channel_fill_urgent();
+            }
+            fill_header(next_tx_buf, next_writable, false);
+            memset(next_rx_buf, 0, sizeof(next_rx_buf));
+            transfer[desc].len = header_length();
+            transfer[desc].tx_buf = (unsigned long)next_tx_buf;
+            transfer[desc].rx_buf = (unsigned long)next_rx_buf;
+            desc++;
+        }
+
+        if (desc == 0) {
+            stats.empty++;
+        }
+
+        coprocessor_view_update(tx_buf, rx_buf, true);
+
         // If the previous logic designated the need for a SPI transaction
         if (desc != 0) {
             debug("Performing transfer on %i channels\n", desc);
@@ -553,23 +1341,73 @@ int main(int argc, char** argv) {
             // Make the SPI transaction
             int status = ioctl(spi_fd, SPI_IOC_MESSAGE(desc), transfer);
 
-            // Ensure there were no errors
-            if (status < 0) {
-              fatal("SPI_IOC_MESSAGE: data: %s", strerror(errno));
+            // With a trailer, this is resolved like a data phase whose trailer was lost. Without
+            // one, as in version 1, the coprocessor puts its buffers back when SYNC falls before
+            // its DMA completes, so the received data is dropped and ours is sent again.
+            bool failed = status < 0;
+            if (failed) {
+                error("SPI_IOC_MESSAGE: data: %s", strerror(errno));
+                memset(next_rx_buf, 0, sizeof(next_rx_buf));
+                if (!trailer) {
+                    unconfirmed_resolve(false);
+                    transaction_needed = true;
+                }
+            }
+
+            long us = elapsed_us(&transaction_start);
+            if (us > stats.transaction_us_max) {
+                stats.transaction_us_max = us;
+            }
+
+            // Continue with the next transaction right away if the trailer is valid and it has
+            // data. Its sequence number confirms the coprocessor took part in this data phase.
+            bool confirmed = true;
+            if (trailer) {
+                if (!header_valid(next_rx_buf, 2) || next_rx_buf[SEQ_BYTE] != tx_buf[SEQ_BYTE]) {
+                    error("Invalid trailer: %2x %2x %2x %2x %2x\n", next_rx_buf[0], next_rx_buf[1], next_rx_buf[2], next_rx_buf[3], next_rx_buf[4]);
+                    stats.trailer_errors++;
+                    // Hold on to this data phase until the next header tells whether it took place
+                    transaction_needed = true;
+                    confirmed = false;
+                    unconfirmed = true;
+                    unconfirmed_seq = tx_buf[SEQ_BYTE];
+                    unconfirmed_rx = 0;
+                } else {
+                    opened_confirm(next_rx_buf[SEQ_BYTE]);
+                    // The trailer describes the queues once this transaction completes
+                    coprocessor_view_update(next_tx_buf, next_rx_buf, false);
+                    if (pipeline_run < PIPELINE_MAX_RUN && count_transfers(next_tx_buf, next_rx_buf) > 0) {
+                        pipeline_next = true;
+                    }
+                }
+            }
+
+            if (confirmed) {
+                for (int chan=0; chan<N_CHANNEL; chan++) {
+                    channels[chan].out_sent = 0;
+                }
             }
 
             // Write received data to the appropriate socket
             for (int chan=0; chan<N_CHANNEL; chan++) {
                 // Get the length of the received data for this channel
-                int size = rx_buf[2+chan];
-                // Make sure that channel is writable and we have data to send to it
-                if (get_channel_bitmask_state(&channels_writable_bitmask, chan) && size > 0) {
-                    // Write this data to the pipe
-                    int r = write(CONN_POLL(chan).fd, &channels[chan].in_buf[0], size);
-                    debug("%i: Write %u %i\n", chan, size, r);
-                    // Ensure there were no errors
-                    if (r < 0) {
-                        error("Error in write %i: %s\n", chan, strerror(errno));
+                int size = rx_size[chan];
+                // Make sure that channel was announced writable and we have data to send to it
+                if (header_ready(tx_buf) & (1<<chan) && size > 0) {
+                    if (CONN_POLL(chan).fd < 0 || (failed && !trailer)) {
+                        // Closed since the header was sent, or never received
+                        continue;
+                    }
+                    if (confirmed) {
+                        channel_send(chan, size);
+                    } else {
+                        unconfirmed_rx |= (1<<chan);
+                        unconfirmed_size[chan] = size;
+                    }
+
+                    if (pipeline_next && (next_writable & (1<<chan))) {
+                        // Still writable for the pipelined transaction
+                        continue;
                     }
 
                     // Mark we want to know when this pipe is writable again
@@ -579,5 +1417,24 @@ int main(int argc, char** argv) {
                 }
             }
         }
+
+        // Check for any open/close requests on the channels. This is done after the data phase
+        // because a closed channel's buffers are part of the transfers announced in the header.
+        manage_channel_active_status(rx_buf);
+
+        if (request_v2) {
+            // The coprocessor saw our request in this header, and switches after this transaction.
+            // The headers of this transaction are decoded with version 1 until here.
+            info("Switching to version 2 framing\n");
+            protocol_version = 2;
+        }
+
+        // Close sockets that hung up once everything they sent has been passed on
+        for (int chan=0; chan<N_CHANNEL && !pipeline_next; chan++) {
+            if (CONN_POLL(chan).fd != -1 && channels[chan].out_eof && channels[chan].out_length == 0
+                && channels[chan].out_sent == 0) {
+                close_channel_connection(chan);
+            }
+        }
     }
 }
@@ -12,11 +12,15 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <spawn.h>
 
 enum Commands {
     CMD_RESET = 0x0,
@@ -66,9 +70,18 @@ struct epoll_event spid_event;
 // Static array for those events to be stored
 struct epoll_event events[MAX_EPOLL_EVENTS];
 
-#define INTERNAL_PIPE_BUF_SIZE 32768
+// The size of a stream's internal buffer, which is also the credit window
+// the CLI is given for stdin and control
+#define INTERNAL_PIPE_BUF_SIZE 65536
 #define MAX_CTRL_ARGS 255
-#define MAX_WRITE_LEN 255
+// The largest stream packet, limited by the 16-bit length carried in the header
+#define MAX_WRITE_LEN 0xFFFF
+
+// Whether stream data is moved with splice() between child pipes and the domain socket.
+// Cleared the first time the kernel refuses to splice, after which data is copied
+bool use_splice = true;
+// Stream data smaller than this is copied into the output batch instead of spliced
+#define SPLICE_MIN_LEN PIPE_BUF
 
 // Flag to close a stream immediately without waiting for remaining bytes to be flushed
 #define NO_FLUSH 1
@@ -108,12 +121,20 @@ typedef struct {
     int endpos;
     // The number of 'active' bytes
     int bufcount;
-    // The internal buffer used for back pressure
-    char buffer[INTERNAL_PIPE_BUF_SIZE];
+    // The number of bytes before startpos that are queued in the output batch but not yet sent
+    int inflight;
+    // The internal buffer used for back pressure, only allocated while it holds data
+    char* buffer;
 } pipebuf_t;
 
-typedef struct {
+typedef struct procinfo {
     int pid;
+    // The id set by the CLI
+    uint8_t id;
+    // The next process in the same pid_hash bucket
+    struct procinfo* pid_next;
+    // The child's ends of the pipes (indexed by role) until it has been spawned
+    int child_fds[4];
     pipebuf_t ctrl;
     pipebuf_t stdin;
     pipebuf_t stdout;
@@ -124,7 +145,11 @@ typedef struct {
 #define N_PROC 256
 procinfo_t* processes[N_PROC];
 
-void child(int ctrl, int stdin, int stdout, int stderr);
+// Running processes by OpenWRT process id, so SIGCHLD doesn't need to scan the process table
+#define PID_HASH_SIZE 64
+procinfo_t* pid_hash[PID_HASH_SIZE];
+
+void spawn_process(procinfo_t* p);
 void pipebuf_out_ack(pipebuf_t* pb, size_t acksize);
 void modify_pipebuf_epoll(pipebuf_t* pb, int operation);
 void add_pipebuf_epoll(pipebuf_t* pb);
@@ -134,9 +159,134 @@ int write_from_pipebuf(pipebuf_t *pb, int fd, int len);
 void pipebuf_out_to_internal_buffer(pipebuf_t* pb, int len);
 void pipebuf_out_is_writable(pipebuf_t* pb);
 void pipebuf_common_debug(pipebuf_t *pb, const char * str);
+void pipebuf_release_buffer(pipebuf_t *pb);
 void handle_closed_spid_socket();
 
-/* Helper function to write a packet header to the domain socket
+// The maximum number of separate pieces of output gathered into one batch
+#define OUT_BATCH_IOVS 64
+// Space for headers and ACK lengths queued in one batch
+#define OUT_BATCH_BYTES 1024
+
+// Output for the domain socket gathered over an event loop iteration
+// and written with a single sendmsg() in flush_output()
+struct {
+    // The pieces to write, pointing into bytes or into pipe buffer rings
+    struct iovec iov[OUT_BATCH_IOVS];
+    int iovcnt;
+    // Storage for headers and other small messages
+    uint8_t bytes[OUT_BATCH_BYTES];
+    int nbytes;
+    // Pipe buffers whose ring data is referenced by the batch
+    pipebuf_t* pbs[OUT_BATCH_IOVS];
+    int npbs;
+} out_batch;
+
+/* Write everything queued in the output batch to the domain socket
+Param: flags - MSG_MORE if the caller is about to send more data directly
+*/
+void flush_output(int flags) {
+    struct msghdr msg = { .msg_iov = out_batch.iov, .msg_iovlen = out_batch.iovcnt };
+
+    // While the socket is active and there is data left to write
+    while (sock_fd > -1 && msg.msg_iovlen > 0) {
+        ssize_t r = sendmsg(sock_fd, &msg, flags | MSG_NOSIGNAL);
+
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // The CLI end went away, the hangup will be handled by the event loop
+            if (errno == EPIPE || errno == ECONNRESET) {
+                break;
+            }
+            fatal("Unable to write to the domain socket: %s", strerror(errno));
+        }
+
+        // Skip past everything that was written in case of a short write
+        while (msg.msg_iovlen > 0 && (size_t) r >= msg.msg_iov->iov_len) {
+            r -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + r;
+            msg.msg_iov->iov_len -= r;
+        }
+    }
+
+    // The ring space written from can now be reused
+    for (int i = 0; i < out_batch.npbs; i++) {
+        out_batch.pbs[i]->inflight = 0;
+        pipebuf_release_buffer(out_batch.pbs[i]);
+    }
+
+    out_batch.iovcnt = out_batch.nbytes = out_batch.npbs = 0;
+}
+
+/* Queue a small message to be written to the domain socket
+Param: data - the bytes to queue (copied into the batch)
+Param: len - the number of bytes
+*/
+void queue_output(const void* data, int len) {
+    // Make room if the batch is full
+    if (out_batch.nbytes + len > OUT_BATCH_BYTES || out_batch.iovcnt == OUT_BATCH_IOVS) {
+        flush_output(0);
+    }
+
+    uint8_t* dest = &out_batch.bytes[out_batch.nbytes];
+    memcpy(dest, data, len);
+    out_batch.nbytes += len;
+
+    // Extend the previous piece if these bytes directly follow it
+    struct iovec* last = out_batch.iovcnt > 0 ? &out_batch.iov[out_batch.iovcnt - 1] : NULL;
+    if (last && (uint8_t *) last->iov_base + last->iov_len == dest) {
+        last->iov_len += len;
+    }
+    else {
+        out_batch.iov[out_batch.iovcnt].iov_base = dest;
+        out_batch.iov[out_batch.iovcnt].iov_len = len;
+        out_batch.iovcnt++;
+    }
+}
+
+/* Queue bytes from the front of a pipe buffer's internal buffer to be written to the
+domain socket without copying them. They are consumed from the ring immediately, but
+their space isn't reused until the batch is flushed.
+Param: pb - the pipebuffer to take the bytes from
+Param: len - the number of bytes to queue
+*/
+void queue_output_from_pipebuf(pipebuf_t* pb, int len) {
+    // A wrapped ring needs two pieces
+    if (out_batch.iovcnt + 2 > OUT_BATCH_IOVS) {
+        flush_output(0);
+    }
+
+    if (pb->inflight == 0) {
+        out_batch.pbs[out_batch.npbs++] = pb;
+    }
+
+    while (len) {
+        int to_write = len;
+        // If the data would go past the end of the buffer, only take up to the end
+        if (pb->startpos + to_write > INTERNAL_PIPE_BUF_SIZE) {
+            to_write = INTERNAL_PIPE_BUF_SIZE - pb->startpos;
+        }
+
+        out_batch.iov[out_batch.iovcnt].iov_base = &(pb->buffer[pb->startpos]);
+        out_batch.iov[out_batch.iovcnt].iov_len = to_write;
+        out_batch.iovcnt++;
+
+        pb->startpos += to_write;
+        if (pb->startpos == INTERNAL_PIPE_BUF_SIZE) {
+            pb->startpos = 0;
+        }
+        pb->bufcount -= to_write;
+        pb->inflight += to_write;
+        len -= to_write;
+    }
+}
+
+/* Helper function to queue a packet header for the domain socket
 Param: cmd - which command in the Commands enum to send
 Param: id - which process is sending this
 Param: arg - an argument for the command (like ACK)
@@ -147,12 +297,8 @@ void send_header(uint8_t cmd, uint8_t id, uint8_t arg, uint8_t len) {
     if (sock_fd > -1) {
         // Create the packet
         uint8_t buf[4] = {cmd, id, arg, len};
-        // Write the packet to the socket
-        int r = write(sock_fd, buf, sizeof(buf));
-        // Ensure it wrote all of the bytes
-        if (r != sizeof(buf)) {
-            fatal("send_header failed: %s", strerror(errno));
-        }
+        // Queue the packet for the socket
+        queue_output(buf, sizeof(buf));
     }
 }
 
@@ -211,10 +357,13 @@ int pipebuf_common_init(pipebuf_t* pb, int id, int role, uint32_t events, unsign
     pb->startpos = pb->endpos = pb->bufcount = 0;
     pb->credit = 0;
     pb->events = events;
+    pb->inflight = 0;
+    pb->buffer = NULL;
     // Allocate memory for file descriptors
     int pipefd[2];
-    // Create the pipes
-    int r = pipe(pipefd);
+    // Create the pipes. Neither end is inherited by children unless
+    // it is explicitly passed on by spawn_process()
+    int r = pipe2(pipefd, O_CLOEXEC);
     // Verify it worked
     if (r < 0) {
         fatal("pipe failed: %s", strerror(errno));
@@ -232,6 +381,72 @@ int pipebuf_common_init(pipebuf_t* pb, int id, int role, uint32_t events, unsign
     return pipefd[!bufend];
 }
 
+/* Allocate the internal buffer of a pipe buffer the first time it has to hold bytes back
+Param: pb - the pipebuffer that needs its internal buffer
+*/
+void pipebuf_alloc_buffer(pipebuf_t *pb) {
+    if (pb->buffer == NULL) {
+        pb->buffer = malloc(INTERNAL_PIPE_BUF_SIZE);
+        if (pb->buffer == NULL) {
+            fatal("Unable to allocate pipe buffer: %s", strerror(errno));
+        }
+        pb->startpos = pb->endpos = 0;
+    }
+}
+
+/* Release the internal buffer of a pipe buffer once all of its bytes have been written
+(and flushed from the output batch)
+Param: pb - the pipebuffer to release the internal buffer of
+*/
+void pipebuf_release_buffer(pipebuf_t *pb) {
+    if (pb->bufcount == 0 && pb->inflight == 0 && pb->buffer != NULL) {
+        free(pb->buffer);
+        pb->buffer = NULL;
+        pb->startpos = pb->endpos = 0;
+    }
+}
+
+/* Helper function to move bytes that are already waiting in a pipe to the domain socket
+with splice(), so they never get copied through user space. Falls back to a bounce
+buffer if the kernel can't splice into the socket.
+Param: pipe_fd - the readable end of the pipe holding the bytes
+Param: len - the number of bytes to move (must be available in the pipe)
+*/
+void splice_to_sock(int pipe_fd, int len) {
+    char bounce[PIPE_BUF];
+    ssize_t r = 0;
+
+    while (len) {
+        if (use_splice) {
+            r = splice(pipe_fd, NULL, sock_fd, NULL, len, SPLICE_F_MOVE);
+            // Older kernels can't splice into a unix socket
+            if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                info("splice unavailable (%s), copying stream data", strerror(errno));
+                use_splice = false;
+                continue;
+            }
+        }
+        else {
+            r = read(pipe_fd, bounce, len < sizeof(bounce) ? len : sizeof(bounce));
+            if (r > 0 && write(sock_fd, bounce, r) != r) {
+                fatal("Unable to write stream data to the socket: %s", strerror(errno));
+            }
+        }
+
+        if (r > 0) {
+            len -= r;
+        }
+        // The socket is full, wait until it drains
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = sock_fd, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+        }
+        else {
+            fatal("Unable to move stream data to the socket: %s", r == 0 ? "unexpected EOF" : strerror(errno));
+        }
+    }
+}
+
 /* Helper function to write from a pipe buffer's internal buffer
 into its file descriptor
 Param: pb - the pipebuffer to write from
@@ -259,6 +474,10 @@ int write_from_pipebuf(pipebuf_t *pb, int fd, int write_len) {
 
         // Write this batch to the file descriptor from the internal buffer
         written = write(fd, &(pb->buffer[pb->startpos]), to_write);
+        // Stop if the file descriptor can't take any more right now
+        if (written <= 0) {
+            break;
+        }
 
         // Increment the start position
         pb->startpos += written;
@@ -275,6 +494,9 @@ int write_from_pipebuf(pipebuf_t *pb, int fd, int write_len) {
         write_len -= written;
     }
 
+    // Give the memory back once nothing is held back any more
+    pipebuf_release_buffer(pb);
+
     // Return the total number of bytes written
     return (total_written - write_len);
 }
@@ -336,8 +558,9 @@ int pipebuf_common_close(pipebuf_t* pb, int flush) {
             }
             // Set it back to -1
             pb->fd = -1;
-            // Reset other fields
-            pb->startpos = pb->endpos = pb->bufcount = 0;
+            // Reset other fields and drop any unflushed data
+            pb->bufcount = 0;
+            pipebuf_release_buffer(pb);
             pipebuf_common_debug(pb, "Successfully closed");
             return CLOSE_SUCCESS;
         }
@@ -393,10 +616,10 @@ void pipebuf_in_close(pipebuf_t* pb, int flush) {
 }
 
 
-/* Write from a readable stream (stdout, stderr) to the domain socket (CLI)
+/* Queue data from a readable stream (stdout, stderr) to be written to the domain socket (CLI)
 Param: pb - the pipebuffer to transfer data from (internal -> CLI)
 Param: num_to_write - the number of bytes to write
-Returns: the number of bytes written
+Returns: the number of bytes queued
 */
 int pipebuf_in_write_to_sock(pipebuf_t* pb, size_t num_to_write) {
 
@@ -422,10 +645,11 @@ int pipebuf_in_write_to_sock(pipebuf_t* pb, size_t num_to_write) {
         int packet_write_size = (remaining < MAX_WRITE_LEN) ? remaining : MAX_WRITE_LEN;
         // Send the header so the CLI knows it's about to receive data
         send_header(CMD_WRITE_CONTROL + pb->role, pb->id, packet_write_size >> 8, packet_write_size & 0xFF);
-        // Send the data and increment the counter of the number of bytes written
+        // Queue the data and increment the counter of the number of bytes written
         pipebuf_common_debug(pb, "Writing from stdout/stderr internal to CLI");
         debug("{%d bytes}", packet_write_size);
-        written += write_from_pipebuf(pb, sock_fd, packet_write_size);
+        queue_output_from_pipebuf(pb, packet_write_size);
+        written += packet_write_size;
     }
 
     debug("{%d in total}", written);
@@ -436,14 +660,72 @@ int pipebuf_in_write_to_sock(pipebuf_t* pb, size_t num_to_write) {
     return written;
 }
 
+/* Send data from a readable stream (stdout, stderr) straight from its pipe to the domain socket (CLI)
+while the internal buffer is empty and the CLI has credit. Less than SPLICE_MIN_LEN bytes are
+left for the internal buffer so they can share a batched write with other output.
+Param: pb - the pipebuffer to transfer data from (child -> CLI)
+Returns: the number of bytes left in the pipe for the internal buffer (0 if the pipe was drained),
+or -1 if the child closed its end of the pipe
+*/
+int pipebuf_in_splice_to_sock(pipebuf_t* pb) {
+    // Whether any bytes were sent during this call
+    bool sent = false;
+
+    while (1) {
+        // Find out how many bytes the child has left in the pipe
+        int available = 0;
+        if (ioctl(pb->fd, FIONREAD, &available) < 0) {
+            fatal("Unable to query stdout/stderr pipe: %s", strerror(errno));
+        }
+
+        // A readable pipe with nothing in it means the child closed its end
+        if (available == 0) {
+            return sent ? 0 : -1;
+        }
+
+        // Leave the rest for the internal buffer if the CLI can't take it
+        // or it's too little to be worth a syscall of its own
+        if (pb->credit <= 0 || sock_fd < 0 || available < SPLICE_MIN_LEN) {
+            return available;
+        }
+
+        // Calculate the size of this packet
+        int packet_write_size = available;
+        if (packet_write_size > pb->credit) {
+            packet_write_size = pb->credit;
+        }
+        if (packet_write_size > MAX_WRITE_LEN) {
+            packet_write_size = MAX_WRITE_LEN;
+        }
+
+        // Send the header so the CLI knows it's about to receive data
+        send_header(CMD_WRITE_CONTROL + pb->role, pb->id, packet_write_size >> 8, packet_write_size & 0xFF);
+        pipebuf_common_debug(pb, "Splicing from stdout/stderr child to CLI");
+        debug("{%d bytes}", packet_write_size);
+        // Everything queued so far, including the header, has to go out first
+        flush_output(MSG_MORE);
+        splice_to_sock(pb->fd, packet_write_size);
+
+        pb->credit -= packet_write_size;
+        sent = true;
+    }
+}
+
 /* Add more credits to a readable stream (stdout, stderr)
 Param: pb - the pipebuffer to add more credits to. Also sends out more data to fd if necessary
-Param: ack_number_size - the number of credits to add to the stream
+Param: ack_number_size - the number of bytes used to encode the credits to add
 */
 void pipebuf_in_ack(pipebuf_t* pb, size_t ack_number_size) {
 
-    uint8_t ack_size_bytes[ack_number_size];
-    int sock_closed = read_until(sock_fd, ack_size_bytes, ack_number_size);
+    // The ACK is little endian and can be up to 32 bits wide,
+    // any higher bytes are read and ignored
+    uint8_t ack_size_bytes[4] = {0};
+    size_t low_size = ack_number_size < sizeof(ack_size_bytes) ? ack_number_size : sizeof(ack_size_bytes);
+    int sock_closed = read_until(sock_fd, ack_size_bytes, low_size);
+    for (size_t i = low_size; i < ack_number_size && sock_closed != -1; i++) {
+        uint8_t ignored;
+        sock_closed = read_until(sock_fd, &ignored, 1);
+    }
     // If the socket was closed prematurely
     if (sock_closed == -1) {
         // Return back to the event loop
@@ -451,10 +733,10 @@ void pipebuf_in_ack(pipebuf_t* pb, size_t ack_number_size) {
         return handle_closed_spid_socket();
     }
 
-    int ack_size = 0;
+    uint32_t ack_size = 0;
 
-    for (int i = 0; i < ack_number_size; i++) {
-        ack_size += (ack_size_bytes[i] << (i * 8));
+    for (size_t i = 0; i < sizeof(ack_size_bytes); i++) {
+        ack_size |= ((uint32_t) ack_size_bytes[i] << (i * 8));
     }
 
     // If this pipe buffer was previously full
@@ -464,15 +746,21 @@ void pipebuf_in_ack(pipebuf_t* pb, size_t ack_number_size) {
         add_pipebuf_epoll(pb);
     }
 
-    // Add this ack size to the credit count
-    pb->credit += ack_size;
+    // Add this ack size to the credit count, letting the window grow
+    // as large as the CLI wants without overflowing
+    if (ack_size > INT_MAX - pb->credit) {
+        pb->credit = INT_MAX;
+    }
+    else {
+        pb->credit += ack_size;
+    }
 
     // If there is data ready to write to the CLI
     if (pb->bufcount > 0) {
 
         // Write from STDOUT/STDERR Buffer ----> CLI
-        // (the smaller of ack_size of the remaining bytes in the internal buffer)
-        pipebuf_in_write_to_sock(pb, (pb->bufcount < ack_size ? pb->bufcount : ack_size));
+        // (as much of the internal buffer as the credit allows)
+        pipebuf_in_write_to_sock(pb, pb->bufcount);
     }
 
     // If we just finished sending the rest of the data
@@ -487,12 +775,33 @@ Param: pb - the pipebuffer that has data to read
 */
 void pipebuf_in_to_internal_buffer(pipebuf_t* pb) {
 
+    // If nothing is held back internally, try to hand the data to the CLI without copying it
+    if (pb->bufcount == 0) {
+        int remaining = pipebuf_in_splice_to_sock(pb);
+
+        if (remaining < 0) {
+            pipebuf_common_debug(pb, "Pipe has been closed by the child");
+            // Remove this file descriptor from the epoll and close the stream
+            pb->eof = true;
+            delete_pipebuf_epoll(pb);
+            pipebuf_in_close(pb, FLUSH);
+            return;
+        }
+        else if (remaining == 0) {
+            return;
+        }
+        // Otherwise we ran out of credit, buffer whatever is left
+    }
+
+    pipebuf_alloc_buffer(pb);
+
     /* Read from the file descriptor into the pipe buffer
     until the pipe buffer is full or there is nothing
     else to read */
     int r = 0;
     int try_to_read = 0;
-    int space_available = INTERNAL_PIPE_BUF_SIZE - pb->bufcount;
+    // Bytes still queued in the output batch keep their space until it is flushed
+    int space_available = INTERNAL_PIPE_BUF_SIZE - pb->bufcount - pb->inflight;
     pipebuf_common_debug(pb, "stdout/stderr has data from child to be read");
     // While we have space in the pipe buffer
     while (space_available) {
@@ -554,6 +863,9 @@ void pipebuf_in_to_internal_buffer(pipebuf_t* pb) {
 
     }
 
+    // Nothing was buffered after all
+    pipebuf_release_buffer(pb);
+
     // If the pipe buffer is full
     if (pb->bufcount == INTERNAL_PIPE_BUF_SIZE) {
         // remove it from the epoll
@@ -588,10 +900,49 @@ Param: pb - the pipebuffer to close
 Param: flush - whether or not to allow the buffer to flush before closing
 */
 void pipebuf_out_close(pipebuf_t* pb, int flush) {
-    pipebuf_common_close(pb, flush);
+    int res = pipebuf_common_close(pb, flush);
+
+    // Once the whole command has been written to the control pipe
+    // the process can be started
+    if (res == CLOSE_SUCCESS && pb->role == ROLE_CTRL && flush == FLUSH) {
+        spawn_process(processes[pb->id]);
+    }
 }
 
 
+/* Move bytes the CLI is writing to a writable stream (control, stdin) straight from the
+domain socket into the child's pipe
+Param: pb - the pipebuffer to write the data to
+Param: len - the number of bytes the CLI is sending
+Returns: the number of bytes moved, stopping early once the pipe is full
+*/
+int pipebuf_out_splice_from_sock(pipebuf_t* pb, int len) {
+    int moved = 0;
+
+    while (use_splice && moved < len) {
+        // The pipe is non-blocking so this returns as soon as it fills up
+        ssize_t r = splice(sock_fd, NULL, pb->fd, NULL, len - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (r > 0) {
+            moved += r;
+        }
+        // The pipe is full or the rest hasn't arrived yet, buffer it instead
+        else if (r == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        // Older kernels can't splice out of a unix socket
+        else if (errno == EINVAL || errno == ENOSYS) {
+            info("splice unavailable (%s), copying stream data", strerror(errno));
+            use_splice = false;
+        }
+        else {
+            fatal("Unable to splice socket into stdin/control pipe: %s", strerror(errno));
+        }
+    }
+
+    return moved;
+}
+
 /* The CLI is writing data to the internal buffer of a writable stream (control, stdin)
 Param: pb - the pipebuffer to write the data to
 Param: read_len - the number of bytes to read from the domain socket
@@ -605,6 +956,24 @@ void pipebuf_out_to_internal_buffer(pipebuf_t* pb, int read_len) {
         fatal("This stream was already closed.");
     }
 
+    // If nothing is held back internally, pass the data to the child without copying it
+    if (pb->bufcount == 0 && read_len > 0) {
+        int moved = pipebuf_out_splice_from_sock(pb, read_len);
+
+        if (moved > 0) {
+            pipebuf_common_debug(pb, "Spliced bytes from CLI socket into stdin/control");
+            debug("(%d bytes)", moved);
+            read_len -= moved;
+            pb->credit -= moved;
+            // The child already has these bytes, so the CLI can send more
+            pipebuf_out_ack(pb, moved);
+        }
+
+        if (read_len == 0) {
+            return;
+        }
+    }
+
     // If there is currently nothing in the internal buffer
     // and data is being added
     if (pb->bufcount == 0 && read_len > 0) {
@@ -613,6 +982,8 @@ void pipebuf_out_to_internal_buffer(pipebuf_t* pb, int read_len) {
         add_pipebuf_epoll(pb);
     }
 
+    pipebuf_alloc_buffer(pb);
+
     // The number of bytes to read from the socket
     int to_read = 0;
 
@@ -704,24 +1075,170 @@ void pipebuf_out_ack(pipebuf_t* pb, size_t acksize) {
     memset(size_bytes, 0, num_size);
     // Then copy over the bytes from acksize
     memcpy(size_bytes, &acksize, num_size);
-    // Then write this ack length to the socket 
-    int t = write(sock_fd, size_bytes, num_size);
+    // Then queue this ack length right behind its header
+    if (sock_fd > -1) {
+        queue_output(size_bytes, num_size);
+    }
+}
+
+/* Associate a newly spawned process with its OpenWRT process id
+Param: p - the process to add, with its pid set
+*/
+void pid_hash_add(procinfo_t* p) {
+    procinfo_t** bucket = &pid_hash[p->pid % PID_HASH_SIZE];
+    p->pid_next = *bucket;
+    *bucket = p;
+}
+
+/* Forget the OpenWRT process id of a process, before it is cleared
+Param: p - the process to remove
+*/
+void pid_hash_remove(procinfo_t* p) {
+    for (procinfo_t** pp = &pid_hash[p->pid % PID_HASH_SIZE]; *pp != NULL; pp = &(*pp)->pid_next) {
+        if (*pp == p) {
+            *pp = p->pid_next;
+            break;
+        }
+    }
+    p->pid_next = NULL;
+}
+
+/* Helper function to convert a OpenWRT process id to a process
+Param: pid - the OpenWRT process id
+Returns: the process, or NULL if no process has that pid
+*/
+procinfo_t* find_by_pid(int pid) {
+    for (procinfo_t* p = pid_hash[pid % PID_HASH_SIZE]; p != NULL; p = p->pid_next) {
+        if (p->pid == pid) {
+            return p;
+        }
+    }
+    return NULL;
+}
 
-    if (t < 0) {
-        fatal("Unable to write STDIN/CTRL Ack to the pipe: %s", strerror(errno));
+/* Close whichever of the child's ends of the pipes the daemon still holds
+Param: p - the process to close the child's pipes of
+*/
+void close_child_fds(procinfo_t* p) {
+    for (int i = 0; i < 4; i++) {
+        if (p->child_fds[i] != -1) {
+            close(p->child_fds[i]);
+            p->child_fds[i] = -1;
+        }
     }
 }
 
+/* Reads the command sent over the control stream, parses the arguments,
+and spawns the process with the other three pipes as its standard streams.
+Called once the control stream has been flushed and closed.
+Param: p - the process to start
+*/
+void spawn_process(procinfo_t* p) {
+
+    // Create buffer to store incoming command
+    char command[MAX_COMMAND_LEN];
+    // Create int variables to ensure we don't write more than we should
+    int total_read = 0, r = 0, max_to_read = MAX_COMMAND_LEN - 1;
+
+    // The write end is closed, so the whole command is waiting in the control pipe
+    while (total_read < max_to_read) {
+        r = read(p->child_fds[ROLE_CTRL], &(command[total_read]), max_to_read - total_read);
+        if (r > 0) {
+            total_read += r;
+        }
+        else if (r == 0) {
+            break;
+        }
+        else {
+            fatal("Control Pipe is unable to read command: %s", strerror(errno));
+        }
+    }
+
+    // Add a null character to the end of the command
+    command[total_read] = '\0';
+
+    // The number of arguments for the command
+    int argc = 0;
+    // The index of the command string
+    int i = 0;
+    // An array of command args and one space for the null to indicate end
+    char *argv[MAX_CTRL_ARGS + 1];
+
+    // Assign the command name as the first arg
+    argv[argc++] = &(command[i]);
+
+    // Iterate over the command
+    while (i < total_read && argc < MAX_CTRL_ARGS) {
+        // When the byte is a null byte
+        if (command[i++] == '\0') {
+            // Set the next byte to be the beginning of the next arg
+            argv[argc++] = &(command[i]);
+        }
+    }
+
+    // Set the last arg to be NULL
+    argv[argc] = NULL;
+
+    // Hand the child its standard streams. Every other descriptor
+    // the daemon holds is close-on-exec
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, p->child_fds[ROLE_STDIN], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, p->child_fds[ROLE_STDOUT], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, p->child_fds[ROLE_STDERR], STDERR_FILENO);
+
+    // The daemon blocks SIGCHLD for its signalfd, don't pass that on.
+    // Where supported, use vfork rather than copying the daemon's address space
+    posix_spawnattr_t attr;
+    sigset_t sigmask;
+    sigemptyset(&sigmask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    int pid = 0;
+    int ret = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    // The child has its own copies now
+    close_child_fds(p);
+
+    // Report any errors
+    if (ret != 0) {
+        error("Could not exec child process: %s", strerror(ret));
+        // Tell the CLI the process failed like a child that couldn't exec would have
+        send_header(CMD_EXIT_STATUS, p->id, 1, 0);
+        return;
+    }
+
+    // Set the field for the child process pid
+    p->pid = pid;
+    pid_hash_add(p);
+}
+
 void close_process(procinfo_t* p) {
 
+    // Output may still point into this process's buffers
+    flush_output(0);
+
     // If the process isn't killed yet
     if (p->pid) {
         // Kill it now
         kill(p->pid, SIGKILL);
         // Wait for it to be finished
         waitpid(p->pid, NULL, 0);
+        pid_hash_remove(p);
     }
 
+    // Close the child's ends of the pipes if it never got spawned
+    close_child_fds(p);
+
     // Close out all of the pipe buffers if they haven't been closed already
     if ((&p->ctrl)->fd != -1) pipebuf_out_close(&p->ctrl, NO_FLUSH);
     if ((&p->stdin)->fd != -1) pipebuf_out_close(&p->stdin, NO_FLUSH);
@@ -780,56 +1297,22 @@ void handle_socket_readable() {
             
             // Create a new process
             p = processes[id] = malloc(sizeof(procinfo_t));
+            if (p == NULL) {
+                fatal("Unable to allocate process: %s", strerror(errno));
+            }
+            p->pid = 0;
+            p->id = id;
+            p->pid_next = NULL;
 
-            // Create a writable pipebuf and return the readable pipe for the child process
-            int ctrl_fd   = pipebuf_out_init (&p->ctrl,   id, 0);
-            int stdin_fd  = pipebuf_out_init (&p->stdin,  id, 1);
-
-            // Create a readable pipebuf and return the writable pipe for the child process
-            int stdout_fd = pipebuf_in_init(&p->stdout, id, 2);
-            int stderr_fd = pipebuf_in_init(&p->stderr, id, 3);
-
-            int pid;
-            // Fork the child process, if this is the child process
-            if ((pid = fork()) == 0) {
-
-                // For every process in the parent
-                for (int iterator = 0; iterator < N_PROC; iterator++) {
-                    // Get a reference to the correspondong process
-                    procinfo_t* parent_process = processes[iterator];
-
-                    // If this process exists
-                    if (parent_process) {
-                        // Close all of the file descriptors for this child
-                        if ((&parent_process->ctrl)->fd != -1) close((&parent_process->ctrl)->fd);
-                        if ((&parent_process->stdin)->fd != -1) close((&parent_process->stdin)->fd);
-                        if ((&parent_process->stdout)->fd != -1) close((&parent_process->stdout)->fd);
-                        if ((&parent_process->stderr)->fd != -1) close((&parent_process->stderr)->fd);
-                    }
-                }
+            // Create a writable pipebuf and keep the readable pipe for the child process
+            p->child_fds[ROLE_CTRL]   = pipebuf_out_init (&p->ctrl,   id, ROLE_CTRL);
+            p->child_fds[ROLE_STDIN]  = pipebuf_out_init (&p->stdin,  id, ROLE_STDIN);
 
-                // Close socket and fds used by parent
-                close(sock_fd);
-                close(ep_fd);
-                close(sig_fd);
-
-                // Get started on its own task
-                child(ctrl_fd, stdin_fd, stdout_fd, stderr_fd);
-            // If there was an error
-            } else if (pid < 0) {
-                // Notify the user
-                fatal("Error in fork: %s", strerror(errno));
-            // If this is the parent process 
-            } else {
-                // Close the child ends of the pipes
-                close(ctrl_fd);
-                close(stdin_fd);
-                close(stdout_fd);
-                close(stderr_fd);
-                // Set the field for the child process pid
-                p->pid = pid;
-            }
+            // Create a readable pipebuf and keep the writable pipe for the child process
+            p->child_fds[ROLE_STDOUT] = pipebuf_in_init(&p->stdout, id, ROLE_STDOUT);
+            p->child_fds[ROLE_STDERR] = pipebuf_in_init(&p->stderr, id, ROLE_STDERR);
 
+            // The process is spawned once its command has arrived on the control stream
             break;
 
         case CMD_CLOSE:
@@ -895,20 +1378,6 @@ void handle_socket_readable() {
     }
 }
 
-/* Helper function to convert a OpenWRT process id to a friendly process id
-as specified by the CLI
-Param: pid - the OpenWRT process id
-Returns: the friendly process id
-*/
-int find_by_pid(int pid) {
-    for (int i = 0; i < N_PROC; i++) {
-        if (processes[i] != NULL && processes[i]->pid == pid) {
-            return i;
-        }
-    }
-    return -1;
-}
-
 /* Called when a child died. Responsible for iterating through
 all children deaths and reporting them to the CLI
 */
@@ -958,19 +1427,18 @@ void handle_sigchld() {
         }
 
         // Find the appropriate child
-        int id = find_by_pid(pid);
-        if (id < 0) {
+        procinfo_t* p = find_by_pid(pid);
+        if (p == NULL) {
             error("Could not find id for pid %i", pid);
             continue;
         }
 
-        // Get a reference to the process
-        procinfo_t* p = processes[id];
         // Set the pid to 0 so we know it is inactive
+        pid_hash_remove(p);
         p->pid = 0;
 
         // Send news of the death to the CLI
-        send_header(CMD_EXIT_STATUS, id, code, 0);
+        send_header(CMD_EXIT_STATUS, p->id, code, 0);
     }
 }
 
@@ -1017,7 +1485,7 @@ void initialize_listening_socket(char *argv_path) {
     // Set the address family to unix
     listener_addr.sun_family = AF_UNIX;
     // Create a new unix streaming socket
-    if ((listener_fd = socket(listener_addr.sun_family, SOCK_STREAM, 0)) == -1) {
+    if ((listener_fd = socket(listener_addr.sun_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
         // Fail and report an error if necessary
         fatal("Error creating socket %s: %s\n", listener_addr.sun_path, strerror(errno));
     }
@@ -1062,7 +1530,7 @@ void initialize_sigchild_events() {
     sigaddset(&sigmask, SIGCHLD);
 
     // Create the file descriptor that will be written to for that signal
-    sig_fd = signalfd(-1, &sigmask, SFD_NONBLOCK);
+    sig_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
 
     // Create an epoll event for that file descriptor
     struct epoll_event sig_child_event;
@@ -1083,7 +1551,7 @@ Accept incoming socket connection, start listening for data, stop listening for
 
 void handle_incoming_spid_socket() {
     // Accept the connection and set our socket fd
-    sock_fd = accept(listener_fd, NULL, NULL);
+    sock_fd = accept4(listener_fd, NULL, NULL, SOCK_CLOEXEC);
     // Fail if we have an error
     if (sock_fd < 0) {
         fatal("Unable to accept socket connection...");
@@ -1138,8 +1606,8 @@ int main(int argc, char** argv) {
     debug("Starting...");
 
     // Register an event listener with the kernel
-    // First argument to epoll_create must be non-zero (doesn't mean anything else)
-    ep_fd = epoll_create(1);
+    // None of the daemon's descriptors should leak into children
+    ep_fd = epoll_create1(EPOLL_CLOEXEC);
     if (ep_fd < 0) {
         fatal("Error creating epoll: %s\n", strerror(errno));
     }
@@ -1205,85 +1673,8 @@ int main(int argc, char** argv) {
                 }
             }
         }
-    }
-}
-
-/* Takes all four pipes to the child process, receives the bash command
-for the control stream, parses the arguments, and execs the process.
-Param ctrl - the control file descriptor
-Param stdin - the stdin file descriptor
-Param stdout - the stdout file descriptor
-Param stderr - the stderr file descriptor
-*/
-void child(int ctrl, int stdin, int stdout, int stderr) {
-
-    // Create buffer to store incoming command
-    char command[MAX_COMMAND_LEN];
-    // Create int variables to ensure we don't write more than we should
-    int total_read = 0, r = 0, max_to_read = MAX_COMMAND_LEN -1;
-
-    // While there is still space in the command buffer
-    while (total_read <= max_to_read) {
-        // Read from the control socket into the command buferr
-        r = read(ctrl, &(command[total_read]), max_to_read - total_read);
-        // If we received bytes
-        if (r > 0) {
-            // Add them to the total
-            total_read += r;
-            // Continue reading
-            continue;
-        }
-        // If we read an EOF flag
-        else if (r == 0) {
-            // Stop reading loop
-            break;
-        }
-        // If something else happened, we didn't plan for it
-        else {
-            fatal("Control Pipe is unable to read command: %s", strerror(errno));
-        }
-    } 
-
-    // Add a null character to the end of the command
-    command[total_read] = '\0';
-
-    // Duplicate these pipes so we can have comms with the parent
-    dup2(stdin, STDIN_FILENO);
-    dup2(stdout, STDOUT_FILENO);
-    dup2(stderr, STDERR_FILENO);
-
-    // Close non-standard pipes (control was already closed)
-    close(stdin);
-    close(stderr);
-    close(stdout);
 
-    // The number of arguments for the command
-    int argc = 0;
-    // The index of the command string
-    int i = 0;
-    // An array of command args and one space for the null to indicate end
-    char *argv[MAX_CTRL_ARGS + 1];
-
-    // Assign the command name as the first arg
-    argv[argc++] = &(command[i]);
-
-    // Iterate over the command
-    while (i < total_read && argc < MAX_CTRL_ARGS) {
-        // When the byte is a null byte
-        if (command[i++] == '\0') {
-            // Set the next byte to be the beginning of the next arg
-            argv[argc++] = &(command[i]);
-        }
-    }
-
-    // Set the last arg to be NULL
-    argv[argc] = NULL;
-
-    // Execute the command
-    int ret = execvp(argv[0], argv);
-
-    // Report any errors
-    if (ret == -1) {
-        fatal("Could not exec child process: %s", strerror(errno));
+        // Write everything this iteration produced in one go
+        flush_output(0);
     }
 }
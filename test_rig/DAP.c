@@ -382,6 +382,10 @@ static uint32_t DAP_SWJ_Clock(uint8_t *request, uint8_t *response) {
     DAP_Data.clock_delay = delay;
   }
 
+#if (DAP_SWD != 0)
+  SWD_SPI_Clock(clock);
+#endif
+
   *response = DAP_OK;
   return (1);
 }
@@ -190,6 +190,9 @@ extern uint32_t JTAG_ReadIDCode (void);
 extern void     JTAG_WriteAbort (uint32_t data);
 extern uint8_t  JTAG_Transfer   (uint32_t request, uint32_t *data);
 extern uint8_t  SWD_Transfer    (uint32_t request, uint32_t *data);
+extern void     SWD_SPI_Setup   (uint32_t clock);
+extern void     SWD_SPI_Clock   (uint32_t clock);
+extern void     SWD_SPI_Disable (void);
 
 extern void     Delayms         (uint32_t delay);
 
@@ -21,6 +21,9 @@
 #include "stdint.h"
 
 #define __forceinline inline
+
+// The SWD pins are read and written through the single-cycle IOBUS alias of the port
+#define SWD_PORT(p) (PORT_IOBUS->Group[(p).group])
 //**************************************************************************************************
 /**
 \defgroup DAP_Config_Debug_gr CMSIS-DAP Debug Unit Information
@@ -43,7 +46,7 @@ Provides definitions about:
 /// requrie 2 processor cycles for a I/O Port Write operation.  If the Debug Unit uses
 /// a Cortex-M0+ processor with high-speed peripheral I/O only 1 processor cycle might be
 /// requrired.
-#define IO_PORT_WRITE_CYCLES    2               ///< I/O Cycles: 2=default, 1=Cortex-M0+ fast I/0
+#define IO_PORT_WRITE_CYCLES    1               ///< I/O Cycles: 2=default, 1=Cortex-M0+ fast I/0
 
 /// Indicate that Serial Wire Debug (SWD) communication mode is available at the Debug Access Port.
 /// This information is returned by the command \ref DAP_Info as part of <b>Capabilities</b>.
@@ -64,7 +67,7 @@ Provides definitions about:
 /// Default communication speed on the Debug Access Port for SWD and JTAG mode.
 /// Used to initialize the default SWD/JTAG clock frequency.
 /// The command \ref DAP_SWJ_Clock can be used to overwrite this default setting.
-#define DAP_DEFAULT_SWJ_CLOCK   100000         ///< Default SWD/JTAG clock frequency in Hz.
+#define DAP_DEFAULT_SWJ_CLOCK   2000000        ///< Default SWD/JTAG clock frequency in Hz.
 
 /// Maximum Package Size for Command and Response data.
 /// This configuration settings is used to optimized the communication performance with the
@@ -75,7 +78,7 @@ Provides definitions about:
 /// This configuration settings is used to optimized the communication performance with the
 /// debugger and depends on the USB peripheral. For devices with limited RAM or USB buffer the
 /// setting can be reduced (valid range is 1 .. 255). Change setting to 4 for High-Speed USB.
-#define DAP_PACKET_COUNT        1              ///< Buffers: 64 = Full-Speed, 4 = High-Speed.
+#define DAP_PACKET_COUNT        4              ///< Buffers: 64 = Full-Speed, 4 = High-Speed.
 
 
 /// Debug Unit is connected to fixed Target Device.
@@ -149,6 +152,10 @@ static __inline void PORT_SWD_SETUP (void) {
   pin_out(PIN_SWCLK);
   pin_out(PIN_SWDIO);
   pin_out(PIN_RESET);
+  // The IOBUS functions below only switch the SWDIO direction, so its input buffer stays on,
+  // and is sampled continuously so that an IOBUS read of IN is current
+  PORT->Group[PIN_SWDIO.group].PINCFG[PIN_SWDIO.pin].bit.INEN = 1;
+  PORT->Group[PIN_SWDIO.group].CTRL.reg |= 1 << PIN_SWDIO.pin;
 }
 
 /** Disable JTAG/SWD I/O Pins.
@@ -167,21 +174,21 @@ static __inline void PORT_OFF (void) {
 \return Current status of the SWCLK/TCK DAP hardware I/O pin.
 */
 static __forceinline uint32_t PIN_SWCLK_TCK_IN  (void) {
-  return pin_read(PIN_SWCLK);
+  return (SWD_PORT(PIN_SWCLK).IN.reg >> PIN_SWCLK.pin) & 1;
 }
 
 /** SWCLK/TCK I/O pin: Set Output to High.
 Set the SWCLK/TCK DAP hardware I/O pin to high level.
 */
 static __forceinline void     PIN_SWCLK_TCK_SET (void) {
-  pin_high(PIN_SWCLK);
+  SWD_PORT(PIN_SWCLK).OUTSET.reg = 1 << PIN_SWCLK.pin;
 }
 
 /** SWCLK/TCK I/O pin: Set Output to Low.
 Set the SWCLK/TCK DAP hardware I/O pin to low level.
 */
 static __forceinline void     PIN_SWCLK_TCK_CLR (void) {
-  pin_low(PIN_SWCLK);
+  SWD_PORT(PIN_SWCLK).OUTCLR.reg = 1 << PIN_SWCLK.pin;
 }
 
 // SWDIO/TMS Pin I/O --------------------------------------
@@ -190,28 +197,28 @@ static __forceinline void     PIN_SWCLK_TCK_CLR (void) {
 \return Current status of the SWDIO/TMS DAP hardware I/O pin.
 */
 static __forceinline uint32_t PIN_SWDIO_TMS_IN  (void) {
-  return pin_read(PIN_SWDIO);
+  return (SWD_PORT(PIN_SWDIO).IN.reg >> PIN_SWDIO.pin) & 1;
 }
 
 /** SWDIO/TMS I/O pin: Set Output to High.
 Set the SWDIO/TMS DAP hardware I/O pin to high level.
 */
 static __forceinline void     PIN_SWDIO_TMS_SET (void) {
-  pin_high(PIN_SWDIO);
+  SWD_PORT(PIN_SWDIO).OUTSET.reg = 1 << PIN_SWDIO.pin;
 }
 
 /** SWDIO/TMS I/O pin: Set Output to Low.
 Set the SWDIO/TMS DAP hardware I/O pin to low level.
 */
 static __forceinline void     PIN_SWDIO_TMS_CLR (void) {
-  pin_low(PIN_SWDIO);
+  SWD_PORT(PIN_SWDIO).OUTCLR.reg = 1 << PIN_SWDIO.pin;
 }
 
 /** SWDIO I/O pin: Get Input (used in SWD mode only).
 \return Current status of the SWDIO DAP hardware I/O pin.
 */
 static __forceinline uint32_t PIN_SWDIO_IN      (void) {
-  return pin_read(PIN_SWDIO);
+  return (SWD_PORT(PIN_SWDIO).IN.reg >> PIN_SWDIO.pin) & 1;
 }
 
 /** SWDIO I/O pin: Set Output (used in SWD mode only).
@@ -219,9 +226,9 @@ static __forceinline uint32_t PIN_SWDIO_IN      (void) {
 */
 static __forceinline void     PIN_SWDIO_OUT     (uint32_t bit){
   if (bit & 1) {
-    pin_high(PIN_SWDIO);
+    SWD_PORT(PIN_SWDIO).OUTSET.reg = 1 << PIN_SWDIO.pin;
 	} else {
-    pin_low(PIN_SWDIO);
+    SWD_PORT(PIN_SWDIO).OUTCLR.reg = 1 << PIN_SWDIO.pin;
 	}
 }
 
@@ -230,7 +237,7 @@ Configure the SWDIO DAP hardware I/O pin to output mode. This function is
 called prior \ref PIN_SWDIO_OUT function calls.
 */
 static __forceinline void     PIN_SWDIO_OUT_ENABLE  (void) {
-	pin_out(PIN_SWDIO);
+	SWD_PORT(PIN_SWDIO).DIRSET.reg = 1 << PIN_SWDIO.pin;
 }
 
 /** SWDIO I/O pin: Switch to Input mode (used in SWD mode only).
@@ -238,7 +245,7 @@ Configure the SWDIO DAP hardware I/O pin to input mode. This function is
 called prior \ref PIN_SWDIO_IN function calls.
 */
 static __forceinline void     PIN_SWDIO_OUT_DISABLE (void) {
-	pin_in(PIN_SWDIO);
+	SWD_PORT(PIN_SWDIO).DIRCLR.reg = 1 << PIN_SWDIO.pin;
 }
 
 
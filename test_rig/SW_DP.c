@@ -78,6 +78,81 @@ void SWJ_Sequence (uint32_t count, uint8_t *data) {
 #if (DAP_SWD != 0)
 
 
+// SERCOM-assisted write data phase
+//   SWDIO and SWCLK are PAD2 and PAD3 of SERCOM_SWD, so an SPI master in mode 3 sending LSB
+//   first clocks out the data phase of a write at the SWJ clock, with no bit-banging. WDATA,
+//   the parity bit and SWD_SPI_IDLE_CYCLES idle cycles go out as five bytes. The SWD line
+//   allows any number of idle cycles after a write, so the extra ones are harmless.
+//   Reads stay bit-banged, as the SERCOM can't release SWDIO while it clocks.
+#define SWD_SPI_IDLE_CYCLES 7
+
+static uint8_t swd_spi_enabled;
+
+static void SWD_SPI_Write (uint32_t val) {
+  Sercom *spi = sercom(SERCOM_SWD);
+  uint32_t parity;
+  uint32_t n;
+
+  parity = val ^ (val >> 16);
+  parity ^= parity >> 8;
+  parity ^= parity >> 4;
+  parity ^= parity >> 2;
+  parity ^= parity >> 1;
+
+  // SWCLK is high as the pins switch over, and the SPI clock idles high
+  pin_mux(PIN_SWDIO);
+  pin_mux(PIN_SWCLK);
+  for (n = 4; n; n--) {
+    while (!spi->SPI.INTFLAG.bit.DRE);
+    spi->SPI.DATA.reg = val & 0xff;
+    val >>= 8;
+  }
+  while (!spi->SPI.INTFLAG.bit.DRE);
+  spi->SPI.DATA.reg = parity & 1;
+  while (!spi->SPI.INTFLAG.bit.TXC);
+  pin_gpio(PIN_SWCLK);
+  pin_gpio(PIN_SWDIO);
+}
+
+// Set the SPI clock to the SWJ clock, or fall back to bit-banging below the slowest SPI clock
+void SWD_SPI_Clock (uint32_t clock) {
+  uint32_t baud;
+
+  baud = (CPU_CLOCK/2 + (clock - 1)) / clock - 1;
+  if (baud > 255) {
+    swd_spi_enabled = 0;
+    return;
+  }
+  // BAUD is enable-protected
+  sercom(SERCOM_SWD)->SPI.CTRLA.bit.ENABLE = 0;
+  while (sercom(SERCOM_SWD)->SPI.SYNCBUSY.bit.ENABLE);
+  sercom(SERCOM_SWD)->SPI.BAUD.reg = baud;
+  sercom(SERCOM_SWD)->SPI.CTRLA.bit.ENABLE = 1;
+  while (sercom(SERCOM_SWD)->SPI.SYNCBUSY.bit.ENABLE);
+  swd_spi_enabled = 1;
+}
+
+void SWD_SPI_Setup (uint32_t clock) {
+  sercom_clock_enable(SERCOM_SWD, GCLK_SYSTEM, 1);
+  sercom_spi_master_init(SERCOM_SWD, 0, SERCOM_SWD_DOPO, 1, 1, 0);
+
+  // DORD is enable-protected
+  sercom(SERCOM_SWD)->SPI.CTRLA.bit.ENABLE = 0;
+  while (sercom(SERCOM_SWD)->SPI.SYNCBUSY.bit.ENABLE);
+  sercom(SERCOM_SWD)->SPI.CTRLA.bit.DORD = 1;
+  sercom(SERCOM_SWD)->SPI.CTRLA.bit.ENABLE = 1;
+  while (sercom(SERCOM_SWD)->SPI.SYNCBUSY.bit.ENABLE);
+
+  SWD_SPI_Clock(clock);
+}
+
+void SWD_SPI_Disable (void) {
+  swd_spi_enabled = 0;
+  sercom_reset(SERCOM_SWD);
+  sercom_clock_disable(SERCOM_SWD);
+}
+
+
 // SWD Transfer I/O
 //   request: A[3:2] RnW APnDP
 //   data:    DATA[31:0]
@@ -146,6 +221,7 @@ uint8_t SWD_Transfer##speed (uint32_t request, uint32_t *data) {
         SW_CLOCK_CYCLE();                                                       \
       }                                                                         \
       PIN_SWDIO_OUT_ENABLE();                                                   \
+      n = DAP_Data.transfer.idle_cycles;                                        \
     } else {                                                                    \
       /* Turnaround */                                                          \
       for (n = DAP_Data.swd_conf.turnaround; n; n--) {                          \
@@ -154,16 +230,22 @@ uint8_t SWD_Transfer##speed (uint32_t request, uint32_t *data) {
       PIN_SWDIO_OUT_ENABLE();                                                   \
       /* Write data */                                                          \
       val = *data;                                                              \
-      parity = 0;                                                               \
-      for (n = 32; n; n--) {                                                    \
-        SW_WRITE_BIT(val);              /* Write WDATA[0:31] */                 \
-        parity += val;                                                          \
-        val >>= 1;                                                              \
+      if (swd_spi_enabled) {                                                    \
+        SWD_SPI_Write(val);             /* WDATA[0:31], Parity, some idle */    \
+        n = DAP_Data.transfer.idle_cycles;                                      \
+        n = (n > SWD_SPI_IDLE_CYCLES) ? (n - SWD_SPI_IDLE_CYCLES) : 0;          \
+      } else {                                                                  \
+        parity = 0;                                                             \
+        for (n = 32; n; n--) {                                                  \
+          SW_WRITE_BIT(val);            /* Write WDATA[0:31] */                 \
+          parity += val;                                                        \
+          val >>= 1;                                                            \
+        }                                                                       \
+        SW_WRITE_BIT(parity);           /* Write Parity Bit */                  \
+        n = DAP_Data.transfer.idle_cycles;                                      \
       }                                                                         \
-      SW_WRITE_BIT(parity);             /* Write Parity Bit */                  \
     }                                                                           \
     /* Idle cycles */                                                           \
-    n = DAP_Data.transfer.idle_cycles;                                          \
     if (n) {                                                                    \
       PIN_SWDIO_OUT(0);                                                         \
       for (; n; n--) {                                                          \
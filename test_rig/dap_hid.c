@@ -2,17 +2,42 @@
 #include "DAP_config.h"
 #include "DAP.h"
 
-USB_ALIGN u8 dap_buf_in[DAP_PACKET_SIZE];
-USB_ALIGN u8 dap_buf_out[DAP_PACKET_SIZE];
+// The host may queue up to DAP_PACKET_COUNT commands, as reported by DAP_Info. Each command is
+// executed as soon as it arrives, and the next OUT transfer starts while its response waits for
+// the IN endpoint, so the bus never idles between commands. Slots are used in order.
+USB_ALIGN u8 dap_buf_in[DAP_PACKET_COUNT][DAP_PACKET_SIZE];
+USB_ALIGN u8 dap_buf_out[DAP_PACKET_COUNT][DAP_PACKET_SIZE];
+u16 dap_response_len[DAP_PACKET_COUNT];
+
+/// Slot of the OUT transfer in progress
+u8 dap_recv;
+/// Slot of the oldest response not yet sent
+u8 dap_send;
+/// Number of responses waiting for or in the IN transfer
+u8 dap_pending;
+
+void dap_start_in() {
+    // The bulk interface ends a response with a short packet, so only send what was written
+    usb_ep_start_in(USB_EP_DAP_HID_IN, dap_buf_in[dap_send], dap_response_len[dap_send], false);
+}
+
+void dap_start_out() {
+    usb_ep_start_out(USB_EP_DAP_HID_OUT, dap_buf_out[dap_recv], DAP_PACKET_SIZE);
+}
 
 void dap_enable() {
     DAP_Setup();
+    SWD_SPI_Setup(DAP_DEFAULT_SWJ_CLOCK);
+    dap_recv = 0;
+    dap_send = 0;
+    dap_pending = 0;
     usb_enable_ep(USB_EP_DAP_HID_OUT, USB_EP_TYPE_BULK, 64);
     usb_enable_ep(USB_EP_DAP_HID_IN, USB_EP_TYPE_BULK, 64);
-    usb_ep_start_out(USB_EP_DAP_HID_OUT, dap_buf_out, DAP_PACKET_SIZE);
+    dap_start_out();
 }
 
 void dap_disable() {
+    SWD_SPI_Disable();
     pin_in(PIN_SWCLK);
     pin_in(PIN_SWDIO);
     pin_in(PIN_RESET);
@@ -21,10 +46,29 @@ void dap_disable() {
 }
 
 void dap_handle_usb_in_completion() {
-    usb_ep_start_out(USB_EP_DAP_HID_OUT, dap_buf_out, DAP_PACKET_SIZE);
+    dap_send = (dap_send + 1) % DAP_PACKET_COUNT;
+    // The OUT endpoint stops while every slot holds a response
+    bool out_stopped = dap_pending == DAP_PACKET_COUNT;
+    dap_pending -= 1;
+
+    if (dap_pending > 0) {
+        dap_start_in();
+    }
+    if (out_stopped) {
+        dap_start_out();
+    }
 }
 
 void dap_handle_usb_out_completion() {
-    DAP_ProcessCommand(dap_buf_out, dap_buf_in);
-    usb_ep_start_in(USB_EP_DAP_HID_IN, dap_buf_in, DAP_PACKET_SIZE, false);
+    u8 slot = dap_recv;
+    dap_response_len[slot] = DAP_ProcessCommand(dap_buf_out[slot], dap_buf_in[slot]);
+    dap_recv = (dap_recv + 1) % DAP_PACKET_COUNT;
+    dap_pending += 1;
+
+    if (dap_pending == 1) {
+        dap_start_in();
+    }
+    if (dap_pending < DAP_PACKET_COUNT) {
+        dap_start_out();
+    }
 }
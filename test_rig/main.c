@@ -35,7 +35,9 @@ void DMAC_Handler() {
     u32 intpend = DMAC->INTPEND.reg;
     if (intpend & DMAC_INTPEND_TCMPL) {
         u32 id = intpend & DMAC_INTPEND_ID_Msk;
-        (void) id;
+        if (id == DMA_ADC_SCAN_RESULT) {
+            adc_scan_completion();
+        }
     }
 
     if (intpend & (DMAC_INTPEND_TERR | DMAC_INTPEND_SUSP)) {
@@ -53,3 +53,84 @@ void usb_control_req_analog_read(uint16_t wIndex, uint16_t wValue) {
     usb_ep0_in(2);
     usb_ep0_out();
 }
+
+#define ANALOG_PIN_COUNT (sizeof(ANALOG_PINS) / sizeof(Pin))
+#define DIGITAL_PIN_COUNT (sizeof(DIGITAL_PINS) / sizeof(Pin))
+
+// A measurement samples a set of analog pins back to back and replies with the samples and
+// the state of every digital pin in one control transfer. The first conversion is started by
+// software. On each RESRDY one DMA channel moves the result out, and another writes the
+// INPUTCTRL of the next pin, with its event output starting that conversion.
+u32 adc_scan_inputctrl[ANALOG_PIN_COUNT];
+u16 adc_scan_results[ANALOG_PIN_COUNT];
+u8 adc_scan_count;
+DmacDescriptor adc_scan_mux_desc;
+DmacDescriptor adc_scan_result_desc;
+
+void usb_control_req_measure(uint16_t wValue) {
+    // wValue = bitmask of ANALOG_PINS to sample, in array order
+    if (wValue == 0 || wValue >= (1 << ANALOG_PIN_COUNT)) {
+        return usb_ep0_stall();
+    }
+
+    u8 n = 0;
+    for (uint8_t c = 0; c < ANALOG_PIN_COUNT; c++) {
+        if (wValue & (1 << c)) {
+            pin_analog(ANALOG_PINS[c]);
+            adc_scan_inputctrl[n++] = adc_inputctrl(ANALOG_PINS[c], ADC_INPUTCTRL_GAIN_1X);
+        }
+    }
+    adc_scan_count = n;
+
+    // the digital pins are read as the scan starts, and follow the samples in the reply
+    for (uint8_t c = 0; c < DIGITAL_PIN_COUNT; c++) {
+        ep0_buf_in[n * 2 + c] = pin_read(DIGITAL_PINS[c]);
+    }
+
+    ADC->INTFLAG.reg = ADC_INTFLAG_RESRDY;
+    adc_scan_result_desc.SRCADDR.reg = (unsigned) &ADC->RESULT.reg;
+    adc_scan_result_desc.DSTADDR.reg = (unsigned) &adc_scan_results[n];
+    adc_scan_result_desc.BTCNT.reg = n;
+    adc_scan_result_desc.BTCTRL.reg = DMAC_BTCTRL_VALID
+        | DMAC_BTCTRL_DSTINC
+        | DMAC_BTCTRL_BEATSIZE_HWORD
+        | DMAC_BTCTRL_BLOCKACT_INT;
+    adc_scan_result_desc.DESCADDR.reg = 0;
+    dma_configure(DMA_ADC_SCAN_RESULT, ADC_DMAC_ID_RESRDY);
+    dma_enable_interrupt(DMA_ADC_SCAN_RESULT);
+    dma_start_descriptor(DMA_ADC_SCAN_RESULT, &adc_scan_result_desc);
+
+    if (n > 1) {
+        adc_scan_mux_desc.SRCADDR.reg = (unsigned) &adc_scan_inputctrl[n];
+        adc_scan_mux_desc.DSTADDR.reg = (unsigned) &ADC->INPUTCTRL.reg;
+        adc_scan_mux_desc.BTCNT.reg = n - 1;
+        adc_scan_mux_desc.BTCTRL.reg = DMAC_BTCTRL_VALID
+            | DMAC_BTCTRL_SRCINC
+            | DMAC_BTCTRL_BEATSIZE_WORD
+            | DMAC_BTCTRL_EVOSEL_BEAT;
+        adc_scan_mux_desc.DESCADDR.reg = 0;
+        dma_configure(DMA_ADC_SCAN_MUX, ADC_DMAC_ID_RESRDY);
+        dma_enable_event_output(DMA_ADC_SCAN_MUX);
+        dma_start_descriptor(DMA_ADC_SCAN_MUX, &adc_scan_mux_desc);
+        evsys_config(EVSYS_ADC_SCAN, EVSYS_ID_GEN_DMAC_CH_0 + DMA_ADC_SCAN_MUX, EVSYS_ID_USER_ADC_START);
+        adc_set_event_start(true);
+    }
+
+    ADC->INPUTCTRL.reg = adc_scan_inputctrl[0];
+    ADC->SWTRIG.reg = ADC_SWTRIG_START;
+}
+
+/// The last result of a measurement has been moved out, so send the reply
+void adc_scan_completion() {
+    u8 n = adc_scan_count;
+    if (n > 1) {
+        adc_set_event_start(false);
+    }
+
+    for (u8 i = 0; i < n; i++) {
+        ep0_buf_in[i * 2] = adc_scan_results[i];
+        ep0_buf_in[i * 2 + 1] = adc_scan_results[i] >> 8;
+    }
+    usb_ep0_in(n * 2 + DIGITAL_PIN_COUNT);
+    usb_ep0_out();
+}
@@ -7,6 +7,7 @@ var REQ = {
     digital         : 1,
     analog          : 2,
     readAllDigital  : 3,
+    measure         : 4,
 };
 
 function digital (pin, state, callback) {
@@ -29,6 +30,32 @@ function readAllDigital (callback) {
     });
 }
 
+// Sample a set of analog pins and read every digital pin in a single transfer
+function measure (analog, callback) {
+    var mask = 0;
+    analog.forEach(function (name) {
+        mask |= 1 << analogPins.indexOf(name.toUpperCase());
+    });
+    rig.controlTransfer(0xC0, REQ.measure, mask, 0, 64, function(err, data) {
+        if (callback) {
+            var result = { analog: {}, digital: {} };
+            if (!err) {
+                var n = 0;
+                for (var i = 0; i < analogPins.length; i++) {
+                    if (mask & (1 << i)) {
+                        result.analog[analogPins[i]] = data.readUInt16LE(n * 2);
+                        n++;
+                    }
+                }
+                for (var j = 0; j < digitalPins.length; j++) {
+                    result.digital[digitalPins[j]] = !!data[n * 2 + j];
+                }
+            }
+            callback(err, result);
+        }
+    });
+}
+
 function pinId (name) {
     return digitalPins.indexOf(name.toUpperCase());
 }
@@ -62,12 +89,30 @@ var digitalPins = [
     "PORTB_G2",
 ];
 
+var analogPins = [
+    "CURRENT_UUT",
+    "CURRENT_USB0",
+    "CURRENT_USB1",
+    "CURRENT_PORTA33",
+    "CURRENT_PORTB33",
+    "VOLTAGE_VREF",
+    "VOLTAGE_5VUSB1",
+    "VOLTAGE_5VUUT",
+    "VOLTAGE_PORTA33",
+    "VOLTAGE_12",
+    "VOLTAGE_33CP",
+    "VOLTAGE_PORTB33",
+    "VOLTAGE_18",
+    "VOLTAGE_33MT",
+    "VOLTAGE_5VUSB0",
+];
+
 var s = 0;
 setInterval(function () {
     digital ("led_pass", s++%3, function (err, data) {
         console.log(err, data);
     });
-    readAllDigital(function (err, data) {
+    measure(analogPins, function (err, data) {
         console.log(err);
         console.log(data);
         console.log('\n');
@@ -5,9 +5,11 @@
 
 /// DMA allocation. Channels 0-3 support EVSYS and are reserved for
 /// functions that need it
-
+#define DMA_ADC_SCAN_MUX 0
+#define DMA_ADC_SCAN_RESULT 4
 
 /// EVSYS allocation
+#define EVSYS_ADC_SCAN 0
 
 /// USB Endpoint allocation
 #define USB_EP_DAP_HID_OUT 0x01
@@ -34,6 +36,8 @@ void usb_control_req_digital(uint16_t wIndex, uint16_t wValue);
 void usb_control_req_digital_read_all();
 void init_all_digital_pins();
 void usb_control_req_analog_read(uint16_t wIndex, uint16_t wValue);
+void usb_control_req_measure(uint16_t wValue);
+void adc_scan_completion();
 
 // button.c
 void button_init();
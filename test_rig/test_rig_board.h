@@ -30,8 +30,10 @@ const static Pin PIN_USB_DP = {.group = 0, .pin = 25, .mux = MUX_PA25G_USB_DP };
 // UUT SWD
 
 const static Pin PIN_RESET =        {.group = 0, .pin = 14};
-const static Pin PIN_SWDIO =        {.group = 1, .pin = 10};
-const static Pin PIN_SWCLK =        {.group = 1, .pin = 11};
+const static Pin PIN_SWDIO =        {.group = 1, .pin = 10, .mux = MUX_PB10D_SERCOM4_PAD2};
+const static Pin PIN_SWCLK =        {.group = 1, .pin = 11, .mux = MUX_PB11D_SERCOM4_PAD3};
+#define SERCOM_SWD 4
+#define SERCOM_SWD_DOPO 1
 
 #ifdef XPLAINED
 const static Pin PIN_START_BUTTON = {.group = 0, .pin = 15};
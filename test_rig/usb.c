@@ -5,6 +5,7 @@
 #define DIGITAL_CONTROL  1
 #define ANALOG_SAMPLE    2
 #define READ_ALL_DIGITAL 3
+#define MEASURE          4
 
 #define REQ_INFO 0x30
 #define REQ_INFO_GIT_HASH 0x0
@@ -39,8 +40,8 @@ typedef struct ConfigDesc {
 	USB_ConfigurationDescriptor Config;
 	USB_InterfaceDescriptor DAPInterfaceOff;
 	USB_InterfaceDescriptor DAPInterface;
-	USB_EndpointDescriptor DAPInEndpoint;
 	USB_EndpointDescriptor DAPOutEndpoint;
+	USB_EndpointDescriptor DAPInEndpoint;
 	USB_InterfaceDescriptor EventInterface;
 	USB_EndpointDescriptor ReportInEndpoint;
 }  __attribute__((packed)) ConfigDesc;
@@ -78,18 +79,18 @@ __attribute__((__aligned__(4))) const ConfigDesc configuration_descriptor = {
 		.bInterfaceProtocol = 0x00,
 		.iInterface = 0x10,
 	},
-	.DAPInEndpoint = {
+	.DAPOutEndpoint = {
 		.bLength = sizeof(USB_EndpointDescriptor),
 		.bDescriptorType = USB_DTYPE_Endpoint,
-		.bEndpointAddress = USB_EP_DAP_HID_IN,
+		.bEndpointAddress = USB_EP_DAP_HID_OUT,
 		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 		.wMaxPacketSize = 64,
 		.bInterval = 0x00
 	},
-	.DAPOutEndpoint = {
+	.DAPInEndpoint = {
 		.bLength = sizeof(USB_EndpointDescriptor),
 		.bDescriptorType = USB_DTYPE_Endpoint,
-		.bEndpointAddress = USB_EP_DAP_HID_OUT,
+		.bEndpointAddress = USB_EP_DAP_HID_IN,
 		.bmAttributes = (USB_EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
 		.wMaxPacketSize = 64,
 		.bInterval = 0x00
@@ -235,6 +236,8 @@ void usb_cb_control_setup(void) {
 				return usb_control_req_digital_read_all();
 			case ANALOG_SAMPLE:
 				return usb_control_req_analog_read(usb_setup.wIndex, usb_setup.wValue);
+			case MEASURE:
+				return usb_control_req_measure(usb_setup.wValue);
 			case REQ_BOOT: return req_boot();
 		}
 	} else if (recipient == USB_RECIPIENT_INTERFACE) {